@@ -0,0 +1,67 @@
+# - try to find liburing
+#
+# Cache Variables: (probably not for direct use in your scripts)
+#  LIBURING_INCLUDE_DIR
+#  LIBURING_LIBRARY
+#
+# Non-cache variables you might use in your CMakeLists.txt:
+#  LIBURING_FOUND
+#  LIBURING_INCLUDE_DIRS
+#  LIBURING_LIBRARIES
+#
+# Requires these CMake modules:
+#  FindPackageHandleStandardArgs (known included with CMake >=2.6.2)
+
+if(NOT CMAKE_SYSTEM_NAME STREQUAL "Linux")
+	if(NOT Liburing_FIND_QUIETLY)
+		message(STATUS "Platform not supported by liburing - skipping search")
+	endif()
+else()
+	set(LIBURING_ROOT_DIR
+		"${LIBURING_ROOT_DIR}"
+		CACHE
+		PATH
+		"Directory to search")
+
+	if(CMAKE_SIZEOF_VOID_P MATCHES "8")
+		set(_LIBSUFFIXES lib64 lib)
+	else()
+		set(_LIBSUFFIXES lib)
+	endif()
+
+	find_library(LIBURING_LIBRARY
+		NAMES
+		uring
+		HINTS
+		"${LIBURING_ROOT_DIR}"
+		PATH_SUFFIXES
+		${_LIBSUFFIXES})
+
+	# Might want to look close to the library first for the includes.
+	get_filename_component(_libdir "${LIBURING_LIBRARY}" PATH)
+
+	find_path(LIBURING_INCLUDE_DIR
+		NAMES
+		liburing.h
+		HINTS
+		"${_libdir}/.."
+		PATHS
+		"${LIBURING_ROOT_DIR}"
+		PATH_SUFFIXES
+		include/)
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Liburing
+	DEFAULT_MSG
+	LIBURING_LIBRARY
+	LIBURING_INCLUDE_DIR)
+
+if(LIBURING_FOUND)
+	set(LIBURING_LIBRARIES "${LIBURING_LIBRARY}")
+	set(LIBURING_INCLUDE_DIRS "${LIBURING_INCLUDE_DIR}")
+	mark_as_advanced(LIBURING_ROOT_DIR)
+endif()
+
+mark_as_advanced(LIBURING_INCLUDE_DIR
+	LIBURING_LIBRARY)
@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "bm_dispatcher.h"
+#include "bm_histogram.h"
+#include "bm_time.h"
+
+/*
+ * Benchmark for the dispatcher.
+ * The benchmark runs the dispatcher in-process against a set of
+ * emulated peers listening on the loopback interface. Some of the
+ * peers send timestamped messages at a given rate; all of them
+ * receive the messages relayed by the dispatcher and record the
+ * fan-out latency.
+ */
+
+/*
+ * Header at the beginning of each message sent by a peer
+ */
+struct bm_bench_header_s {
+   /* When the message was sent, in ns of the monotonic clock */
+   uint64_t ts;
+   /* The index of the sending peer */
+   uint32_t peer;
+   /* The sequence number of the message */
+   uint32_t seq;
+};
+
+/*
+ * An emulated peer.
+ */
+struct bm_bench_peer_s {
+   /* The peer index */
+   size_t id;
+   /* 1 for TCP, 0 for UDP */
+   int tcp;
+   /* The listening socket (TCP) or the bound socket (UDP) */
+   int lsock;
+   /* The socket connected to the dispatcher */
+   int sock;
+   /* The dispatcher address (UDP) */
+   struct sockaddr_in hub;
+   /* The port the peer listens on */
+   uint16_t port;
+   /* Number of messages sent */
+   uint64_t sent;
+   /* Number of messages received */
+   uint64_t received;
+   /* Number of bytes received */
+   uint64_t bytes;
+   /* Latency of the received messages */
+   struct bm_histogram_s latency;
+   /* The receiving thread */
+   pthread_t rthread;
+   /* The sending thread */
+   pthread_t sthread;
+};
+typedef struct bm_bench_peer_s* bm_bench_peer_t;
+
+/*
+ * The benchmark settings.
+ */
+struct bm_bench_s {
+   /* The number of peers */
+   size_t peer_num;
+   /* The number of peers that send messages */
+   size_t sender_num;
+   /* The peer type: "tcp", "udp", or "mixed" */
+   const char* type;
+   /* The message size */
+   size_t msg_len;
+   /* Messages per second per sender, 0 for as fast as possible */
+   double rate;
+   /* Duration of the sending phase, in seconds */
+   double duration;
+   /* The number of dispatcher threads */
+   size_t threads;
+   /* Whether the dispatcher sends through io_uring */
+   int uring;
+   /* Options appended to every stream descriptor, or NULL */
+   const char* options;
+   /* Set to 1 to report the latency against that of the first run */
+   int compare;
+   /* The median and 99th percentile latency of the first run (us), or
+    * -1 before it */
+   double base_p50;
+   double base_p99;
+   /* Output format: "csv" or "json" */
+   const char* format;
+   /* Whether to print the CSV header */
+   int header;
+   /* The peers */
+   struct bm_bench_peer_s* peers;
+   /* Set to 1 to stop the senders */
+   volatile int stop_send;
+   /* Set to 1 to stop the receivers */
+   volatile int stop_recv;
+};
+typedef struct bm_bench_s* bm_bench_t;
+
+/****************************************/
+/****************************************/
+
+void usage(FILE* stream, const char* prg) {
+   fprintf(stream, "Usage:\n");
+   fprintf(stream, "   %s [OPTIONS]\n", prg);
+   fprintf(stream, "Measures the throughput and latency of BlabberMouth against emulated peers\n");
+   fprintf(stream, "on the loopback interface.\n");
+   fprintf(stream, "\nOptions:\n\n");
+   fprintf(stream, "  -n N | --peers N          The number of peers (default: 8)\n");
+   fprintf(stream, "  -S N | --senders N        The number of peers that send (default: 1)\n");
+   fprintf(stream, "  -p TYPE | --type TYPE     The peer type: tcp, udp, or mixed (default: tcp)\n");
+   fprintf(stream, "  -s SIZE | --size SIZE     The message size, at least %zu (default: 64)\n",
+           sizeof(struct bm_bench_header_s));
+   fprintf(stream, "  -r RATE | --rate RATE     Messages per second per sender, 0 for as fast\n");
+   fprintf(stream, "                            as possible (default: 1000)\n");
+   fprintf(stream, "  -d SECS | --duration SECS How long the senders run (default: 5)\n");
+   fprintf(stream, "  -t N | --threads N        The number of dispatcher threads (default: 1)\n");
+   fprintf(stream, "  -U | --io-uring           Send through io_uring, where available\n");
+   fprintf(stream, "  -O OPTS | --options OPTS  Options appended to every stream descriptor; when\n");
+   fprintf(stream, "                            given several times, the benchmark runs once per\n");
+   fprintf(stream, "                            set of options and reports the latency deltas\n");
+   fprintf(stream, "                            against the first one (\"\" for no options)\n");
+   fprintf(stream, "  -F FMT | --format FMT     Output format: csv or json (default: csv)\n");
+   fprintf(stream, "  -H | --no-header          Don't print the CSV header\n");
+   fprintf(stream, "\nThe results go to the standard output, everything else to the standard error.\n");
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Creates the listening socket of a peer.
+ */
+int bm_bench_peer_listen(bm_bench_peer_t p) {
+   p->lsock = socket(AF_INET, p->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+   if(p->lsock < 0) return 0;
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = 0;
+   socklen_t len = sizeof(addr);
+   if(bind(p->lsock, (struct sockaddr*)&addr, len) < 0 ||
+      getsockname(p->lsock, (struct sockaddr*)&addr, &len) < 0 ||
+      (p->tcp && listen(p->lsock, 1) < 0)) {
+      close(p->lsock);
+      return 0;
+   }
+   p->port = ntohs(addr.sin_port);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Waits for the dispatcher to connect to a peer.
+ */
+int bm_bench_peer_accept(bm_bench_peer_t p) {
+   if(p->tcp) {
+      p->sock = accept(p->lsock, NULL, NULL);
+      return p->sock >= 0;
+   }
+   /* UDP streams send a one-byte hello to announce themselves */
+   uint8_t hello;
+   socklen_t len = sizeof(p->hub);
+   if(recvfrom(p->lsock, &hello, 1, 0, (struct sockaddr*)&p->hub, &len) < 0)
+      return 0;
+   p->sock = p->lsock;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Records a received message.
+ */
+void bm_bench_peer_record(bm_bench_peer_t p,
+                          const uint8_t* msg,
+                          size_t len) {
+   struct bm_bench_header_s h;
+   memcpy(&h, msg, sizeof(h));
+   uint64_t now = bm_time_now();
+   bm_histogram_record(&p->latency, now > h.ts ? now - h.ts : 0);
+   ++p->received;
+   p->bytes += len;
+}
+
+/****************************************/
+/****************************************/
+
+struct bm_bench_thread_s {
+   bm_bench_t bench;
+   bm_bench_peer_t peer;
+};
+
+void* bm_bench_receiver(void* arg) {
+   struct bm_bench_thread_s* t = (struct bm_bench_thread_s*)arg;
+   bm_bench_peer_t p = t->peer;
+   size_t sz = t->bench->msg_len;
+   size_t cap = sz > 65536 ? sz : 65536;
+   uint8_t* buf = (uint8_t*)malloc(cap);
+   size_t have = 0;
+   /* Wake up regularly to check whether to stop */
+   struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+   setsockopt(p->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   while(!t->bench->stop_recv) {
+      ssize_t n = recv(p->sock, buf + have, p->tcp ? cap - have : cap, 0);
+      if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+         continue;
+      if(n <= 0) break;
+      if(!p->tcp) {
+         /* One message per datagram */
+         if((size_t)n == sz) bm_bench_peer_record(p, buf, n);
+         continue;
+      }
+      /* Slice the stream into messages */
+      have += n;
+      size_t pos = 0;
+      while(have - pos >= sz) {
+         bm_bench_peer_record(p, buf + pos, sz);
+         pos += sz;
+      }
+      memmove(buf, buf + pos, have - pos);
+      have -= pos;
+   }
+   free(buf);
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+void* bm_bench_sender(void* arg) {
+   struct bm_bench_thread_s* t = (struct bm_bench_thread_s*)arg;
+   bm_bench_peer_t p = t->peer;
+   size_t sz = t->bench->msg_len;
+   uint8_t* buf = (uint8_t*)calloc(sz, 1);
+   struct bm_bench_header_s h = { .ts = 0, .peer = p->id, .seq = 0 };
+   uint64_t start = bm_time_now();
+   uint64_t period = t->bench->rate > 0 ? 1e9 / t->bench->rate : 0;
+   while(!t->bench->stop_send) {
+      /* Pace the messages */
+      if(period > 0) {
+         uint64_t next = start + p->sent * period;
+         uint64_t now = bm_time_now();
+         if(next > now) {
+            struct timespec ts = {
+               .tv_sec = (next - now) / 1000000000ULL,
+               .tv_nsec = (next - now) % 1000000000ULL
+            };
+            nanosleep(&ts, NULL);
+         }
+      }
+      /* Send the message */
+      h.ts = bm_time_now();
+      h.seq = p->sent;
+      memcpy(buf, &h, sizeof(h));
+      ssize_t n;
+      if(p->tcp) {
+         size_t off = 0;
+         while(off < sz) {
+            n = send(p->sock, buf + off, sz - off, MSG_NOSIGNAL);
+            if(n <= 0) break;
+            off += n;
+         }
+         if(off < sz) break;
+      }
+      else {
+         n = sendto(p->sock, buf, sz, 0, (struct sockaddr*)&p->hub, sizeof(p->hub));
+         if(n < 0) break;
+      }
+      ++p->sent;
+   }
+   free(buf);
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+void* bm_bench_dispatcher(void* arg) {
+   bm_dispatcher_execute((bm_dispatcher_t)arg);
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Prints the results.
+ */
+void bm_bench_report(bm_bench_t b,
+                     FILE* out,
+                     double elapsed) {
+   uint64_t sent = 0, received = 0, bytes = 0;
+   struct bm_histogram_s lat;
+   bm_histogram_init(&lat);
+   for(size_t i = 0; i < b->peer_num; ++i) {
+      sent += b->peers[i].sent;
+      received += b->peers[i].received;
+      bytes += b->peers[i].bytes;
+      bm_histogram_merge(&lat, &b->peers[i].latency);
+   }
+   /* Every message is relayed to all the peers but its sender */
+   uint64_t expected = sent * (b->peer_num - 1);
+   double mps = received / elapsed;
+   double bps = bytes / elapsed;
+   double p50 = bm_histogram_percentile(&lat, 50) / 1e3;
+   double p99 = bm_histogram_percentile(&lat, 99) / 1e3;
+   double p999 = bm_histogram_percentile(&lat, 99.9) / 1e3;
+   double pmax = bm_histogram_percentile(&lat, 100) / 1e3;
+   /* The first run is the reference of the comparison */
+   if(b->base_p50 < 0) {
+      b->base_p50 = p50;
+      b->base_p99 = p99;
+   }
+   if(strcmp(b->format, "json") == 0) {
+      fprintf(out, "{\"peers\":%zu,\"senders\":%zu,\"type\":\"%s\",\"size\":%zu,"
+              "\"rate\":%g,\"threads\":%zu,\"uring\":%d,\"options\":\"%s\",\"duration\":%.3f,"
+              "\"sent\":%" PRIu64 ",\"expected\":%" PRIu64 ",\"received\":%" PRIu64 ","
+              "\"msgs_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+              "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f",
+              b->peer_num, b->sender_num, b->type, b->msg_len,
+              b->rate, b->threads, b->uring, b->options ? b->options : "", elapsed,
+              sent, expected, received,
+              mps, bps,
+              p50, p99, p999, pmax);
+      if(b->compare)
+         fprintf(out, ",\"p50_delta_us\":%.1f,\"p99_delta_us\":%.1f",
+                 p50 - b->base_p50, p99 - b->base_p99);
+      fprintf(out, "}\n");
+   }
+   else {
+      if(b->header)
+         fprintf(out, "peers,senders,type,size,rate,threads,uring,options,duration,"
+                 "sent,expected,received,msgs_per_sec,bytes_per_sec,"
+                 "p50_us,p99_us,p999_us,max_us%s\n",
+                 b->compare ? ",p50_delta_us,p99_delta_us" : "");
+      fprintf(out, "%zu,%zu,%s,%zu,%g,%zu,%d,\"%s\",%.3f,"
+              "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.1f,%.1f,"
+              "%.1f,%.1f,%.1f,%.1f",
+              b->peer_num, b->sender_num, b->type, b->msg_len,
+              b->rate, b->threads, b->uring, b->options ? b->options : "", elapsed,
+              sent, expected, received, mps, bps,
+              p50, p99, p999, pmax);
+      if(b->compare)
+         fprintf(out, ",%.1f,%.1f", p50 - b->base_p50, p99 - b->base_p99);
+      fprintf(out, "\n");
+      b->header = 0;
+   }
+   fflush(out);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses a number option.
+ */
+int parse_number(const char* prg,
+                 const char* opt,
+                 const char* val,
+                 double* v) {
+   char* endptr;
+   *v = strtod(val, &endptr);
+   if(endptr == val || *endptr != '\0' || *v < 0) {
+      fprintf(stderr, "%s: can't parse '%s' as a value for %s\n", prg, val, opt);
+      return 0;
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Runs the benchmark once with the current options, and prints the
+ * results.
+ * @return 1 for success, 0 for failure.
+ */
+int bm_bench_run(bm_bench_t b,
+                 FILE* out,
+                 const char* prg) {
+   b->stop_send = 0;
+   b->stop_recv = 0;
+   /* Create the peers */
+   b->peers = (struct bm_bench_peer_s*)calloc(b->peer_num,
+                                             sizeof(struct bm_bench_peer_s));
+   for(size_t i = 0; i < b->peer_num; ++i) {
+      bm_bench_peer_t p = &b->peers[i];
+      p->id = i;
+      p->tcp = strcmp(b->type, "tcp") == 0 ||
+         (strcmp(b->type, "mixed") == 0 && i % 2 == 0);
+      bm_histogram_init(&p->latency);
+      if(!bm_bench_peer_listen(p)) {
+         fprintf(stderr, "%s: can't create peer %zu: %s\n",
+                 prg, i, strerror(errno));
+         return 0;
+      }
+   }
+   /* Create the dispatcher and its streams */
+   bm_dispatcher_t d = bm_dispatcher_new();
+   if(!d) {
+      fprintf(stderr, "%s: can't create dispatcher\n", prg);
+      return 0;
+   }
+   d->msg_len = b->msg_len;
+   d->reactor_num = b->threads;
+   d->uring = b->uring;
+   char* desc;
+   for(size_t i = 0; i < b->peer_num; ++i) {
+      asprintf(&desc, "%zu:%s:0:127.0.0.1:%u%s%s",
+               i,
+               b->peers[i].tcp ? "tcp" : "udp",
+               b->peers[i].port,
+               b->options ? ":" : "",
+               b->options ? b->options : "");
+      int ok = bm_dispatcher_stream_add(d, desc);
+      free(desc);
+      if(!ok) {
+         fprintf(stderr, "%s: can't connect peer %zu\n", prg, i);
+         return 0;
+      }
+   }
+   /* TCP streams connect once the dispatcher runs */
+   pthread_t dthread;
+   pthread_create(&dthread, NULL, bm_bench_dispatcher, d);
+   for(size_t i = 0; i < b->peer_num; ++i) {
+      if(!bm_bench_peer_accept(&b->peers[i])) {
+         fprintf(stderr, "%s: can't connect peer %zu\n", prg, i);
+         return 0;
+      }
+   }
+   /* Start the peers */
+   struct bm_bench_thread_s* t = (struct bm_bench_thread_s*)calloc(
+      b->peer_num, sizeof(struct bm_bench_thread_s));
+   for(size_t i = 0; i < b->peer_num; ++i) {
+      t[i].bench = b;
+      t[i].peer = &b->peers[i];
+      pthread_create(&b->peers[i].rthread, NULL, bm_bench_receiver, &t[i]);
+   }
+   /* Give the dispatcher a moment to start polling */
+   usleep(200000);
+   uint64_t start = bm_time_now();
+   for(size_t i = 0; i < b->sender_num; ++i)
+      pthread_create(&b->peers[i].sthread, NULL, bm_bench_sender, &t[i]);
+   /* Let the senders run */
+   struct timespec ts = {
+      .tv_sec = (time_t)b->duration,
+      .tv_nsec = (long)((b->duration - (time_t)b->duration) * 1e9)
+   };
+   nanosleep(&ts, NULL);
+   b->stop_send = 1;
+   for(size_t i = 0; i < b->sender_num; ++i)
+      pthread_join(b->peers[i].sthread, NULL);
+   double elapsed = (bm_time_now() - start) / 1e9;
+   /* Let the messages in flight arrive */
+   usleep(500000);
+   b->stop_recv = 1;
+   for(size_t i = 0; i < b->peer_num; ++i)
+      pthread_join(b->peers[i].rthread, NULL);
+   /* Report */
+   bm_bench_report(b, out, elapsed);
+   /* Cleanup */
+   bm_dispatcher_stop(d);
+   pthread_join(dthread, NULL);
+   bm_dispatcher_destroy(d);
+   for(size_t i = 0; i < b->peer_num; ++i) {
+      if(b->peers[i].tcp) close(b->peers[i].sock);
+      close(b->peers[i].lsock);
+   }
+   free(t);
+   free(b->peers);
+   b->peers = NULL;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int main(int argc, char* argv[]) {
+   struct bm_bench_s b = {
+      .peer_num = 8,
+      .sender_num = 1,
+      .type = "tcp",
+      .msg_len = 64,
+      .rate = 1000,
+      .duration = 5,
+      .threads = 1,
+      .uring = 0,
+      .options = NULL,
+      .compare = 0,
+      .base_p50 = -1,
+      .base_p99 = -1,
+      .format = "csv",
+      .header = 1,
+      .peers = NULL,
+      .stop_send = 0,
+      .stop_recv = 0
+   };
+   /* Parse the arguments */
+   double v;
+   const char** option_sets = NULL;
+   size_t option_num = 0;
+   for(int i = 1; i < argc; ++i) {
+      const char* opt = argv[i];
+      if(strcmp(opt, "-h") == 0 || strcmp(opt, "--help") == 0) {
+         usage(stdout, argv[0]);
+         return EXIT_SUCCESS;
+      }
+      if(strcmp(opt, "-H") == 0 || strcmp(opt, "--no-header") == 0) {
+         b.header = 0;
+         continue;
+      }
+      if(strcmp(opt, "-U") == 0 || strcmp(opt, "--io-uring") == 0) {
+         b.uring = 1;
+         continue;
+      }
+      if(i + 1 >= argc) {
+         fprintf(stderr, "%s: %s: unknown option or missing value\n", argv[0], opt);
+         return EXIT_FAILURE;
+      }
+      const char* val = argv[++i];
+      if(strcmp(opt, "-n") == 0 || strcmp(opt, "--peers") == 0) {
+         if(!parse_number(argv[0], opt, val, &v)) return EXIT_FAILURE;
+         b.peer_num = v;
+      }
+      else if(strcmp(opt, "-S") == 0 || strcmp(opt, "--senders") == 0) {
+         if(!parse_number(argv[0], opt, val, &v)) return EXIT_FAILURE;
+         b.sender_num = v;
+      }
+      else if(strcmp(opt, "-p") == 0 || strcmp(opt, "--type") == 0) {
+         b.type = val;
+      }
+      else if(strcmp(opt, "-s") == 0 || strcmp(opt, "--size") == 0) {
+         if(!parse_number(argv[0], opt, val, &v)) return EXIT_FAILURE;
+         b.msg_len = v;
+      }
+      else if(strcmp(opt, "-r") == 0 || strcmp(opt, "--rate") == 0) {
+         if(!parse_number(argv[0], opt, val, &b.rate)) return EXIT_FAILURE;
+      }
+      else if(strcmp(opt, "-d") == 0 || strcmp(opt, "--duration") == 0) {
+         if(!parse_number(argv[0], opt, val, &b.duration)) return EXIT_FAILURE;
+      }
+      else if(strcmp(opt, "-t") == 0 || strcmp(opt, "--threads") == 0) {
+         if(!parse_number(argv[0], opt, val, &v)) return EXIT_FAILURE;
+         b.threads = v;
+      }
+      else if(strcmp(opt, "-O") == 0 || strcmp(opt, "--options") == 0) {
+         option_sets = (const char**)realloc(option_sets,
+                                             (option_num + 1) * sizeof(const char*));
+         option_sets[option_num++] = val;
+      }
+      else if(strcmp(opt, "-F") == 0 || strcmp(opt, "--format") == 0) {
+         b.format = val;
+      }
+      else {
+         fprintf(stderr, "%s: %s: unknown option\n", argv[0], opt);
+         return EXIT_FAILURE;
+      }
+   }
+   /* Check the settings */
+   if(b.peer_num < 2 || b.sender_num < 1 || b.sender_num > b.peer_num) {
+      fprintf(stderr, "%s: at least 2 peers and between 1 and %zu senders are needed\n",
+              argv[0], b.peer_num);
+      return EXIT_FAILURE;
+   }
+   if(b.msg_len < sizeof(struct bm_bench_header_s)) {
+      fprintf(stderr, "%s: the message size must be at least %zu\n",
+              argv[0], sizeof(struct bm_bench_header_s));
+      return EXIT_FAILURE;
+   }
+   if(strcmp(b.type, "tcp") != 0 &&
+      strcmp(b.type, "udp") != 0 &&
+      strcmp(b.type, "mixed") != 0) {
+      fprintf(stderr, "%s: unknown peer type '%s'\n", argv[0], b.type);
+      return EXIT_FAILURE;
+   }
+   if(strcmp(b.format, "csv") != 0 && strcmp(b.format, "json") != 0) {
+      fprintf(stderr, "%s: unknown output format '%s'\n", argv[0], b.format);
+      return EXIT_FAILURE;
+   }
+   if(b.threads < 1) b.threads = 1;
+   b.compare = option_num > 1;
+   /* Keep the standard output for the results, the dispatcher logs go
+    * to the standard error */
+   FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+   dup2(STDERR_FILENO, STDOUT_FILENO);
+   /* Run once per set of options */
+   for(size_t i = 0; i < (option_num > 0 ? option_num : 1); ++i) {
+      if(option_num > 0)
+         b.options = *option_sets[i] ? option_sets[i] : NULL;
+      if(!bm_bench_run(&b, out, argv[0])) return EXIT_FAILURE;
+   }
+   free(option_sets);
+   fclose(out);
+   return EXIT_SUCCESS;
+}
+
+/****************************************/
+/****************************************/
@@ -16,6 +16,7 @@ int bm_bt_datastream_connect(void* ds);
 void bm_bt_datastream_disconnect(void* ds);
 ssize_t bm_bt_datastream_send(void* ds, const uint8_t* data, size_t sz);
 ssize_t bm_bt_datastream_recv(void* ds, uint8_t* data, size_t sz);
+int bm_bt_datastream_fd(void* ds);
 
 /****************************************/
 /****************************************/
@@ -57,6 +58,13 @@ ssize_t bm_bt_datastream_recv(void* ds,
 /****************************************/
 /****************************************/
 
+int bm_bt_datastream_fd(void* ds) {
+   return -1;
+}
+
+/****************************************/
+/****************************************/
+
 bm_bt_datastream_t bm_bt_datastream_new(const char* desc) {
    /* Allocate memory */
    bm_bt_datastream_t this = malloc(sizeof(struct bm_bt_datastream_s));
@@ -67,7 +75,8 @@ bm_bt_datastream_t bm_bt_datastream_new(const char* desc) {
                       bm_bt_datastream_connect,
                       bm_bt_datastream_disconnect,
                       bm_bt_datastream_send,
-                      bm_bt_datastream_recv);
+                      bm_bt_datastream_recv,
+                      bm_bt_datastream_fd);
    if(this->parent.status == BM_DATASTREAM_ERROR) {
       bm_bt_datastream_destroy(this);
       return NULL;
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include "bm_capture.h"
+#include "bm_time.h"
+#include "bm_log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the name of a segment, to be freed by the caller.
+ */
+static char* bm_capture_segment_name(bm_capture_t c,
+                                     uint64_t seq) {
+   char* name;
+   asprintf(&name, "%s.%zu.%06" PRIu64, c->prefix, c->reactor, seq);
+   return name;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Closes a segment, truncated to its records.
+ */
+static void bm_capture_segment_close(bm_capture_t c,
+                                     struct bm_capture_segment_s* seg) {
+   if(seg->base) {
+      munmap(seg->base, c->size);
+      seg->base = NULL;
+   }
+   if(seg->fd >= 0) {
+      if(ftruncate(seg->fd, seg->off) < 0)
+         bm_log(BM_LOG_WARNING, "Capture: can't truncate segment %" PRIu64 ": %s",
+                seg->seq,
+                strerror(errno));
+      close(seg->fd);
+      seg->fd = -1;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Takes note that a segment can't be started, and when to try again.
+ * The failure is logged only if the previous attempt succeeded, and
+ * written out right away, as the process might not live long enough
+ * for the background thread of the log to do it.
+ * @param fmt The format of the log line, as in printf().
+ */
+static void bm_capture_fail(bm_capture_t c,
+                            const char* fmt,
+                            ...) {
+   c->retry_at = bm_time_now() + BM_CAPTURE_RETRY;
+   if(c->failing) return;
+   c->failing = 1;
+   va_list args;
+   va_start(args, fmt);
+   bm_logv(BM_LOG_ERROR, fmt, args);
+   va_end(args);
+   bm_log_flush();
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Creates a segment, allocated and mapped, with its pages already
+ * faulted in.
+ * @param seq The sequence number of the segment.
+ * @param seg The segment to set up.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_capture_segment_open(bm_capture_t c,
+                                   uint64_t seq,
+                                   struct bm_capture_segment_s* seg) {
+   char* name = bm_capture_segment_name(c, seq);
+   seg->seq = seq;
+   seg->base = NULL;
+   seg->off = 0;
+   seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if(seg->fd < 0) {
+      bm_capture_fail(c, "Capture: can't create %s: %s", name, strerror(errno));
+      free(name);
+      return 0;
+   }
+   /* Allocate the blocks now, so that running out of space shows up
+    * here rather than as a fault while writing */
+   int err = posix_fallocate(seg->fd, 0, c->size);
+   if(err == EOPNOTSUPP || err == EINVAL)
+      err = ftruncate(seg->fd, c->size) < 0 ? errno : 0;
+   if(err != 0) {
+      bm_capture_fail(c, "Capture: can't allocate %s: %s", name, strerror(err));
+      free(name);
+      bm_capture_segment_close(c, seg);
+      return 0;
+   }
+   seg->base = (uint8_t*)mmap(NULL, c->size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+   if(seg->base == MAP_FAILED) {
+      seg->base = NULL;
+      bm_capture_fail(c, "Capture: can't map %s: %s", name, strerror(errno));
+      free(name);
+      bm_capture_segment_close(c, seg);
+      return 0;
+   }
+#ifdef MADV_POPULATE_WRITE
+   /* MAP_POPULATE only maps the pages for reading, so that the first
+    * write to each would still fault; failing is harmless */
+   madvise(seg->base, c->size, MADV_POPULATE_WRITE);
+#endif
+   if(c->failing) {
+      bm_log(BM_LOG_INFO, "Capture: segments start again with %s", name);
+      c->failing = 0;
+   }
+   free(name);
+   memcpy(seg->base, BM_CAPTURE_MAGIC, BM_CAPTURE_HEADER);
+   seg->off = BM_CAPTURE_HEADER;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Closes a full segment, and removes the one that falls out of the
+ * segments to keep now that the next one is in use.
+ */
+static void bm_capture_segment_retire(bm_capture_t c,
+                                      struct bm_capture_segment_s* seg) {
+   bm_capture_segment_close(c, seg);
+   if(c->keep > 0 && seg->seq + 1 >= c->keep) {
+      char* name = bm_capture_segment_name(c, seg->seq + 1 - c->keep);
+      unlink(name);
+      free(name);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Closes the segments the reactor is done with and prepares the next
+ * one, until the capture is closed.
+ */
+static void* bm_capture_thread(void* arg) {
+   bm_capture_t c = (bm_capture_t)arg;
+   pthread_mutex_lock(&c->mutex);
+   while(1) {
+      /* Close the full segment, even when stopping */
+      if(c->full.base) {
+         struct bm_capture_segment_s seg = c->full;
+         c->full.base = NULL;
+         c->full.fd = -1;
+         pthread_mutex_unlock(&c->mutex);
+         bm_capture_segment_retire(c, &seg);
+         pthread_mutex_lock(&c->mutex);
+         continue;
+      }
+      if(c->stop) break;
+      /* Wait for the reactor to take the next segment, or to try
+       * again after a failure */
+      uint64_t now = bm_time_now();
+      if(c->next.base || now < c->retry_at) {
+         c->busy = 0;
+         pthread_cond_broadcast(&c->idle);
+         if(c->next.base) {
+            pthread_cond_wait(&c->cond, &c->mutex);
+         }
+         else {
+            struct timespec ts = {
+               .tv_sec = c->retry_at / 1000000000ULL,
+               .tv_nsec = c->retry_at % 1000000000ULL
+            };
+            pthread_cond_timedwait(&c->cond, &c->mutex, &ts);
+         }
+         c->busy = 1;
+         continue;
+      }
+      /* Prepare the next segment without holding the lock */
+      struct bm_capture_segment_s seg;
+      uint64_t seq = c->next_seq;
+      pthread_mutex_unlock(&c->mutex);
+      int ok = bm_capture_segment_open(c, seq, &seg);
+      pthread_mutex_lock(&c->mutex);
+      if(ok) {
+         c->next = seg;
+         ++c->next_seq;
+      }
+   }
+   c->busy = 0;
+   pthread_cond_broadcast(&c->idle);
+   pthread_mutex_unlock(&c->mutex);
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Moves on to the segment prepared by the thread, and leaves the
+ * current one for the thread to close. If the thread is still at
+ * work, it is waited for rather than losing messages; it is idle
+ * without a segment only after a failure.
+ * @return 1 for success, 0 if there is no next segment.
+ */
+static int bm_capture_rotate(bm_capture_t c) {
+   pthread_mutex_lock(&c->mutex);
+   while(!c->next.base && c->busy)
+      pthread_cond_wait(&c->idle, &c->mutex);
+   if(!c->next.base) {
+      pthread_mutex_unlock(&c->mutex);
+      return 0;
+   }
+   /* The thread closes the full segment before preparing a new one,
+    * so there is none left to close */
+   c->full = c->cur;
+   c->cur = c->next;
+   c->next.base = NULL;
+   c->next.fd = -1;
+   c->busy = 1;
+   pthread_cond_signal(&c->cond);
+   pthread_mutex_unlock(&c->mutex);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_capture_t bm_capture_new(const char* prefix,
+                            size_t reactor,
+                            size_t size,
+                            size_t keep) {
+   bm_capture_t c = (bm_capture_t)malloc(sizeof(struct bm_capture_s));
+   c->prefix = strdup(prefix);
+   c->reactor = reactor;
+   c->size = size < BM_CAPTURE_SEGMENT_MIN ? BM_CAPTURE_SEGMENT_MIN : size;
+   c->keep = keep;
+   c->records = 0;
+   c->dropped = 0;
+   c->failing = 0;
+   c->retry_at = 0;
+   c->stop = 0;
+   c->busy = 1;
+   c->next.fd = -1;
+   c->next.base = NULL;
+   c->next_seq = 1;
+   c->full.fd = -1;
+   c->full.base = NULL;
+   /* Records are stamped with the wall clock */
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   c->clock_offset = (int64_t)(now.tv_sec * 1000000000ULL + now.tv_nsec) -
+      (int64_t)bm_time_now();
+   /* The first segment is started right away, the others by the thread */
+   if(!bm_capture_segment_open(c, 0, &c->cur)) {
+      free(c->prefix);
+      free(c);
+      return NULL;
+   }
+   /* The thread waits on the clock of bm_time_now() */
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&c->cond, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_cond_init(&c->idle, NULL);
+   pthread_mutex_init(&c->mutex, NULL);
+   int err = pthread_create(&c->thread, NULL, &bm_capture_thread, c);
+   if(err != 0) {
+      bm_log(BM_LOG_ERROR, "Capture: can't start thread: %s", strerror(err));
+      bm_capture_segment_close(c, &c->cur);
+      pthread_cond_destroy(&c->cond);
+      pthread_cond_destroy(&c->idle);
+      pthread_mutex_destroy(&c->mutex);
+      free(c->prefix);
+      free(c);
+      return NULL;
+   }
+   return c;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_capture_destroy(bm_capture_t c) {
+   /* Let the thread close the full segment and stop */
+   pthread_mutex_lock(&c->mutex);
+   c->stop = 1;
+   pthread_cond_signal(&c->cond);
+   pthread_mutex_unlock(&c->mutex);
+   pthread_join(c->thread, NULL);
+   bm_capture_segment_close(c, &c->cur);
+   /* The segment prepared ahead holds nothing */
+   if(c->next.base) {
+      bm_capture_segment_close(c, &c->next);
+      char* name = bm_capture_segment_name(c, c->next.seq);
+      unlink(name);
+      free(name);
+   }
+   pthread_cond_destroy(&c->cond);
+   pthread_cond_destroy(&c->idle);
+   pthread_mutex_destroy(&c->mutex);
+   bm_log(BM_LOG_INFO, "Capture %s.%zu: %" PRIu64 " messages recorded, %" PRIu64 " dropped",
+          c->prefix,
+          c->reactor,
+          c->records,
+          c->dropped);
+   free(c->prefix);
+   free(c);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_capture_write(bm_capture_t c,
+                      const char* id,
+                      bm_msg_t m) {
+   size_t id_len = strlen(id);
+   if(id_len > UINT8_MAX) id_len = UINT8_MAX;
+   size_t n = bm_capture_record_len(id_len, m->len);
+   /* Move on to the next segment if this one is full */
+   if(c->cur.off + n > c->size &&
+      (BM_CAPTURE_HEADER + n > c->size || !bm_capture_rotate(c))) {
+      ++c->dropped;
+      return;
+   }
+   /* Fill the record, then set its timestamp, which makes it valid */
+   struct bm_capture_record_s* rec = (struct bm_capture_record_s*)(c->cur.base + c->cur.off);
+   rec->len = m->len;
+   rec->channel = m->channel;
+   rec->id_len = id_len;
+   rec->reserved = 0;
+   memcpy(c->cur.base + c->cur.off + sizeof(struct bm_capture_record_s), id, id_len);
+   memcpy(c->cur.base + c->cur.off + sizeof(struct bm_capture_record_s) + id_len,
+          m->data,
+          m->len);
+   atomic_thread_fence(memory_order_release);
+   rec->ts = m->ts + c->clock_offset;
+   c->cur.off += n;
+   ++c->records;
+}
+
+/****************************************/
+/****************************************/
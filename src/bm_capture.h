@@ -0,0 +1,178 @@
+#ifndef BM_CAPTURE_H
+#define BM_CAPTURE_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "bm_msg.h"
+
+/*
+ * Default size of a capture segment
+ */
+#define BM_CAPTURE_SEGMENT (64 * 1024 * 1024)
+
+/*
+ * Smallest size of a capture segment
+ */
+#define BM_CAPTURE_SEGMENT_MIN (64 * 1024)
+
+/*
+ * How long to wait before trying again to start a segment (ns)
+ */
+#define BM_CAPTURE_RETRY 1000000000ULL
+
+/*
+ * The magic number at the beginning of every segment
+ */
+#define BM_CAPTURE_MAGIC "BMCAP001"
+
+/*
+ * Length of the segment header: the magic number
+ */
+#define BM_CAPTURE_HEADER 8
+
+/*
+ * Records start on multiples of this
+ */
+#define BM_CAPTURE_ALIGN 8
+
+/*
+ * A capture of the messages received by a reactor.
+ * The messages go into segments, files of a fixed size named
+ * PREFIX.REACTOR.SEQUENCE, preallocated and memory-mapped, so that
+ * recording a message is little more than copying it. A background
+ * thread prepares the next segment, prefaulted, while the current one
+ * fills up, so that moving on to it is a pointer swap (the reactor
+ * only waits for it if the thread falls behind); the thread also
+ * closes the full segments, and removes the oldest ones past a given
+ * number. The segment prepared ahead is there on disk too, empty.
+ * A segment holds the magic number, then records one after the other,
+ * each aligned on BM_CAPTURE_ALIGN bytes: a struct bm_capture_record_s,
+ * the id of the source stream, then the payload. A record with a
+ * timestamp of 0 (or the end of the file) ends the segment.
+ * If a segment can't be started, the messages are dropped once the
+ * current one is full, until a new attempt succeeds, every
+ * BM_CAPTURE_RETRY.
+ */
+
+/*
+ * The header of a record, in host byte order.
+ */
+struct bm_capture_record_s {
+   /* Reception time, in ns since the epoch */
+   uint64_t ts;
+   /* Payload length */
+   uint32_t len;
+   /* Channel the message was published on */
+   uint8_t channel;
+   /* Length of the id of the source stream */
+   uint8_t id_len;
+   /* Unused, 0 */
+   uint16_t reserved;
+};
+
+/*
+ * A segment of a capture.
+ */
+struct bm_capture_segment_s {
+   /* The sequence number of the segment */
+   uint64_t seq;
+   /* The file of the segment, -1 for none */
+   int fd;
+   /* The mapping of the segment, NULL for none */
+   uint8_t* base;
+   /* Where the next record goes */
+   size_t off;
+};
+
+/*
+ * A capture, written by a single reactor.
+ */
+struct bm_capture_s {
+   /* The prefix of the segment names */
+   char* prefix;
+   /* The index of the reactor, part of the segment names */
+   size_t reactor;
+   /* The size of a segment */
+   size_t size;
+   /* How many segments to keep, 0 for all */
+   size_t keep;
+   /* The segment being written, only touched by the reactor */
+   struct bm_capture_segment_s cur;
+   /* Added to the monotonic clock to get the time since the epoch */
+   int64_t clock_offset;
+   /* Number of messages recorded */
+   uint64_t records;
+   /* Number of messages that could not be recorded */
+   uint64_t dropped;
+   /* The thread that prepares and closes the segments */
+   pthread_t thread;
+   /* Whether the last attempt of the thread to start a segment failed */
+   int failing;
+   /* When the thread tries again to start a segment, after a failure (ns) */
+   uint64_t retry_at;
+   /* Protects the fields below */
+   pthread_mutex_t mutex;
+   /* Signaled when there is work for the thread */
+   pthread_cond_t cond;
+   /* Signaled when the thread is done with its work */
+   pthread_cond_t idle;
+   /* Whether the thread has a segment to prepare or close */
+   int busy;
+   /* The segment prepared by the thread, base is NULL until it is
+    * ready */
+   struct bm_capture_segment_s next;
+   /* The sequence number of the segment to prepare next */
+   uint64_t next_seq;
+   /* The segment left by the reactor for the thread to close, base is
+    * NULL if none */
+   struct bm_capture_segment_s full;
+   /* Set to 1 to make the thread stop */
+   int stop;
+};
+typedef struct bm_capture_s* bm_capture_t;
+
+/*
+ * Creates a new capture and its first segment.
+ * @param prefix The prefix of the segment names.
+ * @param reactor The index of the reactor.
+ * @param size The size of a segment.
+ * @param keep How many segments to keep, 0 for all.
+ * @return The capture, or NULL for failure.
+ */
+extern bm_capture_t bm_capture_new(const char* prefix,
+                                   size_t reactor,
+                                   size_t size,
+                                   size_t keep);
+
+/*
+ * Closes a capture.
+ * The current segment is truncated to its records.
+ * @param c The capture.
+ */
+extern void bm_capture_destroy(bm_capture_t c);
+
+/*
+ * Records a message.
+ * Only the reactor of the capture can call this.
+ * @param c The capture.
+ * @param id The id of the stream the message was received from.
+ * @param m The message.
+ */
+extern void bm_capture_write(bm_capture_t c,
+                             const char* id,
+                             bm_msg_t m);
+
+/*
+ * Returns the length of a record.
+ * @param id_len The length of the id of the source stream.
+ * @param len The payload length.
+ * @return The record length, padding included.
+ */
+static inline size_t bm_capture_record_len(size_t id_len,
+                                           size_t len) {
+   size_t n = sizeof(struct bm_capture_record_s) + id_len + len;
+   return (n + BM_CAPTURE_ALIGN - 1) & ~(size_t)(BM_CAPTURE_ALIGN - 1);
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "bm_conflate.h"
+#include <string.h>
+
+/****************************************/
+/****************************************/
+
+/*
+ * Hashes the key of a message (FNV-1a).
+ */
+static uint32_t bm_conflate_hash(bm_conflate_t c,
+                                 bm_msg_t m) {
+   uint32_t h = 2166136261u;
+   const uint8_t* k = m->data + c->off;
+   for(size_t i = 0; i < c->len; ++i)
+      h = (h ^ k[i]) * 16777619u;
+   return h;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_conflate_init(bm_conflate_t c) {
+   c->off = 0;
+   c->len = 0;
+   c->buckets = NULL;
+   c->mask = 0;
+   c->entries = NULL;
+   c->free = NULL;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_conflate_cleanup(bm_conflate_t c) {
+   free(c->buckets);
+   free(c->entries);
+   c->buckets = NULL;
+   c->entries = NULL;
+   c->free = NULL;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_conflate_parse(bm_conflate_t c,
+                      const char* str) {
+   char* endptr;
+   unsigned long first = strtoul(str, &endptr, 10);
+   unsigned long last = first;
+   if(endptr == str) return 0;
+   if(*endptr == '-') {
+      str = endptr + 1;
+      last = strtoul(str, &endptr, 10);
+      if(endptr == str || last < first) return 0;
+   }
+   if(*endptr != '\0') return 0;
+   c->off = first;
+   c->len = last - first + 1;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_conflate_entry_t bm_conflate_find(bm_conflate_t c,
+                                     bm_msg_t m) {
+   if(!c->buckets) return NULL;
+   uint32_t h = bm_conflate_hash(c, m);
+   bm_conflate_entry_t e = c->buckets[h & c->mask];
+   while(e &&
+         (e->hash != h ||
+          memcmp(e->msg->data + c->off, m->data + c->off, c->len) != 0))
+      e = e->next;
+   return e;
+}
+
+/****************************************/
+/****************************************/
+
+bm_conflate_entry_t bm_conflate_add(bm_conflate_t c,
+                                    bm_msg_t m,
+                                    size_t max) {
+   /* Allocate one entry per queue slot, and at least twice as many
+    * buckets */
+   if(!c->entries) {
+      size_t n = 2;
+      while(n < 2 * max) n <<= 1;
+      c->buckets = (bm_conflate_entry_t*)calloc(n, sizeof(bm_conflate_entry_t));
+      c->mask = n - 1;
+      c->entries = (struct bm_conflate_entry_s*)malloc(max * sizeof(struct bm_conflate_entry_s));
+      for(size_t i = 0; i < max; ++i)
+         c->entries[i].next = i + 1 < max ? &c->entries[i + 1] : NULL;
+      c->free = max > 0 ? c->entries : NULL;
+   }
+   bm_conflate_entry_t e = c->free;
+   if(!e) return NULL;
+   c->free = e->next;
+   e->msg = m;
+   e->hash = bm_conflate_hash(c, m);
+   e->next = c->buckets[e->hash & c->mask];
+   c->buckets[e->hash & c->mask] = e;
+   return e;
+}
+
+/****************************************/
+/****************************************/
+
+bm_msg_t bm_conflate_remove(bm_conflate_t c,
+                            bm_conflate_entry_t e) {
+   bm_conflate_entry_t* p = &c->buckets[e->hash & c->mask];
+   while(*p != e) p = &(*p)->next;
+   *p = e->next;
+   bm_msg_t m = e->msg;
+   e->msg = NULL;
+   e->next = c->free;
+   c->free = e;
+   return m;
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,117 @@
+#ifndef BM_CONFLATE_H
+#define BM_CONFLATE_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include "bm_msg.h"
+
+/*
+ * Conflation of the outbound queue of a stream.
+ * A message is keyed by a range of its bytes, e.g. the id of the robot
+ * it comes from. While a message waits in the queue, a newer one with
+ * the same key takes its place, rather than being queued after it, so
+ * only the latest value of each key is sent and the queue holds at
+ * most one message per key.
+ * The queue holds entries instead of the keyed messages themselves;
+ * an entry stays in the cache while it is queued, and the message it
+ * holds can be swapped. The entries are allocated once, as many as the
+ * queue can hold. Messages shorter than the key are not conflated.
+ * Only the reactor that owns the stream touches the cache.
+ */
+
+/*
+ * A queued message and its key.
+ */
+struct bm_conflate_entry_s {
+   /* The message */
+   bm_msg_t msg;
+   /* The hash of the key */
+   uint32_t hash;
+   /* Next entry in the bucket, or in the free list */
+   struct bm_conflate_entry_s* next;
+};
+typedef struct bm_conflate_entry_s* bm_conflate_entry_t;
+
+/*
+ * The cache of the queued messages of a stream.
+ */
+struct bm_conflate_s {
+   /* The offset of the key in the payload */
+   size_t off;
+   /* The length of the key, 0 not to conflate */
+   size_t len;
+   /* The entries of the queued messages, by hash of their key */
+   bm_conflate_entry_t* buckets;
+   /* The number of buckets - 1; the number is a power of two */
+   size_t mask;
+   /* The entries, allocated on first use */
+   struct bm_conflate_entry_s* entries;
+   /* The unused entries */
+   bm_conflate_entry_t free;
+};
+typedef struct bm_conflate_s* bm_conflate_t;
+
+/*
+ * Initializes a cache that doesn't conflate.
+ * @param c The cache.
+ */
+extern void bm_conflate_init(bm_conflate_t c);
+
+/*
+ * Releases a cache.
+ * The queue must be empty.
+ * @param c The cache.
+ */
+extern void bm_conflate_cleanup(bm_conflate_t c);
+
+/*
+ * Parses a key range: FIRST-LAST (inclusive) or a single offset.
+ * @param c The cache.
+ * @param str The string to parse.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_conflate_parse(bm_conflate_t c,
+                             const char* str);
+
+/*
+ * Returns whether a message is conflated.
+ * @param c The cache.
+ * @param m The message.
+ * @return 1 if the message is keyed, 0 otherwise.
+ */
+static inline int bm_conflate_keyed(bm_conflate_t c,
+                                    bm_msg_t m) {
+   return c->len > 0 && m->len >= c->off + c->len;
+}
+
+/*
+ * Finds the queued entry with the key of a message.
+ * @param c The cache.
+ * @param m The message, keyed.
+ * @return The entry, or NULL if no message with that key is queued.
+ */
+extern bm_conflate_entry_t bm_conflate_find(bm_conflate_t c,
+                                            bm_msg_t m);
+
+/*
+ * Makes an entry for a message about to be queued.
+ * @param c The cache.
+ * @param m The message, keyed; the entry takes over the reference.
+ * @param max The most messages the queue holds.
+ * @return The entry, or NULL if all are in use.
+ */
+extern bm_conflate_entry_t bm_conflate_add(bm_conflate_t c,
+                                           bm_msg_t m,
+                                           size_t max);
+
+/*
+ * Releases an entry taken out of the queue, or that could not be
+ * queued.
+ * @param c The cache.
+ * @param e The entry.
+ * @return The message of the entry, with its reference.
+ */
+extern bm_msg_t bm_conflate_remove(bm_conflate_t c,
+                                   bm_conflate_entry_t e);
+
+#endif
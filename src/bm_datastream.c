@@ -4,6 +4,27 @@
 #include <string.h>
 #include "bm_datastream.h"
 
+/*
+ * Default number of messages each stream can have waiting to be sent
+ */
+#define BM_DATASTREAM_QUEUE_DEPTH 1024
+
+/*
+ * Default maximum number of messages sent in one batch
+ */
+#define BM_DATASTREAM_SEND_BATCH 64
+
+/*
+ * Default time to wait for room in a full queue with BM_OVERFLOW_BLOCK (ms)
+ */
+#define BM_DATASTREAM_BLOCK_TIMEOUT 100
+
+/*
+ * The queue of a conflating stream holds the entries of the keyed
+ * messages, told apart from the other messages by their lowest bit.
+ */
+#define BM_DATASTREAM_ENTRY_TAG 1
+
 /****************************************/
 /****************************************/
 
@@ -13,15 +34,105 @@ void bm_datastream_init(bm_datastream_t ds,
                         int (*connectf)(void*),
                         void (*disconnectf)(void*),
                         ssize_t (*sendf)(void*, const uint8_t*, size_t),
-                        ssize_t (*recvf)(void*, uint8_t*, size_t)) {
+                        ssize_t (*recvf)(void*, uint8_t*, size_t),
+                        int (*fdf)(void*)) {
    /* Set methods */
    ds->destroy = destroyf;
    ds->connect = connectf;
    ds->disconnect = disconnectf;
    ds->send = sendf;
    ds->recv = recvf;
+   ds->fd = fdf;
+   ds->sendv = bm_datastream_sendv;
+   ds->recvv = bm_datastream_recvv;
+   ds->bytestream = 0;
+   ds->accept = NULL;
+   ds->reconnect = NULL;
+   ds->handshake = NULL;
    /* Set descriptor */
    ds->descriptor = strdup(desc);
+   ds->id = NULL;
+   /* Set status */
+   ds->status_desc = NULL;
+   bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
+   /* Set channels, all subscribed by default */
+   ds->pub_channel = 0;
+   ds->pub_offset = -1;
+   ds->sets_channel = 0;
+   ds->self_paced = 0;
+   ds->room_on_read = 0;
+   ds->shared = 0;
+   ds->peer_idle = BM_DATASTREAM_PEER_IDLE;
+   memset(ds->subs, 0xFF, sizeof(ds->subs));
+   /* Set framing */
+   bm_framing_init(&ds->framing);
+   /* Set socket tuning */
+   bm_sockopt_init(&ds->sockopt);
+   bm_sockopt_init(&ds->sockopt_eff);
+   ds->pools = NULL;
+   ds->scratch = NULL;
+   ds->scratch_size = 0;
+   /* Set owner reactor */
+   ds->reactor = 0;
+   /* Set outbound queue */
+   ds->outq = NULL;
+   ds->queue_max_msgs = BM_DATASTREAM_QUEUE_DEPTH;
+   ds->queue_max_bytes = 0;
+   atomic_init(&ds->queue_bytes, 0);
+   ds->overflow = BM_OVERFLOW_DROP_NEWEST;
+   ds->block_timeout = BM_DATASTREAM_BLOCK_TIMEOUT;
+   ds->backlog = NULL;
+   ds->backlog_num = 0;
+   ds->backlog_cap = 0;
+   ds->blocked_since = 0;
+   atomic_init(&ds->overflowed, 0);
+   bm_conflate_init(&ds->conflate);
+   ds->out_max = BM_DATASTREAM_SEND_BATCH;
+   ds->out_batch = (bm_msg_t*)malloc(ds->out_max * sizeof(bm_msg_t));
+   ds->out_num = 0;
+   ds->out_off = 0;
+   ds->flush_delay = 0;
+   ds->flush_deadline = 0;
+   ds->defer_next = NULL;
+   ds->deferred = 0;
+   for(size_t i = 0; i < BM_DATASTREAM_BATCH_BUCKETS; ++i)
+      atomic_init(&ds->batch_hist[i], 0);
+   atomic_init(&ds->flush_pending, 0);
+   atomic_init(&ds->inbound, 0);
+   ds->flush_next = NULL;
+   ds->want_write = 0;
+   ds->resume_next = NULL;
+   ds->resuming = 0;
+   ds->pause_next = NULL;
+   ds->paused = 0;
+   ds->sending = 0;
+   ds->uring_file = -1;
+   atomic_init(&ds->dropped, 0);
+   atomic_init(&ds->conflated, 0);
+   /* Set metrics */
+   atomic_init(&ds->msgs_in, 0);
+   atomic_init(&ds->bytes_in, 0);
+   atomic_init(&ds->msgs_out, 0);
+   atomic_init(&ds->bytes_out, 0);
+   atomic_init(&ds->send_errors, 0);
+   atomic_init(&ds->reconnects, 0);
+   atomic_init(&ds->duplicates, 0);
+   bm_histogram_init(&ds->latency);
+   /* Set reconnection */
+   ds->backoff_min = BM_DATASTREAM_BACKOFF_MIN;
+   ds->backoff_max = BM_DATASTREAM_BACKOFF_MAX;
+   ds->backoff = ds->backoff_min;
+   ds->retry_deadline = 0;
+   ds->retry_next = NULL;
+   ds->retrying = 0;
+   ds->connect_start = 0;
+   ds->starting = 0;
+   ds->resolver = NULL;
+   bm_histogram_init(&ds->connect_latency);
+   /* Set lifecycle */
+   ds->accepted = 0;
+   ds->closed = 0;
+   ds->reclaim_stage = 0;
    /* Set id */
    char* delim = strchr(desc, ':');
    if(!delim) {
@@ -33,12 +144,7 @@ void bm_datastream_init(bm_datastream_t ds,
    }
    ds->id = (char*)malloc(delim - desc + 1);
    strncpy(ds->id, desc, delim - desc);
-   ds->id[delim - desc + 1] = '\0';
-   /* Set status */
-   ds->status_desc = NULL;
-   bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
-   /* Set next */
-   ds->next = NULL;
+   ds->id[delim - desc] = '\0';
 }
 
 /****************************************/
@@ -46,6 +152,12 @@ void bm_datastream_init(bm_datastream_t ds,
 
 void bm_datastream_destroy(bm_datastream_t ds) {
    ds->disconnect(ds);
+   bm_datastream_drain(ds);
+   if(ds->outq) bm_queue_destroy(ds->outq);
+   bm_conflate_cleanup(&ds->conflate);
+   free(ds->out_batch);
+   free(ds->backlog);
+   free(ds->scratch);
    free(ds->status_desc);
    free(ds->descriptor);
    free(ds->id);
@@ -69,3 +181,557 @@ void bm_datastream_set_status(void* ds,
 
 /****************************************/
 /****************************************/
+
+void bm_datastream_tune(void* ds,
+                        int fd) {
+   bm_datastream_t this = (bm_datastream_t)ds;
+   bm_sockopt_apply(&this->sockopt, fd, this->descriptor, &this->sockopt_eff);
+}
+
+/****************************************/
+/****************************************/
+
+bm_msg_t bm_datastream_msg_new(bm_datastream_t ds,
+                               size_t len) {
+   if(!ds->pools)
+      return bm_msg_new(len);
+   bm_msg_t m = bm_msgpool_set_get(ds->pools, len);
+   m->sender = 0;
+   return m;
+}
+
+/****************************************/
+/****************************************/
+
+uint8_t* bm_datastream_scratch(bm_datastream_t ds,
+                               size_t n,
+                               size_t sz) {
+   if(ds->scratch_size < n * sz) {
+      uint8_t* scratch = (uint8_t*)realloc(ds->scratch, n * sz);
+      if(!scratch) return NULL;
+      ds->scratch = scratch;
+      ds->scratch_size = n * sz;
+   }
+   return ds->scratch;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_datastream_sendv(void* ds,
+                            bm_msg_t* msgs,
+                            size_t n,
+                            size_t off) {
+   bm_datastream_t this = (bm_datastream_t)ds;
+   ssize_t tot = 0, sent;
+   uint8_t hdr[BM_FRAMING_HEADER_MAX];
+   size_t hlen, plen, wlen, left;
+   const uint8_t* data;
+   for(size_t i = 0; i < n; ++i) {
+      /* Send the header, the payload and the trailer of the frame */
+      hlen = bm_framing_header(&this->framing, msgs[i], hdr);
+      plen = hlen + msgs[i]->len;
+      wlen = plen + bm_framing_trailer(&this->framing);
+      while(off < wlen) {
+         if(off < hlen) {
+            data = hdr + off;
+            left = hlen - off;
+         }
+         else if(off < plen) {
+            data = msgs[i]->data + off - hlen;
+            left = plen - off;
+         }
+         else {
+            data = &this->framing.delim;
+            left = wlen - off;
+         }
+         sent = this->send(this, data, left);
+         if(sent < 0) {
+            /* Report what was sent before the error, if anything; the
+             * error shows up again at the next call */
+            return tot > 0 ? tot : sent;
+         }
+         tot += sent;
+         off += sent;
+         /* Stop at partial sends */
+         if((size_t)sent < left) return tot;
+      }
+      off = 0;
+   }
+   return tot;
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_datastream_iov(bm_datastream_t ds,
+                         bm_msg_t* msgs,
+                         size_t n,
+                         size_t off,
+                         struct iovec* iovs,
+                         size_t iovmax,
+                         uint8_t (*hdrs)[BM_FRAMING_HEADER_MAX]) {
+   /* Each frame is made of up to a header, the payload, and a trailer */
+   bm_framing_t f = &ds->framing;
+   size_t iovnum = 0, hlen;
+   size_t trailer = bm_framing_trailer(f);
+   for(size_t i = 0; i < n && iovnum + 3 <= iovmax; ++i) {
+      hlen = bm_framing_header(f, msgs[i], hdrs[i]);
+      if(hlen > 0) {
+         iovs[iovnum].iov_base = hdrs[i];
+         iovs[iovnum++].iov_len = hlen;
+      }
+      iovs[iovnum].iov_base = msgs[i]->data;
+      iovs[iovnum++].iov_len = msgs[i]->len;
+      if(trailer > 0) {
+         iovs[iovnum].iov_base = &f->delim;
+         iovs[iovnum++].iov_len = trailer;
+      }
+   }
+   /* Skip what was already sent of the first frame */
+   size_t skip = 0;
+   while(off >= iovs[skip].iov_len) {
+      off -= iovs[skip].iov_len;
+      ++skip;
+   }
+   if(skip > 0) {
+      iovnum -= skip;
+      memmove(iovs, iovs + skip, iovnum * sizeof(struct iovec));
+   }
+   iovs[0].iov_base = (uint8_t*)iovs[0].iov_base + off;
+   iovs[0].iov_len -= off;
+   return iovnum;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_datastream_recvv(void* ds,
+                            bm_msg_t* msgs,
+                            size_t n) {
+   bm_datastream_t this = (bm_datastream_t)ds;
+   ssize_t num = 0, received;
+   while((size_t)num < n) {
+      msgs[num] = bm_datastream_msg_new(this, this->framing.size);
+      received = this->recv(this, msgs[num]->data, this->framing.size);
+      if(received <= 0) {
+         bm_msg_unref(msgs[num]);
+         /* Report the messages received before running out of data;
+          * closing and errors show up again at the next call */
+         return num > 0 ? num : received;
+      }
+      ++num;
+   }
+   return num;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_datastream_parse_size(const char* str,
+                             size_t* v) {
+   char* endptr;
+   unsigned long long n = strtoull(str, &endptr, 10);
+   if(endptr == str) return 0;
+   if(*endptr == 'k' || *endptr == 'K') { n <<= 10; ++endptr; }
+   else if(*endptr == 'm' || *endptr == 'M') { n <<= 20; ++endptr; }
+   else if(*endptr == 'g' || *endptr == 'G') { n <<= 30; ++endptr; }
+   if(*endptr != '\0') return 0;
+   *v = n;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_datastream_parse_duration(const char* str,
+                                 double unit,
+                                 uint64_t* v) {
+   char* endptr;
+   double t = strtod(str, &endptr);
+   if(endptr == str || t < 0) return 0;
+   if(strcmp(endptr, "s") == 0) t *= 1e9;
+   else if(strcmp(endptr, "ms") == 0) t *= 1e6;
+   else if(strcmp(endptr, "us") == 0) t *= 1e3;
+   else if(*endptr == '\0') t *= unit;
+   else return 0;
+   *v = t;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses a channel number.
+ * @param str The string to parse.
+ * @param end Where the end of the number is stored.
+ * @param v Where the value is stored.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_datastream_parse_channel(const char* str,
+                                       char** end,
+                                       size_t* v) {
+   *v = strtoul(str, end, 10);
+   return *end != str && *v < BM_MSG_CHANNELS;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses a set of channels, such as "1+4-7+12".
+ * @param str The string to parse.
+ * @param subs Where the set is stored, one bit per channel.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_datastream_parse_channels(const char* str,
+                                        uint64_t* subs) {
+   memset(subs, 0, BM_MSG_CHANNELS / 8);
+   char* endptr;
+   size_t first, last;
+   while(1) {
+      if(!bm_datastream_parse_channel(str, &endptr, &first)) return 0;
+      last = first;
+      if(*endptr == '-' &&
+         (!bm_datastream_parse_channel(endptr + 1, &endptr, &last) ||
+          last < first))
+         return 0;
+      for(size_t c = first; c <= last; ++c)
+         subs[c / 64] |= (uint64_t)1 << (c % 64);
+      if(*endptr == '\0') return 1;
+      if(*endptr != '+') return 0;
+      str = endptr + 1;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+int bm_datastream_parse_options(bm_datastream_t ds,
+                                const char* opts) {
+   /* Duplicate string for strtok_r */
+   char* wopts = strdup(opts);
+   /* Buffer pointer for strtok_r */
+   char* saveptr = NULL;
+   /* Whether an option is a socket option */
+   int known;
+   /* Go through the options */
+   for(char* tok = strtok_r(wopts, ",", &saveptr);
+       tok != NULL;
+       tok = strtok_r(NULL, ",", &saveptr)) {
+      /* Split name and value */
+      char* val = strchr(tok, '=');
+      if(val) *val++ = '\0';
+      if(strcmp(tok, "q") == 0 && val) {
+         /* Queue depth in messages */
+         if(!bm_datastream_parse_size(val, &ds->queue_max_msgs) ||
+            ds->queue_max_msgs == 0) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse queue depth '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "qbytes") == 0 && val) {
+         /* Queue depth in bytes */
+         if(!bm_datastream_parse_size(val, &ds->queue_max_bytes)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse queue size '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "conflate") == 0 && val) {
+         /* Key of the messages that replace each other in the queue */
+         if(!bm_conflate_parse(&ds->conflate, val)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse key range '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "idle") == 0 && val) {
+         /* How long the peers of a shared stream can stay silent */
+         if(!bm_datastream_parse_duration(val, 1000000000, &ds->peer_idle) ||
+            ds->peer_idle == 0) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse idle time '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "batch") == 0 && val) {
+         /* Maximum number of messages per send */
+         size_t n;
+         if(!bm_datastream_parse_size(val, &n) ||
+            n == 0 || n > BM_DATASTREAM_BATCH_MAX) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse batch size '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+         ds->out_max = n;
+         ds->out_batch = (bm_msg_t*)realloc(ds->out_batch,
+                                            n * sizeof(bm_msg_t));
+      }
+      else if(strcmp(tok, "flush") == 0 && val) {
+         /* Latency budget to fill a batch */
+         if(!bm_datastream_parse_duration(val, 1000, &ds->flush_delay)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse flush delay '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "backoff") == 0 && val) {
+         /* Range of the delays before reconnecting, or 0 for never */
+         char* max = strchr(val, '-');
+         if(max) *max++ = '\0';
+         if(!bm_datastream_parse_duration(val, 1000000, &ds->backoff_min) ||
+            (max && !bm_datastream_parse_duration(max, 1000000, &ds->backoff_max)) ||
+            (max && ds->backoff_max < ds->backoff_min) ||
+            (max && ds->backoff_min == 0)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse backoff '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+         if(!max) ds->backoff_max = ds->backoff_min;
+         ds->backoff = ds->backoff_min;
+      }
+      else if(strcmp(tok, "pub") == 0 && val) {
+         /* Channel of the received messages, fixed or read from the
+          * payload */
+         char* endptr;
+         size_t v;
+         int ok;
+         if(*val == '@') {
+            ok = bm_datastream_parse_size(val + 1, &v);
+            ds->pub_offset = v;
+         }
+         else {
+            ok = bm_datastream_parse_channel(val, &endptr, &v) &&
+               *endptr == '\0';
+            ds->pub_channel = v;
+         }
+         if(!ok) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse channel '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "sub") == 0 && val) {
+         /* Channels to receive messages from */
+         if(!bm_datastream_parse_channels(val, ds->subs)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse channels '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "frame") == 0 && val) {
+         /* Framing type */
+         if(!bm_framing_parse_type(&ds->framing, val)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Unknown framing '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "size") == 0 && val) {
+         /* Message size with fixed framing */
+         if(!bm_datastream_parse_size(val, &ds->framing.size) ||
+            ds->framing.size == 0) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse message size '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "max") == 0 && val) {
+         /* Maximum length of a received message */
+         if(!bm_datastream_parse_size(val, &ds->framing.max) ||
+            ds->framing.max == 0) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse maximum message size '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "delim") == 0 && val) {
+         /* Delimiter with delimiter framing */
+         if(!bm_framing_parse_delim(&ds->framing, val)) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse delimiter '%s' in '%s'",
+                                     val, ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else if(strcmp(tok, "drop-newest") == 0 && !val) {
+         ds->overflow = BM_OVERFLOW_DROP_NEWEST;
+      }
+      else if(strcmp(tok, "drop-oldest") == 0 && !val) {
+         ds->overflow = BM_OVERFLOW_DROP_OLDEST;
+      }
+      else if(strcmp(tok, "block") == 0) {
+         ds->overflow = BM_OVERFLOW_BLOCK;
+         if(val) {
+            char* endptr;
+            ds->block_timeout = strtol(val, &endptr, 10);
+            if(endptr == val || *endptr != '\0' || ds->block_timeout < 0) {
+               bm_datastream_set_status(ds,
+                                        BM_DATASTREAM_ERROR,
+                                        "Can't parse block timeout '%s' in '%s'",
+                                        val, ds->descriptor);
+               free(wopts);
+               return 0;
+            }
+         }
+      }
+      else if(strcmp(tok, "disconnect") == 0 && !val) {
+         ds->overflow = BM_OVERFLOW_DISCONNECT;
+      }
+      else if((known = bm_sockopt_parse(&ds->sockopt, tok, val)) >= 0) {
+         /* Socket tuning */
+         if(!known) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse %s '%s' in '%s'",
+                                     tok, val ? val : "", ds->descriptor);
+            free(wopts);
+            return 0;
+         }
+      }
+      else {
+         bm_datastream_set_status(ds,
+                                  BM_DATASTREAM_ERROR,
+                                  "Unknown option '%s' in '%s'",
+                                  tok, ds->descriptor);
+         free(wopts);
+         return 0;
+      }
+   }
+   free(wopts);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_datastream_queue_push(bm_datastream_t ds,
+                             bm_msg_t m) {
+   bm_conflate_entry_t e = NULL;
+   if(bm_conflate_keyed(&ds->conflate, m)) {
+      /* Take the place of the queued message with the same key */
+      e = bm_conflate_find(&ds->conflate, m);
+      if(e) {
+         atomic_fetch_add_explicit(&ds->queue_bytes, m->len, memory_order_relaxed);
+         atomic_fetch_sub_explicit(&ds->queue_bytes, e->msg->len, memory_order_relaxed);
+         bm_msg_unref(e->msg);
+         e->msg = m;
+         atomic_fetch_add_explicit(&ds->conflated, 1, memory_order_relaxed);
+         return 1;
+      }
+   }
+   /* Check the byte limit; an empty queue always takes a message */
+   size_t bytes = atomic_load_explicit(&ds->queue_bytes,
+                                       memory_order_relaxed);
+   if(ds->queue_max_bytes > 0 &&
+      bytes > 0 &&
+      bytes + m->len > ds->queue_max_bytes)
+      return 0;
+   /* Check the message limit */
+   if(bm_queue_size(ds->outq) >= ds->queue_max_msgs)
+      return 0;
+   if(bm_conflate_keyed(&ds->conflate, m)) {
+      /* Queue the entry of the new key */
+      e = bm_conflate_add(&ds->conflate, m, ds->queue_max_msgs);
+      if(!e) return 0;
+      if(!bm_queue_push(ds->outq, (void*)((uintptr_t)e | BM_DATASTREAM_ENTRY_TAG))) {
+         bm_conflate_remove(&ds->conflate, e);
+         return 0;
+      }
+   }
+   else if(!bm_queue_push(ds->outq, m)) {
+      return 0;
+   }
+   atomic_fetch_add_explicit(&ds->queue_bytes, m->len, memory_order_relaxed);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_msg_t bm_datastream_queue_pop(bm_datastream_t ds) {
+   if(!ds->outq) return NULL;
+   void* p = bm_queue_pop(ds->outq);
+   if(!p) return NULL;
+   bm_msg_t m;
+   if((uintptr_t)p & BM_DATASTREAM_ENTRY_TAG)
+      m = bm_conflate_remove(&ds->conflate,
+                             (bm_conflate_entry_t)((uintptr_t)p & ~(uintptr_t)BM_DATASTREAM_ENTRY_TAG));
+   else
+      m = (bm_msg_t)p;
+   atomic_fetch_sub_explicit(&ds->queue_bytes, m->len, memory_order_relaxed);
+   return m;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_datastream_batch_record(bm_datastream_t ds,
+                                size_t n) {
+   size_t b = 0;
+   while(n > 1 && b < BM_DATASTREAM_BATCH_BUCKETS - 1) {
+      n >>= 1;
+      ++b;
+   }
+   atomic_fetch_add_explicit(&ds->batch_hist[b], 1, memory_order_relaxed);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_datastream_drain(bm_datastream_t ds) {
+   for(size_t i = 0; i < ds->out_num; ++i)
+      bm_msg_unref(ds->out_batch[i]);
+   ds->out_num = 0;
+   ds->out_off = 0;
+   bm_msg_t m;
+   while((m = bm_datastream_queue_pop(ds)))
+      bm_msg_unref(m);
+   for(size_t i = 0; i < ds->backlog_num; ++i)
+      bm_msg_unref(ds->backlog[i]);
+   ds->backlog_num = 0;
+}
+
+/****************************************/
+/****************************************/
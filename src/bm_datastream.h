@@ -4,7 +4,57 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include "bm_msg.h"
+#include "bm_msgpool.h"
+#include "bm_queue.h"
+#include "bm_histogram.h"
+#include "bm_framing.h"
+#include "bm_conflate.h"
+#include "bm_sockopt.h"
+
+struct bm_resolver_s;
+
+/*
+ * Number of buckets of the batch size histogram.
+ * Bucket i counts the batches of 2^i to 2^(i+1)-1 messages.
+ */
+#define BM_DATASTREAM_BATCH_BUCKETS 11
+
+/*
+ * Maximum number of messages sent in one batch
+ */
+#define BM_DATASTREAM_BATCH_MAX 1024
+
+/*
+ * Default delays before reconnecting a stream whose connection is lost
+ * (ns): the first delay, doubled after every failed attempt up to the
+ * second
+ */
+#define BM_DATASTREAM_BACKOFF_MIN 100000000ULL
+#define BM_DATASTREAM_BACKOFF_MAX 10000000000ULL
+
+/*
+ * Default time after which a silent peer of a shared stream is
+ * forgotten (ns)
+ */
+#define BM_DATASTREAM_PEER_IDLE 60000000000ULL
+
+/*
+ * What to do with a new message when the outbound queue is full.
+ */
+enum bm_overflow_e {
+   /* Discard the new message */
+   BM_OVERFLOW_DROP_NEWEST = 0,
+   /* Discard the oldest queued message to make room */
+   BM_OVERFLOW_DROP_OLDEST,
+   /* Wait for room in the queue, up to a timeout, then discard */
+   BM_OVERFLOW_BLOCK,
+   /* Close the stream, which then reconnects if it can */
+   BM_OVERFLOW_DISCONNECT
+};
 
 /**
  * A generic data stream.
@@ -16,15 +66,56 @@ struct bm_datastream_s {
    int (*connect)(void*);
    /* Disconnects the stream */
    void (*disconnect)(void*);
-   /* Send data on this stream; return bytes sent or <0 for error */
+   /* Send data on this stream; return bytes sent or <0 for error.
+    * Fewer bytes than requested may be sent; when no data can be sent
+    * at all, return -1 with errno set to EAGAIN */
    ssize_t (*send)(void*, const uint8_t*, size_t);
-   /* Receive data on this stream; return bytes received or <0 for error */
+   /* Receive data on this stream; return bytes received or <0 for error.
+    * Streams are non-blocking: when no complete message is available yet,
+    * return -1 with errno set to EAGAIN and leave the status untouched */
    ssize_t (*recv)(void*, uint8_t*, size_t);
+   /* Returns the file descriptor to poll for this stream, or -1 */
+   int (*fd)(void*);
+   /* Send a batch of messages, framed, the first of which has already
+    * been partially sent up to the given offset in its frame. Return the
+    * number of bytes sent past the offset, or <0 for error (-1 with errno set to EAGAIN
+    * if nothing could be sent). Defaults to calling send() in a loop */
+   ssize_t (*sendv)(void*, bm_msg_t*, size_t, size_t);
+   /* Receive up to the given number of messages, allocated with
+    * bm_datastream_msg_new(). Return the number of messages received,
+    * 0 if the stream was closed, or <0 for error (-1 with errno set to
+    * EAGAIN if no message is available). Defaults to calling recv() */
+   ssize_t (*recvv)(void*, bm_msg_t*, size_t);
+   /* For listening streams only, NULL otherwise. Accept a new peer and
+    * return its connected stream, or NULL (with errno set to EAGAIN if
+    * no peer is waiting). Listening streams don't take part in the
+    * broadcast */
+   struct bm_datastream_s* (*accept)(void*);
+   /* Connect to stream again without blocking, NULL if the stream
+    * can't reconnect. Return 1 if connected, 0 if the connection is in
+    * progress (fd() becomes writable once it is done), or -1 for
+    * error (with errno set to EAGAIN if the server address is still
+    * being resolved). Streams that can reconnect connect this way from
+    * the start */
+   int (*reconnect)(void*);
+   /* Carry on with the connection in progress once fd() is readable,
+    * NULL if it is done as soon as the socket is connected. Return 1
+    * if connected, 0 if still in progress, or -1 for error (with the
+    * status set) */
+   int (*handshake)(void*);
+   /* Set to 1 if sendv() writes the frames back to back on fd(), as
+    * bm_datastream_iov() describes them, so a reactor can send them
+    * on its own */
+   int bytestream;
    /* Stream status */
    enum {
       BM_DATASTREAM_UNKNOWN = 0,
       BM_DATASTREAM_READY,
-      BM_DATASTREAM_ERROR
+      BM_DATASTREAM_ERROR,
+      /* Connection in progress */
+      BM_DATASTREAM_CONNECTING,
+      /* Waiting to reconnect */
+      BM_DATASTREAM_BACKOFF
    } status;
    /* "unknown", "ready", or error message */
    char* status_desc;
@@ -32,12 +123,166 @@ struct bm_datastream_s {
    char* descriptor;
    /* Datastream id */
    char* id;
-   /* The thread handle associated to this stream */
-   pthread_t thread;
+   /* Index of the reactor that owns this stream */
+   size_t reactor;
    /* Verbose flag */
    int verbose;
-   /* Used to have manage the linked list of streams */
-   struct bm_datastream_s* next;
+   /* The channel received messages are published on */
+   uint8_t pub_channel;
+   /* If >= 0, the offset of the payload byte that holds the channel of
+    * a received message, pub_channel being used for shorter messages */
+   ssize_t pub_offset;
+   /* Set to 1 if recvv() sets the channel of the messages itself, so
+    * pub_channel and pub_offset are ignored */
+   int sets_channel;
+   /* Set to 1 if the stream makes up messages on its own rather than
+    * relaying a peer, so it is only polled once the streams that
+    * connect at startup have made their first attempt */
+   int self_paced;
+   /* Set to 1 if fd() is never writable, and becomes readable instead
+    * once there is room to send again */
+   int room_on_read;
+   /* Set to 1 if the stream serves several peers, which get each
+    * other's messages; received messages then carry their sender */
+   int shared;
+   /* For shared streams, how long a peer can stay silent before it is
+    * forgotten (ns) */
+   uint64_t peer_idle;
+   /* The channels the stream receives messages from, one bit each */
+   uint64_t subs[BM_MSG_CHANNELS / 64];
+   /* How messages are delimited on the wire */
+   struct bm_framing_s framing;
+   /* The tuning requested for the sockets of the stream */
+   struct bm_sockopt_s sockopt;
+   /* The values in effect on the socket last tuned, -1 for those that
+    * don't apply to it */
+   struct bm_sockopt_s sockopt_eff;
+   /* The pools received messages are allocated from */
+   bm_msgpool_set_t pools;
+   /* Where batches of datagrams are received, only touched by the
+    * owner reactor */
+   uint8_t* scratch;
+   /* The size of scratch */
+   size_t scratch_size;
+   /* Outbound message queue */
+   bm_queue_t outq;
+   /* Maximum number of queued messages */
+   size_t queue_max_msgs;
+   /* Maximum number of queued bytes, 0 for no limit */
+   size_t queue_max_bytes;
+   /* Number of queued bytes */
+   atomic_size_t queue_bytes;
+   /* What to do when the queue is full */
+   enum bm_overflow_e overflow;
+   /* With BM_OVERFLOW_BLOCK, how long the stream can send nothing
+    * before the messages waiting for room are dropped (in ms) */
+   int block_timeout;
+   /* With BM_OVERFLOW_BLOCK, the messages waiting for room in the
+    * queue, only touched by the owner reactor */
+   bm_msg_t* backlog;
+   /* Number of messages in backlog */
+   size_t backlog_num;
+   /* Maximum number of messages in backlog before it grows */
+   size_t backlog_cap;
+   /* When the backlog started to build up, or the stream last sent
+    * something since (ns) */
+   uint64_t blocked_since;
+   /* Replaces the queued messages with newer ones of the same key */
+   struct bm_conflate_s conflate;
+   /* Set to 1 when the queue overflowed with BM_OVERFLOW_DISCONNECT */
+   atomic_int overflowed;
+   /* Messages being sent, only touched by the owner reactor */
+   bm_msg_t* out_batch;
+   /* Number of messages in out_batch */
+   size_t out_num;
+   /* Maximum number of messages in out_batch */
+   size_t out_max;
+   /* Number of bytes of the first framed message in out_batch already sent */
+   size_t out_off;
+   /* How long sending can be delayed to fill a batch (ns), 0 for no delay */
+   uint64_t flush_delay;
+   /* When the delayed sending is due, 0 if not delayed */
+   uint64_t flush_deadline;
+   /* Used to manage the list of streams with delayed sending */
+   struct bm_datastream_s* defer_next;
+   /* Whether the stream is in the list of streams with delayed sending */
+   int deferred;
+   /* Histogram of the number of messages per send call */
+   atomic_size_t batch_hist[BM_DATASTREAM_BATCH_BUCKETS];
+   /* Set to 1 while the stream is scheduled for flushing */
+   atomic_int flush_pending;
+   /* Used to manage the list of streams to flush */
+   struct bm_datastream_s* flush_next;
+   /* Number of messages for the stream handed over by other reactors
+    * and not queued yet */
+   atomic_size_t inbound;
+   /* Whether the owner reactor is polling for writability */
+   int want_write;
+   /* Used to manage the list of streams to receive from again */
+   struct bm_datastream_s* resume_next;
+   /* Whether the stream is in the list of streams to receive from
+    * again, because it stopped with data left that epoll can't see */
+   int resuming;
+   /* Used to manage the list of streams not received from until the
+    * blocked queues drain */
+   struct bm_datastream_s* pause_next;
+   /* Whether the owner reactor stopped receiving from the stream until
+    * the blocked queues drain */
+   int paused;
+   /* Set to 1 while the owner reactor sends out_batch on its own */
+   int sending;
+   /* The slot of fd() among the files registered with the io_uring
+    * instance of the owner reactor, -1 for none */
+   int uring_file;
+   /* Number of messages dropped because the queue was full */
+   atomic_size_t dropped;
+   /* Number of queued messages replaced by a newer one */
+   atomic_size_t conflated;
+   /* Number of messages received */
+   atomic_uint_fast64_t msgs_in;
+   /* Number of bytes received */
+   atomic_uint_fast64_t bytes_in;
+   /* Number of messages sent */
+   atomic_uint_fast64_t msgs_out;
+   /* Number of bytes sent */
+   atomic_uint_fast64_t bytes_out;
+   /* Number of failed send calls */
+   atomic_uint_fast64_t send_errors;
+   /* Number of times the stream was reconnected */
+   atomic_uint_fast64_t reconnects;
+   /* First delay before reconnecting (ns) */
+   uint64_t backoff_min;
+   /* Longest delay before reconnecting (ns), 0 to never reconnect */
+   uint64_t backoff_max;
+   /* Delay before the next attempt to reconnect (ns) */
+   uint64_t backoff;
+   /* When the next attempt to reconnect is due, or the connection in
+    * progress times out; 0 if neither */
+   uint64_t retry_deadline;
+   /* Used to manage the list of streams waiting to reconnect */
+   struct bm_datastream_s* retry_next;
+   /* Whether the stream is in the list of streams waiting to reconnect */
+   int retrying;
+   /* When the connection in progress started */
+   uint64_t connect_start;
+   /* Set to 1 until the first attempt to connect completes */
+   int starting;
+   /* Where the server address is looked up when reconnecting, NULL
+    * to use the address found by connect() */
+   struct bm_resolver_s* resolver;
+   /* Time to connect (ns) */
+   struct bm_histogram_s connect_latency;
+   /* Number of messages from other hubs discarded as already seen */
+   atomic_uint_fast64_t duplicates;
+   /* Time from the reception of a message to its sending on this stream (ns) */
+   struct bm_histogram_s latency;
+   /* Set to 1 for streams accepted by a listening stream, which are
+    * removed from the dispatcher once closed */
+   int accepted;
+   /* Set to 1 once the owner reactor has closed the stream */
+   int closed;
+   /* How far the release of a removed stream has gone */
+   int reclaim_stage;
 };
 typedef struct bm_datastream_s* bm_datastream_t;
 
@@ -53,6 +298,7 @@ typedef struct bm_datastream_s* bm_datastream_t;
  * @param disconnectf The disconnect() method.
  * @param sendf The send() method.
  * @param recvf The recv() method.
+ * @param fdf The fd() method.
  */
 extern void bm_datastream_init(bm_datastream_t ds,
                                const char* desc,
@@ -60,11 +306,13 @@ extern void bm_datastream_init(bm_datastream_t ds,
                                int (*connectf)(void*),
                                void (*disconnectf)(void*),
                                ssize_t (*sendf)(void*, const uint8_t*, size_t),
-                               ssize_t (*recvf)(void*, uint8_t*, size_t));
+                               ssize_t (*recvf)(void*, uint8_t*, size_t),
+                               int (*fdf)(void*));
 
 /*
  * Performs generic stream cleanup.
  * - Calls disconnect()
+ * - Releases the queued messages
  * - Frees the strings
  * @param ds The datastream.
  */
@@ -73,7 +321,8 @@ extern void bm_datastream_destroy(bm_datastream_t ds);
 /*
  * Sets the data stream status.
  * @param ds The datastream.
- * @param status The status code (BM_DATASTREAM_UNKNOWN, BM_DATASTREAM_READY, BM_DATASTREAM_ERROR)
+ * @param status The status code (BM_DATASTREAM_UNKNOWN, BM_DATASTREAM_READY, BM_DATASTREAM_ERROR,
+ * BM_DATASTREAM_CONNECTING, BM_DATASTREAM_BACKOFF)
  * @param desc The string description ("unknown", "ready", or error message)
  */
 extern void bm_datastream_set_status(void* ds,
@@ -81,4 +330,151 @@ extern void bm_datastream_set_status(void* ds,
                                      const char* desc,
                                      ...);
 
+/*
+ * Applies the socket options of a stream to one of its sockets, and
+ * records the values in effect.
+ * Options that can't be set are logged, and don't make the stream fail.
+ * @param ds The datastream.
+ * @param fd The socket.
+ */
+extern void bm_datastream_tune(void* ds,
+                               int fd);
+
+/*
+ * Allocates a message to receive data into.
+ * @param ds The datastream.
+ * @param len The payload length.
+ * @return The message.
+ */
+extern bm_msg_t bm_datastream_msg_new(bm_datastream_t ds,
+                                      size_t len);
+
+/*
+ * Returns the area a batch of datagrams is received into, before the
+ * datagrams that arrived are copied into messages of their size.
+ * The area is allocated the first time and kept for the next batches.
+ * @param ds The datastream.
+ * @param n The number of datagrams.
+ * @param sz The maximum size of a datagram.
+ * @return n slots of sz bytes, or NULL for failure.
+ */
+extern uint8_t* bm_datastream_scratch(bm_datastream_t ds,
+                                      size_t n,
+                                      size_t sz);
+
+/*
+ * Default sendv() method, based on send().
+ * Each message is sent framed.
+ * @param ds The datastream.
+ * @param msgs The messages to send.
+ * @param n The number of messages.
+ * @param off The number of bytes of the first frame already sent.
+ * @return The number of bytes sent past off, or <0 for error.
+ */
+extern ssize_t bm_datastream_sendv(void* ds,
+                                   bm_msg_t* msgs,
+                                   size_t n,
+                                   size_t off);
+
+/*
+ * Describes framed messages as an I/O vector, as streams that send
+ * their frames back to back write them.
+ * @param ds The datastream.
+ * @param msgs The messages.
+ * @param n The number of messages.
+ * @param off The number of bytes of the first frame already sent.
+ * @param iovs Where the vector is stored.
+ * @param iovmax The capacity of iovs, at least 3.
+ * @param hdrs Where the frame headers are stored, room for iovmax.
+ * @return The number of elements in the vector; fewer messages than
+ * n are described if iovs is too short.
+ */
+extern size_t bm_datastream_iov(bm_datastream_t ds,
+                                bm_msg_t* msgs,
+                                size_t n,
+                                size_t off,
+                                struct iovec* iovs,
+                                size_t iovmax,
+                                uint8_t (*hdrs)[BM_FRAMING_HEADER_MAX]);
+
+/*
+ * Default recvv() method, based on recv().
+ * Only fixed-size framing is supported.
+ * @param ds The datastream.
+ * @param msgs Where the received messages are stored.
+ * @param n The maximum number of messages to receive.
+ * @return The number of messages received, 0 on close, or <0 for error.
+ */
+extern ssize_t bm_datastream_recvv(void* ds,
+                                   bm_msg_t* msgs,
+                                   size_t n);
+
+/*
+ * Parses a size with an optional k/m/g suffix.
+ * @param str The string to parse.
+ * @param v Where the value is stored.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_datastream_parse_size(const char* str,
+                                    size_t* v);
+
+/*
+ * Parses a duration, with an optional unit: s, ms, or us.
+ * @param str The string to parse.
+ * @param unit The length of the default unit (ns).
+ * @param v Where the value is stored (ns).
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_datastream_parse_duration(const char* str,
+                                        double unit,
+                                        uint64_t* v);
+
+/*
+ * Parses the generic stream options.
+ * The options are a comma-separated list that follows the
+ * type-specific fields of a descriptor, for instance "q=1024,drop-oldest".
+ * @param ds The datastream.
+ * @param opts The options.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_datastream_parse_options(bm_datastream_t ds,
+                                       const char* opts);
+
+/*
+ * Appends a message to the outbound queue, if the queue limits allow it,
+ * or puts it in the place of the queued message with the same key if
+ * the stream conflates.
+ * The queue takes over the passed reference.
+ * Must be called by the thread of the owner reactor if the stream
+ * conflates.
+ * @param ds The datastream.
+ * @param m The message.
+ * @return 1 for success, 0 if the queue is full.
+ */
+extern int bm_datastream_queue_push(bm_datastream_t ds,
+                                    bm_msg_t m);
+
+/*
+ * Removes the oldest message from the outbound queue.
+ * The caller takes over the reference of the queue.
+ * @param ds The datastream.
+ * @return The message, or NULL if the queue is empty.
+ */
+extern bm_msg_t bm_datastream_queue_pop(bm_datastream_t ds);
+
+/*
+ * Records the size of a batch of messages sent in one call.
+ * @param ds The datastream.
+ * @param n The number of messages in the batch.
+ */
+extern void bm_datastream_batch_record(bm_datastream_t ds,
+                                       size_t n);
+
+/*
+ * Releases all the messages waiting to be sent on the stream, the
+ * backlog included.
+ * @param ds The datastream.
+ */
+extern void bm_datastream_drain(bm_datastream_t ds);
+
 #endif
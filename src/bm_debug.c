@@ -1,8 +1,22 @@
-#define _GNU_SOURCE
 #include "bm_debug.h"
 #include "bm_datastream.h"
+#include "bm_log.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
+
+/****************************************/
+/****************************************/
+
+/*
+ * Logs a line at the debug level, regardless of the log level.
+ */
+static void bm_debug_log(const char* fmt, ...) {
+   va_list al;
+   va_start(al, fmt);
+   bm_logv(BM_LOG_DEBUG, fmt, al);
+   va_end(al);
+}
 
 /****************************************/
 /****************************************/
@@ -10,13 +24,16 @@
 void bm_debug(void* ds,
               const char* fmt, ...) {
    bm_datastream_t this = (bm_datastream_t)ds;
-   if(!this->verbose) return;
-   char* msg;
+   if(!this->verbose && bm_log_level() < BM_LOG_DEBUG) return;
+   /* Callers check errno right after logging */
+   int olderrno = errno;
+   char line[256];
    va_list al;
    va_start(al, fmt);
-   vasprintf(&msg, fmt, al);
+   vsnprintf(line, sizeof(line), fmt, al);
    va_end(al);
-   fprintf(stderr, "[%s] %s\n", this->descriptor, msg);
+   bm_debug_log("[%s] %s", this->descriptor, line);
+   errno = olderrno;
 }
 
 /****************************************/
@@ -2,8 +2,10 @@
 #define BM_DEBUG_H
 
 /*
- * Prints a debug message, if the stream verbosity is 1.
- * This function works exactly like printf().
+ * Logs a debug message, if the stream verbosity is 1 or the log level
+ * is BM_LOG_DEBUG.
+ * This function works exactly like printf(). The message is written
+ * asynchronously by the logging thread.
  * @param ds The datastream.
  * @param fmt The format of the string to print.
  */
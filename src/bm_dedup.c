@@ -0,0 +1,128 @@
+#include "bm_dedup.h"
+#include <string.h>
+
+/*
+ * How far behind the window a sequence number must be to be taken as
+ * the origin having restarted, rather than as a late duplicate
+ */
+#define BM_DEDUP_RESTART (1u << 20)
+
+/****************************************/
+/****************************************/
+
+void bm_dedup_init(bm_dedup_t d) {
+   for(size_t i = 0; i < BM_DEDUP_SHARDS; ++i) {
+      memset(d->shards[i].origins, 0, sizeof(d->shards[i].origins));
+      d->shards[i].clock = 0;
+      pthread_mutex_init(&d->shards[i].mutex, NULL);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dedup_cleanup(bm_dedup_t d) {
+   for(size_t i = 0; i < BM_DEDUP_SHARDS; ++i)
+      pthread_mutex_destroy(&d->shards[i].mutex);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Starts the window of an origin over at the given sequence number.
+ */
+static void bm_dedup_origin_reset(struct bm_dedup_origin_s* o,
+                                  uint32_t seq) {
+   o->top = seq;
+   memset(o->seen, 0, sizeof(o->seen));
+   o->seen[0] = 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Slides the window of an origin forward.
+ */
+static void bm_dedup_origin_advance(struct bm_dedup_origin_s* o,
+                                    uint32_t seq) {
+   uint32_t diff = seq - o->top;
+   if(diff >= BM_DEDUP_WINDOW) {
+      bm_dedup_origin_reset(o, seq);
+      return;
+   }
+   /* Bit i moves to bit i + diff */
+   size_t q = diff / 64, r = diff % 64;
+   for(size_t w = BM_DEDUP_WINDOW / 64; w-- > 0;) {
+      uint64_t v = 0;
+      if(w >= q) {
+         v = o->seen[w - q] << r;
+         if(r > 0 && w > q) v |= o->seen[w - q - 1] >> (64 - r);
+      }
+      o->seen[w] = v;
+   }
+   o->top = seq;
+   o->seen[0] |= 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_dedup_check(bm_dedup_t d,
+                   uint32_t origin,
+                   uint16_t reactor,
+                   uint32_t seq) {
+   int fresh = 1;
+   /* Fibonacci hashing of the origin */
+   uint32_t h = (origin ^ ((uint32_t)reactor << 16) ^ reactor) * 0x9E3779B1u;
+   struct bm_dedup_shard_s* sh = &d->shards[h >> (32 - BM_DEDUP_SHARD_BITS)];
+   pthread_mutex_lock(&sh->mutex);
+   ++sh->clock;
+   /* Look for the origin, remember the slot to reuse meanwhile */
+   struct bm_dedup_origin_s* o = NULL;
+   struct bm_dedup_origin_s* oldest = &sh->origins[0];
+   for(size_t i = 0; i < BM_DEDUP_ORIGINS; ++i) {
+      if(sh->origins[i].origin == origin &&
+         sh->origins[i].reactor == reactor) {
+         o = &sh->origins[i];
+         break;
+      }
+      if(sh->origins[i].last < oldest->last)
+         oldest = &sh->origins[i];
+   }
+   if(!o) {
+      /* New origin, or one forgotten for a while */
+      o = oldest;
+      o->origin = origin;
+      o->reactor = reactor;
+      bm_dedup_origin_reset(o, seq);
+   }
+   else if((int32_t)(seq - o->top) > 0) {
+      /* Newer than anything seen */
+      bm_dedup_origin_advance(o, seq);
+   }
+   else {
+      uint32_t age = o->top - seq;
+      if(age >= BM_DEDUP_WINDOW) {
+         /* Too old to tell, unless the origin started over */
+         if(age > BM_DEDUP_RESTART)
+            bm_dedup_origin_reset(o, seq);
+         else
+            fresh = 0;
+      }
+      else {
+         uint64_t bit = (uint64_t)1 << (age % 64);
+         if(o->seen[age / 64] & bit)
+            fresh = 0;
+         else
+            o->seen[age / 64] |= bit;
+      }
+   }
+   o->last = sh->clock;
+   pthread_mutex_unlock(&sh->mutex);
+   return fresh;
+}
+
+/****************************************/
+/****************************************/
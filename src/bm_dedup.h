@@ -0,0 +1,99 @@
+#ifndef BM_DEDUP_H
+#define BM_DEDUP_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * Number of sequence numbers remembered per origin, as a multiple of 64
+ */
+#define BM_DEDUP_WINDOW 4096
+
+/*
+ * Maximum number of origins remembered at once by a shard
+ */
+#define BM_DEDUP_ORIGINS 32
+
+/*
+ * Number of shards, as a power of two
+ */
+#define BM_DEDUP_SHARD_BITS 4
+#define BM_DEDUP_SHARDS (1 << BM_DEDUP_SHARD_BITS)
+
+/*
+ * Duplicate suppression for messages relayed among hubs.
+ * Each reactor of a hub numbers the messages it receives from its own
+ * streams, so a message is identified by its origin hub, its origin
+ * reactor and its sequence number; "origin" below stands for the pair.
+ * For each origin, the cache keeps a sliding window of the sequence
+ * numbers seen recently; a message older than the window is considered
+ * a duplicate. The origins are spread over shards with a lock each, so
+ * the reactors checking messages from different origins don't contend.
+ * Memory is bounded: when too many origins show up in a shard, the one
+ * that has been quiet the longest is forgotten.
+ */
+
+/*
+ * The sequence numbers seen from an origin.
+ */
+struct bm_dedup_origin_s {
+   /* The origin hub, 0 for an unused slot */
+   uint32_t origin;
+   /* The origin reactor */
+   uint16_t reactor;
+   /* The highest sequence number seen */
+   uint32_t top;
+   /* Bit i is set if top - i has been seen */
+   uint64_t seen[BM_DEDUP_WINDOW / 64];
+   /* When the origin was last seen, as a counter of checks */
+   uint64_t last;
+};
+
+/*
+ * A part of the cache.
+ */
+struct bm_dedup_shard_s {
+   /* The origins */
+   struct bm_dedup_origin_s origins[BM_DEDUP_ORIGINS];
+   /* The number of checks so far */
+   uint64_t clock;
+   /* Protects the shard, shared by the reactors */
+   pthread_mutex_t mutex;
+};
+
+/*
+ * The duplicate suppression cache.
+ */
+struct bm_dedup_s {
+   /* The shards, picked by origin */
+   struct bm_dedup_shard_s shards[BM_DEDUP_SHARDS];
+};
+typedef struct bm_dedup_s* bm_dedup_t;
+
+/*
+ * Initializes the cache.
+ * @param d The cache.
+ */
+extern void bm_dedup_init(bm_dedup_t d);
+
+/*
+ * Releases the cache.
+ * @param d The cache.
+ */
+extern void bm_dedup_cleanup(bm_dedup_t d);
+
+/*
+ * Checks whether a message is new, and remembers it.
+ * @param d The cache.
+ * @param origin The origin hub of the message, other than 0.
+ * @param reactor The origin reactor of the message.
+ * @param seq The sequence number of the message.
+ * @return 1 if the message is new, 0 if it is a duplicate.
+ */
+extern int bm_dedup_check(bm_dedup_t d,
+                          uint32_t origin,
+                          uint16_t reactor,
+                          uint32_t seq);
+
+#endif
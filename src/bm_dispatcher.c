@@ -1,12 +1,22 @@
 #include "bm_dispatcher.h"
 #include "bm_tcp_datastream.h"
 #include "bm_udp_datastream.h"
+#include "bm_mcast_datastream.h"
+#include "bm_shm_datastream.h"
+#include "bm_replay_datastream.h"
+#include "bm_capture.h"
+#include "bm_time.h"
+#include "bm_log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/random.h>
 
 /****************************************/
 /****************************************/
@@ -16,80 +26,925 @@
  * When set to 1, this means: the program must finish.
  * The value of this variable is set by a signal handler.
  */
-static int done = 0;
+static volatile sig_atomic_t done = 0;
 
 /*
- * Active threads
+ * Maximum number of messages received from a stream in one call
  */
-static int active_threads = 0;
+#define BM_DISPATCHER_RECV_BATCH 64
+
+/*
+ * Maximum number of receive calls on a stream per event.
+ * This keeps a busy stream from starving the others.
+ */
+#define BM_DISPATCHER_RECV_BURST 16
+
+/*
+ * Initial number of messages a stream can keep waiting for room in
+ * its queue
+ */
+#define BM_DISPATCHER_BACKLOG 256
+
+/*
+ * Maximum memory used by the message pools
+ */
+#define BM_DISPATCHER_POOL_SIZE (64 * 1024 * 1024)
+
+/*
+ * Maximum number of peers accepted by a listening stream per event
+ */
+#define BM_DISPATCHER_ACCEPT_BURST 64
+
+/*
+ * How often removed streams are reclaimed (ns)
+ */
+#define BM_DISPATCHER_RECLAIM_INTERVAL 100000000
+
+/*
+ * Highest CPU number reactors can be pinned to, plus one
+ */
+#define BM_DISPATCHER_CPU_MAX 1024
+
+/*
+ * How long a connection in progress can take before it's retried (ns)
+ */
+#define BM_DISPATCHER_CONNECT_TIMEOUT 5000000000ULL
+
+/*
+ * How often a stream checks whether its server address is resolved (ns)
+ */
+#define BM_DISPATCHER_RESOLVE_POLL 10000000ULL
+
+/****************************************/
+/****************************************/
+
+/*
+ * Allocates a snapshot of streams, with room for its hot fields, its
+ * routing table and its index.
+ * @param cap The maximum number of streams.
+ * @return The snapshot, with no streams, or NULL for failure.
+ */
+static bm_streamset_t bm_dispatcher_streamset_new(size_t cap) {
+   size_t words = (cap + 63) / 64;
+   /* Keep the index at most half full */
+   size_t slots = 4;
+   while(slots < 2 * cap) slots *= 2;
+   bm_streamset_t set =
+      (bm_streamset_t)malloc(sizeof(struct bm_streamset_s) +
+                             cap * sizeof(bm_datastream_t) +
+                             cap * sizeof(struct bm_streamset_entry_s) +
+                             BM_MSG_CHANNELS * words * sizeof(uint64_t) +
+                             slots * sizeof(uint32_t));
+   if(!set) return NULL;
+   set->num = 0;
+   set->gen = 0;
+   set->hubs = 0;
+   set->words = words;
+   set->entries = (bm_streamset_entry_t)(set->streams + cap);
+   set->routes = (uint64_t*)(set->entries + cap);
+   set->slots = (uint32_t*)(set->routes + BM_MSG_CHANNELS * words);
+   set->mask = slots - 1;
+   memset(set->slots, 0, slots * sizeof(uint32_t));
+   return set;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the slot of the index of a snapshot where the search for an
+ * id starts (FNV-1a).
+ */
+static size_t bm_dispatcher_streamset_slot(bm_streamset_t set,
+                                           const char* id) {
+   uint64_t h = 0xCBF29CE484222325ULL;
+   for(; *id; ++id) {
+      h ^= (uint8_t)*id;
+      h *= 0x100000001B3ULL;
+   }
+   return h & set->mask;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Fills the hot fields, the routing table and the index of a snapshot
+ * from its streams. Listening streams receive nothing.
+ * @param set The snapshot.
+ */
+static void bm_dispatcher_streamset_build(bm_streamset_t set) {
+   memset(set->routes, 0, BM_MSG_CHANNELS * set->words * sizeof(uint64_t));
+   set->hubs = 0;
+   for(size_t i = 0; i < set->num; ++i) {
+      bm_datastream_t s = set->streams[i];
+      if(s->framing.type == BM_FRAMING_HUB) ++set->hubs;
+      set->entries[i].stream = s;
+      set->entries[i].reactor = s->reactor;
+      set->entries[i].shared = s->shared;
+      set->entries[i].framing = s->framing;
+      size_t slot = bm_dispatcher_streamset_slot(set, s->id);
+      while(set->slots[slot] != 0)
+         slot = (slot + 1) & set->mask;
+      set->slots[slot] = i + 1;
+      if(s->accept) continue;
+      for(size_t c = 0; c < BM_MSG_CHANNELS; ++c)
+         if(s->subs[c / 64] & ((uint64_t)1 << (c % 64)))
+            set->routes[c * set->words + i / 64] |= (uint64_t)1 << (i % 64);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+bm_datastream_t bm_streamset_find(bm_streamset_t set,
+                                  const char* id) {
+   size_t slot = bm_dispatcher_streamset_slot(set, id);
+   uint32_t pos;
+   while((pos = set->slots[slot]) != 0) {
+      if(strcmp(set->streams[pos - 1]->id, id) == 0)
+         return set->streams[pos - 1];
+      slot = (slot + 1) & set->mask;
+   }
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Publishes a snapshot of the streams with a stream added or removed,
+ * and retires the previous snapshot.
+ * The streams must be set up, with their reactor assigned, before they
+ * are added, as the snapshot keeps a copy of those fields.
+ * @param d The dispatcher.
+ * @param s The stream, or NULL just to copy the fields again.
+ * @param add 1 to add the stream, 0 to remove it.
+ * @return 1 for success, 0 if the snapshot can't be allocated; the
+ * current snapshot then stays.
+ */
+static int bm_dispatcher_streams_update(bm_dispatcher_t d,
+                                        bm_datastream_t s,
+                                        int add) {
+   bm_streamset_t cur = atomic_load(&d->streams);
+   bm_streamset_t next;
+   while(1) {
+      next = bm_dispatcher_streamset_new(cur->num + 1);
+      if(!next) return 0;
+      for(size_t i = 0; i < cur->num; ++i)
+         if(cur->streams[i] != s)
+            next->streams[next->num++] = cur->streams[i];
+      if(add) next->streams[next->num++] = s;
+      next->gen = cur->gen + 1;
+      bm_dispatcher_streamset_build(next);
+      /* Another thread might have published a snapshot meanwhile */
+      if(atomic_compare_exchange_strong(&d->streams, &cur, next)) break;
+      free(next);
+   }
+   bm_epoch_retire(&d->epoch, bm_epoch_free, cur);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Destroys a stream removed from the dispatcher.
+ * Once no snapshot holds the stream, it can still wait in the flush
+ * list of its reactor, and the reactor can still be flushing it;
+ * both cases take one more grace period each. Messages for it can also
+ * still be in transit from the other reactors.
+ * @return 1 if the stream was destroyed, 0 to be called again later.
+ */
+static int bm_dispatcher_stream_release(void* arg) {
+   bm_datastream_t s = (bm_datastream_t)arg;
+   if(atomic_load(&s->flush_pending)) return 0;
+   if(atomic_load(&s->inbound) > 0) return 0;
+   if(s->reclaim_stage == 0) {
+      s->reclaim_stage = 1;
+      return 0;
+   }
+   s->destroy(s);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Prepares a stream for polling: gives it the message pools and the
+ * default message size.
+ * @return 1 for success, 0 if the stream has no usable framing.
+ */
+static int bm_dispatcher_stream_setup(bm_dispatcher_t d,
+                                      bm_datastream_t s) {
+   s->pools = d->pools;
+   s->resolver = &d->resolver;
+   if(s->framing.type == BM_FRAMING_FIXED && s->framing.size == 0) {
+      if(d->msg_len == 0) {
+         bm_datastream_set_status(s,
+                                  BM_DATASTREAM_ERROR,
+                                  "No message size, use -s SIZE or the size/frame options");
+         return 0;
+      }
+      s->framing.size = d->msg_len;
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Lets the reactors receive again once a stream no longer has messages
+ * waiting for room, if it was the last blocked one.
+ */
+static void bm_dispatcher_unblock(bm_dispatcher_t d,
+                                  bm_datastream_t s) {
+   if(s->blocked_since == 0) return;
+   s->blocked_since = 0;
+   if(atomic_fetch_sub(&d->blocked, 1) == 1)
+      for(size_t i = 0; i < d->reactor_num; ++i)
+         bm_reactor_wakeup(&d->reactors[i]);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Releases the messages waiting to be sent on a stream.
+ */
+static void bm_dispatcher_stream_drain(bm_dispatcher_t d,
+                                       bm_datastream_t s) {
+   bm_dispatcher_unblock(d, s);
+   bm_datastream_drain(s);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Moves the messages waiting for room into the queue of a stream.
+ * Must be called by the owner of the stream.
+ */
+static void bm_dispatcher_backlog_flush(bm_dispatcher_t d,
+                                        bm_datastream_t s) {
+   if(s->backlog_num == 0) return;
+   size_t i;
+   for(i = 0;
+       i < s->backlog_num && bm_datastream_queue_push(s, s->backlog[i]);
+       ++i);
+   s->backlog_num -= i;
+   memmove(s->backlog, s->backlog + i, s->backlog_num * sizeof(bm_msg_t));
+   if(s->backlog_num == 0) bm_dispatcher_unblock(d, s);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Drops the messages waiting for room in the queue of a stream once
+ * the stream has sent nothing for too long, or checks again when the
+ * time is up.
+ * Must be called by the owner of the stream.
+ */
+static void bm_dispatcher_backlog_expire(bm_dispatcher_t d,
+                                         bm_reactor_t r,
+                                         bm_datastream_t s) {
+   if(s->backlog_num == 0) return;
+   uint64_t deadline = s->blocked_since + s->block_timeout * 1000000ULL;
+   if(bm_time_now() < deadline) {
+      if(s->flush_deadline == 0 || s->flush_deadline > deadline)
+         s->flush_deadline = deadline;
+      bm_reactor_defer_flush(r, s);
+      return;
+   }
+   for(size_t i = 0; i < s->backlog_num; ++i)
+      bm_msg_unref(s->backlog[i]);
+   atomic_fetch_add_explicit(&s->dropped, s->backlog_num, memory_order_relaxed);
+   s->backlog_num = 0;
+   bm_dispatcher_unblock(d, s);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Keeps a message that found the queue of a stream full until there
+ * is room. Meanwhile, the reactors stop receiving, so that the data
+ * waits in the sockets and the senders slow down.
+ * Must be called by the owner of the stream.
+ * @return 1 if the message was kept, 0 otherwise.
+ */
+static int bm_dispatcher_backlog_push(bm_dispatcher_t d,
+                                      bm_reactor_t r,
+                                      bm_datastream_t s,
+                                      bm_msg_t msg) {
+   if(s->backlog_num == s->backlog_cap) {
+      size_t cap = s->backlog_cap > 0 ? s->backlog_cap * 2 : BM_DISPATCHER_BACKLOG;
+      bm_msg_t* backlog = (bm_msg_t*)realloc(s->backlog, cap * sizeof(bm_msg_t));
+      if(!backlog) return 0;
+      s->backlog = backlog;
+      s->backlog_cap = cap;
+   }
+   s->backlog[s->backlog_num++] = msg;
+   if(s->backlog_num == 1) {
+      s->blocked_since = bm_time_now();
+      atomic_fetch_add(&d->blocked, 1);
+      /* Drop the backlog if the stream sends nothing in time */
+      bm_dispatcher_backlog_expire(d, r, s);
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Appends a message to the queue of a stream, applying the
+ * overflow policy of the stream if the queue is full.
+ * Must be called by the owner of the stream.
+ * @return 1 if the message was queued or kept for later, 0 otherwise.
+ */
+static int bm_dispatcher_enqueue(bm_dispatcher_t d,
+                                 bm_reactor_t r,
+                                 bm_datastream_t s,
+                                 bm_msg_t msg) {
+   /* The queue holds its own reference to the message */
+   bm_msg_ref(msg);
+   /* The messages waiting for room go first */
+   if(s->backlog_num == 0 && bm_datastream_queue_push(s, msg)) return 1;
+   /* The queue is full */
+   switch(s->overflow) {
+      case BM_OVERFLOW_DROP_OLDEST: {
+         /* Make room; a large message can take several old ones */
+         bm_msg_t old;
+         while((old = bm_datastream_queue_pop(s))) {
+            bm_msg_unref(old);
+            atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+            if(bm_datastream_queue_push(s, msg)) return 1;
+         }
+         break;
+      }
+      case BM_OVERFLOW_BLOCK:
+         if(bm_dispatcher_backlog_push(d, r, s, msg)) return 1;
+         break;
+      case BM_OVERFLOW_DISCONNECT:
+         /* The owner closes the stream at the next flush */
+         atomic_store(&s->overflowed, 1);
+         break;
+      default:
+         break;
+   }
+   bm_msg_unref(msg);
+   atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+   return 0;
+}
 
 /****************************************/
 /****************************************/
 
 void bm_dispatcher_broadcast(bm_dispatcher_t dispatcher,
                              bm_datastream_t stream,
-                             const uint8_t* data) {
-   pthread_mutex_lock(&dispatcher->datamutex);
-   bm_datastream_t cur = dispatcher->streams;
-   ssize_t sent;
-   while(cur) {
-      if(cur != stream)
-         sent = cur->send(cur, data, dispatcher->msg_len);
-      if(sent < dispatcher->msg_len) {
-         fprintf(stderr, "sent %zd bytes instead of %zu to %s: %s\n",
-                 sent,
-                 dispatcher->msg_len,
-                 cur->descriptor,
-                 cur->status_desc);
+                             bm_msg_t* msgs,
+                             size_t n) {
+   bm_streamset_t set = bm_dispatcher_streams(dispatcher);
+   bm_reactor_t self = bm_reactor_self();
+   bm_reactor_t owner;
+   bm_streamset_entry_t e;
+   bm_datastream_t cur;
+   const uint64_t* route;
+   uint64_t bits;
+   size_t i, j, k;
+   uint8_t ch;
+   for(i = 0; i < n; ++i) {
+      /* Send the messages of a channel together, the first time the
+       * channel comes up */
+      ch = msgs[i]->channel;
+      for(k = 0; k < i && msgs[k]->channel != ch; ++k);
+      if(k < i) continue;
+      /* Go through the subscribers of the channel */
+      route = bm_streamset_route(set, ch);
+      for(size_t w = 0; w < set->words; ++w) {
+         for(bits = route[w]; bits; bits &= bits - 1) {
+            j = w * 64 + __builtin_ctzll(bits);
+            e = &set->entries[j];
+            cur = e->stream;
+            if((cur == stream && !e->shared) ||
+               cur->status != BM_DATASTREAM_READY)
+               continue;
+            owner = &dispatcher->reactors[e->reactor];
+            for(k = i; k < n; ++k) {
+               if(msgs[k]->channel != ch) continue;
+               if(!bm_framing_accepts(&e->framing, msgs[k])) {
+                  /* The framing of the stream can't carry the message */
+                  atomic_fetch_add_explicit(&cur->dropped, 1, memory_order_relaxed);
+               }
+               else if(self && owner != self) {
+                  /* Hand the message over to the owner, which queues it */
+                  bm_msg_ref(msgs[k]);
+                  if(!bm_reactor_send(self, owner, cur, msgs[k])) {
+                     bm_msg_unref(msgs[k]);
+                     atomic_fetch_add_explicit(&cur->dropped, 1, memory_order_relaxed);
+                  }
+               }
+               else {
+                  bm_dispatcher_enqueue(dispatcher, owner, cur, msgs[k]);
+               }
+            }
+            if(!self || owner == self)
+               bm_reactor_schedule_flush(owner, cur);
+         }
       }
-      cur = cur->next;
    }
-   pthread_mutex_unlock(&dispatcher->datamutex);
+   /* Wake up the owners of the messages handed over */
+   if(self) bm_reactor_notify(self);
 }
 
 /****************************************/
 /****************************************/
 
-struct bm_dispatcher_thread_data_s {
-   bm_dispatcher_t dispatcher;
-   bm_datastream_t stream;
-};
-typedef struct bm_dispatcher_thread_data_s* bm_dispatcher_thread_data_t;
-
-void* bm_dispatcher_thread(void* arg) {
-   /* Get thread data */
-   bm_dispatcher_thread_data_t data = (bm_dispatcher_thread_data_t)arg;
-   /* Wait for start signal */
-   pthread_mutex_lock(&data->dispatcher->startmutex);
-   ++active_threads;
-   while(data->dispatcher->start == 0)
-      pthread_cond_wait(&data->dispatcher->startcond,
-                        &data->dispatcher->startmutex);
-   pthread_mutex_unlock(&data->dispatcher->startmutex);
-   /* Execute logic */
-   uint8_t* buf = (uint8_t*)calloc(data->dispatcher->msg_len, 1);
-   while(!done) {
-      /* Receive data */
-      if(data->stream->recv(data->stream,
-                            buf,
-                            data->dispatcher->msg_len) <= 0) {
-         /* Error receiving data, exit */
-         fprintf(stderr, "%s: exiting\n", data->stream->descriptor);
-         pthread_mutex_lock(&data->dispatcher->startmutex);
-         --active_threads;
-         pthread_mutex_unlock(&data->dispatcher->startmutex);
-         return NULL;
+void bm_dispatcher_stream_deliver(bm_dispatcher_t d,
+                                  bm_reactor_t r,
+                                  bm_datastream_t s,
+                                  bm_msg_t m) {
+   if(!s->closed && s->status == BM_DATASTREAM_READY) {
+      bm_dispatcher_enqueue(d, r, s, m);
+      bm_reactor_schedule_flush(r, s);
+   }
+   bm_msg_unref(m);
+   atomic_fetch_sub(&s->inbound, 1);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Picks a delay between half and all of the given one, so that the
+ * streams cut off together don't all try to reconnect together.
+ */
+static uint64_t bm_dispatcher_jitter(uint64_t delay) {
+   static __thread uint64_t state = 0;
+   if(state == 0 &&
+      getrandom(&state, sizeof(state), 0) != sizeof(state))
+      state = bm_time_now();
+   state |= 1;
+   /* xorshift64 */
+   state ^= state << 13;
+   state ^= state >> 7;
+   state ^= state << 17;
+   return delay / 2 + state % (delay / 2 + 1);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Disconnects a stream that can reconnect and schedules the next
+ * attempt. The delay doubles after each attempt, up to backoff_max.
+ */
+static void bm_dispatcher_stream_backoff(bm_dispatcher_t d,
+                                         bm_reactor_t r,
+                                         bm_datastream_t s) {
+   uint64_t delay = bm_dispatcher_jitter(s->backoff);
+   bm_log(BM_LOG_WARNING, "%s: %s, reconnecting in %.3f s",
+          s->descriptor,
+          s->status == BM_DATASTREAM_READY ? "connection closed" : s->status_desc,
+          delay / 1e9);
+   bm_reactor_stream_remove(r, s);
+   s->disconnect(s);
+   bm_datastream_set_status(s, BM_DATASTREAM_BACKOFF, "reconnecting");
+   bm_dispatcher_stream_drain(d, s);
+   s->backoff = s->backoff < s->backoff_max / 2 ? s->backoff * 2 : s->backoff_max;
+   s->retry_deadline = bm_time_now() + delay;
+   bm_reactor_retry(r, s);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_close(bm_dispatcher_t d,
+                                bm_reactor_t r,
+                                bm_datastream_t s) {
+   if(s->closed) return;
+   /* Streams that can reconnect keep trying until the end */
+   if(s->reconnect && s->backoff_max > 0 && !done) {
+      bm_dispatcher_stream_backoff(d, r, s);
+      return;
+   }
+   s->closed = 1;
+   bm_log(BM_LOG_INFO, "%s: exiting", s->descriptor);
+   bm_reactor_stream_remove(r, s);
+   s->disconnect(s);
+   bm_datastream_set_status(s, BM_DATASTREAM_ERROR, "closed");
+   bm_dispatcher_stream_drain(d, s);
+   atomic_fetch_sub(&d->active_streams, 1);
+   /* Streams accepted at runtime go away for good; if the snapshot
+    * can't be replaced, the stream stays in it, closed, until the end */
+   if(s->accepted) {
+      if(bm_dispatcher_streams_update(d, s, 0))
+         bm_epoch_retire(&d->epoch, bm_dispatcher_stream_release, s);
+      else
+         bm_log(BM_LOG_ERROR, "%s: can't remove stream: out of memory", s->descriptor);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Starts polling the self-paced streams held back during the startup.
+ * The streams of the other reactors are handed over to them.
+ * @param r The calling reactor, or NULL before the reactors start.
+ */
+static void bm_dispatcher_release_held(bm_dispatcher_t d,
+                                       bm_reactor_t r) {
+   for(size_t i = 0; i < d->held_num; ++i) {
+      bm_datastream_t s = d->held[i];
+      bm_reactor_t owner = &d->reactors[s->reactor];
+      if(!r || owner == r)
+         bm_dispatcher_stream_adopt(d, owner, s);
+      else
+         /* Fails only when shutting down */
+         bm_reactor_hand_over(r, owner, s);
+   }
+   if(r) bm_reactor_notify(r);
+   free(d->held);
+   d->held = NULL;
+   d->held_num = 0;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Takes note of the outcome of the first attempt to connect a stream,
+ * and reports the startup time once all the streams have made theirs.
+ */
+static void bm_dispatcher_stream_started(bm_dispatcher_t d,
+                                         bm_reactor_t r,
+                                         bm_datastream_t s,
+                                         int connected) {
+   s->starting = 0;
+   if(connected) atomic_fetch_add(&d->startup_connected, 1);
+   if(atomic_fetch_sub(&d->starting, 1) == 1) {
+      bm_log(BM_LOG_INFO, "Started in %.3f ms, %zu of %zu streams connected",
+             (bm_time_now() - d->start_time) / 1e6,
+             atomic_load(&d->startup_connected),
+             d->startup_total);
+      bm_dispatcher_release_held(d, r);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Puts a stream that connected into service.
+ */
+static void bm_dispatcher_stream_connected(bm_dispatcher_t d,
+                                           bm_reactor_t r,
+                                           bm_datastream_t s) {
+   uint64_t elapsed = bm_time_now() - s->connect_start;
+   bm_histogram_record(&s->connect_latency, elapsed);
+   if(!s->starting)
+      atomic_fetch_add_explicit(&s->reconnects, 1, memory_order_relaxed);
+   /* The reactor timer ignores the connection timeout from now on */
+   s->retry_deadline = 0;
+   s->backoff = s->backoff_min;
+   atomic_store(&s->overflowed, 0);
+   bm_datastream_set_status(s, BM_DATASTREAM_READY, "ready");
+   bm_reactor_stream_want_write(r, s, 0);
+   bm_log(BM_LOG_INFO, "%s: connected in %.3f ms",
+          s->descriptor,
+          elapsed / 1e6);
+   if(s->starting) bm_dispatcher_stream_started(d, r, s, 1);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Handles a failed attempt to connect: the stream tries again later if
+ * it can, and is closed otherwise.
+ */
+static void bm_dispatcher_stream_connect_failed(bm_dispatcher_t d,
+                                                bm_reactor_t r,
+                                                bm_datastream_t s) {
+   if(s->backoff_max == 0)
+      bm_log(BM_LOG_ERROR, "%s: %s", s->descriptor, s->status_desc);
+   bm_dispatcher_stream_close(d, r, s);
+   if(s->starting) bm_dispatcher_stream_started(d, r, s, 0);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_retry(bm_dispatcher_t d,
+                                bm_reactor_t r,
+                                bm_datastream_t s) {
+   if(s->closed) return;
+   /* The connection in progress took too long */
+   if(s->status == BM_DATASTREAM_CONNECTING) {
+      bm_datastream_set_status(s, BM_DATASTREAM_ERROR, "Connection timed out");
+      bm_dispatcher_stream_connect_failed(d, r, s);
+      return;
+   }
+   /* Try again */
+   s->connect_start = bm_time_now();
+   int ret = s->reconnect(s);
+   if(ret < 0 && errno == EAGAIN) {
+      /* The server address is not known yet */
+      s->retry_deadline = s->connect_start + BM_DISPATCHER_RESOLVE_POLL;
+      bm_reactor_retry(r, s);
+      return;
+   }
+   if(ret < 0 || !bm_reactor_stream_add(r, s)) {
+      bm_dispatcher_stream_connect_failed(d, r, s);
+      return;
+   }
+   if(ret == 0) {
+      /* Wait for the connection to complete */
+      bm_reactor_stream_want_write(r, s, 1);
+      s->retry_deadline = s->connect_start + BM_DISPATCHER_CONNECT_TIMEOUT;
+      bm_reactor_retry(r, s);
+      return;
+   }
+   bm_dispatcher_stream_connected(d, r, s);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Takes note of the result of sending the batch of a stream: releases
+ * the messages sent completely, or handles the error.
+ * @return 1 if the stream can take more, 0 otherwise.
+ */
+static int bm_dispatcher_stream_account(bm_dispatcher_t d,
+                                        bm_reactor_t r,
+                                        bm_datastream_t s,
+                                        ssize_t sent) {
+   if(sent > 0) bm_datastream_batch_record(s, s->out_num);
+   if(sent < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+         /* Resume when the socket is writable again */
+         bm_reactor_stream_want_write(r, s, 1);
+         bm_dispatcher_backlog_expire(d, r, s);
       }
-      /* Broadcast data */
-      bm_dispatcher_broadcast(data->dispatcher,
-                              data->stream,
-                              buf);
-   }
-   /* All done */
-   pthread_mutex_lock(&data->dispatcher->startmutex);
-   --active_threads;
-   pthread_mutex_unlock(&data->dispatcher->startmutex);
-   return NULL;
+      else {
+         atomic_fetch_add_explicit(&s->send_errors, 1, memory_order_relaxed);
+         bm_log(BM_LOG_ERROR, "%s: %s", s->descriptor, s->status_desc);
+         bm_dispatcher_stream_close(d, r, s);
+      }
+      return 0;
+   }
+   /* Release the messages sent completely */
+   uint64_t now = bm_time_now();
+   if(s->backlog_num > 0 && sent > 0) s->blocked_since = now;
+   size_t done, wire;
+   s->out_off += sent;
+   for(done = 0;
+       done < s->out_num &&
+          s->out_off >= (wire = bm_framing_wire_len(&s->framing,
+                                                    s->out_batch[done]->len));
+       ++done) {
+      s->out_off -= wire;
+      bm_histogram_record(&s->latency, now - s->out_batch[done]->ts);
+      bm_msg_unref(s->out_batch[done]);
+   }
+   s->out_num -= done;
+   atomic_fetch_add_explicit(&s->msgs_out, done, memory_order_relaxed);
+   atomic_fetch_add_explicit(&s->bytes_out, sent, memory_order_relaxed);
+   memmove(s->out_batch,
+           s->out_batch + done,
+           s->out_num * sizeof(bm_msg_t));
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_flush(bm_dispatcher_t d,
+                                bm_reactor_t r,
+                                bm_datastream_t s) {
+   /* The batch is on its way, the rest follows once it's sent */
+   if(s->sending) return;
+   if(s->status != BM_DATASTREAM_READY) {
+      bm_dispatcher_stream_drain(d, s);
+      return;
+   }
+   if(atomic_load(&s->overflowed)) {
+      bm_log(BM_LOG_WARNING, "%s: queue overflow", s->descriptor);
+      bm_dispatcher_stream_close(d, r, s);
+      return;
+   }
+   bm_msg_t m;
+   while(1) {
+      /* Fill the batch of messages to send */
+      while(s->out_num < s->out_max &&
+            (m = bm_datastream_queue_pop(s)))
+         s->out_batch[s->out_num++] = m;
+      /* Let the messages waiting for room in */
+      bm_dispatcher_backlog_flush(d, s);
+      if(s->out_num == 0) break;
+      /* Send along with the other streams of the reactor if possible */
+      if(bm_reactor_stream_send(r, s)) return;
+      /* Send as much as possible */
+      if(!bm_dispatcher_stream_account(d, r, s,
+                                       s->sendv(s,
+                                                s->out_batch,
+                                                s->out_num,
+                                                s->out_off)))
+         return;
+   }
+   /* Queue empty */
+   bm_reactor_stream_want_write(r, s, 0);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_sent(bm_dispatcher_t d,
+                               bm_reactor_t r,
+                               bm_datastream_t s,
+                               ssize_t res) {
+   if(res < 0) {
+      errno = -res;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+         bm_datastream_set_status(s,
+                                  BM_DATASTREAM_ERROR,
+                                  "Error sending data: %s",
+                                  strerror(errno));
+      res = -1;
+   }
+   /* Send the rest in the next batch */
+   if(bm_dispatcher_stream_account(d, r, s, res))
+      bm_reactor_schedule_flush(r, s);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_flush_delayed(bm_dispatcher_t d,
+                                        bm_reactor_t r,
+                                        bm_datastream_t s) {
+   if(s->flush_delay > 0 &&
+      !s->want_write &&
+      s->backlog_num == 0 &&
+      s->status == BM_DATASTREAM_READY &&
+      s->out_num + bm_queue_size(s->outq) < s->out_max) {
+      /* The batch is not full, wait a bit for more messages */
+      if(s->flush_deadline == 0) {
+         s->flush_deadline = bm_time_now() + s->flush_delay;
+         bm_reactor_defer_flush(r, s);
+         return;
+      }
+      if(bm_time_now() < s->flush_deadline) return;
+   }
+   /* The reactor timer ignores streams flushed in the meantime */
+   s->flush_deadline = 0;
+   bm_dispatcher_stream_flush(d, r, s);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_event(bm_dispatcher_t d,
+                                bm_reactor_t r,
+                                bm_datastream_t s,
+                                uint32_t events) {
+   /* The stream might have been closed earlier in this round */
+   if(s->closed) return;
+   /* Complete the connection in progress */
+   if(s->status == BM_DATASTREAM_CONNECTING) {
+      if(s->handshake) {
+         int ret = s->handshake(s);
+         if(ret > 0)
+            bm_dispatcher_stream_connected(d, r, s);
+         else if(ret < 0)
+            bm_dispatcher_stream_connect_failed(d, r, s);
+         return;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if(getsockopt(s->fd(s), SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+         err = errno;
+      if(err == 0 && (events & (EPOLLERR | EPOLLHUP))) err = ECONNRESET;
+      if(err == 0) {
+         bm_dispatcher_stream_connected(d, r, s);
+      }
+      else {
+         bm_datastream_set_status(s, BM_DATASTREAM_ERROR, strerror(err));
+         bm_dispatcher_stream_connect_failed(d, r, s);
+      }
+      return;
+   }
+   /* Accept new peers */
+   if(s->accept) {
+      bm_datastream_t peer;
+      for(size_t i = 0; i < BM_DISPATCHER_ACCEPT_BURST; ++i) {
+         peer = s->accept(s);
+         if(!peer) break;
+         bm_dispatcher_stream_join(d, r, peer);
+      }
+      /* Wake up the reactors given peers */
+      bm_reactor_notify(r);
+      return;
+   }
+   /* Resume sending */
+   if((events & EPOLLOUT) || (s->want_write && s->room_on_read)) {
+      bm_dispatcher_stream_flush(d, r, s);
+      if(s->status != BM_DATASTREAM_READY) return;
+   }
+   if(!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+   /* While a queue is blocked, leave the data in the socket to slow
+    * the sender down; streams that learn about room for sending by
+    * reading, and those that hung up, are still received from */
+   if(atomic_load_explicit(&d->blocked, memory_order_relaxed) > 0 &&
+      !(events & (EPOLLERR | EPOLLHUP)) &&
+      !s->room_on_read) {
+      bm_reactor_pause(r, s);
+      return;
+   }
+   /* Receive data */
+   bm_msg_t msgs[BM_DISPATCHER_RECV_BATCH];
+   ssize_t received;
+   for(size_t i = 0; i < BM_DISPATCHER_RECV_BURST; ++i) {
+      received = s->recvv(s, msgs, BM_DISPATCHER_RECV_BATCH);
+      if(received > 0) {
+         /* Timestamp the messages */
+         uint64_t now = bm_time_now();
+         size_t bytes = 0;
+         for(ssize_t j = 0; j < received; ++j) {
+            msgs[j]->ts = now;
+            bytes += msgs[j]->len;
+         }
+         atomic_fetch_add_explicit(&s->msgs_in, received, memory_order_relaxed);
+         atomic_fetch_add_explicit(&s->bytes_in, bytes, memory_order_relaxed);
+         if(s->framing.type == BM_FRAMING_HUB) {
+            /* Messages from other hubs come with their origin, sequence
+             * number and channel; keep those not seen here yet */
+            ssize_t kept = 0;
+            for(ssize_t j = 0; j < received; ++j) {
+               if(msgs[j]->origin != 0 &&
+                  msgs[j]->origin != d->hub_id &&
+                  bm_dedup_check(&d->dedup,
+                                 msgs[j]->origin,
+                                 msgs[j]->origin_reactor,
+                                 msgs[j]->seq)) {
+                  msgs[kept++] = msgs[j];
+               }
+               else {
+                  bm_msg_unref(msgs[j]);
+                  atomic_fetch_add_explicit(&s->duplicates, 1, memory_order_relaxed);
+               }
+            }
+            received = kept;
+         }
+         else {
+            /* Find the channel, and number the messages if there are
+             * hub links to relay them; each reactor numbers its own */
+            uint32_t origin = 0;
+            uint32_t seq = r->hub_seq;
+            if(bm_dispatcher_streams(d)->hubs > 0) {
+               origin = d->hub_id;
+               r->hub_seq += received;
+            }
+            for(ssize_t j = 0; j < received; ++j) {
+               if(!s->sets_channel)
+                  msgs[j]->channel =
+                     (s->pub_offset >= 0 && msgs[j]->len > (size_t)s->pub_offset) ?
+                     msgs[j]->data[s->pub_offset] : s->pub_channel;
+               msgs[j]->origin = origin;
+               msgs[j]->origin_reactor = r->id;
+               msgs[j]->seq = seq + j;
+            }
+         }
+         /* Record the messages */
+         if(r->capture)
+            for(ssize_t j = 0; j < received; ++j)
+               bm_capture_write(r->capture, s->id, msgs[j]);
+         /* Broadcast data, then release our references */
+         bm_dispatcher_broadcast(d, s, msgs, received);
+         for(ssize_t j = 0; j < received; ++j)
+            bm_msg_unref(msgs[j]);
+      }
+      else if(received < 0 &&
+              (errno == EAGAIN || errno == EWOULDBLOCK) &&
+              s->status == BM_DATASTREAM_READY) {
+         /* No more data for now */
+         return;
+      }
+      else {
+         /* Error receiving data, stop polling the stream */
+         bm_dispatcher_stream_close(d, r, s);
+         return;
+      }
+   }
+   /* The burst is over, the stream might have data left in its own
+    * buffer that epoll won't report */
+   bm_reactor_resume(r, s);
 }
 
 /****************************************/
@@ -97,28 +952,48 @@ void* bm_dispatcher_thread(void* arg) {
 
 bm_dispatcher_t bm_dispatcher_new() {
    bm_dispatcher_t d = (bm_dispatcher_t)malloc(sizeof(struct bm_dispatcher_s));
-   d->streams = NULL;
-   d->stream_num = 0;
-   d->start = 0;
-   d->msg_len = 0;
-   if(pthread_cond_init(&d->startcond, NULL) != 0) {
-      fprintf(stderr, "Error initializing the start condition variable: %s\n",
-              strerror(errno));
-      free(d);
-      return NULL;
-   }
-   if(pthread_mutex_init(&d->startmutex, NULL) != 0) {
-      fprintf(stderr, "Error initializing the start mutex: %s\n",
-              strerror(errno));
+   if(!d) return NULL;
+   bm_streamset_t set = bm_dispatcher_streamset_new(0);
+   if(!set) {
       free(d);
       return NULL;
    }
-   if(pthread_mutex_init(&d->datamutex, NULL) != 0) {
-      fprintf(stderr, "Error initializing the data mutex: %s\n",
-              strerror(errno));
-      free(d);
-      return NULL;
+   /* Run until stopped, even after an earlier dispatcher of this process */
+   done = 0;
+   atomic_init(&d->streams, set);
+   bm_epoch_init(&d->epoch, 1);
+   atomic_init(&d->next_reactor, 0);
+   /* Hubs pick random ids and sequence numbers, so a restarted hub
+    * does not look like a source of duplicates */
+   uint32_t seed[2] = { 0, 0 };
+   if(getrandom(seed, sizeof(seed), 0) != sizeof(seed)) {
+      seed[0] = bm_time_now() ^ getpid();
+      seed[1] = bm_time_now() >> 32;
    }
+   d->hub_id = seed[0] ? seed[0] : 1;
+   d->hub_seq = seed[1];
+   bm_dedup_init(&d->dedup);
+   bm_resolver_init(&d->resolver);
+   d->start_time = bm_time_now();
+   atomic_init(&d->starting, 0);
+   atomic_init(&d->startup_connected, 0);
+   d->startup_total = 0;
+   d->held = NULL;
+   d->held_num = 0;
+   d->msg_len = 0;
+   d->pools = NULL;
+   d->reactor_num = 1;
+   d->reactors = NULL;
+   d->cpus = NULL;
+   d->cpu_num = 0;
+   d->uring = 0;
+   d->capture_path = NULL;
+   d->capture_size = BM_CAPTURE_SEGMENT;
+   d->capture_keep = 0;
+   atomic_init(&d->blocked, 0);
+   atomic_init(&d->active_streams, 0);
+   d->metrics_addr = NULL;
+   d->metrics = NULL;
    return d;
 }
 
@@ -126,22 +1001,60 @@ bm_dispatcher_t bm_dispatcher_new() {
 /****************************************/
 
 void bm_dispatcher_destroy(bm_dispatcher_t d) {
-   pthread_cond_destroy(&d->startcond);
-   pthread_mutex_destroy(&d->startmutex);
-   pthread_mutex_destroy(&d->datamutex);
-   bm_datastream_t cur = d->streams;
-   bm_datastream_t next;
-   while(cur) {
-      next = cur->next;
-      cur->destroy(cur);
-      cur = next;
-   }
+   bm_streamset_t set = bm_dispatcher_streams(d);
+   for(size_t i = 0; i < set->num; ++i)
+      set->streams[i]->destroy(set->streams[i]);
+   free(set);
+   /* Destroy the streams removed in the meantime */
+   bm_epoch_cleanup(&d->epoch);
+   bm_dedup_cleanup(&d->dedup);
+   bm_resolver_cleanup(&d->resolver);
+   /* All the messages have been released by now */
+   if(d->pools) bm_msgpool_set_destroy(d->pools);
+   free(d->held);
+   free(d->cpus);
    free(d);
 }
 
 /****************************************/
 /****************************************/
 
+int bm_dispatcher_set_cpus(bm_dispatcher_t d,
+                           const char* list) {
+   int* cpus = NULL;
+   size_t num = 0;
+   const char* p = list;
+   char* endptr;
+   long first, last;
+   while(1) {
+      /* Parse a number or a range */
+      first = strtol(p, &endptr, 10);
+      if(endptr == p || first < 0 || first >= BM_DISPATCHER_CPU_MAX) break;
+      last = first;
+      if(*endptr == '-') {
+         p = endptr + 1;
+         last = strtol(p, &endptr, 10);
+         if(endptr == p || last < first || last >= BM_DISPATCHER_CPU_MAX) break;
+      }
+      cpus = (int*)realloc(cpus, (num + last - first + 1) * sizeof(int));
+      while(first <= last) cpus[num++] = first++;
+      /* Move on to the next item */
+      if(*endptr == '\0') {
+         free(d->cpus);
+         d->cpus = cpus;
+         d->cpu_num = num;
+         return 1;
+      }
+      if(*endptr != ',') break;
+      p = endptr + 1;
+   }
+   free(cpus);
+   return 0;
+}
+
+/****************************************/
+/****************************************/
+
 int bm_dispatcher_stream_add(bm_dispatcher_t d,
                              const char* s) {
    char* ws = strdup(s);
@@ -154,17 +1067,14 @@ int bm_dispatcher_stream_add(bm_dispatcher_t d,
       return 0;
    }
    /* Make sure id has not been already used */
-   for(bm_datastream_t cur = d->streams;
-       cur != NULL;
-       cur = cur->next) {
-      if(strcmp(tok, cur->id) == 0) {
-         fprintf(stderr, "'%s': id '%s' already in use by '%s'\n",
-                 s,
-                 tok,
-                 cur->descriptor);
-         free(ws);
-         return 0;
-      }
+   bm_datastream_t cur = bm_streamset_find(bm_dispatcher_streams(d), tok);
+   if(cur) {
+      fprintf(stderr, "'%s': id '%s' already in use by '%s'\n",
+              s,
+              tok,
+              cur->descriptor);
+      free(ws);
+      return 0;
    }
    /* Get stream type */
    tok = strtok_r(NULL, ":", &saveptr);
@@ -179,10 +1089,50 @@ int bm_dispatcher_stream_add(bm_dispatcher_t d,
       /* Create new TCP stream */
       stream = (bm_datastream_t)bm_tcp_datastream_new(s);
    }
+   else if(strcmp(tok, "tcplisten") == 0) {
+      /* Create new TCP listening stream */
+      stream = (bm_datastream_t)bm_tcp_datastream_listen_new(s);
+   }
+   else if(strcmp(tok, "hub") == 0) {
+      /* Create new link to another hub */
+      stream = (bm_datastream_t)bm_tcp_datastream_new(s);
+   }
+   else if(strcmp(tok, "hublisten") == 0) {
+      /* Create new listening stream for links from other hubs */
+      stream = (bm_datastream_t)bm_tcp_datastream_listen_new(s);
+   }
+   else if(strcmp(tok, "unix") == 0) {
+      /* Create new Unix domain socket stream */
+      stream = (bm_datastream_t)bm_tcp_datastream_new(s);
+   }
+   else if(strcmp(tok, "unixlisten") == 0) {
+      /* Create new listening Unix domain socket stream */
+      stream = (bm_datastream_t)bm_tcp_datastream_listen_new(s);
+   }
+   else if(strcmp(tok, "shm") == 0) {
+      /* Create new shared memory stream */
+      stream = (bm_datastream_t)bm_shm_datastream_new(s);
+   }
+   else if(strcmp(tok, "shmlisten") == 0) {
+      /* Create new listening shared memory stream */
+      stream = (bm_datastream_t)bm_shm_datastream_listen_new(s);
+   }
    else if(strcmp(tok, "udp") == 0) {
       /* Create new UDP stream */
       stream = (bm_datastream_t)bm_udp_datastream_new(s);
    }
+   else if(strcmp(tok, "udplisten") == 0) {
+      /* Create new UDP stream serving many peers */
+      stream = (bm_datastream_t)bm_udp_datastream_listen_new(s);
+   }
+   else if(strcmp(tok, "mcast") == 0) {
+      /* Create new multicast stream */
+      stream = (bm_datastream_t)bm_mcast_datastream_new(s);
+   }
+   else if(strcmp(tok, "replay") == 0) {
+      /* Create new replay of a capture */
+      stream = (bm_datastream_t)bm_replay_datastream_new(s);
+   }
 #ifdef BLABBERMOUTH_WITH_BT
    else if(strcmp(tok, "bt") == 0) {
       /* Create new Bluetooth stream */
@@ -196,10 +1146,16 @@ int bm_dispatcher_stream_add(bm_dispatcher_t d,
       free(ws);
       return 0;
    }
+   if(!stream) {
+      fprintf(stderr, "'%s': Can't create stream\n", s);
+      free(ws);
+      return 0;
+   }
    /* Set verbosity */
    tok = strtok_r(NULL, ":", &saveptr);
    if(!tok) {
       fprintf(stderr, "Can't parse '%s'\n", s);
+      stream->destroy(stream);
       free(ws);
       return 0;
    }
@@ -207,34 +1163,27 @@ int bm_dispatcher_stream_add(bm_dispatcher_t d,
    stream->verbose = strtol(tok, &endptr, 10);
    if(*endptr != 0) {
       fprintf(stderr, "Can't parse '%s'\n", s);
+      stream->destroy(stream);
       free(ws);
       return 0;
    }
-   /* Attempt to connect */
-   if(!stream->connect(stream)) {
+   /* Attempt to connect; the streams that can reconnect connect in
+    * the background once the dispatcher runs, all at once */
+   if(!stream->reconnect && !stream->connect(stream)) {
       fprintf(stderr, "'%s': Connection error: %s\n", s, stream->status_desc);
-      bm_datastream_destroy(stream);
+      stream->destroy(stream);
       free(ws);
       return 0;
    }
-   /* Add a thread dedicated to this stream */
-   bm_dispatcher_thread_data_t info =
-      (bm_dispatcher_thread_data_t)malloc(
-         sizeof(struct bm_dispatcher_thread_data_s));
-   info->dispatcher = d;
-   info->stream = stream;
-   if(pthread_create(&stream->thread, NULL, &bm_dispatcher_thread, info) != 0) {
-      fprintf(stderr, "'%s': Can't create thread: %s\n", s, strerror(errno));
-      bm_datastream_destroy(stream);
-      free(info);
+   /* Create the outbound queue */
+   stream->outq = bm_queue_new(stream->queue_max_msgs);
+   /* Add stream to the dispatcher */
+   if(!bm_dispatcher_streams_update(d, stream, 1)) {
+      fprintf(stderr, "'%s': Can't add stream: out of memory\n", s);
+      stream->destroy(stream);
       free(ws);
       return 0;
    }
-   /* Add stream at the beginning of the list */
-   if(d->streams != NULL)
-      stream->next = d->streams;
-   d->streams = stream;
-   ++d->stream_num;
    /* Wrap up */
    fprintf(stdout, "Added stream '%s'\n", s);
    free(ws);
@@ -244,38 +1193,198 @@ int bm_dispatcher_stream_add(bm_dispatcher_t d,
 /****************************************/
 /****************************************/
 
+void bm_dispatcher_stream_join(bm_dispatcher_t d,
+                               bm_reactor_t r,
+                               bm_datastream_t s) {
+   s->outq = bm_queue_new(s->queue_max_msgs);
+   /* Only the owner touches the stream from now on */
+   bm_reactor_t owner = &d->reactors[atomic_fetch_add(&d->next_reactor, 1) %
+                                     d->reactor_num];
+   s->reactor = owner->id;
+   if(owner == r) {
+      bm_dispatcher_stream_adopt(d, r, s);
+   }
+   else if(!bm_reactor_hand_over(r, owner, s)) {
+      /* Shutting down */
+      s->destroy(s);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+void bm_dispatcher_stream_adopt(bm_dispatcher_t d,
+                                bm_reactor_t r,
+                                bm_datastream_t s) {
+   /* Accepted streams join the broadcast, then start receiving; the
+    * others are already set up and in the snapshot */
+   int ok = 1;
+   if(s->accepted) {
+      ok = bm_dispatcher_stream_setup(d, s);
+      if(!bm_dispatcher_streams_update(d, s, 1)) {
+         bm_log(BM_LOG_ERROR, "%s: can't add stream: out of memory", s->descriptor);
+         s->destroy(s);
+         return;
+      }
+      atomic_fetch_add(&d->active_streams, 1);
+   }
+   if(!ok || !bm_reactor_stream_add(r, s)) {
+      bm_log(BM_LOG_ERROR, "%s: %s", s->descriptor, s->status_desc);
+      bm_dispatcher_stream_close(d, r, s);
+      return;
+   }
+   if(s->accepted)
+      bm_log(BM_LOG_INFO, "Added stream '%s'", s->descriptor);
+}
+
+/****************************************/
+/****************************************/
+
 void sighandler(int sig) {
    /* The program is done */
    fprintf(stdout, "Termination requested\n");
    done = 1;
 }
 
+void bm_dispatcher_stop(bm_dispatcher_t d) {
+   done = 1;
+}
+
+/****************************************/
+/****************************************/
+
 void bm_dispatcher_execute(bm_dispatcher_t d) {
    /* Set signal handlers */
    signal(SIGTERM, sighandler);
    signal(SIGINT, sighandler);
-   /* Start all threads */
-   pthread_mutex_lock(&d->startmutex);
-   d->start = 1;
-   pthread_mutex_unlock(&d->startmutex);
-   pthread_cond_broadcast(&d->startcond);
-   /* Wait for done signal */
+   signal(SIGPIPE, SIG_IGN);
+   /* Create the message pools */
+   d->pools = bm_msgpool_set_new(d->msg_len, BM_DISPATCHER_POOL_SIZE);
+   /* Create the reactors */
+   d->reactors = (bm_reactor_t)calloc(d->reactor_num,
+                                      sizeof(struct bm_reactor_s));
+   size_t i;
+   for(i = 0; i < d->reactor_num; ++i) {
+      if(!bm_reactor_init(&d->reactors[i], d, i)) {
+         while(i > 0) bm_reactor_cleanup(&d->reactors[--i]);
+         free(d->reactors);
+         d->reactors = NULL;
+         return;
+      }
+   }
+   /* From now on, each reactor and the metrics endpoint read the
+    * streams in their own epoch slot */
+   bm_epoch_cleanup(&d->epoch);
+   bm_epoch_init(&d->epoch, d->reactor_num + 1);
+   /* Create the metrics endpoint */
+   if(d->metrics_addr) {
+      d->metrics = bm_metrics_new(d, d->metrics_addr);
+      if(!d->metrics) {
+         for(i = 0; i < d->reactor_num; ++i)
+            bm_reactor_cleanup(&d->reactors[i]);
+         free(d->reactors);
+         d->reactors = NULL;
+         return;
+      }
+   }
+   /* Distribute the streams among the reactors */
+   size_t starting = 0;
+   i = 0;
+   bm_streamset_t set = bm_dispatcher_streams(d);
+   for(size_t j = 0; j < set->num; ++j) {
+      bm_datastream_t s = set->streams[j];
+      if(!bm_dispatcher_stream_setup(d, s)) {
+         fprintf(stderr, "%s: %s\n", s->descriptor, s->status_desc);
+         continue;
+      }
+      if(s->reconnect) {
+         /* The reactor connects it, along with the others */
+         s->reactor = i;
+         s->starting = 1;
+         ++starting;
+         s->retry_deadline = bm_time_now();
+         bm_reactor_retry(&d->reactors[i], s);
+      }
+      else if(s->self_paced) {
+         /* Polled once the others are connected */
+         s->reactor = i;
+         d->held = (bm_datastream_t*)realloc(d->held, (d->held_num + 1) * sizeof(bm_datastream_t));
+         d->held[d->held_num++] = s;
+      }
+      else if(!bm_reactor_stream_add(&d->reactors[i], s)) {
+         fprintf(stderr, "%s: %s\n", s->descriptor, s->status_desc);
+         continue;
+      }
+      atomic_fetch_add(&d->active_streams, 1);
+      i = (i + 1) % d->reactor_num;
+   }
+   atomic_store(&d->next_reactor, i);
+   /* The snapshot holds the reactors and framings of before */
+   if(!bm_dispatcher_streams_update(d, NULL, 0)) {
+      fprintf(stderr, "Can't update the streams: out of memory\n");
+      done = 1;
+   }
+   d->startup_total = starting;
+   atomic_store(&d->starting, starting);
+   if(starting == 0) {
+      bm_log(BM_LOG_INFO, "Started in %.3f ms",
+             (bm_time_now() - d->start_time) / 1e6);
+      bm_dispatcher_release_held(d, NULL);
+   }
+   /* Start the reactors */
+   size_t started;
+   for(started = 0; !done && started < d->reactor_num; ++started)
+      if(!bm_reactor_start(&d->reactors[started])) {
+         done = 1;
+         break;
+      }
+   /* Wait for done signal, meanwhile reclaim the removed streams */
+   struct timespec pause = {
+      .tv_sec = 0,
+      .tv_nsec = BM_DISPATCHER_RECLAIM_INTERVAL
+   };
    while(!done) {
-      sleep(1);
-      pthread_mutex_lock(&d->startmutex);
-      if(active_threads == 0) done = 1;
-      pthread_mutex_unlock(&d->startmutex);
-   }
-   /* Cancel all threads */
-   for(bm_datastream_t s = d->streams;
-       s != NULL;
-       s = s->next)
-      pthread_cancel(s->thread);
-   /* Wait for all threads to be done */
-   for(bm_datastream_t s = d->streams;
-       s != NULL;
-       s = s->next)
-      pthread_join(s->thread, NULL);
+      nanosleep(&pause, NULL);
+      bm_epoch_reclaim(&d->epoch);
+      if(atomic_load(&d->active_streams) == 0) done = 1;
+   }
+   /* Stop the reactors */
+   for(i = 0; i < started; ++i)
+      bm_reactor_stop(&d->reactors[i]);
+   for(i = 0; i < d->reactor_num; ++i)
+      bm_reactor_cleanup(&d->reactors[i]);
+   free(d->reactors);
+   /* Stop serving the metrics */
+   if(d->metrics) {
+      bm_metrics_destroy(d->metrics);
+      d->metrics = NULL;
+   }
+   /* Let the log lines of the reactors out before the report */
+   bm_log_flush();
+   /* Report the messages that slow streams could not keep up with */
+   set = bm_dispatcher_streams(d);
+   for(size_t j = 0; j < set->num; ++j) {
+      bm_datastream_t s = set->streams[j];
+      size_t dropped = atomic_load(&s->dropped);
+      if(dropped > 0)
+         fprintf(stderr, "%s: %zu messages dropped\n", s->descriptor, dropped);
+      size_t conflated = atomic_load(&s->conflated);
+      if(conflated > 0)
+         fprintf(stderr, "%s: %zu messages conflated\n", s->descriptor, conflated);
+      /* Report the achieved batch sizes */
+      size_t calls = 0;
+      for(size_t b = 0; b < BM_DATASTREAM_BATCH_BUCKETS; ++b)
+         calls += atomic_load(&s->batch_hist[b]);
+      if(calls > 0) {
+         fprintf(stderr, "%s: %zu sends, messages per send:", s->descriptor, calls);
+         for(size_t b = 0; b < BM_DATASTREAM_BATCH_BUCKETS; ++b) {
+            size_t n = atomic_load(&s->batch_hist[b]);
+            if(n > 0) fprintf(stderr, " %zu+:%zu", (size_t)1 << b, n);
+         }
+         fprintf(stderr, "\n");
+      }
+   }
+   d->reactors = NULL;
 }
 
 /****************************************/
@@ -2,31 +2,149 @@
 #define BM_DISPATCHER_H
 
 #include "bm_datastream.h"
+#include "bm_reactor.h"
+#include "bm_metrics.h"
+#include "bm_epoch.h"
+#include "bm_dedup.h"
+#include "bm_resolver.h"
+
+/*
+ * What the broadcast needs to know about a stream, besides its status.
+ * These fields don't change while the stream is in a snapshot, so each
+ * snapshot keeps a copy of them packed together, rather than spread
+ * over the cache lines of the streams.
+ */
+struct bm_streamset_entry_s {
+   /* The stream */
+   bm_datastream_t stream;
+   /* The index of the reactor that owns the stream */
+   size_t reactor;
+   /* Whether the stream gets the messages it sent itself */
+   int shared;
+   /* How the stream frames the messages, to tell which it can carry */
+   struct bm_framing_s framing;
+};
+typedef struct bm_streamset_entry_s* bm_streamset_entry_t;
+
+/*
+ * A snapshot of the streams of the dispatcher.
+ * Snapshots are never modified: adding or removing a stream publishes
+ * a new snapshot and retires the old one, so threads can go through
+ * the streams without locks while peers come and go.
+ * Each snapshot comes with its routing table, so that a message only
+ * visits the streams subscribed to its channel, and with an index of
+ * the streams by id.
+ */
+struct bm_streamset_s {
+   /* The number of streams */
+   size_t num;
+   /* The generation of the snapshot, one more than the one it replaced */
+   uint64_t gen;
+   /* The number of streams with hub framing, listening ones included;
+    * received messages are only numbered if there are any */
+   size_t hubs;
+   /* The number of 64-bit words in a route */
+   size_t words;
+   /* For each channel, the bitset of the indices of the streams
+    * subscribed to it */
+   uint64_t* routes;
+   /* The hot fields of the streams, by index */
+   bm_streamset_entry_t entries;
+   /* The hash index of the streams by id: the index of a stream + 1
+    * in each slot, 0 for an empty slot; open addressing */
+   uint32_t* slots;
+   /* The number of slots - 1; the number is a power of two */
+   size_t mask;
+   /* The streams */
+   bm_datastream_t streams[];
+};
+typedef struct bm_streamset_s* bm_streamset_t;
+
+/*
+ * Returns the streams subscribed to a channel.
+ * @param set The snapshot.
+ * @param channel The channel.
+ * @return The bitset of the indices of the streams.
+ */
+static inline const uint64_t* bm_streamset_route(bm_streamset_t set,
+                                                 uint8_t channel) {
+   return set->routes + channel * set->words;
+}
+
+/*
+ * Finds a stream by id.
+ * @param set The snapshot.
+ * @param id The id.
+ * @return The stream, or NULL if no stream has that id.
+ */
+extern bm_datastream_t bm_streamset_find(bm_streamset_t set,
+                                         const char* id);
 
 /*
  * The dispatcher state.
  */
 struct bm_dispatcher_s {
-   /* A linked list of streams */
-   bm_datastream_t streams;
-   /* The number of streams */
-   size_t stream_num;
-   /* The message length */
+   /* The current snapshot of the streams */
+   _Atomic(bm_streamset_t) streams;
+   /* Reclaims the removed streams and the old snapshots. Each reactor
+    * uses the slot matching its index, the metrics endpoint the last */
+   struct bm_epoch_s epoch;
+   /* The reactor the next accepted stream goes to */
+   atomic_size_t next_reactor;
+   /* The id of this hub among linked hubs, never 0 */
+   uint32_t hub_id;
+   /* The sequence number the reactors start numbering messages from */
+   uint32_t hub_seq;
+   /* The messages seen from the other hubs */
+   struct bm_dedup_s dedup;
+   /* The addresses of the servers streams connect to */
+   struct bm_resolver_s resolver;
+   /* When the dispatcher was created */
+   uint64_t start_time;
+   /* The number of streams connecting for the first time */
+   atomic_size_t starting;
+   /* The number of streams connected at startup, out of startup_total */
+   atomic_size_t startup_connected;
+   size_t startup_total;
+   /* The self-paced streams waiting for the startup to complete */
+   bm_datastream_t* held;
+   size_t held_num;
+   /* The message size of the streams with fixed framing and no size
+    * of their own, 0 for none */
    size_t msg_len;
-   /* PThread condition variable to start the streams */
-   pthread_cond_t startcond;
-   /* PThread mutex to start the streams */
-   pthread_mutex_t startmutex;
-   /* A condition variable to start the streams */
-   int start;
-   /* PThread mutex to send data */
-   pthread_mutex_t datamutex;
+   /* The pools messages are allocated from */
+   bm_msgpool_set_t pools;
+   /* The number of reactors */
+   size_t reactor_num;
+   /* The reactors */
+   struct bm_reactor_s* reactors;
+   /* The CPUs the reactors are pinned to, in turn, or NULL */
+   int* cpus;
+   /* The number of CPUs */
+   size_t cpu_num;
+   /* Set to 1 for the reactors to send through io_uring when available */
+   int uring;
+   /* The prefix of the capture segments, or NULL not to capture */
+   const char* capture_path;
+   /* The size of a capture segment */
+   size_t capture_size;
+   /* How many capture segments to keep per reactor, 0 for all */
+   size_t capture_keep;
+   /* The number of streams with messages waiting for room in their
+    * queue; the reactors don't receive while it is not 0 */
+   atomic_size_t blocked;
+   /* The number of streams still being polled */
+   atomic_size_t active_streams;
+   /* Where to serve the metrics, or NULL */
+   const char* metrics_addr;
+   /* The metrics endpoint */
+   bm_metrics_t metrics;
 };
 typedef struct bm_dispatcher_s* bm_dispatcher_t;
 
 /*
  * Creates a new dispatcher.
- * @return A new dispatcher instance.
+ * @return A new dispatcher instance, or NULL for failure.
  */
 extern bm_dispatcher_t bm_dispatcher_new();
 
@@ -45,10 +163,144 @@ extern void bm_dispatcher_destroy(bm_dispatcher_t d);
 extern int bm_dispatcher_stream_add(bm_dispatcher_t d,
                                     const char* s);
 
+/*
+ * Adds a stream accepted at runtime to the dispatcher.
+ * The stream is given to one of the reactors, which sets it up, makes
+ * it join the broadcast and polls it; when that reactor is another
+ * one, the stream is handed over to it, and the reactors given streams
+ * must be notified with bm_reactor_notify().
+ * Called by the reactor that accepted the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The connected stream
+ */
+extern void bm_dispatcher_stream_join(bm_dispatcher_t d,
+                                      bm_reactor_t r,
+                                      bm_datastream_t s);
+
+/*
+ * Sets the CPUs the reactors are pinned to.
+ * Reactor i runs on the CPU at position i modulo the list length.
+ * @param d The dispatcher
+ * @param list The CPUs, as a comma-separated list of numbers and
+ * ranges, for instance "0,2,4-7".
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_dispatcher_set_cpus(bm_dispatcher_t d,
+                                  const char* list);
+
+/*
+ * Returns the current snapshot of the streams.
+ * The snapshot remains valid until the calling thread leaves its
+ * epoch critical section.
+ * @param d The dispatcher
+ * @return The snapshot.
+ */
+static inline bm_streamset_t bm_dispatcher_streams(bm_dispatcher_t d) {
+   return atomic_load(&d->streams);
+}
+
 /*
  * Executes the dispatcher.
  * @param d The dispatcher
  */
 extern void bm_dispatcher_execute(bm_dispatcher_t d);
 
+/*
+ * Makes bm_dispatcher_execute() return.
+ * Can be called from any thread.
+ * @param d The dispatcher
+ */
+extern void bm_dispatcher_stop(bm_dispatcher_t d);
+
+/*
+ * Handles an event on a stream.
+ * Called by the reactor that owns the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ * @param events The epoll events
+ */
+extern void bm_dispatcher_stream_event(bm_dispatcher_t d,
+                                       bm_reactor_t r,
+                                       bm_datastream_t s,
+                                       uint32_t events);
+
+/*
+ * Queues a message handed over by another reactor.
+ * Called by the reactor that owns the stream, which takes over the
+ * reference of the message.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ * @param m The message
+ */
+extern void bm_dispatcher_stream_deliver(bm_dispatcher_t d,
+                                         bm_reactor_t r,
+                                         bm_datastream_t s,
+                                         bm_msg_t m);
+
+/*
+ * Starts polling a stream handed over by another reactor with
+ * bm_reactor_hand_over(): an accepted stream, which is set up and joins
+ * the broadcast first, or a stream held back during the startup.
+ * Called by the reactor that owns the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ */
+extern void bm_dispatcher_stream_adopt(bm_dispatcher_t d,
+                                       bm_reactor_t r,
+                                       bm_datastream_t s);
+
+/*
+ * Moves on with the reconnection of a stream once its retry_deadline
+ * has passed: tries to connect again, or gives up on the connection
+ * in progress.
+ * Called by the reactor that owns the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ */
+extern void bm_dispatcher_stream_retry(bm_dispatcher_t d,
+                                       bm_reactor_t r,
+                                       bm_datastream_t s);
+
+/*
+ * Sends the messages queued on a stream, as long as the stream
+ * accepts them.
+ * Called by the reactor that owns the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ */
+extern void bm_dispatcher_stream_flush(bm_dispatcher_t d,
+                                       bm_reactor_t r,
+                                       bm_datastream_t s);
+
+/*
+ * Handles the result of a send batched by the reactor.
+ * Called by the reactor that owns the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ * @param res The number of bytes sent, or -errno
+ */
+extern void bm_dispatcher_stream_sent(bm_dispatcher_t d,
+                                      bm_reactor_t r,
+                                      bm_datastream_t s,
+                                      ssize_t res);
+
+/*
+ * Like bm_dispatcher_stream_flush(), but if the stream has a latency
+ * budget, waits until a full batch is queued or the budget is spent.
+ * Called by the reactor that owns the stream.
+ * @param d The dispatcher
+ * @param r The reactor
+ * @param s The stream
+ */
+extern void bm_dispatcher_stream_flush_delayed(bm_dispatcher_t d,
+                                               bm_reactor_t r,
+                                               bm_datastream_t s);
+
 #endif
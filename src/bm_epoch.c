@@ -0,0 +1,114 @@
+#include "bm_epoch.h"
+
+/****************************************/
+/****************************************/
+
+void bm_epoch_init(bm_epoch_t e,
+                   size_t slot_num) {
+   atomic_init(&e->epoch, 1);
+   e->slot_num = slot_num;
+   e->slots = (struct bm_epoch_slot_s*)aligned_alloc(
+      BM_CACHE_LINE,
+      slot_num * sizeof(struct bm_epoch_slot_s));
+   for(size_t i = 0; i < slot_num; ++i)
+      atomic_init(&e->slots[i].epoch, 0);
+   e->retired = NULL;
+   pthread_mutex_init(&e->mutex, NULL);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_epoch_cleanup(bm_epoch_t e) {
+   /* No reader is left, so the objects can go right away */
+   while(e->retired) {
+      struct bm_epoch_retired_s* r = e->retired;
+      e->retired = NULL;
+      while(r) {
+         struct bm_epoch_retired_s* next = r->next;
+         if(r->release(r->obj)) {
+            free(r);
+         }
+         else {
+            r->next = e->retired;
+            e->retired = r;
+         }
+         r = next;
+      }
+   }
+   free(e->slots);
+   e->slots = NULL;
+   pthread_mutex_destroy(&e->mutex);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_epoch_retire(bm_epoch_t e,
+                     int (*release)(void*),
+                     void* obj) {
+   struct bm_epoch_retired_s* r =
+      (struct bm_epoch_retired_s*)malloc(sizeof(struct bm_epoch_retired_s));
+   r->release = release;
+   r->obj = obj;
+   /* Readers that enter from now on use a later epoch */
+   r->epoch = atomic_fetch_add(&e->epoch, 1);
+   pthread_mutex_lock(&e->mutex);
+   r->next = e->retired;
+   e->retired = r;
+   pthread_mutex_unlock(&e->mutex);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_epoch_reclaim(bm_epoch_t e) {
+   /* Find the oldest epoch a reader is in */
+   uint64_t oldest = UINT64_MAX;
+   for(size_t i = 0; i < e->slot_num; ++i) {
+      uint64_t s = atomic_load(&e->slots[i].epoch);
+      if(s != 0 && s < oldest) oldest = s;
+   }
+   /* Take the objects retired before that */
+   struct bm_epoch_retired_s* ready = NULL;
+   pthread_mutex_lock(&e->mutex);
+   struct bm_epoch_retired_s** prev = &e->retired;
+   struct bm_epoch_retired_s* r;
+   while((r = *prev)) {
+      if(r->epoch < oldest) {
+         *prev = r->next;
+         r->next = ready;
+         ready = r;
+      }
+      else {
+         prev = &r->next;
+      }
+   }
+   pthread_mutex_unlock(&e->mutex);
+   /* Release them; those that are not done wait some more */
+   while(ready) {
+      r = ready;
+      ready = r->next;
+      if(r->release(r->obj)) {
+         free(r);
+      }
+      else {
+         r->epoch = atomic_fetch_add(&e->epoch, 1);
+         pthread_mutex_lock(&e->mutex);
+         r->next = e->retired;
+         e->retired = r;
+         pthread_mutex_unlock(&e->mutex);
+      }
+   }
+}
+
+/****************************************/
+/****************************************/
+
+int bm_epoch_free(void* obj) {
+   free(obj);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
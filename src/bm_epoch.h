@@ -0,0 +1,117 @@
+#ifndef BM_EPOCH_H
+#define BM_EPOCH_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "bm_queue.h"
+
+/*
+ * Epoch-based reclamation.
+ * Readers access shared objects inside critical sections, without
+ * locks. An object that has been unlinked is retired rather than
+ * freed: it is released once every reader that could still see it
+ * has left its critical section.
+ * Each reader thread uses its own slot.
+ */
+
+/*
+ * The slot of a reader.
+ */
+struct bm_epoch_slot_s {
+   /* The epoch the reader entered in, 0 when outside */
+   _Alignas(BM_CACHE_LINE) atomic_uint_fast64_t epoch;
+};
+
+/*
+ * A retired object.
+ */
+struct bm_epoch_retired_s {
+   /* The epoch the object was retired in */
+   uint64_t epoch;
+   /* Releases the object; returns 0 to wait for another grace period */
+   int (*release)(void*);
+   /* The object */
+   void* obj;
+   /* Used to manage the list of retired objects */
+   struct bm_epoch_retired_s* next;
+};
+
+/*
+ * The reclamation state.
+ */
+struct bm_epoch_s {
+   /* The current epoch, starting from 1 */
+   atomic_uint_fast64_t epoch;
+   /* The reader slots */
+   struct bm_epoch_slot_s* slots;
+   /* The number of reader slots */
+   size_t slot_num;
+   /* The retired objects */
+   struct bm_epoch_retired_s* retired;
+   /* Protects the list of retired objects */
+   pthread_mutex_t mutex;
+};
+typedef struct bm_epoch_s* bm_epoch_t;
+
+/*
+ * Initializes the reclamation state.
+ * @param e The state.
+ * @param slot_num The number of reader slots.
+ */
+extern void bm_epoch_init(bm_epoch_t e,
+                          size_t slot_num);
+
+/*
+ * Releases all the retired objects and the state.
+ * No reader must be in a critical section.
+ * @param e The state.
+ */
+extern void bm_epoch_cleanup(bm_epoch_t e);
+
+/*
+ * Enters a critical section.
+ * @param e The state.
+ * @param slot The slot of the reader.
+ */
+static inline void bm_epoch_enter(bm_epoch_t e,
+                                  size_t slot) {
+   atomic_store(&e->slots[slot].epoch, atomic_load(&e->epoch));
+}
+
+/*
+ * Leaves a critical section.
+ * @param e The state.
+ * @param slot The slot of the reader.
+ */
+static inline void bm_epoch_leave(bm_epoch_t e,
+                                  size_t slot) {
+   atomic_store_explicit(&e->slots[slot].epoch, 0, memory_order_release);
+}
+
+/*
+ * Retires an object that readers can no longer reach.
+ * @param e The state.
+ * @param release The function that releases the object. It can
+ * return 0 to be called again after another grace period.
+ * @param obj The object.
+ */
+extern void bm_epoch_retire(bm_epoch_t e,
+                            int (*release)(void*),
+                            void* obj);
+
+/*
+ * Releases the retired objects no reader can see anymore.
+ * @param e The state.
+ */
+extern void bm_epoch_reclaim(bm_epoch_t e);
+
+/*
+ * A release function that calls free().
+ * @param obj The object.
+ * @return 1.
+ */
+extern int bm_epoch_free(void* obj);
+
+#endif
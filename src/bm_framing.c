@@ -0,0 +1,302 @@
+#include "bm_framing.h"
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Largest UDP payload over IPv4
+ */
+#define BM_FRAMING_DATAGRAM_MAX 65507
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes a varint.
+ * @return The number of bytes written.
+ */
+static size_t bm_framing_varint_write(size_t v,
+                                      uint8_t* buf) {
+   size_t n = 0;
+   do {
+      buf[n++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+      v >>= 7;
+   } while(v > 0);
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the length of a varint.
+ */
+static size_t bm_framing_varint_len(size_t v) {
+   size_t n = 1;
+   while(v >>= 7) ++n;
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Reads a varint.
+ * @return The number of bytes read, 0 if the varint is not complete
+ * yet, or -1 if it is too long.
+ */
+static ssize_t bm_framing_varint_read(const uint8_t* buf,
+                                      size_t avail,
+                                      size_t* v) {
+   size_t n = 0;
+   *v = 0;
+   while(1) {
+      if(n == BM_FRAMING_VARINT_MAX) return -1;
+      if(n == avail) return 0;
+      *v |= (size_t)(buf[n] & 0x7F) << (7 * n);
+      if(!(buf[n++] & 0x80)) return n;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Reads a 32-bit big endian integer.
+ */
+static uint32_t bm_framing_u32_read(const uint8_t* buf) {
+   return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+      ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes a 32-bit big endian integer.
+ */
+static void bm_framing_u32_write(uint32_t v,
+                                 uint8_t* buf) {
+   buf[0] = v >> 24;
+   buf[1] = v >> 16;
+   buf[2] = v >> 8;
+   buf[3] = v;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_framing_init(bm_framing_t f) {
+   f->type = BM_FRAMING_FIXED;
+   f->size = 0;
+   f->delim = '\n';
+   f->max = BM_FRAMING_MAX;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_framing_parse_type(bm_framing_t f,
+                          const char* name) {
+   if(strcasecmp(name, "fixed") == 0) f->type = BM_FRAMING_FIXED;
+   else if(strcasecmp(name, "u16") == 0) f->type = BM_FRAMING_U16;
+   else if(strcasecmp(name, "u32") == 0) f->type = BM_FRAMING_U32;
+   else if(strcasecmp(name, "varint") == 0) f->type = BM_FRAMING_VARINT;
+   else if(strcasecmp(name, "delim") == 0) f->type = BM_FRAMING_DELIM;
+   else if(strcasecmp(name, "datagram") == 0) f->type = BM_FRAMING_DATAGRAM;
+   else if(strcasecmp(name, "hub") == 0) f->type = BM_FRAMING_HUB;
+   else return 0;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_framing_parse_delim(bm_framing_t f,
+                           const char* str) {
+   if(str[0] != '\0' && str[1] == '\0') {
+      f->delim = str[0];
+      return 1;
+   }
+   if(str[0] == '\\' && str[2] == '\0') {
+      switch(str[1]) {
+         case 'n': f->delim = '\n'; return 1;
+         case 'r': f->delim = '\r'; return 1;
+         case 't': f->delim = '\t'; return 1;
+         case '0': f->delim = '\0'; return 1;
+         default: return 0;
+      }
+   }
+   if(str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+      char* endptr;
+      unsigned long v = strtoul(str + 2, &endptr, 16);
+      if(endptr == str + 2 || *endptr != '\0' || v > 0xFF) return 0;
+      f->delim = v;
+      return 1;
+   }
+   return 0;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_framing_accepts(bm_framing_t f,
+                       bm_msg_t m) {
+   switch(f->type) {
+      case BM_FRAMING_FIXED:
+         return m->len == f->size;
+      case BM_FRAMING_U16:
+         return m->len <= UINT16_MAX;
+      case BM_FRAMING_U32:
+         return m->len <= UINT32_MAX;
+      case BM_FRAMING_DELIM:
+         return memchr(m->data, f->delim, m->len) == NULL;
+      case BM_FRAMING_DATAGRAM:
+         return m->len <= BM_FRAMING_DATAGRAM_MAX;
+      case BM_FRAMING_HUB:
+         /* Messages not numbered can't be told apart from duplicates */
+         return m->origin != 0;
+      default:
+         return 1;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_framing_header(bm_framing_t f,
+                         bm_msg_t m,
+                         uint8_t* hdr) {
+   switch(f->type) {
+      case BM_FRAMING_U16:
+         hdr[0] = m->len >> 8;
+         hdr[1] = m->len;
+         return 2;
+      case BM_FRAMING_U32:
+         bm_framing_u32_write(m->len, hdr);
+         return 4;
+      case BM_FRAMING_VARINT:
+         return bm_framing_varint_write(m->len, hdr);
+      case BM_FRAMING_HUB:
+         bm_framing_u32_write(m->origin, hdr);
+         hdr[4] = m->origin_reactor >> 8;
+         hdr[5] = m->origin_reactor;
+         bm_framing_u32_write(m->seq, hdr + 6);
+         hdr[10] = m->channel;
+         return BM_FRAMING_HUB_META +
+            bm_framing_varint_write(m->len, hdr + BM_FRAMING_HUB_META);
+      default:
+         return 0;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+void bm_framing_header_read(bm_framing_t f,
+                            const uint8_t* frame,
+                            bm_msg_t m) {
+   if(f->type != BM_FRAMING_HUB) return;
+   m->origin = bm_framing_u32_read(frame);
+   m->origin_reactor = ((uint16_t)frame[4] << 8) | frame[5];
+   m->seq = bm_framing_u32_read(frame + 6);
+   m->channel = frame[10];
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_framing_wire_len(bm_framing_t f,
+                           size_t len) {
+   switch(f->type) {
+      case BM_FRAMING_U16:
+         return 2 + len;
+      case BM_FRAMING_U32:
+         return 4 + len;
+      case BM_FRAMING_VARINT:
+         return bm_framing_varint_len(len) + len;
+      case BM_FRAMING_HUB:
+         return BM_FRAMING_HUB_META + bm_framing_varint_len(len) + len;
+      case BM_FRAMING_DELIM:
+         return len + 1;
+      default:
+         return len;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_framing_frame_max(bm_framing_t f) {
+   switch(f->type) {
+      case BM_FRAMING_FIXED:
+         return f->size;
+      case BM_FRAMING_U16:
+         return 2 + (f->max < UINT16_MAX ? f->max : UINT16_MAX);
+      case BM_FRAMING_DATAGRAM:
+         return f->max < BM_FRAMING_DATAGRAM_MAX ? f->max : BM_FRAMING_DATAGRAM_MAX;
+      default:
+         return bm_framing_wire_len(f, f->max);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_framing_decode(bm_framing_t f,
+                          const uint8_t* buf,
+                          size_t avail,
+                          size_t* off,
+                          size_t* len) {
+   switch(f->type) {
+      case BM_FRAMING_FIXED:
+         if(avail < f->size) return 0;
+         *off = 0;
+         *len = f->size;
+         return f->size;
+      case BM_FRAMING_U16:
+         if(avail < 2) return 0;
+         *off = 2;
+         *len = ((size_t)buf[0] << 8) | buf[1];
+         break;
+      case BM_FRAMING_U32:
+         if(avail < 4) return 0;
+         *off = 4;
+         *len = bm_framing_u32_read(buf);
+         break;
+      case BM_FRAMING_VARINT: {
+         ssize_t n = bm_framing_varint_read(buf, avail, len);
+         if(n <= 0) return n;
+         *off = n;
+         break;
+      }
+      case BM_FRAMING_HUB: {
+         if(avail < BM_FRAMING_HUB_META) return 0;
+         ssize_t n = bm_framing_varint_read(buf + BM_FRAMING_HUB_META,
+                                            avail - BM_FRAMING_HUB_META,
+                                            len);
+         if(n <= 0) return n;
+         *off = BM_FRAMING_HUB_META + n;
+         break;
+      }
+      case BM_FRAMING_DELIM: {
+         /* Look no further than the longest payload allowed */
+         size_t span = avail > f->max ? f->max + 1 : avail;
+         const uint8_t* end = (const uint8_t*)memchr(buf, f->delim, span);
+         if(!end) return avail > f->max ? -1 : 0;
+         *off = 0;
+         *len = end - buf;
+         return *len + 1;
+      }
+      case BM_FRAMING_DATAGRAM:
+         *off = 0;
+         *len = avail;
+         return avail;
+   }
+   /* Length-prefixed frames */
+   if(*len > f->max) return -1;
+   if(avail - *off < *len) return 0;
+   return *off + *len;
+}
+
+/****************************************/
+/****************************************/
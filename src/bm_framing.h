@@ -0,0 +1,169 @@
+#ifndef BM_FRAMING_H
+#define BM_FRAMING_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "bm_msg.h"
+
+/*
+ * Maximum length of a varint (64 bits)
+ */
+#define BM_FRAMING_VARINT_MAX 10
+
+/*
+ * Length of the fields that precede the payload length in a hub frame:
+ * origin (32 bits), origin reactor (16 bits), sequence number (32 bits),
+ * channel (8 bits)
+ */
+#define BM_FRAMING_HUB_META 11
+
+/*
+ * Maximum length of a frame header
+ */
+#define BM_FRAMING_HEADER_MAX (BM_FRAMING_HUB_META + BM_FRAMING_VARINT_MAX)
+
+/*
+ * Default maximum payload length of a received frame
+ */
+#define BM_FRAMING_MAX (64 * 1024)
+
+/*
+ * How the messages of a stream are delimited on the wire.
+ * Messages only hold their payload: each stream adds and removes its
+ * own framing, so messages can flow between streams that frame them
+ * differently.
+ */
+enum bm_framing_e {
+   /* Every message is exactly the same size */
+   BM_FRAMING_FIXED = 0,
+   /* Payload preceded by its length, 16-bit big endian */
+   BM_FRAMING_U16,
+   /* Payload preceded by its length, 32-bit big endian */
+   BM_FRAMING_U32,
+   /* Payload preceded by its length, as an unsigned LEB128 varint */
+   BM_FRAMING_VARINT,
+   /* Payload followed by a delimiter byte, which it can't contain */
+   BM_FRAMING_DELIM,
+   /* One message per datagram, for datagram streams only */
+   BM_FRAMING_DATAGRAM,
+   /* Between hubs: payload preceded by its origin, origin reactor,
+    * sequence number, channel (big endian) and length (varint) */
+   BM_FRAMING_HUB
+};
+
+/*
+ * The framing of a stream.
+ */
+struct bm_framing_s {
+   /* The framing type */
+   enum bm_framing_e type;
+   /* With BM_FRAMING_FIXED, the message size, 0 for the dispatcher default */
+   size_t size;
+   /* With BM_FRAMING_DELIM, the delimiter */
+   uint8_t delim;
+   /* Maximum payload length of a received frame */
+   size_t max;
+};
+typedef struct bm_framing_s* bm_framing_t;
+
+/*
+ * Initializes a framing to fixed-size messages of the default size.
+ * @param f The framing.
+ */
+extern void bm_framing_init(bm_framing_t f);
+
+/*
+ * Sets the framing type from its name: fixed, u16, u32, varint,
+ * delim, datagram, or hub.
+ * @param f The framing.
+ * @param name The type name.
+ * @return 1 for success, 0 if the name is unknown.
+ */
+extern int bm_framing_parse_type(bm_framing_t f,
+                                 const char* name);
+
+/*
+ * Parses a delimiter: a single character, an escape (\n, \r, \t, \0),
+ * or a hex byte (0xNN).
+ * @param f The framing.
+ * @param str The delimiter.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_framing_parse_delim(bm_framing_t f,
+                                  const char* str);
+
+/*
+ * Returns whether a message can be sent with a framing.
+ * @param f The framing.
+ * @param m The message.
+ * @return 1 if the message fits the framing, 0 otherwise.
+ */
+extern int bm_framing_accepts(bm_framing_t f,
+                              bm_msg_t m);
+
+/*
+ * Writes the header that precedes the payload of a message.
+ * @param f The framing.
+ * @param m The message.
+ * @param hdr Where the header is written, BM_FRAMING_HEADER_MAX bytes.
+ * @return The header length.
+ */
+extern size_t bm_framing_header(bm_framing_t f,
+                                bm_msg_t m,
+                                uint8_t* hdr);
+
+/*
+ * Copies the message fields carried by the header of a complete frame
+ * (origin, sequence number and channel with hub framing) into a
+ * message. Does nothing for the other framings.
+ * @param f The framing.
+ * @param frame The frame.
+ * @param m The message.
+ */
+extern void bm_framing_header_read(bm_framing_t f,
+                                   const uint8_t* frame,
+                                   bm_msg_t m);
+
+/*
+ * Returns the length of the trailer that follows a payload.
+ * @param f The framing.
+ * @return The trailer length.
+ */
+static inline size_t bm_framing_trailer(bm_framing_t f) {
+   return f->type == BM_FRAMING_DELIM ? 1 : 0;
+}
+
+/*
+ * Returns the length of a framed payload on the wire.
+ * @param f The framing.
+ * @param len The payload length.
+ * @return The frame length.
+ */
+extern size_t bm_framing_wire_len(bm_framing_t f,
+                                  size_t len);
+
+/*
+ * Returns the length of the longest frame that can be received.
+ * @param f The framing.
+ * @return The frame length.
+ */
+extern size_t bm_framing_frame_max(bm_framing_t f);
+
+/*
+ * Looks for a complete frame at the beginning of a buffer.
+ * @param f The framing.
+ * @param buf The buffer.
+ * @param avail The number of bytes in the buffer.
+ * @param off Where the offset of the payload is stored.
+ * @param len Where the payload length is stored.
+ * @return The frame length, 0 if the frame is not complete yet, or -1
+ * if the frame is malformed or exceeds the maximum payload length.
+ */
+extern ssize_t bm_framing_decode(bm_framing_t f,
+                                 const uint8_t* buf,
+                                 size_t avail,
+                                 size_t* off,
+                                 size_t* len);
+
+#endif
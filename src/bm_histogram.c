@@ -0,0 +1,109 @@
+#include "bm_histogram.h"
+
+/*
+ * Values below 2^BM_HISTOGRAM_SUB_BITS get one bucket each. Above,
+ * each power of two [2^e, 2^(e+1)) is split into 2^BM_HISTOGRAM_SUB_BITS
+ * buckets of equal width.
+ */
+
+/****************************************/
+/****************************************/
+
+void bm_histogram_init(bm_histogram_t h) {
+   for(size_t i = 0; i < BM_HISTOGRAM_BUCKETS; ++i)
+      atomic_init(&h->counts[i], 0);
+   atomic_init(&h->sum, 0);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the index of the bucket that counts a value.
+ */
+static size_t bm_histogram_index(uint64_t v) {
+   if(v < (1ULL << BM_HISTOGRAM_SUB_BITS)) return v;
+   if(v >= (1ULL << (BM_HISTOGRAM_MAX_BITS + 1)))
+      return BM_HISTOGRAM_BUCKETS - 1;
+   size_t e = 63 - __builtin_clzll(v);
+   size_t sub = (v >> (e - BM_HISTOGRAM_SUB_BITS)) &
+      ((1ULL << BM_HISTOGRAM_SUB_BITS) - 1);
+   return ((e - BM_HISTOGRAM_SUB_BITS + 1) << BM_HISTOGRAM_SUB_BITS) + sub;
+}
+
+/****************************************/
+/****************************************/
+
+uint64_t bm_histogram_bucket_max(size_t i) {
+   if(i < (1ULL << BM_HISTOGRAM_SUB_BITS)) return i;
+   size_t e = (i >> BM_HISTOGRAM_SUB_BITS) + BM_HISTOGRAM_SUB_BITS - 1;
+   uint64_t sub = i & ((1ULL << BM_HISTOGRAM_SUB_BITS) - 1);
+   uint64_t width = 1ULL << (e - BM_HISTOGRAM_SUB_BITS);
+   return (1ULL << e) + (sub + 1) * width - 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_histogram_record(bm_histogram_t h,
+                         uint64_t v) {
+   atomic_fetch_add_explicit(&h->counts[bm_histogram_index(v)],
+                             1,
+                             memory_order_relaxed);
+   atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_histogram_merge(bm_histogram_t h,
+                        bm_histogram_t o) {
+   for(size_t i = 0; i < BM_HISTOGRAM_BUCKETS; ++i)
+      atomic_fetch_add_explicit(&h->counts[i],
+                                atomic_load_explicit(&o->counts[i],
+                                                     memory_order_relaxed),
+                                memory_order_relaxed);
+   atomic_fetch_add_explicit(&h->sum,
+                             atomic_load_explicit(&o->sum,
+                                                  memory_order_relaxed),
+                             memory_order_relaxed);
+}
+
+/****************************************/
+/****************************************/
+
+uint64_t bm_histogram_count(bm_histogram_t h) {
+   uint64_t n = 0;
+   for(size_t i = 0; i < BM_HISTOGRAM_BUCKETS; ++i)
+      n += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+uint64_t bm_histogram_sum(bm_histogram_t h) {
+   return atomic_load_explicit(&h->sum, memory_order_relaxed);
+}
+
+/****************************************/
+/****************************************/
+
+uint64_t bm_histogram_percentile(bm_histogram_t h,
+                                 double p) {
+   uint64_t total = bm_histogram_count(h);
+   if(total == 0) return 0;
+   /* Rank of the value to find, counting from 1 */
+   uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+   if(rank < 1) rank = 1;
+   if(rank > total) rank = total;
+   uint64_t seen = 0;
+   for(size_t i = 0; i < BM_HISTOGRAM_BUCKETS; ++i) {
+      seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+      if(seen >= rank) return bm_histogram_bucket_max(i);
+   }
+   return bm_histogram_bucket_max(BM_HISTOGRAM_BUCKETS - 1);
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,95 @@
+#ifndef BM_HISTOGRAM_H
+#define BM_HISTOGRAM_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/*
+ * Number of sub-buckets per power of two, as a power of two.
+ * With 4 bits, values are recorded with a precision of about 6%.
+ */
+#define BM_HISTOGRAM_SUB_BITS 4
+
+/*
+ * Largest power of two that can be recorded; larger values are
+ * clamped. Values are meant to be nanoseconds, so 2^40 is about
+ * 18 minutes.
+ */
+#define BM_HISTOGRAM_MAX_BITS 40
+
+/*
+ * Number of buckets of a histogram
+ */
+#define BM_HISTOGRAM_BUCKETS \
+   ((BM_HISTOGRAM_MAX_BITS - BM_HISTOGRAM_SUB_BITS + 2) << BM_HISTOGRAM_SUB_BITS)
+
+/*
+ * A log-linear histogram, in the style of HdrHistogram.
+ * Values are counted in buckets whose width grows with the value, so
+ * the relative error is bounded over the whole range. Recording is a
+ * single relaxed atomic increment, so any number of threads can
+ * record and read concurrently without locks.
+ */
+struct bm_histogram_s {
+   /* The number of values per bucket */
+   atomic_uint_fast64_t counts[BM_HISTOGRAM_BUCKETS];
+   /* The sum of the recorded values */
+   atomic_uint_fast64_t sum;
+};
+typedef struct bm_histogram_s* bm_histogram_t;
+
+/*
+ * Initializes a histogram.
+ * @param h The histogram.
+ */
+extern void bm_histogram_init(bm_histogram_t h);
+
+/*
+ * Records a value.
+ * @param h The histogram.
+ * @param v The value.
+ */
+extern void bm_histogram_record(bm_histogram_t h,
+                                uint64_t v);
+
+/*
+ * Adds the counts of a histogram to another.
+ * @param h The histogram to add to.
+ * @param o The histogram to add.
+ */
+extern void bm_histogram_merge(bm_histogram_t h,
+                               bm_histogram_t o);
+
+/*
+ * Returns the number of recorded values.
+ * @param h The histogram.
+ * @return The number of recorded values.
+ */
+extern uint64_t bm_histogram_count(bm_histogram_t h);
+
+/*
+ * Returns the sum of the recorded values.
+ * @param h The histogram.
+ * @return The sum of the recorded values.
+ */
+extern uint64_t bm_histogram_sum(bm_histogram_t h);
+
+/*
+ * Returns a percentile of the recorded values.
+ * @param h The histogram.
+ * @param p The percentile, between 0 and 100.
+ * @return The upper bound of the bucket the percentile falls in, or 0
+ * if no value was recorded.
+ */
+extern uint64_t bm_histogram_percentile(bm_histogram_t h,
+                                        double p);
+
+/*
+ * Returns the largest value counted by a bucket.
+ * @param i The bucket index.
+ * @return The largest value counted by the bucket.
+ */
+extern uint64_t bm_histogram_bucket_max(size_t i);
+
+#endif
@@ -0,0 +1,362 @@
+#include "bm_log.h"
+#include "bm_queue.h"
+#include "bm_time.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Maximum length of a log line, longer lines are truncated
+ */
+#define BM_LOG_LINE_MAX 240
+
+/*
+ * Number of records in the ring of each thread, must be a power of two
+ */
+#define BM_LOG_RING_SIZE 1024
+
+/*
+ * Default number of records per second each thread can log
+ */
+#define BM_LOG_RATE 10000
+
+/*
+ * How long the background thread sleeps when there is nothing to
+ * write (ns)
+ */
+#define BM_LOG_IDLE_SLEEP 5000000
+
+/*
+ * How often the background thread reports discarded records (ns)
+ */
+#define BM_LOG_REPORT_INTERVAL 1000000000ULL
+
+/*
+ * A log record.
+ */
+struct bm_log_record_s {
+   /* The length of the line */
+   uint32_t len;
+   /* The line, newline included */
+   char line[BM_LOG_LINE_MAX];
+};
+
+/*
+ * The ring of records of a thread.
+ * The thread is the only producer and the background thread is the
+ * only consumer.
+ */
+struct bm_log_ring_s {
+   /* Index of the next record to write out, updated by the consumer */
+   _Alignas(BM_CACHE_LINE) atomic_size_t head;
+   /* Index of the next record to fill, updated by the producer */
+   _Alignas(BM_CACHE_LINE) atomic_size_t tail;
+   /* Rate limiter tokens, only touched by the producer */
+   double tokens;
+   /* When the tokens were last refilled (ns) */
+   uint64_t refill;
+   /* Set to 1 when the thread has exited */
+   atomic_int closed;
+   /* Used to manage the list of rings */
+   struct bm_log_ring_s* next;
+   /* The records */
+   struct bm_log_record_s records[BM_LOG_RING_SIZE];
+};
+typedef struct bm_log_ring_s* bm_log_ring_t;
+
+/*
+ * The logger state
+ */
+static struct {
+   /* The list of rings */
+   bm_log_ring_t rings;
+   /* Protects the list of rings, taken only when a thread logs for
+    * the first time or exits, and by the background thread */
+   pthread_mutex_t mutex;
+   /* The most verbose level logged */
+   atomic_int level;
+   /* Records per second per thread, 0 for no limit */
+   atomic_size_t rate;
+   /* Records discarded because a ring was full */
+   atomic_size_t overflows;
+   /* Records discarded because of the rate limit */
+   atomic_size_t suppressed;
+   /* Set to 1 to make the background thread stop */
+   atomic_int stop;
+   /* Whether the background thread is running */
+   int running;
+   /* The background thread */
+   pthread_t thread;
+   /* Used to release the ring of an exiting thread */
+   pthread_key_t key;
+} bm_log_state = {
+   .rings = NULL,
+   .mutex = PTHREAD_MUTEX_INITIALIZER,
+   .level = BM_LOG_INFO,
+   .rate = BM_LOG_RATE,
+   .overflows = 0,
+   .suppressed = 0,
+   .stop = 0,
+   .running = 0
+};
+
+/*
+ * Starts the background thread once
+ */
+static pthread_once_t bm_log_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The ring of the current thread
+ */
+static __thread bm_log_ring_t bm_log_ring = NULL;
+
+/****************************************/
+/****************************************/
+
+void bm_log_set_level(int level) {
+   atomic_store(&bm_log_state.level, level);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_log_level() {
+   return atomic_load_explicit(&bm_log_state.level, memory_order_relaxed);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_log_parse_level(const char* name) {
+   if(strcasecmp(name, "error") == 0) return BM_LOG_ERROR;
+   if(strcasecmp(name, "warning") == 0) return BM_LOG_WARNING;
+   if(strcasecmp(name, "info") == 0) return BM_LOG_INFO;
+   if(strcasecmp(name, "debug") == 0) return BM_LOG_DEBUG;
+   return -1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_log_set_rate(size_t rate) {
+   atomic_store(&bm_log_state.rate, rate);
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_log_dropped() {
+   return atomic_load(&bm_log_state.overflows) +
+      atomic_load(&bm_log_state.suppressed);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes out the pending records of a ring.
+ * @return The number of records written.
+ */
+static size_t bm_log_ring_drain(bm_log_ring_t r) {
+   size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+   size_t n = tail - head;
+   while(head != tail) {
+      struct bm_log_record_s* rec = &r->records[head & (BM_LOG_RING_SIZE - 1)];
+      fwrite(rec->line, 1, rec->len, stderr);
+      ++head;
+   }
+   atomic_store_explicit(&r->head, head, memory_order_release);
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes out the pending records of all the rings, and releases the
+ * rings of the threads that have exited.
+ * @return The number of records written.
+ */
+static size_t bm_log_drain() {
+   size_t n = 0;
+   pthread_mutex_lock(&bm_log_state.mutex);
+   bm_log_ring_t* prev = &bm_log_state.rings;
+   bm_log_ring_t r;
+   while((r = *prev)) {
+      /* Check for closing first, so no record is left behind */
+      int closed = atomic_load(&r->closed);
+      n += bm_log_ring_drain(r);
+      if(closed) {
+         *prev = r->next;
+         free(r);
+      }
+      else {
+         prev = &r->next;
+      }
+   }
+   pthread_mutex_unlock(&bm_log_state.mutex);
+   if(n > 0) fflush(stderr);
+   return n;
+}
+
+/****************************************/
+/****************************************/
+
+void* bm_log_thread(void* arg) {
+   size_t reported = 0;
+   uint64_t next_report = bm_time_now() + BM_LOG_REPORT_INTERVAL;
+   struct timespec idle = { .tv_sec = 0, .tv_nsec = BM_LOG_IDLE_SLEEP };
+   while(!atomic_load(&bm_log_state.stop)) {
+      if(bm_log_drain() == 0) nanosleep(&idle, NULL);
+      /* Tell how many records were discarded in the meantime */
+      if(bm_time_now() >= next_report) {
+         size_t dropped = bm_log_dropped();
+         if(dropped > reported) {
+            fprintf(stderr,
+                    "Log: %zu lines discarded (%zu ring full, %zu rate limited)\n",
+                    dropped - reported,
+                    atomic_load(&bm_log_state.overflows),
+                    atomic_load(&bm_log_state.suppressed));
+            reported = dropped;
+         }
+         next_report = bm_time_now() + BM_LOG_REPORT_INTERVAL;
+      }
+   }
+   bm_log_drain();
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Marks the ring of an exiting thread as closed; the background
+ * thread releases it once drained.
+ */
+static void bm_log_ring_close(void* arg) {
+   bm_log_ring_t r = (bm_log_ring_t)arg;
+   atomic_store(&r->closed, 1);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Stops the background thread at exit, writing the last records.
+ */
+static void bm_log_stop() {
+   if(!bm_log_state.running) return;
+   atomic_store(&bm_log_state.stop, 1);
+   pthread_join(bm_log_state.thread, NULL);
+   bm_log_state.running = 0;
+}
+
+/****************************************/
+/****************************************/
+
+static void bm_log_start() {
+   pthread_key_create(&bm_log_state.key, bm_log_ring_close);
+   if(pthread_create(&bm_log_state.thread, NULL, &bm_log_thread, NULL) != 0) {
+      fprintf(stderr, "Can't create logging thread, logging is disabled\n");
+      return;
+   }
+   bm_log_state.running = 1;
+   atexit(bm_log_stop);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the ring of the current thread, creating it if needed.
+ */
+static bm_log_ring_t bm_log_ring_get() {
+   if(bm_log_ring) return bm_log_ring;
+   pthread_once(&bm_log_once, bm_log_start);
+   if(!bm_log_state.running) return NULL;
+   bm_log_ring_t r = (bm_log_ring_t)aligned_alloc(BM_CACHE_LINE,
+                                                  sizeof(struct bm_log_ring_s));
+   atomic_init(&r->head, 0);
+   atomic_init(&r->tail, 0);
+   r->tokens = atomic_load(&bm_log_state.rate);
+   r->refill = bm_time_now();
+   atomic_init(&r->closed, 0);
+   pthread_mutex_lock(&bm_log_state.mutex);
+   r->next = bm_log_state.rings;
+   bm_log_state.rings = r;
+   pthread_mutex_unlock(&bm_log_state.mutex);
+   pthread_setspecific(bm_log_state.key, r);
+   bm_log_ring = r;
+   return r;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_logv(int level,
+             const char* fmt,
+             va_list args) {
+   bm_log_ring_t r = bm_log_ring_get();
+   if(!r) {
+      /* No background thread, write right away */
+      vfprintf(stderr, fmt, args);
+      fputc('\n', stderr);
+      return;
+   }
+   /* Apply the rate limit, errors always get through */
+   size_t rate = atomic_load_explicit(&bm_log_state.rate, memory_order_relaxed);
+   if(rate > 0 && level > BM_LOG_ERROR) {
+      uint64_t now = bm_time_now();
+      r->tokens += (now - r->refill) * 1e-9 * rate;
+      if(r->tokens > rate) r->tokens = rate;
+      r->refill = now;
+      if(r->tokens < 1) {
+         atomic_fetch_add_explicit(&bm_log_state.suppressed, 1, memory_order_relaxed);
+         return;
+      }
+      r->tokens -= 1;
+   }
+   /* Make sure there is room */
+   size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+   if(tail - atomic_load_explicit(&r->head, memory_order_acquire) >= BM_LOG_RING_SIZE) {
+      atomic_fetch_add_explicit(&bm_log_state.overflows, 1, memory_order_relaxed);
+      return;
+   }
+   /* Fill the record */
+   struct bm_log_record_s* rec = &r->records[tail & (BM_LOG_RING_SIZE - 1)];
+   int len = vsnprintf(rec->line, BM_LOG_LINE_MAX, fmt, args);
+   if(len < 0) len = 0;
+   if(len > BM_LOG_LINE_MAX - 2) len = BM_LOG_LINE_MAX - 2;
+   rec->line[len] = '\n';
+   rec->len = len + 1;
+   atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_log(int level,
+            const char* fmt, ...) {
+   if(level > bm_log_level()) return;
+   va_list al;
+   va_start(al, fmt);
+   bm_logv(level, fmt, al);
+   va_end(al);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_log_flush() {
+   if(!bm_log_state.running) return;
+   bm_log_drain();
+}
+
+/****************************************/
+/****************************************/
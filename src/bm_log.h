@@ -0,0 +1,86 @@
+#ifndef BM_LOG_H
+#define BM_LOG_H
+
+#include <stdlib.h>
+#include <stdarg.h>
+
+/*
+ * Log levels, from the most to the least important.
+ */
+enum bm_log_level_e {
+   BM_LOG_ERROR = 0,
+   BM_LOG_WARNING,
+   BM_LOG_INFO,
+   BM_LOG_DEBUG
+};
+
+/*
+ * Asynchronous logging.
+ * Each thread formats its log lines into fixed-size records and
+ * pushes them into its own lock-free ring; a background thread
+ * writes them to the standard error. A thread never blocks on
+ * logging: when its ring is full, or when it exceeds its rate limit,
+ * the record is discarded and counted.
+ * The background thread is started by the first log call and
+ * stopped when the program exits.
+ */
+
+/*
+ * Sets the most verbose level that is logged (default: BM_LOG_INFO).
+ * @param level The level.
+ */
+extern void bm_log_set_level(int level);
+
+/*
+ * Returns the most verbose level that is logged.
+ * @return The level.
+ */
+extern int bm_log_level();
+
+/*
+ * Parses a level name: error, warning, info, or debug.
+ * @param name The level name.
+ * @return The level, or -1 if the name is unknown.
+ */
+extern int bm_log_parse_level(const char* name);
+
+/*
+ * Sets how many records per second each thread can log, 0 for no
+ * limit (default: 10000). Errors are not limited.
+ * @param rate The number of records per second.
+ */
+extern void bm_log_set_rate(size_t rate);
+
+/*
+ * Logs a line, if the level is enabled.
+ * This function works like printf(); the newline is added.
+ * @param level The level of the line.
+ * @param fmt The format of the line.
+ */
+extern void bm_log(int level,
+                   const char* fmt, ...)
+   __attribute__((format(printf, 2, 3)));
+
+/*
+ * Logs a line regardless of the level.
+ * @param level The level of the line.
+ * @param fmt The format of the line.
+ * @param args The arguments.
+ */
+extern void bm_logv(int level,
+                    const char* fmt,
+                    va_list args);
+
+/*
+ * Returns the number of records discarded so far because a ring was
+ * full or a thread exceeded its rate.
+ * @return The number of discarded records.
+ */
+extern size_t bm_log_dropped();
+
+/*
+ * Waits until all the records logged so far have been written.
+ */
+extern void bm_log_flush();
+
+#endif
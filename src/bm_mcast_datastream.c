@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "bm_mcast_datastream.h"
+#include "bm_debug.h"
+
+/*
+ * Maximum number of datagrams sent or received per system call
+ */
+#define BM_MCAST_DATASTREAM_BATCH 64
+
+/****************************************/
+/****************************************/
+
+void bm_mcast_datastream_destroy(void* ds);
+int bm_mcast_datastream_connect(void* ds);
+void bm_mcast_datastream_disconnect(void* ds);
+ssize_t bm_mcast_datastream_send(void* ds, const uint8_t* data, size_t sz);
+ssize_t bm_mcast_datastream_recv(void* ds, uint8_t* data, size_t sz);
+int bm_mcast_datastream_fd(void* ds);
+ssize_t bm_mcast_datastream_sendv(void* ds, bm_msg_t* msgs, size_t n, size_t off);
+ssize_t bm_mcast_datastream_recvv(void* ds, bm_msg_t* msgs, size_t n);
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses an option of multicast streams.
+ * @param ds The stream.
+ * @param name The name of the option.
+ * @param val The value of the option, or NULL.
+ * @return 1 if the option was parsed, 0 if it is not a multicast
+ * option, -1 if its value is wrong.
+ */
+static int bm_mcast_datastream_parse_option(bm_mcast_datastream_t ds,
+                                            const char* name,
+                                            const char* val) {
+   char* endptr;
+   if(strcmp(name, "ttl") == 0 && val) {
+      unsigned long ttl = strtoul(val, &endptr, 10);
+      if(endptr == val || *endptr != '\0' || ttl > 255) return -1;
+      ds->ttl = ttl;
+      return 1;
+   }
+   if(strcmp(name, "loop") == 0 && val) {
+      if(strcmp(val, "0") != 0 && strcmp(val, "1") != 0) return -1;
+      ds->loop = *val == '1';
+      return 1;
+   }
+   if(strcmp(name, "iface") == 0 && val) {
+      /* An address, or else the name of an interface */
+      if(inet_pton(AF_INET, val, &ds->iface.imr_address) == 1)
+         return 1;
+      ds->iface.imr_ifindex = if_nametoindex(val);
+      return ds->iface.imr_ifindex > 0 ? 1 : -1;
+   }
+   return 0;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_mcast_datastream_parse(bm_mcast_datastream_t ds,
+                              const char* desc) {
+   /* Duplicate string for strtok_r */
+   char* wdesc = strdup(desc);
+   /* Buffer pointer for strtok_r */
+   char* saveptr = NULL;
+   /* Get id (and discard it) */
+   char* tok = strtok_r(wdesc, ":", &saveptr);
+   /* Get protocol (and discard it) */
+   tok = strtok_r(NULL, ":", &saveptr);
+   /* Get verbosity (and discard it) */
+   tok = strtok_r(NULL, ":", &saveptr);
+   /* Get group */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(!tok) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Can't parse group in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
+   ds->group = strdup(tok);
+   /* Get port */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(!tok) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Can't parse port in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
+   ds->port = strdup(tok);
+   /* Get options: keep the multicast ones, pass the rest on */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(tok) {
+      char* rest = (char*)calloc(strlen(tok) + 1, 1);
+      char* osaveptr = NULL;
+      for(char* opt = strtok_r(tok, ",", &osaveptr);
+          opt != NULL;
+          opt = strtok_r(NULL, ",", &osaveptr)) {
+         char* val = strchr(opt, '=');
+         if(val) *val = '\0';
+         int ret = bm_mcast_datastream_parse_option(ds, opt, val ? val + 1 : NULL);
+         if(ret < 0) {
+            bm_datastream_set_status(ds,
+                                     BM_DATASTREAM_ERROR,
+                                     "Can't parse %s '%s' in '%s'",
+                                     opt, val + 1, desc);
+            free(rest);
+            free(wdesc);
+            return 0;
+         }
+         if(ret == 0) {
+            if(val) *val = '=';
+            if(*rest) strcat(rest, ",");
+            strcat(rest, opt);
+         }
+      }
+      int ok = !*rest || bm_datastream_parse_options(&ds->parent, rest);
+      free(rest);
+      if(!ok) {
+         free(wdesc);
+         return 0;
+      }
+   }
+   /* Datagrams delimit the messages by themselves */
+   if(ds->parent.framing.type != BM_FRAMING_FIXED &&
+      ds->parent.framing.type != BM_FRAMING_DATAGRAM) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Only fixed and datagram framing are supported in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
+   /* Cleanup */
+   free(wdesc);
+   /* Get the address of the group */
+   struct addrinfo hints, *groupinfo;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;      /* Only IPv4 is accepted */
+   hints.ai_socktype = SOCK_DGRAM; /* UDP socket */
+   hints.ai_flags = AI_NUMERICHOST;
+   int retval = getaddrinfo(ds->group, ds->port, &hints, &groupinfo);
+   if(retval != 0) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "%s: Error getting address information: %s",
+                               desc,
+                               gai_strerror(retval));
+      return 0;
+   }
+   memcpy(&ds->sock, groupinfo->ai_addr, sizeof(ds->sock));
+   freeaddrinfo(groupinfo);
+   if(!IN_MULTICAST(ntohl(ds->sock.sin_addr.s_addr))) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "'%s' is not a multicast group in '%s'",
+                               ds->group, desc);
+      return 0;
+   }
+   /* All is OK */
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_mcast_datastream_destroy(void* ds) {
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   bm_datastream_destroy(&this->parent);
+   free(this->group);
+   free(this->port);
+   free(this);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_mcast_datastream_connect(void* ds) {
+   /* Cast datastream to this type */
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   /* Disconnect if the stream is already connected */
+   if(this->stream != -1)
+      bm_mcast_datastream_disconnect(this);
+   /* Join the group; binding the group address rather than any address
+    * keeps out the datagrams of the other groups on the same port */
+   int on = 1;
+   struct ip_mreqn mreq = this->iface;
+   mreq.imr_multiaddr = this->sock.sin_addr;
+   this->stream = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+   if(this->stream < 0 ||
+      setsockopt(this->stream, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      bind(this->stream, (struct sockaddr*)&this->sock, sizeof(this->sock)) < 0 ||
+      setsockopt(this->stream, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      int errnum = errno;
+      bm_mcast_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't join group %s: %s",
+                               this->group,
+                               strerror(errnum));
+      return 0;
+   }
+   /* Send from a socket of its own, whose address tells the datagrams
+    * of this stream apart from those of the other hosts and of the other
+    * streams of this host; the reactor only polls the receiving socket,
+    * so this one must never block */
+   socklen_t len = sizeof(this->self);
+   this->out = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+   if(this->out < 0 ||
+      setsockopt(this->out, IPPROTO_IP, IP_MULTICAST_TTL, &this->ttl, sizeof(this->ttl)) < 0 ||
+      setsockopt(this->out, IPPROTO_IP, IP_MULTICAST_LOOP, &this->loop, sizeof(this->loop)) < 0 ||
+      setsockopt(this->out, IPPROTO_IP, IP_MULTICAST_IF, &this->iface, sizeof(this->iface)) < 0 ||
+      connect(this->out, (struct sockaddr*)&this->sock, sizeof(this->sock)) < 0 ||
+      getsockname(this->out, (struct sockaddr*)&this->self, &len) < 0) {
+      int errnum = errno;
+      bm_mcast_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't send to group %s: %s",
+                               this->group,
+                               strerror(errnum));
+      return 0;
+   }
+   /* The values in effect reported are those of the receiving socket */
+   bm_datastream_tune(this, this->out);
+   bm_datastream_tune(this, this->stream);
+   bm_datastream_set_status(ds, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_mcast_datastream_disconnect(void* ds) {
+   /* Cast datastream to this type */
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   /* Closing the socket leaves the group */
+   if(this->stream != -1) {
+      close(this->stream);
+      this->stream = -1;
+   }
+   if(this->out != -1) {
+      close(this->out);
+      this->out = -1;
+   }
+   bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns whether a datagram was sent by this stream.
+ */
+static int bm_mcast_datastream_own(bm_mcast_datastream_t this,
+                                   const struct sockaddr_in* addr) {
+   return addr->sin_port == this->self.sin_port &&
+      addr->sin_addr.s_addr == this->self.sin_addr.s_addr;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_mcast_datastream_send(void* ds,
+                                 const uint8_t* data,
+                                 size_t sz) {
+   /* Cast datastream to this type */
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Send the datagram */
+   bm_debug(ds, "send: sending %zu bytes", sz);
+   ssize_t sent = send(this->out, data, sz, MSG_DONTWAIT);
+   bm_debug(ds, "send: sent %zd bytes", sent);
+   if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* The owner reactor takes care of closing the socket */
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error sending data: %s",
+                               strerror(errno));
+   }
+   return sent;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_mcast_datastream_recv(void* ds,
+                                 uint8_t* data,
+                                 size_t sz) {
+   /* Cast datastream to this type */
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Get one datagram, skipping the stream's own */
+   struct sockaddr_in addr;
+   socklen_t addrlen;
+   ssize_t received;
+   do {
+      addrlen = sizeof(addr);
+      bm_debug(ds, "recv: waiting for %zu bytes", sz);
+      received = recvfrom(this->stream, data, sz, MSG_DONTWAIT, (struct sockaddr*)&addr, &addrlen);
+      bm_debug(ds, "recv: received %zd bytes", received);
+   } while(received >= 0 && bm_mcast_datastream_own(this, &addr));
+   if(received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      int errnum = errno;
+      bm_mcast_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error receiving data: %s",
+                               strerror(errnum));
+      errno = errnum;
+   }
+   return received;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_mcast_datastream_fd(void* ds) {
+   return ((bm_mcast_datastream_t)ds)->stream;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_mcast_datastream_sendv(void* ds,
+                                  bm_msg_t* msgs,
+                                  size_t n,
+                                  size_t off) {
+   /* Cast datastream to this type */
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Prepare one header per datagram; the socket is connected to the
+    * group */
+   if(n > BM_MCAST_DATASTREAM_BATCH) n = BM_MCAST_DATASTREAM_BATCH;
+   struct mmsghdr hdrs[BM_MCAST_DATASTREAM_BATCH];
+   struct iovec iovs[BM_MCAST_DATASTREAM_BATCH];
+   memset(hdrs, 0, n * sizeof(struct mmsghdr));
+   for(size_t i = 0; i < n; ++i) {
+      /* Datagrams are never sent partially, so off is always 0 */
+      iovs[i].iov_base = msgs[i]->data;
+      iovs[i].iov_len = msgs[i]->len;
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+   /* One datagram per message, for all the members of the group */
+   bm_debug(ds, "sendv: sending %zu datagrams", n);
+   int sent = sendmmsg(this->out, hdrs, n, MSG_DONTWAIT);
+   bm_debug(ds, "sendv: sent %d datagrams", sent);
+   if(sent < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+         /* The owner reactor takes care of closing the socket */
+         bm_datastream_set_status(this,
+                                  BM_DATASTREAM_ERROR,
+                                  "Error sending data: %s",
+                                  strerror(errno));
+         return -1;
+      }
+      /* The sending socket is not polled, so rather than wait for room,
+       * drop the datagrams as a congested network would */
+      bm_debug(ds, "sendv: dropped %zu datagrams", n);
+      atomic_fetch_add_explicit(&this->parent.dropped, n, memory_order_relaxed);
+      sent = n;
+   }
+   ssize_t tot = 0;
+   for(int i = 0; i < sent; ++i)
+      tot += msgs[i]->len;
+   return tot;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_mcast_datastream_recvv(void* ds,
+                                  bm_msg_t* msgs,
+                                  size_t n) {
+   /* Cast datastream to this type */
+   bm_mcast_datastream_t this = (bm_mcast_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Prepare one header and one buffer per datagram */
+   bm_framing_t f = &this->parent.framing;
+   size_t sz = bm_framing_frame_max(f);
+   if(n > BM_MCAST_DATASTREAM_BATCH) n = BM_MCAST_DATASTREAM_BATCH;
+   uint8_t* buf = bm_datastream_scratch(ds, n, sz);
+   if(!buf) {
+      bm_mcast_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't allocate receive buffers");
+      errno = ENOMEM;
+      return -1;
+   }
+   struct mmsghdr hdrs[BM_MCAST_DATASTREAM_BATCH];
+   struct iovec iovs[BM_MCAST_DATASTREAM_BATCH];
+   struct sockaddr_in addrs[BM_MCAST_DATASTREAM_BATCH];
+   memset(hdrs, 0, n * sizeof(struct mmsghdr));
+   for(size_t i = 0; i < n; ++i) {
+      iovs[i].iov_base = buf + i * sz;
+      iovs[i].iov_len = sz;
+      hdrs[i].msg_hdr.msg_name = &addrs[i];
+      hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+   /* Get as many datagrams as are available */
+   bm_debug(ds, "recvv: waiting for %zu datagrams", n);
+   int received = recvmmsg(this->stream, hdrs, n, MSG_DONTWAIT, NULL);
+   bm_debug(ds, "recvv: received %d datagrams", received);
+   if(received < 0) {
+      int errnum = errno;
+      if(errnum != EAGAIN && errnum != EWOULDBLOCK) {
+         bm_mcast_datastream_disconnect(this);
+         bm_datastream_set_status(this,
+                                  BM_DATASTREAM_ERROR,
+                                  "Error receiving data: %s",
+                                  strerror(errnum));
+      }
+      errno = errnum;
+      return -1;
+   }
+   /* Copy the datagrams of the right size from the other senders into
+    * messages of their size */
+   ssize_t num = 0;
+   for(int i = 0; i < received; ++i) {
+      if(bm_mcast_datastream_own(this, &addrs[i])) continue;
+      if((f->type != BM_FRAMING_DATAGRAM && hdrs[i].msg_len != sz) ||
+         (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+         bm_debug(ds, "recvv: discarded datagram of %u bytes",
+                  hdrs[i].msg_len);
+         continue;
+      }
+      msgs[num] = bm_datastream_msg_new(ds, hdrs[i].msg_len);
+      memcpy(msgs[num]->data, iovs[i].iov_base, hdrs[i].msg_len);
+      ++num;
+   }
+   /* Own datagrams or wrong sizes only; nothing to report yet */
+   if(num == 0) errno = EAGAIN;
+   return num > 0 ? num : -1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_mcast_datastream_t bm_mcast_datastream_new(const char* desc) {
+   /* Allocate memory */
+   bm_mcast_datastream_t this = malloc(sizeof(struct bm_mcast_datastream_s));
+   this->stream = -1;
+   this->out = -1;
+   this->group = NULL;
+   this->port = NULL;
+   memset(&this->sock, 0, sizeof(this->sock));
+   memset(&this->self, 0, sizeof(this->self));
+   memset(&this->iface, 0, sizeof(this->iface));
+   this->ttl = 1;
+   this->loop = 0;
+   /* Initialize parent */
+   bm_datastream_init(&this->parent,
+                      desc,
+                      bm_mcast_datastream_destroy,
+                      bm_mcast_datastream_connect,
+                      bm_mcast_datastream_disconnect,
+                      bm_mcast_datastream_send,
+                      bm_mcast_datastream_recv,
+                      bm_mcast_datastream_fd);
+   if(this->parent.status == BM_DATASTREAM_ERROR) {
+      bm_mcast_datastream_destroy(this);
+      return NULL;
+   }
+   /* Use batched datagram I/O */
+   this->parent.sendv = bm_mcast_datastream_sendv;
+   this->parent.recvv = bm_mcast_datastream_recvv;
+   /* Set local attributes */
+   if(!bm_mcast_datastream_parse(this, desc)) {
+      fprintf(stderr, "%s\n", this->parent.status_desc);
+      bm_mcast_datastream_destroy(this);
+      return NULL;
+   }
+   /* All done */
+   return this;
+}
+
+/****************************************/
+/****************************************/
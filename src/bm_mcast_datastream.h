@@ -0,0 +1,58 @@
+#ifndef BM_MCAST_DATASTREAM_H
+#define BM_MCAST_DATASTREAM_H
+
+#include "bm_datastream.h"
+#include <arpa/inet.h>
+
+/*
+ * The string for mcast is:
+ * mcast:group:port[:options]
+ *
+ * A multicast stream joins an IPv4 multicast group and sends each
+ * message once, as a datagram to the group, for all the hosts that
+ * joined it; the messages received on the group are relayed like
+ * those of any other stream. Besides the stream options, it accepts:
+ *
+ * ttl=N      The time-to-live of the datagrams sent (default: 1, the
+ *            local network only)
+ * iface=I    The interface to join the group on and send from, by
+ *            address or by name (default: chosen by the routing table)
+ * loop=0|1   Whether the datagrams sent are also delivered to the
+ *            sockets of this host that joined the group (default: 0)
+ *
+ * The stream never receives its own datagrams back, even with loop=1.
+ */
+
+struct bm_mcast_datastream_s {
+   /* Generic datastream definition */
+   struct bm_datastream_s parent;
+   /* The socket that joined the group, which receives */
+   int stream;
+   /* The socket that sends to the group */
+   int out;
+   /* Group */
+   char* group;
+   /* Port */
+   char* port;
+   /* The address of the group */
+   struct sockaddr_in sock;
+   /* The address the datagrams are sent from, to tell them apart when
+    * they come back */
+   struct sockaddr_in self;
+   /* The interface, by address or index (both 0 for the default) */
+   struct ip_mreqn iface;
+   /* Time-to-live of the datagrams sent */
+   int ttl;
+   /* Whether the datagrams sent loop back to this host */
+   int loop;
+};
+typedef struct bm_mcast_datastream_s* bm_mcast_datastream_t;
+
+/*
+ * Creates a new multicast datastream.
+ * @param desc The stream descriptor.
+ * @return The new multicast datastream.
+ */
+extern bm_mcast_datastream_t bm_mcast_datastream_new(const char* desc);
+
+#endif
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include "bm_metrics.h"
+#include "bm_dispatcher.h"
+#include "bm_log.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * How often the endpoint thread checks whether it must stop (ms)
+ */
+#define BM_METRICS_POLL_INTERVAL 200
+
+/*
+ * Maximum size of an HTTP request
+ */
+#define BM_METRICS_REQUEST_MAX 4096
+
+/*
+ * The latency histograms are reported with one bucket per power of two
+ * of nanoseconds between these two, i.e. from 1us to about 17s.
+ */
+#define BM_METRICS_LATENCY_MIN_BITS 10
+#define BM_METRICS_LATENCY_MAX_BITS 34
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes a label value, escaped as the Prometheus text format wants.
+ */
+static void bm_metrics_label(FILE* out,
+                             const char* v) {
+   for(; *v; ++v) {
+      if(*v == '\\' || *v == '"') fputc('\\', out);
+      if(*v == '\n') fputs("\\n", out);
+      else fputc(*v, out);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes the help and type lines of a metric.
+ */
+static void bm_metrics_header(FILE* out,
+                              const char* name,
+                              const char* type,
+                              const char* help) {
+   fprintf(out, "# HELP %s %s\n", name, help);
+   fprintf(out, "# TYPE %s %s\n", name, type);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes one sample of a metric for each stream.
+ * The value is taken at the given offset in the stream structure.
+ */
+static void bm_metrics_counter(FILE* out,
+                               bm_dispatcher_t d,
+                               const char* name,
+                               const char* help,
+                               size_t offset) {
+   bm_metrics_header(out, name, "counter", help);
+   bm_streamset_t set = bm_dispatcher_streams(d);
+   for(size_t i = 0; i < set->num; ++i) {
+      bm_datastream_t s = set->streams[i];
+      atomic_uint_fast64_t* v = (atomic_uint_fast64_t*)((char*)s + offset);
+      fprintf(out, "%s{stream=\"", name);
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\"} %" PRIu64 "\n",
+              (uint64_t)atomic_load_explicit(v, memory_order_relaxed));
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes a latency histogram of a stream.
+ */
+static void bm_metrics_latency(FILE* out,
+                               bm_datastream_t s,
+                               const char* name,
+                               bm_histogram_t h) {
+   uint64_t n = 0;
+   for(size_t i = 0; i < BM_HISTOGRAM_BUCKETS; ++i) {
+      n += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+      /* Report only the buckets ending on a power of two */
+      if((i + 1) % (1 << BM_HISTOGRAM_SUB_BITS) != 0) continue;
+      uint64_t le = bm_histogram_bucket_max(i) + 1;
+      if(le < (1ULL << BM_METRICS_LATENCY_MIN_BITS) ||
+         le > (1ULL << BM_METRICS_LATENCY_MAX_BITS)) continue;
+      fprintf(out, "%s_bucket{stream=\"", name);
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\",le=\"%g\"} %" PRIu64 "\n", le / 1e9, n);
+   }
+   fprintf(out, "%s_bucket{stream=\"", name);
+   bm_metrics_label(out, s->id);
+   fprintf(out, "\",le=\"+Inf\"} %" PRIu64 "\n", n);
+   fprintf(out, "%s_sum{stream=\"", name);
+   bm_metrics_label(out, s->id);
+   fprintf(out, "\"} %.9f\n", bm_histogram_sum(h) / 1e9);
+   fprintf(out, "%s_count{stream=\"", name);
+   bm_metrics_label(out, s->id);
+   fprintf(out, "\"} %" PRIu64 "\n", n);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_metrics_write(struct bm_dispatcher_s* d,
+                      FILE* out) {
+   bm_streamset_t set = bm_dispatcher_streams(d);
+   bm_datastream_t s;
+   size_t i;
+   /* Global metrics */
+   bm_metrics_header(out, "blabbermouth_streams_active", "gauge",
+                     "Number of streams being polled.");
+   fprintf(out, "blabbermouth_streams_active %zu\n",
+           atomic_load(&d->active_streams));
+   bm_metrics_header(out, "blabbermouth_streams_generation", "gauge",
+                     "Number of times the table of streams was replaced.");
+   fprintf(out, "blabbermouth_streams_generation %" PRIu64 "\n", set->gen);
+   bm_metrics_header(out, "blabbermouth_log_dropped_total", "counter",
+                     "Log lines discarded because a thread logged too fast.");
+   fprintf(out, "blabbermouth_log_dropped_total %zu\n", bm_log_dropped());
+   /* Stream state */
+   bm_metrics_header(out, "blabbermouth_stream_up", "gauge",
+                     "Whether the stream is connected.");
+   for(i = 0; i < set->num; ++i) {
+      s = set->streams[i];
+      fprintf(out, "blabbermouth_stream_up{stream=\"");
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\"} %d\n", s->status == BM_DATASTREAM_READY);
+   }
+   /* Traffic */
+   bm_metrics_counter(out, d, "blabbermouth_received_messages_total",
+                      "Messages received from the stream.",
+                      offsetof(struct bm_datastream_s, msgs_in));
+   bm_metrics_counter(out, d, "blabbermouth_received_bytes_total",
+                      "Bytes received from the stream.",
+                      offsetof(struct bm_datastream_s, bytes_in));
+   bm_metrics_counter(out, d, "blabbermouth_sent_messages_total",
+                      "Messages sent on the stream.",
+                      offsetof(struct bm_datastream_s, msgs_out));
+   bm_metrics_counter(out, d, "blabbermouth_sent_bytes_total",
+                      "Bytes sent on the stream.",
+                      offsetof(struct bm_datastream_s, bytes_out));
+   bm_metrics_counter(out, d, "blabbermouth_send_errors_total",
+                      "Failed send calls on the stream.",
+                      offsetof(struct bm_datastream_s, send_errors));
+   bm_metrics_counter(out, d, "blabbermouth_reconnects_total",
+                      "Times the stream was reconnected.",
+                      offsetof(struct bm_datastream_s, reconnects));
+   bm_metrics_counter(out, d, "blabbermouth_duplicate_messages_total",
+                      "Messages from other hubs discarded as already seen.",
+                      offsetof(struct bm_datastream_s, duplicates));
+   /* Queues */
+   bm_metrics_header(out, "blabbermouth_dropped_messages_total", "counter",
+                     "Messages discarded because the stream queue was full.");
+   for(i = 0; i < set->num; ++i) {
+      s = set->streams[i];
+      fprintf(out, "blabbermouth_dropped_messages_total{stream=\"");
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\"} %zu\n", atomic_load(&s->dropped));
+   }
+   bm_metrics_header(out, "blabbermouth_conflated_messages_total", "counter",
+                     "Queued messages replaced by a newer one with the same key.");
+   for(i = 0; i < set->num; ++i) {
+      s = set->streams[i];
+      fprintf(out, "blabbermouth_conflated_messages_total{stream=\"");
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\"} %zu\n", atomic_load(&s->conflated));
+   }
+   bm_metrics_header(out, "blabbermouth_queue_messages", "gauge",
+                     "Messages waiting to be sent on the stream.");
+   for(i = 0; i < set->num; ++i) {
+      s = set->streams[i];
+      fprintf(out, "blabbermouth_queue_messages{stream=\"");
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\"} %zu\n", s->outq ? bm_queue_size(s->outq) : 0);
+   }
+   bm_metrics_header(out, "blabbermouth_queue_bytes", "gauge",
+                     "Bytes waiting to be sent on the stream.");
+   for(i = 0; i < set->num; ++i) {
+      s = set->streams[i];
+      fprintf(out, "blabbermouth_queue_bytes{stream=\"");
+      bm_metrics_label(out, s->id);
+      fprintf(out, "\"} %zu\n", atomic_load(&s->queue_bytes));
+   }
+   /* Socket tuning */
+   bm_metrics_header(out, "blabbermouth_socket_option", "gauge",
+                     "Socket options in effect: buffer sizes in bytes, busypoll in us, "
+                     "usertimeout in ms, keepidle and keepintvl in s.");
+   for(i = 0; i < set->num; ++i) {
+      s = set->streams[i];
+      for(int o = 0; o < BM_SOCKOPT_NUM; ++o) {
+         if(s->sockopt_eff.v[o] < 0) continue;
+         fprintf(out, "blabbermouth_socket_option{stream=\"");
+         bm_metrics_label(out, s->id);
+         fprintf(out, "\",option=\"%s\"} %d\n",
+                 bm_sockopt_name(o),
+                 s->sockopt_eff.v[o]);
+      }
+   }
+   /* Latency */
+   bm_metrics_header(out, "blabbermouth_latency_seconds", "histogram",
+                     "Time from the reception of a message to its sending on the stream.");
+   for(i = 0; i < set->num; ++i)
+      bm_metrics_latency(out, set->streams[i],
+                         "blabbermouth_latency_seconds",
+                         &set->streams[i]->latency);
+   bm_metrics_header(out, "blabbermouth_connect_seconds", "histogram",
+                     "Time to connect the stream.");
+   for(i = 0; i < set->num; ++i)
+      bm_metrics_latency(out, set->streams[i],
+                         "blabbermouth_connect_seconds",
+                         &set->streams[i]->connect_latency);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Writes a buffer to a socket.
+ */
+static int bm_metrics_send(int fd,
+                           const char* buf,
+                           size_t len) {
+   ssize_t n;
+   while(len > 0) {
+      n = send(fd, buf, len, MSG_NOSIGNAL);
+      if(n < 0) {
+         if(errno == EINTR) continue;
+         return 0;
+      }
+      buf += n;
+      len -= n;
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Serves a request on a connected socket.
+ */
+static void bm_metrics_serve(bm_metrics_t m,
+                             int fd) {
+   /* Don't let a client stall the endpoint */
+   struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+   /* Read the request header */
+   char req[BM_METRICS_REQUEST_MAX];
+   size_t len = 0;
+   ssize_t n;
+   req[0] = '\0';
+   while(len < sizeof(req) - 1 && !strstr(req, "\r\n\r\n")) {
+      n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+      if(n <= 0) return;
+      len += n;
+      req[len] = '\0';
+   }
+   /* Only GET /metrics (or /) is served */
+   char* body = NULL;
+   size_t bodylen = 0;
+   const char* status = "200 OK";
+   FILE* out = open_memstream(&body, &bodylen);
+   if(strncmp(req, "GET ", 4) != 0) {
+      status = "405 Method Not Allowed";
+      fprintf(out, "Method not allowed\n");
+   }
+   else if(strncmp(req + 4, "/metrics ", 9) != 0 &&
+           strncmp(req + 4, "/ ", 2) != 0) {
+      status = "404 Not Found";
+      fprintf(out, "Not found\n");
+   }
+   else {
+      /* The streams are not released while being reported */
+      bm_epoch_enter(&m->dispatcher->epoch, m->dispatcher->reactor_num);
+      bm_metrics_write(m->dispatcher, out);
+      bm_epoch_leave(&m->dispatcher->epoch, m->dispatcher->reactor_num);
+   }
+   fclose(out);
+   /* Send the response */
+   char* head;
+   int headlen = asprintf(&head,
+                          "HTTP/1.0 %s\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n",
+                          status,
+                          bodylen);
+   if(headlen > 0 && bm_metrics_send(fd, head, headlen))
+      bm_metrics_send(fd, body, bodylen);
+   free(head);
+   free(body);
+}
+
+/****************************************/
+/****************************************/
+
+void* bm_metrics_thread(void* arg) {
+   bm_metrics_t m = (bm_metrics_t)arg;
+   struct pollfd pfd = { .fd = m->fd, .events = POLLIN };
+   while(!atomic_load(&m->stop)) {
+      if(poll(&pfd, 1, BM_METRICS_POLL_INTERVAL) <= 0) continue;
+      int fd = accept(m->fd, NULL, NULL);
+      if(fd < 0) continue;
+      bm_metrics_serve(m, fd);
+      close(fd);
+   }
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Creates the listening socket for a Unix socket path.
+ */
+static int bm_metrics_listen_unix(bm_metrics_t m,
+                                  const char* path) {
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if(strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Metrics socket path '%s' is too long\n", path);
+      return 0;
+   }
+   strcpy(addr.sun_path, path);
+   m->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   /* Remove a stale socket left by a previous run */
+   unlink(path);
+   if(m->fd < 0 ||
+      bind(m->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "Can't serve metrics on '%s': %s\n",
+              path,
+              strerror(errno));
+      return 0;
+   }
+   m->path = strdup(path);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Creates the listening socket for a [HOST:]PORT address.
+ */
+static int bm_metrics_listen_tcp(bm_metrics_t m,
+                                 const char* addr) {
+   /* Without a host, listen on the loopback interface only */
+   char* host = strdup(addr);
+   char* port = strrchr(host, ':');
+   const char* node = host;
+   if(port) {
+      *port = '\0';
+      ++port;
+   }
+   else {
+      port = host;
+      node = "127.0.0.1";
+   }
+   struct addrinfo hints, *info;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   int retval = getaddrinfo(node, port, &hints, &info);
+   free(host);
+   if(retval != 0) {
+      fprintf(stderr, "Can't resolve metrics address '%s': %s\n",
+              addr,
+              gai_strerror(retval));
+      return 0;
+   }
+   m->fd = socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC, 0);
+   int on = 1;
+   if(m->fd >= 0)
+      setsockopt(m->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   if(m->fd < 0 || bind(m->fd, info->ai_addr, info->ai_addrlen) < 0) {
+      fprintf(stderr, "Can't serve metrics on '%s': %s\n",
+              addr,
+              strerror(errno));
+      freeaddrinfo(info);
+      return 0;
+   }
+   freeaddrinfo(info);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_metrics_t bm_metrics_new(struct bm_dispatcher_s* d,
+                            const char* addr) {
+   bm_metrics_t m = (bm_metrics_t)malloc(sizeof(struct bm_metrics_s));
+   m->dispatcher = d;
+   m->fd = -1;
+   m->path = NULL;
+   atomic_init(&m->stop, 0);
+   /* Create the listening socket */
+   int ok = strchr(addr, '/') ?
+      bm_metrics_listen_unix(m, addr) :
+      bm_metrics_listen_tcp(m, addr);
+   if(ok && listen(m->fd, 16) < 0) {
+      fprintf(stderr, "Can't serve metrics on '%s': %s\n",
+              addr,
+              strerror(errno));
+      ok = 0;
+   }
+   if(!ok) {
+      if(m->fd >= 0) close(m->fd);
+      free(m->path);
+      free(m);
+      return NULL;
+   }
+   /* Serve the requests */
+   if(pthread_create(&m->thread, NULL, &bm_metrics_thread, m) != 0) {
+      fprintf(stderr, "Can't create thread for the metrics endpoint: %s\n",
+              strerror(errno));
+      close(m->fd);
+      free(m->path);
+      free(m);
+      return NULL;
+   }
+   fprintf(stdout, "Serving metrics on '%s'\n", addr);
+   return m;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_metrics_destroy(bm_metrics_t m) {
+   atomic_store(&m->stop, 1);
+   pthread_join(m->thread, NULL);
+   close(m->fd);
+   if(m->path) {
+      unlink(m->path);
+      free(m->path);
+   }
+   free(m);
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,57 @@
+#ifndef BM_METRICS_H
+#define BM_METRICS_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct bm_dispatcher_s;
+
+/*
+ * An HTTP endpoint exposing the stream metrics in the Prometheus
+ * text format.
+ * The endpoint runs in its own thread and only reads the atomic
+ * counters of the streams, so scraping never slows down the reactors.
+ */
+struct bm_metrics_s {
+   /* The dispatcher whose streams are reported */
+   struct bm_dispatcher_s* dispatcher;
+   /* The listening socket */
+   int fd;
+   /* The Unix socket path, or NULL for a TCP endpoint */
+   char* path;
+   /* Set to 1 to make the endpoint stop */
+   atomic_int stop;
+   /* The thread serving the requests */
+   pthread_t thread;
+};
+typedef struct bm_metrics_s* bm_metrics_t;
+
+/*
+ * Creates the metrics endpoint and starts serving requests.
+ * The address is either a Unix socket path (anything containing a
+ * '/'), a port on the loopback interface, or HOST:PORT.
+ * @param d The dispatcher.
+ * @param addr The address to listen on.
+ * @return The endpoint, or NULL on error.
+ */
+extern bm_metrics_t bm_metrics_new(struct bm_dispatcher_s* d,
+                                   const char* addr);
+
+/*
+ * Stops the metrics endpoint and releases its resources.
+ * @param m The endpoint.
+ */
+extern void bm_metrics_destroy(bm_metrics_t m);
+
+/*
+ * Writes the metrics of the dispatcher in the Prometheus text format.
+ * Must be called inside an epoch critical section while the reactors
+ * run.
+ * @param d The dispatcher.
+ * @param out The stream to write to.
+ */
+extern void bm_metrics_write(struct bm_dispatcher_s* d,
+                             FILE* out);
+
+#endif
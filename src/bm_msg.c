@@ -0,0 +1,41 @@
+#include "bm_msg.h"
+#include "bm_msgpool.h"
+
+/****************************************/
+/****************************************/
+
+bm_msg_t bm_msg_new(size_t len) {
+   bm_msg_t m = (bm_msg_t)malloc(sizeof(struct bm_msg_s) + len);
+   atomic_init(&m->refs, 1);
+   m->pool = NULL;
+   m->ts = 0;
+   m->channel = 0;
+   m->origin = 0;
+   m->origin_reactor = 0;
+   m->seq = 0;
+   m->sender = 0;
+   m->len = len;
+   return m;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_msg_ref(bm_msg_t m) {
+   atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_msg_unref(bm_msg_t m) {
+   if(atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) {
+      if(m->pool)
+         bm_msgpool_put(m->pool, m);
+      else
+         free(m);
+   }
+}
+
+/****************************************/
+/****************************************/
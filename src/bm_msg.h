@@ -0,0 +1,66 @@
+#ifndef BM_MSG_H
+#define BM_MSG_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+struct bm_msgpool_s;
+
+/*
+ * Number of channels a message can be published on
+ */
+#define BM_MSG_CHANNELS 256
+
+/*
+ * A reference-counted message.
+ * A received message is stored once and shared by all the streams
+ * it must be sent to. The message is freed, or given back to its
+ * pool, when the last reference is released.
+ */
+struct bm_msg_s {
+   /* Reference count */
+   atomic_uint refs;
+   /* The pool the message comes from, or NULL if allocated on the heap */
+   struct bm_msgpool_s* pool;
+   /* Reception time, in ns of the monotonic clock */
+   uint64_t ts;
+   /* The channel the message is published on */
+   uint8_t channel;
+   /* The reactor that numbered the message at its origin hub */
+   uint16_t origin_reactor;
+   /* The hub the message entered the hub network from */
+   uint32_t origin;
+   /* The sequence number of the message at its origin reactor */
+   uint32_t seq;
+   /* The peer of a shared stream the message comes from, 0 for none */
+   uint32_t sender;
+   /* Payload length */
+   size_t len;
+   /* Payload */
+   uint8_t data[];
+};
+typedef struct bm_msg_s* bm_msg_t;
+
+/*
+ * Creates a new message with one reference, allocated on the heap.
+ * @param len The payload length.
+ * @return The new message.
+ */
+extern bm_msg_t bm_msg_new(size_t len);
+
+/*
+ * Adds a reference to a message.
+ * @param m The message.
+ */
+extern void bm_msg_ref(bm_msg_t m);
+
+/*
+ * Releases a reference to a message.
+ * The message is freed or given back to its pool when no references
+ * are left.
+ * @param m The message.
+ */
+extern void bm_msg_unref(bm_msg_t m);
+
+#endif
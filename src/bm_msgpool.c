@@ -0,0 +1,154 @@
+#include "bm_msgpool.h"
+#include <string.h>
+
+/*
+ * Target size of a slab
+ */
+#define BM_MSGPOOL_SLAB_SIZE (256 * 1024)
+
+/****************************************/
+/****************************************/
+
+bm_msgpool_t bm_msgpool_new(size_t msg_len,
+                            size_t max_bytes) {
+   bm_msgpool_t p = (bm_msgpool_t)malloc(sizeof(struct bm_msgpool_s));
+   p->msg_len = msg_len;
+   /* Keep each message on its own cache lines, so that updating the
+    * reference count of one does not disturb its neighbors */
+   p->stride = (sizeof(struct bm_msg_s) + msg_len + BM_CACHE_LINE - 1) &
+      ~(size_t)(BM_CACHE_LINE - 1);
+   p->slab_msgs = BM_MSGPOOL_SLAB_SIZE / p->stride;
+   if(p->slab_msgs == 0) p->slab_msgs = 1;
+   p->slab_max = max_bytes / (p->slab_msgs * p->stride);
+   if(p->slab_max == 0) p->slab_max = 1;
+   p->slabs = (uint8_t**)calloc(p->slab_max, sizeof(uint8_t*));
+   p->slab_num = 0;
+   p->free = bm_queue_new(p->slab_max * p->slab_msgs);
+   pthread_mutex_init(&p->slabmutex, NULL);
+   return p;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_msgpool_destroy(bm_msgpool_t p) {
+   for(size_t i = 0; i < p->slab_num; ++i)
+      free(p->slabs[i]);
+   free(p->slabs);
+   bm_queue_destroy(p->free);
+   pthread_mutex_destroy(&p->slabmutex);
+   free(p);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Allocates a new slab and puts its messages in the free list.
+ * @return 1 for success, 0 if the pool is at its maximum size.
+ */
+static int bm_msgpool_grow(bm_msgpool_t p) {
+   pthread_mutex_lock(&p->slabmutex);
+   /* Another thread might have grown the pool in the meantime */
+   if(bm_queue_size(p->free) > 0) {
+      pthread_mutex_unlock(&p->slabmutex);
+      return 1;
+   }
+   if(p->slab_num == p->slab_max) {
+      pthread_mutex_unlock(&p->slabmutex);
+      return 0;
+   }
+   uint8_t* slab = (uint8_t*)aligned_alloc(BM_CACHE_LINE,
+                                           p->slab_msgs * p->stride);
+   p->slabs[p->slab_num++] = slab;
+   for(size_t i = 0; i < p->slab_msgs; ++i) {
+      bm_msg_t m = (bm_msg_t)(slab + i * p->stride);
+      m->pool = p;
+      bm_queue_push(p->free, m);
+   }
+   pthread_mutex_unlock(&p->slabmutex);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_msg_t bm_msgpool_get(bm_msgpool_t p) {
+   bm_msg_t m;
+   do {
+      m = (bm_msg_t)bm_queue_pop(p->free);
+      if(m) {
+         atomic_store_explicit(&m->refs, 1, memory_order_relaxed);
+         m->len = p->msg_len;
+         return m;
+      }
+   } while(bm_msgpool_grow(p));
+   /* The pool is exhausted, fall back to the heap */
+   return bm_msg_new(p->msg_len);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_msgpool_put(bm_msgpool_t p,
+                    bm_msg_t m) {
+   /* The free list can hold every message of the pool */
+   bm_queue_push(p->free, m);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Smallest and largest size class of a pool set
+ */
+#define BM_MSGPOOL_CLASS_MIN 64
+#define BM_MSGPOOL_CLASS_MAX (64 * 1024)
+
+bm_msgpool_set_t bm_msgpool_set_new(size_t msg_len,
+                                    size_t max_bytes) {
+   bm_msgpool_set_t s = (bm_msgpool_set_t)malloc(sizeof(struct bm_msgpool_set_s));
+   /* Collect the class lengths, the given one in its place */
+   size_t lens[BM_MSGPOOL_CLASSES];
+   size_t num = 0;
+   for(size_t len = BM_MSGPOOL_CLASS_MIN; len <= BM_MSGPOOL_CLASS_MAX; len <<= 2) {
+      if(msg_len > (num > 0 ? lens[num-1] : 0) && msg_len < len)
+         lens[num++] = msg_len;
+      lens[num++] = len;
+   }
+   if(msg_len > BM_MSGPOOL_CLASS_MAX)
+      lens[num++] = msg_len;
+   /* Share the memory budget among the classes */
+   s->num = num;
+   for(size_t i = 0; i < num; ++i)
+      s->pools[i] = bm_msgpool_new(lens[i], max_bytes / num);
+   return s;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_msgpool_set_destroy(bm_msgpool_set_t s) {
+   for(size_t i = 0; i < s->num; ++i)
+      bm_msgpool_destroy(s->pools[i]);
+   free(s);
+}
+
+/****************************************/
+/****************************************/
+
+bm_msg_t bm_msgpool_set_get(bm_msgpool_set_t s,
+                            size_t len) {
+   bm_msg_t m;
+   for(size_t i = 0; i < s->num; ++i) {
+      if(len <= s->pools[i]->msg_len) {
+         m = bm_msgpool_get(s->pools[i]);
+         m->len = len;
+         return m;
+      }
+   }
+   return bm_msg_new(len);
+}
+
+/****************************************/
+/****************************************/
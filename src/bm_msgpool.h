@@ -0,0 +1,114 @@
+#ifndef BM_MSGPOOL_H
+#define BM_MSGPOOL_H
+
+#include "bm_msg.h"
+#include "bm_queue.h"
+#include <pthread.h>
+
+/*
+ * A pool of messages of the same length.
+ * Messages are carved out of large slabs and recycled through a
+ * lock-free free list, so allocating and releasing a message costs
+ * a couple of atomic operations. Slabs are only allocated, under a
+ * mutex, when the free list runs dry. Once the pool reaches its
+ * maximum size, messages are allocated on the heap.
+ */
+struct bm_msgpool_s {
+   /* The payload length of the messages */
+   size_t msg_len;
+   /* The distance between two messages in a slab */
+   size_t stride;
+   /* The number of messages per slab */
+   size_t slab_msgs;
+   /* The maximum number of slabs */
+   size_t slab_max;
+   /* The slabs */
+   uint8_t** slabs;
+   /* The number of slabs */
+   size_t slab_num;
+   /* The free messages */
+   bm_queue_t free;
+   /* PThread mutex to allocate new slabs */
+   pthread_mutex_t slabmutex;
+};
+typedef struct bm_msgpool_s* bm_msgpool_t;
+
+/*
+ * Creates a new message pool.
+ * @param msg_len The payload length of the messages.
+ * @param max_bytes The maximum memory used by the slabs.
+ * @return The new pool.
+ */
+extern bm_msgpool_t bm_msgpool_new(size_t msg_len,
+                                   size_t max_bytes);
+
+/*
+ * Destroys a message pool.
+ * All the messages must have been released.
+ * @param p The pool.
+ */
+extern void bm_msgpool_destroy(bm_msgpool_t p);
+
+/*
+ * Gets a message with one reference from the pool.
+ * @param p The pool.
+ * @return The message.
+ */
+extern bm_msg_t bm_msgpool_get(bm_msgpool_t p);
+
+/*
+ * Gives a message back to the pool.
+ * Called by bm_msg_unref() when the last reference is released.
+ * @param p The pool.
+ * @param m The message.
+ */
+extern void bm_msgpool_put(bm_msgpool_t p,
+                           bm_msg_t m);
+
+/*
+ * Maximum number of size classes in a pool set
+ */
+#define BM_MSGPOOL_CLASSES 8
+
+/*
+ * A set of message pools of increasing lengths.
+ * A message comes from the pool with the shortest length it fits in,
+ * so small messages don't pay for the room of large ones. Messages
+ * longer than the largest class are allocated on the heap.
+ */
+struct bm_msgpool_set_s {
+   /* The pools, by increasing message length */
+   bm_msgpool_t pools[BM_MSGPOOL_CLASSES];
+   /* The number of pools */
+   size_t num;
+};
+typedef struct bm_msgpool_set_s* bm_msgpool_set_t;
+
+/*
+ * Creates a new pool set.
+ * The set has a class for each power of four from 64 bytes to 64 kB,
+ * plus one for the given length if it does not match any.
+ * @param msg_len The most common message length, 0 if none.
+ * @param max_bytes The maximum memory used by the slabs of all pools.
+ * @return The new pool set.
+ */
+extern bm_msgpool_set_t bm_msgpool_set_new(size_t msg_len,
+                                           size_t max_bytes);
+
+/*
+ * Destroys a pool set.
+ * All the messages must have been released.
+ * @param s The pool set.
+ */
+extern void bm_msgpool_set_destroy(bm_msgpool_set_t s);
+
+/*
+ * Gets a message with one reference from the pool set.
+ * @param s The pool set.
+ * @param len The payload length.
+ * @return The message.
+ */
+extern bm_msg_t bm_msgpool_set_get(bm_msgpool_set_t s,
+                                   size_t len);
+
+#endif
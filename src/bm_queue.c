@@ -0,0 +1,112 @@
+#include "bm_queue.h"
+#include <stdint.h>
+
+/*
+ * The queue follows Dmitry Vyukov's bounded MPMC design: each cell
+ * carries a sequence number that tells producers and consumers
+ * whether it's their turn to use it, so a single CAS on the position
+ * is enough to claim a cell.
+ */
+
+/****************************************/
+/****************************************/
+
+bm_queue_t bm_queue_new(size_t capacity) {
+   size_t sz = 2;
+   while(sz < capacity) sz <<= 1;
+   bm_queue_t q = (bm_queue_t)aligned_alloc(BM_CACHE_LINE,
+                                            sizeof(struct bm_queue_s));
+   q->cells = (struct bm_queue_cell_s*)malloc(
+      sz * sizeof(struct bm_queue_cell_s));
+   q->mask = sz - 1;
+   for(size_t i = 0; i < sz; ++i) {
+      atomic_init(&q->cells[i].seq, i);
+      q->cells[i].data = NULL;
+   }
+   atomic_init(&q->head, 0);
+   atomic_init(&q->tail, 0);
+   return q;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_queue_destroy(bm_queue_t q) {
+   free(q->cells);
+   free(q);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_queue_push(bm_queue_t q,
+                  void* p) {
+   size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+   struct bm_queue_cell_s* cell;
+   while(1) {
+      cell = &q->cells[pos & q->mask];
+      size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if(diff == 0) {
+         /* The cell is free, try to claim it */
+         if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            break;
+      }
+      else if(diff < 0) {
+         /* The cell still holds an element from the previous lap */
+         return 0;
+      }
+      else {
+         /* Another producer got there first */
+         pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+      }
+   }
+   cell->data = p;
+   atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void* bm_queue_pop(bm_queue_t q) {
+   size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+   struct bm_queue_cell_s* cell;
+   while(1) {
+      cell = &q->cells[pos & q->mask];
+      size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if(diff == 0) {
+         /* The cell is full, try to claim it */
+         if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            break;
+      }
+      else if(diff < 0) {
+         /* Nothing to pop */
+         return NULL;
+      }
+      else {
+         /* Another consumer got there first */
+         pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+      }
+   }
+   void* p = cell->data;
+   atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+   return p;
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_queue_size(bm_queue_t q) {
+   size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+   return head > tail ? head - tail : 0;
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,79 @@
+#ifndef BM_QUEUE_H
+#define BM_QUEUE_H
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/*
+ * Size of a cache line, used to keep the producer and consumer
+ * positions from sharing one.
+ */
+#define BM_CACHE_LINE 64
+
+/*
+ * A cell of the queue.
+ */
+struct bm_queue_cell_s {
+   /* Sequence number, tells whether the cell is free or full */
+   atomic_size_t seq;
+   /* The stored pointer */
+   void* data;
+};
+
+/*
+ * A bounded lock-free queue of pointers.
+ * Any number of threads can push and pop concurrently. Pushing on
+ * a full queue fails instead of blocking, so a slow consumer only
+ * backs up its own queue.
+ */
+struct bm_queue_s {
+   /* The cells, in a ring */
+   struct bm_queue_cell_s* cells;
+   /* Capacity - 1; the capacity is a power of two */
+   size_t mask;
+   /* Position of the next push */
+   _Alignas(BM_CACHE_LINE) atomic_size_t head;
+   /* Position of the next pop */
+   _Alignas(BM_CACHE_LINE) atomic_size_t tail;
+};
+typedef struct bm_queue_s* bm_queue_t;
+
+/*
+ * Creates a new queue.
+ * @param capacity The minimum capacity; it is rounded up to a power of two.
+ * @return The new queue.
+ */
+extern bm_queue_t bm_queue_new(size_t capacity);
+
+/*
+ * Destroys a queue.
+ * The stored pointers are not freed.
+ * @param q The queue.
+ */
+extern void bm_queue_destroy(bm_queue_t q);
+
+/*
+ * Appends a pointer to the queue.
+ * @param q The queue.
+ * @param p The pointer.
+ * @return 1 for success, 0 if the queue is full.
+ */
+extern int bm_queue_push(bm_queue_t q,
+                         void* p);
+
+/*
+ * Removes the oldest pointer from the queue.
+ * @param q The queue.
+ * @return The pointer, or NULL if the queue is empty.
+ */
+extern void* bm_queue_pop(bm_queue_t q);
+
+/*
+ * Returns the number of pointers in the queue.
+ * The value is approximate if the queue is being modified.
+ * @param q The queue.
+ * @return The number of pointers in the queue.
+ */
+extern size_t bm_queue_size(bm_queue_t q);
+
+#endif
@@ -0,0 +1,767 @@
+#define _GNU_SOURCE
+#include <config.h>
+#include "bm_reactor.h"
+#include "bm_dispatcher.h"
+#include "bm_capture.h"
+#ifdef BLABBERMOUTH_WITH_URING
+#include "bm_uring.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "bm_time.h"
+#include "bm_log.h"
+
+/*
+ * Maximum number of events handled per epoll_wait() call
+ */
+#define BM_REACTOR_MAX_EVENTS 64
+
+/*
+ * Number of messages in transit from one reactor to another
+ */
+#define BM_REACTOR_RING_SIZE 4096
+
+/*
+ * The reactor run by the current thread, if any
+ */
+static __thread bm_reactor_t bm_reactor_current = NULL;
+
+/****************************************/
+/****************************************/
+
+int bm_reactor_init(bm_reactor_t r,
+                    struct bm_dispatcher_s* d,
+                    size_t id) {
+   r->dispatcher = d;
+   r->id = id;
+   atomic_init(&r->stop, 0);
+   atomic_init(&r->pending, NULL);
+   r->wakefd = -1;
+   r->timerfd = -1;
+   r->timer_deadline = 0;
+   r->deferred = NULL;
+   r->retrying = NULL;
+   r->resuming = NULL;
+   r->paused = NULL;
+   r->hub_seq = d->hub_seq;
+   r->epfd = -1;
+   r->capture = NULL;
+   /* Create the rings from the other reactors */
+   r->inbox = NULL;
+   r->outbox = NULL;
+   atomic_init(&r->inbox_pending, 0);
+   if(d->reactor_num > 1) {
+      r->inbox = (bm_ring_t*)calloc(d->reactor_num, sizeof(bm_ring_t));
+      for(size_t i = 0; i < d->reactor_num; ++i)
+         if(i != id) r->inbox[i] = bm_ring_new(BM_REACTOR_RING_SIZE);
+      r->outbox = (uint8_t*)calloc(d->reactor_num, sizeof(uint8_t));
+   }
+   /* Pick the CPU */
+   r->cpu = d->cpu_num > 0 ? d->cpus[id % d->cpu_num] : -1;
+   /* Create the io_uring instance */
+   r->uring = NULL;
+   r->batching = 0;
+#ifdef BLABBERMOUTH_WITH_URING
+   if(d->uring) {
+      r->uring = bm_uring_new();
+      if(!r->uring)
+         fprintf(stderr, "io_uring not available for reactor %zu, using epoll only: %s\n",
+                 id,
+                 strerror(errno));
+   }
+#endif
+   /* Create the capture */
+   if(d->capture_path) {
+      r->capture = bm_capture_new(d->capture_path, id, d->capture_size, d->capture_keep);
+      if(!r->capture) {
+         fprintf(stderr, "Error creating capture for reactor %zu\n", id);
+         bm_reactor_cleanup(r);
+         return 0;
+      }
+   }
+   /* Create the epoll instance */
+   r->epfd = epoll_create1(EPOLL_CLOEXEC);
+   if(r->epfd < 0) {
+      fprintf(stderr, "Error creating reactor %zu: %s\n",
+              id,
+              strerror(errno));
+      bm_reactor_cleanup(r);
+      return 0;
+   }
+   /* Create the wakeup descriptor */
+   r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if(r->wakefd < 0) {
+      fprintf(stderr, "Error creating wakeup descriptor for reactor %zu: %s\n",
+              id,
+              strerror(errno));
+      bm_reactor_cleanup(r);
+      return 0;
+   }
+   struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+   if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) < 0) {
+      fprintf(stderr, "Error polling wakeup descriptor for reactor %zu: %s\n",
+              id,
+              strerror(errno));
+      bm_reactor_cleanup(r);
+      return 0;
+   }
+   /* Create the timer for delayed flushes */
+   r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if(r->timerfd < 0) {
+      fprintf(stderr, "Error creating timer for reactor %zu: %s\n",
+              id,
+              strerror(errno));
+      bm_reactor_cleanup(r);
+      return 0;
+   }
+   ev.data.ptr = &r->timerfd;
+   if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->timerfd, &ev) < 0) {
+      fprintf(stderr, "Error polling timer for reactor %zu: %s\n",
+              id,
+              strerror(errno));
+      bm_reactor_cleanup(r);
+      return 0;
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_cleanup(bm_reactor_t r) {
+   /* Empty the flush list, so the streams in it can be released */
+   bm_datastream_t s = atomic_exchange(&r->pending, NULL);
+   while(s) {
+      atomic_store(&s->flush_pending, 0);
+      s = s->flush_next;
+   }
+   /* Release the messages still in transit */
+   if(r->inbox) {
+      struct bm_ring_entry_s e;
+      for(size_t i = 0; i < r->dispatcher->reactor_num; ++i) {
+         if(!r->inbox[i]) continue;
+         while(bm_ring_pop(r->inbox[i], &e)) {
+            if(e.data) {
+               bm_msg_unref((bm_msg_t)e.data);
+               atomic_fetch_sub(&((bm_datastream_t)e.dest)->inbound, 1);
+            }
+            else if(((bm_datastream_t)e.dest)->accepted) {
+               /* A stream accepted for this reactor, never added; the
+                * others belong to the snapshot */
+               ((bm_datastream_t)e.dest)->destroy(e.dest);
+            }
+         }
+         bm_ring_destroy(r->inbox[i]);
+      }
+      free(r->inbox);
+      r->inbox = NULL;
+   }
+   free(r->outbox);
+   r->outbox = NULL;
+#ifdef BLABBERMOUTH_WITH_URING
+   if(r->uring) {
+      bm_uring_destroy(r->uring);
+      r->uring = NULL;
+   }
+#endif
+   if(r->capture) {
+      bm_capture_destroy(r->capture);
+      r->capture = NULL;
+   }
+   if(r->wakefd >= 0) close(r->wakefd);
+   if(r->timerfd >= 0) close(r->timerfd);
+   if(r->epfd >= 0) close(r->epfd);
+   r->wakefd = -1;
+   r->timerfd = -1;
+   r->epfd = -1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_reactor_stream_add(bm_reactor_t r,
+                          bm_datastream_t s) {
+   int fd = s->fd(s);
+   if(fd < 0) {
+      bm_datastream_set_status(s,
+                               BM_DATASTREAM_ERROR,
+                               "No descriptor to poll");
+      return 0;
+   }
+   /* Switch to non-blocking mode */
+   int flags = fcntl(fd, F_GETFL, 0);
+   if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      bm_datastream_set_status(s,
+                               BM_DATASTREAM_ERROR,
+                               "Can't make socket non-blocking: %s",
+                               strerror(errno));
+      return 0;
+   }
+   /* Register the socket to send through io_uring, before any event
+    * can make the reactor flush the stream */
+   s->reactor = r->id;
+#ifdef BLABBERMOUTH_WITH_URING
+   if(r->uring && s->bytestream)
+      s->uring_file = bm_uring_file_add(r->uring, fd);
+#endif
+   /* Poll for incoming data */
+   struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+   if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      bm_datastream_set_status(s,
+                               BM_DATASTREAM_ERROR,
+                               "Can't poll socket: %s",
+                               strerror(errno));
+#ifdef BLABBERMOUTH_WITH_URING
+      if(s->uring_file >= 0) {
+         bm_uring_file_remove(r->uring, s->uring_file);
+         s->uring_file = -1;
+      }
+#endif
+      return 0;
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_stream_remove(bm_reactor_t r,
+                              bm_datastream_t s) {
+   int fd = s->fd(s);
+   if(fd >= 0)
+      epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+#ifdef BLABBERMOUTH_WITH_URING
+   /* The registration keeps the socket open */
+   if(s->uring_file >= 0) {
+      bm_uring_file_remove(r->uring, s->uring_file);
+      s->uring_file = -1;
+   }
+#endif
+   /* Forget the delayed flush */
+   if(s->deferred) {
+      bm_datastream_t* prev = &r->deferred;
+      while(*prev != s) prev = &(*prev)->defer_next;
+      *prev = s->defer_next;
+      s->deferred = 0;
+   }
+   s->flush_deadline = 0;
+   /* Forget the reconnection */
+   if(s->retrying) {
+      bm_datastream_t* prev = &r->retrying;
+      while(*prev != s) prev = &(*prev)->retry_next;
+      *prev = s->retry_next;
+      s->retrying = 0;
+   }
+   s->retry_deadline = 0;
+   /* Forget the data left to receive */
+   if(s->resuming) {
+      /* The list might be in the hands of bm_reactor_resume_all() */
+      bm_datastream_t* prev = &r->resuming;
+      while(*prev && *prev != s) prev = &(*prev)->resume_next;
+      if(*prev) *prev = s->resume_next;
+      s->resuming = 0;
+   }
+   /* Forget the back-pressure */
+   if(s->paused) {
+      bm_datastream_t* prev = &r->paused;
+      while(*prev != s) prev = &(*prev)->pause_next;
+      *prev = s->pause_next;
+      s->paused = 0;
+   }
+   s->want_write = 0;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Updates the events a stream is polled for.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_reactor_stream_poll(bm_reactor_t r,
+                                  bm_datastream_t s) {
+   struct epoll_event ev = {
+      .events = (s->paused ? 0 : EPOLLIN) | (s->want_write ? EPOLLOUT : 0),
+      .data.ptr = s
+   };
+   return epoll_ctl(r->epfd, EPOLL_CTL_MOD, s->fd(s), &ev) == 0;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_stream_want_write(bm_reactor_t r,
+                                  bm_datastream_t s,
+                                  int on) {
+   if(s->want_write == on) return;
+   s->want_write = on;
+   if(!bm_reactor_stream_poll(r, s))
+      s->want_write = !on;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_pause(bm_reactor_t r,
+                      bm_datastream_t s) {
+   if(s->paused) return;
+   s->paused = 1;
+   if(!bm_reactor_stream_poll(r, s)) {
+      s->paused = 0;
+      return;
+   }
+   s->pause_next = r->paused;
+   r->paused = s;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Receives again from the streams paused by back-pressure.
+ */
+static void bm_reactor_unpause_all(bm_reactor_t r) {
+   bm_datastream_t s = r->paused;
+   bm_datastream_t next;
+   r->paused = NULL;
+   while(s) {
+      next = s->pause_next;
+      s->paused = 0;
+      bm_reactor_stream_poll(r, s);
+      /* Don't wait for epoll, the stream might have data left in its
+       * own buffer */
+      bm_reactor_resume(r, s);
+      s = next;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Sends the streams batched so far and hands the results over to the
+ * dispatcher.
+ * @return The number of streams sent.
+ */
+static size_t bm_reactor_uring_submit(bm_reactor_t r) {
+#ifdef BLABBERMOUTH_WITH_URING
+   if(!r->uring) return 0;
+   size_t n = bm_uring_submit(r->uring);
+   for(size_t i = 0; i < n; ++i) {
+      bm_datastream_t s = r->uring->sends[i].stream;
+      s->sending = 0;
+      bm_dispatcher_stream_sent(r->dispatcher, r, s, r->uring->sends[i].res);
+   }
+   return n;
+#else
+   return 0;
+#endif
+}
+
+/****************************************/
+/****************************************/
+
+int bm_reactor_stream_send(bm_reactor_t r,
+                           bm_datastream_t s) {
+#ifdef BLABBERMOUTH_WITH_URING
+   if(!r->uring || !r->batching || !s->bytestream) return 0;
+   /* Make room in a full batch */
+   if(r->uring->num == BM_URING_BATCH) bm_reactor_uring_submit(r);
+   if(!bm_uring_send(r->uring, s)) return 0;
+   s->sending = 1;
+   return 1;
+#else
+   return 0;
+#endif
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_schedule_flush(bm_reactor_t r,
+                               bm_datastream_t s) {
+   /* Nothing to do if the stream is already scheduled */
+   if(atomic_exchange(&s->flush_pending, 1)) return;
+   /* Push the stream on the pending list */
+   bm_datastream_t head = atomic_load(&r->pending);
+   do {
+      s->flush_next = head;
+   } while(!atomic_compare_exchange_weak(&r->pending, &head, s));
+   /* The reactor checks the list after each round of events, so it
+    * must only be woken up if it's another thread and the list was
+    * empty */
+   if(head == NULL && bm_reactor_current != r)
+      bm_reactor_wakeup(r);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_flush(bm_reactor_t r) {
+   bm_datastream_t s;
+   bm_datastream_t next;
+   r->batching = 1;
+   do {
+      /* Take the whole pending list at once */
+      s = atomic_exchange(&r->pending, NULL);
+      while(s) {
+         next = s->flush_next;
+         /* From now on, new messages schedule the stream again */
+         atomic_store(&s->flush_pending, 0);
+         bm_dispatcher_stream_flush_delayed(r->dispatcher, r, s);
+         s = next;
+      }
+      /* Send the batch; streams with more to send are scheduled again */
+   } while(bm_reactor_uring_submit(r) > 0 &&
+           atomic_load(&r->pending) != NULL);
+   r->batching = 0;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Arms the timer to expire at the given time, unless it is already
+ * set to expire earlier.
+ */
+static void bm_reactor_timer_arm(bm_reactor_t r,
+                                 uint64_t deadline) {
+   if(r->timer_deadline != 0 && r->timer_deadline <= deadline) return;
+   struct itimerspec its = {
+      .it_interval = { 0, 0 },
+      .it_value = {
+         .tv_sec = deadline / 1000000000ULL,
+         .tv_nsec = deadline % 1000000000ULL
+      }
+   };
+   timerfd_settime(r->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+   r->timer_deadline = deadline;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_defer_flush(bm_reactor_t r,
+                            bm_datastream_t s) {
+   if(!s->deferred) {
+      s->defer_next = r->deferred;
+      r->deferred = s;
+      s->deferred = 1;
+   }
+   bm_reactor_timer_arm(r, s->flush_deadline);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_retry(bm_reactor_t r,
+                      bm_datastream_t s) {
+   if(!s->retrying) {
+      s->retry_next = r->retrying;
+      r->retrying = s;
+      s->retrying = 1;
+   }
+   bm_reactor_timer_arm(r, s->retry_deadline);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_resume(bm_reactor_t r,
+                       bm_datastream_t s) {
+   if(!s->resuming) {
+      s->resume_next = r->resuming;
+      r->resuming = s;
+      s->resuming = 1;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Receives again from the streams that still have data left.
+ */
+static void bm_reactor_resume_all(bm_reactor_t r) {
+   /* Take the list, streams that stop again go back in; those
+    * removed in the meantime are no longer marked */
+   bm_datastream_t s = r->resuming;
+   bm_datastream_t next;
+   r->resuming = NULL;
+   while(s) {
+      next = s->resume_next;
+      if(s->resuming) {
+         s->resuming = 0;
+         bm_dispatcher_stream_event(r->dispatcher, r, s, EPOLLIN);
+      }
+      s = next;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Flushes the streams whose delayed flush is due, and moves on with
+ * the reconnections that are due.
+ */
+static void bm_reactor_timer_expired(bm_reactor_t r) {
+   uint64_t v;
+   while(read(r->timerfd, &v, sizeof(v)) > 0);
+   r->timer_deadline = 0;
+   /* Take the list, streams that are not due go back in */
+   uint64_t now = bm_time_now();
+   bm_datastream_t s = r->deferred;
+   bm_datastream_t next;
+   r->deferred = NULL;
+   while(s) {
+      next = s->defer_next;
+      s->deferred = 0;
+      if(s->flush_deadline == 0) {
+         /* Already flushed because the batch filled up */
+      }
+      else if(s->flush_deadline <= now) {
+         s->flush_deadline = 0;
+         bm_dispatcher_stream_flush(r->dispatcher, r, s);
+      }
+      else {
+         bm_reactor_defer_flush(r, s);
+      }
+      s = next;
+   }
+   s = r->retrying;
+   r->retrying = NULL;
+   while(s) {
+      next = s->retry_next;
+      s->retrying = 0;
+      if(s->retry_deadline == 0) {
+         /* Nothing left to wait for */
+      }
+      else if(s->retry_deadline <= now) {
+         s->retry_deadline = 0;
+         bm_dispatcher_stream_retry(r->dispatcher, r, s);
+      }
+      else {
+         bm_reactor_retry(r, s);
+      }
+      s = next;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Delivers the messages handed over by the other reactors, and starts
+ * polling the streams they handed over.
+ */
+static void bm_reactor_inbox_drain(bm_reactor_t r) {
+   if(!r->inbox) return;
+   /* Messages pushed from now on trigger a new wakeup */
+   atomic_store(&r->inbox_pending, 0);
+   struct bm_ring_entry_s e;
+   for(size_t i = 0; i < r->dispatcher->reactor_num; ++i) {
+      if(!r->inbox[i]) continue;
+      while(bm_ring_pop(r->inbox[i], &e)) {
+         if(e.data)
+            bm_dispatcher_stream_deliver(r->dispatcher,
+                                         r,
+                                         (bm_datastream_t)e.dest,
+                                         (bm_msg_t)e.data);
+         else
+            bm_dispatcher_stream_adopt(r->dispatcher,
+                                       r,
+                                       (bm_datastream_t)e.dest);
+      }
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Makes sure a reactor checks its inbox soon.
+ */
+static void bm_reactor_inbox_notify(bm_reactor_t r) {
+   if(!atomic_exchange(&r->inbox_pending, 1))
+      bm_reactor_wakeup(r);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Pushes an entry into the inbox of another reactor, waiting for room
+ * if needed.
+ * @return 1 for success, 0 if the other reactor is stopping.
+ */
+static int bm_reactor_push(bm_reactor_t r,
+                           bm_reactor_t to,
+                           bm_datastream_t s,
+                           bm_msg_t m) {
+   bm_ring_t ring = to->inbox[r->id];
+   while(!bm_ring_push(ring, s, m)) {
+      /* The owner is behind; make sure it's working on it, and deliver
+       * what it sent us meanwhile, in case it is waiting on us too */
+      if(atomic_load(&to->stop)) return 0;
+      bm_reactor_inbox_notify(to);
+      bm_reactor_inbox_drain(r);
+      sched_yield();
+   }
+   r->outbox[to->id] = 1;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_reactor_send(bm_reactor_t r,
+                    bm_reactor_t to,
+                    bm_datastream_t s,
+                    bm_msg_t m) {
+   atomic_fetch_add_explicit(&s->inbound, 1, memory_order_relaxed);
+   if(bm_reactor_push(r, to, s, m)) return 1;
+   atomic_fetch_sub(&s->inbound, 1);
+   return 0;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_reactor_hand_over(bm_reactor_t r,
+                         bm_reactor_t to,
+                         bm_datastream_t s) {
+   return bm_reactor_push(r, to, s, NULL);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_notify(bm_reactor_t r) {
+   if(!r->outbox) return;
+   for(size_t i = 0; i < r->dispatcher->reactor_num; ++i) {
+      if(r->outbox[i]) {
+         r->outbox[i] = 0;
+         bm_reactor_inbox_notify(&r->dispatcher->reactors[i]);
+      }
+   }
+}
+
+/****************************************/
+/****************************************/
+
+void* bm_reactor_thread(void* arg) {
+   bm_reactor_t r = (bm_reactor_t)arg;
+   bm_reactor_current = r;
+   bm_epoch_t epoch = &r->dispatcher->epoch;
+   struct epoll_event events[BM_REACTOR_MAX_EVENTS];
+   while(!atomic_load(&r->stop)) {
+      /* Don't sleep while streams have data left to receive */
+      int n = epoll_wait(r->epfd, events, BM_REACTOR_MAX_EVENTS,
+                         r->resuming ? 0 : -1);
+      if(n < 0) {
+         if(errno == EINTR) continue;
+         bm_log(BM_LOG_ERROR, "Reactor %zu: %s", r->id, strerror(errno));
+         break;
+      }
+      /* Streams are not released while the events are handled */
+      bm_epoch_enter(epoch, r->id);
+      for(int i = 0; i < n; ++i) {
+         if(events[i].data.ptr == NULL) {
+            /* Wakeup request, just drain the counter */
+            uint64_t v;
+            while(read(r->wakefd, &v, sizeof(v)) > 0);
+         }
+         else if(events[i].data.ptr == &r->timerfd) {
+            /* Some delayed flushes are due */
+            bm_reactor_timer_expired(r);
+         }
+         else {
+            bm_dispatcher_stream_event(r->dispatcher,
+                                       r,
+                                       (bm_datastream_t)events[i].data.ptr,
+                                       events[i].events);
+         }
+      }
+      bm_reactor_resume_all(r);
+      /* Queue the messages handed over by the other reactors, then
+       * send the messages queued during this round; streams scheduled
+       * by other threads from now on wake the reactor up */
+      bm_reactor_inbox_drain(r);
+      bm_reactor_flush(r);
+      /* Receive again once no queue is blocked; the reactor is woken
+       * up when the last one drains */
+      if(r->paused && atomic_load(&r->dispatcher->blocked) == 0)
+         bm_reactor_unpause_all(r);
+      bm_epoch_leave(epoch, r->id);
+   }
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+bm_reactor_t bm_reactor_self() {
+   return bm_reactor_current;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_reactor_start(bm_reactor_t r) {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   if(r->cpu >= 0) {
+      /* Keep the thread, and the streams it owns, on one core */
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(r->cpu, &cpus);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+   }
+   int err = pthread_create(&r->thread, &attr, &bm_reactor_thread, r);
+   pthread_attr_destroy(&attr);
+   if(err != 0) {
+      if(r->cpu >= 0)
+         fprintf(stderr, "Can't create thread for reactor %zu on CPU %d: %s\n",
+                 r->id,
+                 r->cpu,
+                 strerror(err));
+      else
+         fprintf(stderr, "Can't create thread for reactor %zu: %s\n",
+                 r->id,
+                 strerror(err));
+      return 0;
+   }
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_wakeup(bm_reactor_t r) {
+   uint64_t v = 1;
+   if(write(r->wakefd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+      bm_log(BM_LOG_ERROR, "Can't wake up reactor %zu: %s",
+             r->id,
+             strerror(errno));
+}
+
+/****************************************/
+/****************************************/
+
+void bm_reactor_stop(bm_reactor_t r) {
+   atomic_store(&r->stop, 1);
+   bm_reactor_wakeup(r);
+   pthread_join(r->thread, NULL);
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,260 @@
+#ifndef BM_REACTOR_H
+#define BM_REACTOR_H
+
+#include "bm_datastream.h"
+#include "bm_ring.h"
+#include <stdatomic.h>
+
+struct bm_dispatcher_s;
+struct bm_uring_s;
+struct bm_capture_s;
+
+/*
+ * An epoll-based event loop.
+ * Each reactor runs in its own thread and multiplexes the streams
+ * it owns. A stream is owned by exactly one reactor, which is the
+ * only one that reads from it and that closes it.
+ * Reactors hand messages for the streams of other reactors over
+ * through single-producer single-consumer rings, one per pair of
+ * reactors, so that only the owner touches the queues of a stream.
+ * Streams accepted by a reactor for another one go through the same
+ * rings, as entries with no message.
+ */
+struct bm_reactor_s {
+   /* The dispatcher this reactor belongs to */
+   struct bm_dispatcher_s* dispatcher;
+   /* Reactor index */
+   size_t id;
+   /* The epoll instance */
+   int epfd;
+   /* Event file descriptor used to wake up the reactor */
+   int wakefd;
+   /* Streams with messages to flush, pushed by any thread */
+   _Atomic(bm_datastream_t) pending;
+   /* Timer file descriptor for delayed flushes */
+   int timerfd;
+   /* When the timer expires (ns), 0 if disarmed */
+   uint64_t timer_deadline;
+   /* Streams with a delayed flush, only touched by the reactor thread */
+   bm_datastream_t deferred;
+   /* Streams waiting to reconnect or for their connection to complete,
+    * only touched by the reactor thread */
+   bm_datastream_t retrying;
+   /* Streams to receive from again in the next round, only touched by
+    * the reactor thread */
+   bm_datastream_t resuming;
+   /* Streams not received from until the blocked queues drain, only
+    * touched by the reactor thread */
+   bm_datastream_t paused;
+   /* Messages for the streams of this reactor, and streams for it to
+    * own, one ring per reactor they come from (NULL for this one), or
+    * NULL with a single reactor */
+   bm_ring_t* inbox;
+   /* Set to 1 when messages have been pushed into the inbox since
+    * the reactor last checked it */
+   atomic_int inbox_pending;
+   /* For each reactor, whether this one pushed messages into its inbox
+    * and has yet to notify it; only touched by the reactor thread */
+   uint8_t* outbox;
+   /* The CPU the thread is pinned to, -1 for none */
+   int cpu;
+   /* The io_uring instance the streams are flushed through, NULL to
+    * send with one system call per stream */
+   struct bm_uring_s* uring;
+   /* Set to 1 while the pending streams are flushed, so their sends
+    * can be batched */
+   int batching;
+   /* The sequence number of the next message received from a stream
+    * that is not a hub link, only touched by the reactor thread */
+   uint32_t hub_seq;
+   /* The capture the received messages are recorded in, or NULL */
+   struct bm_capture_s* capture;
+   /* Set to 1 to make the reactor stop */
+   atomic_int stop;
+   /* The thread running the reactor */
+   pthread_t thread;
+};
+typedef struct bm_reactor_s* bm_reactor_t;
+
+/*
+ * Initializes a reactor.
+ * @param r The reactor.
+ * @param d The dispatcher.
+ * @param id The reactor index.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_reactor_init(bm_reactor_t r,
+                           struct bm_dispatcher_s* d,
+                           size_t id);
+
+/*
+ * Releases the resources of a reactor.
+ * The reactor thread must not be running.
+ * @param r The reactor.
+ */
+extern void bm_reactor_cleanup(bm_reactor_t r);
+
+/*
+ * Makes a stream owned by the reactor.
+ * The stream socket is switched to non-blocking mode, and registered
+ * with the io_uring instance of the reactor, if any.
+ * Must be called by the thread of the reactor, or before it starts;
+ * other threads hand the stream over with bm_reactor_hand_over().
+ * @param r The reactor.
+ * @param s The stream.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_reactor_stream_add(bm_reactor_t r,
+                                 bm_datastream_t s);
+
+/*
+ * Stops polling a stream and cancels its delayed flush and its
+ * scheduled reconnection.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ */
+extern void bm_reactor_stream_remove(bm_reactor_t r,
+                                     bm_datastream_t s);
+
+/*
+ * Enables or disables polling a stream for writability.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ * @param on 1 to poll for writability, 0 otherwise.
+ */
+extern void bm_reactor_stream_want_write(bm_reactor_t r,
+                                         bm_datastream_t s,
+                                         int on);
+
+/*
+ * Stops receiving from a stream until no queue is blocked, so that
+ * the data waits in the socket and the sender slows down.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ */
+extern void bm_reactor_pause(bm_reactor_t r,
+                             bm_datastream_t s);
+
+/*
+ * Sends the out_batch of a stream along with those of the other
+ * streams flushed in the same round, if the reactor has an io_uring
+ * instance. Once sent, bm_dispatcher_stream_sent() is called.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ * @return 1 if the send was batched, 0 if the stream must send on
+ * its own.
+ */
+extern int bm_reactor_stream_send(bm_reactor_t r,
+                                  bm_datastream_t s);
+
+/*
+ * Schedules the flush of the outbound queue of a stream.
+ * Can be called by any thread. The reactor is woken up only when
+ * needed.
+ * @param r The reactor that owns the stream.
+ * @param s The stream.
+ */
+extern void bm_reactor_schedule_flush(bm_reactor_t r,
+                                      bm_datastream_t s);
+
+/*
+ * Delays the flush of the outbound queue of a stream.
+ * The stream is flushed once its flush_deadline has passed.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ */
+extern void bm_reactor_defer_flush(bm_reactor_t r,
+                                   bm_datastream_t s);
+
+/*
+ * Schedules the next step of the reconnection of a stream: the
+ * dispatcher is called once the retry_deadline of the stream has
+ * passed.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ */
+extern void bm_reactor_retry(bm_reactor_t r,
+                             bm_datastream_t s);
+
+/*
+ * Makes the reactor receive from a stream again in the next round,
+ * without waiting for epoll. For streams that stopped receiving with
+ * messages left in their own buffer.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param s The stream.
+ */
+extern void bm_reactor_resume(bm_reactor_t r,
+                              bm_datastream_t s);
+
+/*
+ * Hands a message over to the reactor that owns a stream.
+ * If the ring to that reactor is full, waits for room, handling the
+ * inbox of the calling reactor in the meantime. The owner is notified
+ * by bm_reactor_notify().
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param to The reactor that owns the stream.
+ * @param s The stream.
+ * @param m The message; the ring takes over the reference.
+ * @return 1 for success, 0 if the owner is stopping.
+ */
+extern int bm_reactor_send(bm_reactor_t r,
+                           bm_reactor_t to,
+                           bm_datastream_t s,
+                           bm_msg_t m);
+
+/*
+ * Hands a stream over to the reactor that will own it, which starts
+ * polling it with bm_dispatcher_stream_adopt(). Goes through the same
+ * ring as the messages, and the owner is notified the same way.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ * @param to The reactor that will own the stream.
+ * @param s The stream.
+ * @return 1 for success, 0 if the owner is stopping.
+ */
+extern int bm_reactor_hand_over(bm_reactor_t r,
+                                bm_reactor_t to,
+                                bm_datastream_t s);
+
+/*
+ * Wakes up the reactors that bm_reactor_send() gave messages to, if
+ * they are not already due to check their inbox.
+ * Must be called by the thread of the reactor.
+ * @param r The reactor.
+ */
+extern void bm_reactor_notify(bm_reactor_t r);
+
+/*
+ * Returns the reactor run by the calling thread.
+ * @return The reactor, or NULL if the thread runs no reactor.
+ */
+extern bm_reactor_t bm_reactor_self();
+
+/*
+ * Starts the reactor thread.
+ * @param r The reactor.
+ * @return 1 for success, 0 for failure.
+ */
+extern int bm_reactor_start(bm_reactor_t r);
+
+/*
+ * Wakes up the reactor thread.
+ * @param r The reactor.
+ */
+extern void bm_reactor_wakeup(bm_reactor_t r);
+
+/*
+ * Asks the reactor thread to stop and waits for it.
+ * @param r The reactor.
+ */
+extern void bm_reactor_stop(bm_reactor_t r);
+
+#endif
@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "bm_replay_datastream.h"
+#include "bm_capture.h"
+#include "bm_time.h"
+#include "bm_debug.h"
+#include "bm_log.h"
+
+/****************************************/
+/****************************************/
+
+void bm_replay_datastream_destroy(void* ds);
+int bm_replay_datastream_connect(void* ds);
+void bm_replay_datastream_disconnect(void* ds);
+ssize_t bm_replay_datastream_send(void* ds, const uint8_t* data, size_t sz);
+ssize_t bm_replay_datastream_recv(void* ds, uint8_t* data, size_t sz);
+int bm_replay_datastream_fd(void* ds);
+ssize_t bm_replay_datastream_recvv(void* ds, bm_msg_t* msgs, size_t n);
+
+/****************************************/
+/****************************************/
+
+int bm_replay_datastream_parse(bm_replay_datastream_t ds,
+                               const char* desc) {
+   /* Duplicate string for strtok_r */
+   char* wdesc = strdup(desc);
+   /* Buffer pointer for strtok_r */
+   char* saveptr = NULL;
+   /* Get id (and discard it) */
+   char* tok = strtok_r(wdesc, ":", &saveptr);
+   /* Get protocol (and discard it) */
+   tok = strtok_r(NULL, ":", &saveptr);
+   /* Get verbosity (and discard it) */
+   tok = strtok_r(NULL, ":", &saveptr);
+   /* Get prefix */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(!tok) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Can't parse capture prefix in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
+   ds->prefix = strdup(tok);
+   /* Get speed */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(tok) {
+      char* endptr;
+      ds->speed = strtod(tok, &endptr);
+      if(*endptr != 0 || endptr == tok || ds->speed < 0) {
+         bm_datastream_set_status(ds,
+                                  BM_DATASTREAM_ERROR,
+                                  "Can't parse speed in '%s'",
+                                  desc);
+         free(wdesc);
+         return 0;
+      }
+   }
+   /* Get options */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(tok && !bm_datastream_parse_options(&ds->parent, tok)) {
+      free(wdesc);
+      return 0;
+   }
+   /* Cleanup */
+   free(wdesc);
+   /* All is OK */
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * A segment found on disk.
+ */
+struct bm_replay_segment_s {
+   size_t reactor;
+   uint64_t seq;
+   char* path;
+};
+
+static int bm_replay_segment_cmp(const void* a,
+                                 const void* b) {
+   const struct bm_replay_segment_s* x = (const struct bm_replay_segment_s*)a;
+   const struct bm_replay_segment_s* y = (const struct bm_replay_segment_s*)b;
+   if(x->reactor != y->reactor) return x->reactor < y->reactor ? -1 : 1;
+   if(x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+   return 0;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Releases the cursors.
+ */
+static void bm_replay_cursors_free(bm_replay_datastream_t this) {
+   for(size_t i = 0; i < this->cursor_num; ++i) {
+      struct bm_replay_cursor_s* c = &this->cursors[i];
+      if(c->base) munmap(c->base, c->size);
+      for(size_t j = 0; j < c->num; ++j)
+         free(c->files[j]);
+      free(c->files);
+   }
+   free(this->cursors);
+   this->cursors = NULL;
+   this->cursor_num = 0;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Finds the segments of the capture and makes one cursor per reactor.
+ * @return The number of segments found.
+ */
+static size_t bm_replay_cursors_new(bm_replay_datastream_t this) {
+   char* pattern;
+   asprintf(&pattern, "%s.*.*", this->prefix);
+   glob_t g;
+   int err = glob(pattern, 0, NULL, &g);
+   free(pattern);
+   if(err != 0) return 0;
+   /* Keep the names that end with the reactor and sequence numbers */
+   struct bm_replay_segment_s* segs =
+      (struct bm_replay_segment_s*)malloc(g.gl_pathc * sizeof(struct bm_replay_segment_s));
+   size_t num = 0, plen = strlen(this->prefix);
+   for(size_t i = 0; i < g.gl_pathc; ++i) {
+      int end = 0;
+      if(sscanf(g.gl_pathv[i] + plen, ".%zu.%" SCNu64 "%n",
+                &segs[num].reactor, &segs[num].seq, &end) == 2 &&
+         g.gl_pathv[i][plen + end] == 0) {
+         segs[num].path = strdup(g.gl_pathv[i]);
+         ++num;
+      }
+   }
+   globfree(&g);
+   /* Group them by reactor, in order */
+   qsort(segs, num, sizeof(struct bm_replay_segment_s), bm_replay_segment_cmp);
+   for(size_t i = 0; i < num; ++i) {
+      if(i == 0 || segs[i].reactor != segs[i-1].reactor) {
+         this->cursors = (struct bm_replay_cursor_s*)
+            realloc(this->cursors, (this->cursor_num + 1) * sizeof(struct bm_replay_cursor_s));
+         memset(&this->cursors[this->cursor_num], 0, sizeof(struct bm_replay_cursor_s));
+         ++this->cursor_num;
+      }
+      struct bm_replay_cursor_s* c = &this->cursors[this->cursor_num - 1];
+      c->files = (char**)realloc(c->files, (c->num + 1) * sizeof(char*));
+      c->files[c->num++] = segs[i].path;
+   }
+   free(segs);
+   return num;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Maps a segment.
+ * @return 1 for success, 0 if the segment can't be read.
+ */
+static int bm_replay_cursor_map(bm_replay_datastream_t this,
+                                struct bm_replay_cursor_s* c) {
+   const char* path = c->files[c->cur];
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0) {
+      bm_log(BM_LOG_WARNING, "%s: can't open %s: %s",
+             this->parent.descriptor, path, strerror(errno));
+      return 0;
+   }
+   struct stat st;
+   if(fstat(fd, &st) < 0 || (size_t)st.st_size < BM_CAPTURE_HEADER) {
+      close(fd);
+      return 0;
+   }
+   c->size = st.st_size;
+   c->base = (uint8_t*)mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(c->base == MAP_FAILED) {
+      c->base = NULL;
+      bm_log(BM_LOG_WARNING, "%s: can't map %s: %s",
+             this->parent.descriptor, path, strerror(errno));
+      return 0;
+   }
+   if(memcmp(c->base, BM_CAPTURE_MAGIC, BM_CAPTURE_HEADER) != 0) {
+      bm_log(BM_LOG_WARNING, "%s: %s is not a capture segment",
+             this->parent.descriptor, path);
+      munmap(c->base, c->size);
+      c->base = NULL;
+      return 0;
+   }
+   madvise(c->base, c->size, MADV_SEQUENTIAL);
+   c->off = BM_CAPTURE_HEADER;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the next record of a cursor, moving on to the next segments
+ * as needed.
+ * @return The record, or NULL if the segments are exhausted.
+ */
+static struct bm_capture_record_s* bm_replay_cursor_peek(bm_replay_datastream_t this,
+                                                         struct bm_replay_cursor_s* c) {
+   while(c->cur < c->num) {
+      if(!c->base) {
+         if(!bm_replay_cursor_map(this, c)) {
+            ++c->cur;
+            continue;
+         }
+      }
+      if(c->off + sizeof(struct bm_capture_record_s) <= c->size) {
+         struct bm_capture_record_s* rec =
+            (struct bm_capture_record_s*)(c->base + c->off);
+         if(rec->ts != 0 &&
+            c->off + bm_capture_record_len(rec->id_len, rec->len) <= c->size)
+            return rec;
+      }
+      /* End of the segment */
+      munmap(c->base, c->size);
+      c->base = NULL;
+      ++c->cur;
+   }
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_replay_datastream_destroy(void* ds) {
+   bm_replay_datastream_t this = (bm_replay_datastream_t)ds;
+   bm_datastream_destroy(&this->parent);
+   free(this->prefix);
+   free(this);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_replay_datastream_connect(void* ds) {
+   /* Cast datastream to this type */
+   bm_replay_datastream_t this = (bm_replay_datastream_t)ds;
+   /* Start over if the stream is already connected */
+   if(this->timer != -1)
+      bm_replay_datastream_disconnect(this);
+   /* Find the segments */
+   if(bm_replay_cursors_new(this) == 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "No capture segments named %s.REACTOR.SEQUENCE",
+                               this->prefix);
+      return 0;
+   }
+   /* Make the timer, due right away */
+   this->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if(this->timer < 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error creating timer: %s",
+                               strerror(errno));
+      bm_replay_cursors_free(this);
+      return 0;
+   }
+   struct itimerspec its = { .it_value = { .tv_sec = 0, .tv_nsec = 1 } };
+   timerfd_settime(this->timer, 0, &its, NULL);
+   this->first_ts = 0;
+   this->start = 0;
+   bm_datastream_set_status(ds, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_replay_datastream_disconnect(void* ds) {
+   /* Cast datastream to this type */
+   bm_replay_datastream_t this = (bm_replay_datastream_t)ds;
+   if(this->timer != -1) {
+      close(this->timer);
+      this->timer = -1;
+   }
+   bm_replay_cursors_free(this);
+   bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_replay_datastream_send(void* ds,
+                                  const uint8_t* data,
+                                  size_t sz) {
+   /* Nothing is routed to a replay, but take what comes anyway */
+   return sz;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_replay_datastream_recv(void* ds,
+                                  uint8_t* data,
+                                  size_t sz) {
+   /* Messages are only received through recvv() */
+   errno = EAGAIN;
+   return -1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_replay_datastream_fd(void* ds) {
+   return ((bm_replay_datastream_t)ds)->timer;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_replay_datastream_recvv(void* ds,
+                                   bm_msg_t* msgs,
+                                   size_t n) {
+   /* Cast datastream to this type */
+   bm_replay_datastream_t this = (bm_replay_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Acknowledge the timer */
+   uint64_t expirations;
+   if(read(this->timer, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error reading timer: %s",
+                               strerror(errno));
+      return -1;
+   }
+   uint64_t now = bm_time_now();
+   ssize_t num = 0;
+   while(1) {
+      /* Find the earliest record among the reactors */
+      struct bm_replay_cursor_s* next = NULL;
+      struct bm_capture_record_s* rec = NULL;
+      for(size_t i = 0; i < this->cursor_num; ++i) {
+         struct bm_capture_record_s* r =
+            bm_replay_cursor_peek(this, &this->cursors[i]);
+         if(r && (!rec || r->ts < rec->ts)) {
+            next = &this->cursors[i];
+            rec = r;
+         }
+      }
+      if(!rec) {
+         /* Capture exhausted */
+         if(num > 0) return num;
+         bm_debug(ds, "recvv: capture exhausted");
+         return 0;
+      }
+      /* Replay the record once due */
+      if(this->first_ts == 0) {
+         this->first_ts = rec->ts;
+         this->start = now;
+      }
+      uint64_t due = this->start;
+      if(this->speed > 0)
+         due += (uint64_t)((rec->ts - this->first_ts) / this->speed);
+      if(due > now || (size_t)num == n) {
+         /* Wake up when it is due; right away if it already is */
+         struct itimerspec its = {
+            .it_interval = { 0, 0 },
+            .it_value = {
+               .tv_sec = due / 1000000000ULL,
+               .tv_nsec = due % 1000000000ULL
+            }
+         };
+         timerfd_settime(this->timer, TFD_TIMER_ABSTIME, &its, NULL);
+         break;
+      }
+      msgs[num] = bm_datastream_msg_new(ds, rec->len);
+      memcpy(msgs[num]->data,
+             (uint8_t*)(rec + 1) + rec->id_len,
+             rec->len);
+      msgs[num]->channel = rec->channel;
+      ++num;
+      next->off += bm_capture_record_len(rec->id_len, rec->len);
+   }
+   bm_debug(ds, "recvv: replayed %zd messages", num);
+   if(num == 0) errno = EAGAIN;
+   return num > 0 ? num : -1;
+}
+
+/****************************************/
+/****************************************/
+
+bm_replay_datastream_t bm_replay_datastream_new(const char* desc) {
+   /* Allocate memory */
+   bm_replay_datastream_t this = malloc(sizeof(struct bm_replay_datastream_s));
+   this->prefix = NULL;
+   this->speed = 1.0;
+   this->timer = -1;
+   this->cursors = NULL;
+   this->cursor_num = 0;
+   this->first_ts = 0;
+   this->start = 0;
+   /* Initialize parent */
+   bm_datastream_init(&this->parent,
+                      desc,
+                      bm_replay_datastream_destroy,
+                      bm_replay_datastream_connect,
+                      bm_replay_datastream_disconnect,
+                      bm_replay_datastream_send,
+                      bm_replay_datastream_recv,
+                      bm_replay_datastream_fd);
+   if(this->parent.status == BM_DATASTREAM_ERROR) {
+      bm_replay_datastream_destroy(this);
+      return NULL;
+   }
+   /* The records carry their channel */
+   this->parent.recvv = bm_replay_datastream_recvv;
+   this->parent.sets_channel = 1;
+   /* Don't replay to streams still connecting */
+   this->parent.self_paced = 1;
+   /* Set local attributes */
+   if(!bm_replay_datastream_parse(this, desc)) {
+      fprintf(stderr, "%s\n", this->parent.status_desc);
+      bm_replay_datastream_destroy(this);
+      return NULL;
+   }
+   /* A replay is a source only */
+   memset(this->parent.subs, 0, sizeof(this->parent.subs));
+   /* All done */
+   return this;
+}
+
+/****************************************/
+/****************************************/
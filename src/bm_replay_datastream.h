@@ -0,0 +1,64 @@
+#ifndef BM_REPLAY_DATASTREAM_H
+#define BM_REPLAY_DATASTREAM_H
+
+#include "bm_datastream.h"
+
+/*
+ * The string for replay is:
+ * replay:prefix[:speed]
+ *
+ * A replay stream reads back the capture segments written with
+ * --capture (see bm_capture.h) and publishes their messages on their
+ * original channels, in the order they were received, with their
+ * original spacing divided by speed (1 by default; 0 for as fast as
+ * possible). The segments of all the reactors are merged. The stream
+ * receives nothing and closes once the capture is exhausted.
+ */
+
+/*
+ * The position in the segments of one reactor.
+ */
+struct bm_replay_cursor_s {
+   /* The segment files, in order */
+   char** files;
+   /* The number of segment files */
+   size_t num;
+   /* The index of the current segment */
+   size_t cur;
+   /* The mapping of the current segment, NULL for none */
+   uint8_t* base;
+   /* The size of the current segment */
+   size_t size;
+   /* The offset of the next record */
+   size_t off;
+};
+
+struct bm_replay_datastream_s {
+   /* Generic datastream definition */
+   struct bm_datastream_s parent;
+   /* The prefix of the segment names */
+   char* prefix;
+   /* How much faster than recorded to replay, 0 for no delays */
+   double speed;
+   /* The timer that fires when the next record is due */
+   int timer;
+   /* One cursor per reactor that wrote segments */
+   struct bm_replay_cursor_s* cursors;
+   /* The number of cursors */
+   size_t cursor_num;
+   /* The time of the first record (ns since the epoch), 0 until the
+    * replay starts */
+   uint64_t first_ts;
+   /* When the first record was replayed (ns) */
+   uint64_t start;
+};
+typedef struct bm_replay_datastream_s* bm_replay_datastream_t;
+
+/*
+ * Creates a new replay datastream.
+ * @param desc The stream descriptor.
+ * @return The new replay datastream.
+ */
+extern bm_replay_datastream_t bm_replay_datastream_new(const char* desc);
+
+#endif
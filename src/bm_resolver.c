@@ -0,0 +1,172 @@
+#include "bm_resolver.h"
+#include "bm_time.h"
+#include <string.h>
+#include <netdb.h>
+
+/****************************************/
+/****************************************/
+
+/*
+ * Hashes a name and port (FNV-1a).
+ */
+static size_t bm_resolver_hash(const char* host,
+                               const char* port) {
+   uint32_t h = 2166136261u;
+   for(; *host; ++host) h = (h ^ (uint8_t)*host) * 16777619u;
+   h = (h ^ ':') * 16777619u;
+   for(; *port; ++port) h = (h ^ (uint8_t)*port) * 16777619u;
+   return h % BM_RESOLVER_BUCKETS;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Resolves the queued entries until the cache stops.
+ */
+static void* bm_resolver_thread(void* arg) {
+   bm_resolver_t r = (bm_resolver_t)arg;
+   struct bm_resolver_entry_s* e;
+   struct addrinfo hints, *info;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;       /* Only IPv4 is accepted */
+   hints.ai_socktype = SOCK_STREAM;
+   pthread_mutex_lock(&r->mutex);
+   while(!r->stop) {
+      /* Wait for an entry */
+      if(!r->queue_head) {
+         ++r->idle;
+         pthread_cond_wait(&r->cond, &r->mutex);
+         --r->idle;
+         continue;
+      }
+      e = r->queue_head;
+      r->queue_head = e->queue_next;
+      if(!r->queue_head) r->queue_tail = NULL;
+      /* Resolve without holding the lock; the entry stays put and
+       * nobody else touches its name */
+      pthread_mutex_unlock(&r->mutex);
+      int err = getaddrinfo(e->host, e->port, &hints, &info);
+      pthread_mutex_lock(&r->mutex);
+      e->error = err;
+      if(err == 0) {
+         memcpy(&e->addr, info->ai_addr, info->ai_addrlen);
+         e->addrlen = info->ai_addrlen;
+         freeaddrinfo(info);
+      }
+      e->expires = bm_time_now() + (err == 0 ? BM_RESOLVER_TTL : BM_RESOLVER_RETRY);
+      e->started = 0;
+   }
+   pthread_mutex_unlock(&r->mutex);
+   return NULL;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Queues an entry for resolution, and starts a thread for it if all
+ * are busy. Must be called with the lock held.
+ */
+static void bm_resolver_queue(bm_resolver_t r,
+                              struct bm_resolver_entry_s* e,
+                              uint64_t now) {
+   e->started = now;
+   e->queue_next = NULL;
+   if(r->queue_tail) r->queue_tail->queue_next = e;
+   else r->queue_head = e;
+   r->queue_tail = e;
+   if(r->idle > 0) {
+      pthread_cond_signal(&r->cond);
+   }
+   else if(r->thread_num < BM_RESOLVER_THREADS &&
+           pthread_create(&r->threads[r->thread_num], NULL,
+                          bm_resolver_thread, r) == 0) {
+      ++r->thread_num;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+void bm_resolver_init(bm_resolver_t r) {
+   memset(r->buckets, 0, sizeof(r->buckets));
+   r->queue_head = NULL;
+   r->queue_tail = NULL;
+   r->thread_num = 0;
+   r->idle = 0;
+   r->stop = 0;
+   pthread_mutex_init(&r->mutex, NULL);
+   pthread_cond_init(&r->cond, NULL);
+}
+
+/****************************************/
+/****************************************/
+
+void bm_resolver_cleanup(bm_resolver_t r) {
+   /* Stop the threads */
+   pthread_mutex_lock(&r->mutex);
+   r->stop = 1;
+   pthread_cond_broadcast(&r->cond);
+   pthread_mutex_unlock(&r->mutex);
+   for(size_t i = 0; i < r->thread_num; ++i)
+      pthread_join(r->threads[i], NULL);
+   /* Free the entries */
+   struct bm_resolver_entry_s* e;
+   for(size_t i = 0; i < BM_RESOLVER_BUCKETS; ++i) {
+      while((e = r->buckets[i])) {
+         r->buckets[i] = e->next;
+         free(e->host);
+         free(e->port);
+         free(e);
+      }
+   }
+   pthread_cond_destroy(&r->cond);
+   pthread_mutex_destroy(&r->mutex);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_resolver_lookup(bm_resolver_t r,
+                       const char* host,
+                       const char* port,
+                       struct sockaddr_storage* addr,
+                       socklen_t* addrlen,
+                       int* error) {
+   size_t b = bm_resolver_hash(host, port);
+   uint64_t now = bm_time_now();
+   int ret;
+   pthread_mutex_lock(&r->mutex);
+   /* Find the entry, or make one */
+   struct bm_resolver_entry_s* e = r->buckets[b];
+   while(e && (strcmp(e->host, host) != 0 || strcmp(e->port, port) != 0))
+      e = e->next;
+   if(!e) {
+      e = (struct bm_resolver_entry_s*)calloc(1, sizeof(struct bm_resolver_entry_s));
+      e->host = strdup(host);
+      e->port = strdup(port);
+      e->next = r->buckets[b];
+      r->buckets[b] = e;
+   }
+   /* Resolve it again once expired, still using the old address */
+   if(e->started == 0 && e->expires <= now)
+      bm_resolver_queue(r, e, now);
+   if(e->addrlen > 0) {
+      memcpy(addr, &e->addr, e->addrlen);
+      *addrlen = e->addrlen;
+      ret = 1;
+   }
+   else if(e->started != 0 && now - e->started < BM_RESOLVER_TIMEOUT) {
+      ret = 0;
+   }
+   else {
+      *error = e->started != 0 ? EAI_AGAIN : e->error;
+      ret = -1;
+   }
+   pthread_mutex_unlock(&r->mutex);
+   return ret;
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,124 @@
+#ifndef BM_RESOLVER_H
+#define BM_RESOLVER_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/*
+ * Number of buckets of the cache
+ */
+#define BM_RESOLVER_BUCKETS 256
+
+/*
+ * Maximum number of names resolved at once
+ */
+#define BM_RESOLVER_THREADS 16
+
+/*
+ * How long a resolved address is used before it is resolved again (ns)
+ */
+#define BM_RESOLVER_TTL 60000000000ULL
+
+/*
+ * How long a failure is remembered before the name is resolved again (ns)
+ */
+#define BM_RESOLVER_RETRY 1000000000ULL
+
+/*
+ * How long a resolution can take before lookups report it as failed (ns)
+ */
+#define BM_RESOLVER_TIMEOUT 5000000000ULL
+
+/*
+ * A cache of resolved server addresses.
+ * Lookups never block: names not in the cache yet are resolved in the
+ * background by a pool of threads, many at once, and the caller looks
+ * them up again later. Once resolved, an address is kept for
+ * BM_RESOLVER_TTL, then resolved again in the background while the old
+ * one is still used.
+ */
+
+/*
+ * A name and port, and what they resolve to.
+ */
+struct bm_resolver_entry_s {
+   /* The server name */
+   char* host;
+   /* The port */
+   char* port;
+   /* The address, if any */
+   struct sockaddr_storage addr;
+   /* The length of the address, 0 if not resolved */
+   socklen_t addrlen;
+   /* The getaddrinfo() error of the last resolution, 0 if none */
+   int error;
+   /* When the entry must be resolved again */
+   uint64_t expires;
+   /* When the resolution in progress started, 0 if none */
+   uint64_t started;
+   /* Next entry in the bucket */
+   struct bm_resolver_entry_s* next;
+   /* Next entry waiting to be resolved */
+   struct bm_resolver_entry_s* queue_next;
+};
+
+/*
+ * The cache.
+ */
+struct bm_resolver_s {
+   /* The entries, by hash of the name and port */
+   struct bm_resolver_entry_s* buckets[BM_RESOLVER_BUCKETS];
+   /* The entries waiting to be resolved, oldest first */
+   struct bm_resolver_entry_s* queue_head;
+   struct bm_resolver_entry_s* queue_tail;
+   /* The resolving threads, started when needed */
+   pthread_t threads[BM_RESOLVER_THREADS];
+   /* The number of threads */
+   size_t thread_num;
+   /* The number of threads waiting for work */
+   size_t idle;
+   /* Set to 1 to make the threads stop */
+   int stop;
+   /* Protects the cache */
+   pthread_mutex_t mutex;
+   /* Signals new entries to resolve */
+   pthread_cond_t cond;
+};
+typedef struct bm_resolver_s* bm_resolver_t;
+
+/*
+ * Initializes the cache.
+ * @param r The cache.
+ */
+extern void bm_resolver_init(bm_resolver_t r);
+
+/*
+ * Stops the threads and releases the cache.
+ * Waits for the resolutions in progress to complete.
+ * @param r The cache.
+ */
+extern void bm_resolver_cleanup(bm_resolver_t r);
+
+/*
+ * Looks up the IPv4 address of a server, and starts resolving it in
+ * the background if needed.
+ * Can be called from any thread.
+ * @param r The cache.
+ * @param host The server name.
+ * @param port The port.
+ * @param addr Where the address is stored.
+ * @param addrlen Where the length of the address is stored.
+ * @param error Where the getaddrinfo() error is stored on failure.
+ * @return 1 if the address is known, 0 if it is being resolved, or -1
+ * if the last resolution failed or is taking too long.
+ */
+extern int bm_resolver_lookup(bm_resolver_t r,
+                              const char* host,
+                              const char* port,
+                              struct sockaddr_storage* addr,
+                              socklen_t* addrlen,
+                              int* error);
+
+#endif
@@ -0,0 +1,64 @@
+#include "bm_ring.h"
+
+/****************************************/
+/****************************************/
+
+bm_ring_t bm_ring_new(size_t capacity) {
+   size_t sz = 2;
+   while(sz < capacity) sz <<= 1;
+   bm_ring_t r = (bm_ring_t)aligned_alloc(BM_CACHE_LINE,
+                                          sizeof(struct bm_ring_s));
+   r->entries = (struct bm_ring_entry_s*)malloc(
+      sz * sizeof(struct bm_ring_entry_s));
+   r->mask = sz - 1;
+   atomic_init(&r->head, 0);
+   atomic_init(&r->tail, 0);
+   r->tail_cache = 0;
+   r->head_cache = 0;
+   return r;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_ring_destroy(bm_ring_t r) {
+   free(r->entries);
+   free(r);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_ring_push(bm_ring_t r,
+                 void* dest,
+                 void* data) {
+   size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+   if(head - r->tail_cache > r->mask) {
+      /* Looks full, check where the consumer really is */
+      r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+      if(head - r->tail_cache > r->mask) return 0;
+   }
+   r->entries[head & r->mask].dest = dest;
+   r->entries[head & r->mask].data = data;
+   atomic_store_explicit(&r->head, head + 1, memory_order_release);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_ring_pop(bm_ring_t r,
+                struct bm_ring_entry_s* e) {
+   size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+   if(tail == r->head_cache) {
+      /* Looks empty, check where the producer really is */
+      r->head_cache = atomic_load(&r->head);
+      if(tail == r->head_cache) return 0;
+   }
+   *e = r->entries[tail & r->mask];
+   atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,78 @@
+#ifndef BM_RING_H
+#define BM_RING_H
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "bm_queue.h"
+
+/*
+ * An entry of a ring: something to deliver and where to deliver it.
+ */
+struct bm_ring_entry_s {
+   /* The destination */
+   void* dest;
+   /* The delivered pointer */
+   void* data;
+};
+
+/*
+ * A bounded lock-free ring of pointer pairs, for exactly one producer
+ * thread and one consumer thread.
+ * Each side keeps a private copy of the position of the other side and
+ * only reads the shared one when the copy says the ring is full or
+ * empty, so in the steady state pushing and popping touch no cache
+ * line written by the other thread besides the entries themselves.
+ */
+struct bm_ring_s {
+   /* The entries */
+   struct bm_ring_entry_s* entries;
+   /* Capacity - 1; the capacity is a power of two */
+   size_t mask;
+   /* Position of the next push, written by the producer */
+   _Alignas(BM_CACHE_LINE) atomic_size_t head;
+   /* The producer's copy of tail */
+   size_t tail_cache;
+   /* Position of the next pop, written by the consumer */
+   _Alignas(BM_CACHE_LINE) atomic_size_t tail;
+   /* The consumer's copy of head */
+   size_t head_cache;
+};
+typedef struct bm_ring_s* bm_ring_t;
+
+/*
+ * Creates a new ring.
+ * @param capacity The minimum capacity; it is rounded up to a power of two.
+ * @return The new ring.
+ */
+extern bm_ring_t bm_ring_new(size_t capacity);
+
+/*
+ * Destroys a ring.
+ * The stored pointers are not freed.
+ * @param r The ring.
+ */
+extern void bm_ring_destroy(bm_ring_t r);
+
+/*
+ * Appends an entry to the ring.
+ * Must be called by the producer thread only.
+ * @param r The ring.
+ * @param dest The destination.
+ * @param data The delivered pointer.
+ * @return 1 for success, 0 if the ring is full.
+ */
+extern int bm_ring_push(bm_ring_t r,
+                        void* dest,
+                        void* data);
+
+/*
+ * Removes the oldest entry from the ring.
+ * Must be called by the consumer thread only.
+ * @param r The ring.
+ * @param e Where the entry is stored.
+ * @return 1 for success, 0 if the ring is empty.
+ */
+extern int bm_ring_pop(bm_ring_t r,
+                       struct bm_ring_entry_s* e);
+
+#endif
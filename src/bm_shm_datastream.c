@@ -0,0 +1,802 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "bm_shm_datastream.h"
+#include "bm_debug.h"
+#include "bm_log.h"
+
+/*
+ * Size of the header of a record
+ */
+#define BM_SHM_DATASTREAM_RECORD 8
+
+/*
+ * Smallest ring size
+ */
+#define BM_SHM_DATASTREAM_RING_MIN (64 * 1024)
+
+/****************************************/
+/****************************************/
+
+void bm_shm_datastream_destroy(void* ds);
+int bm_shm_datastream_connect(void* ds);
+int bm_shm_datastream_reconnect(void* ds);
+int bm_shm_datastream_handshake(void* ds);
+void bm_shm_datastream_disconnect(void* ds);
+ssize_t bm_shm_datastream_send(void* ds, const uint8_t* data, size_t sz);
+ssize_t bm_shm_datastream_recv(void* ds, uint8_t* data, size_t sz);
+int bm_shm_datastream_fd(void* ds);
+ssize_t bm_shm_datastream_sendv(void* ds, bm_msg_t* msgs, size_t n, size_t off);
+ssize_t bm_shm_datastream_recvv(void* ds, bm_msg_t* msgs, size_t n);
+bm_datastream_t bm_shm_datastream_accept(void* ds);
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the space a message takes in a ring.
+ */
+static inline uint64_t bm_shm_datastream_record_len(size_t len) {
+   return BM_SHM_DATASTREAM_RECORD + ((len + 7) & ~(uint64_t)7);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_shm_datastream_parse(bm_shm_datastream_t ds,
+                            const char* desc) {
+   /* Duplicate string for strtok_r */
+   char* wdesc = strdup(desc);
+   /* Buffer pointer for strtok_r */
+   char* saveptr = NULL;
+   /* Get id (and discard it) */
+   char* tok = strtok_r(wdesc, ":", &saveptr);
+   /* Get protocol (and discard it) */
+   tok = strtok_r(NULL, ":", &saveptr);
+   /* Get verbosity (and discard it) */
+   tok = strtok_r(NULL, ":", &saveptr);
+   /* Get path */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(!tok || strlen(tok) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Can't parse path in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
+   ds->path = strdup(tok);
+   /* Get options: keep the ring size, pass the rest on */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(tok) {
+      ds->options = strdup(tok);
+      char* rest = (char*)calloc(strlen(tok) + 1, 1);
+      char* osaveptr = NULL;
+      for(char* opt = strtok_r(tok, ",", &osaveptr);
+          opt != NULL;
+          opt = strtok_r(NULL, ",", &osaveptr)) {
+         if(strncmp(opt, "ring=", 5) == 0) {
+            size_t size;
+            if(!bm_datastream_parse_size(opt + 5, &size) ||
+               size < BM_SHM_DATASTREAM_RING_MIN) {
+               bm_datastream_set_status(ds,
+                                        BM_DATASTREAM_ERROR,
+                                        "Can't parse ring size '%s' in '%s'",
+                                        opt + 5, desc);
+               free(rest);
+               free(wdesc);
+               return 0;
+            }
+            ds->ring_size = size;
+            continue;
+         }
+         if(*rest) strcat(rest, ",");
+         strcat(rest, opt);
+      }
+      int ok = !*rest || bm_datastream_parse_options(&ds->parent, rest);
+      free(rest);
+      if(!ok) {
+         free(wdesc);
+         return 0;
+      }
+   }
+   /* Records delimit the messages by themselves */
+   if(ds->parent.framing.type != BM_FRAMING_FIXED &&
+      ds->parent.framing.type != BM_FRAMING_DATAGRAM) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Only fixed and datagram framing are supported in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
+   /* Cleanup */
+   free(wdesc);
+   /* All is OK */
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_shm_datastream_destroy(void* ds) {
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   bm_datastream_destroy(&this->parent);
+   free(this->path);
+   free(this->options);
+   free(this);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Maps a segment and sets up the polling of a linked stream.
+ * @param this The datastream, whose socket is linked to the peer.
+ * @param fd The segment.
+ * @param side 0 for the listening side, 1 for the peer.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_shm_datastream_map(bm_shm_datastream_t this,
+                                 int fd,
+                                 int side) {
+   struct stat st;
+   if(fstat(fd, &st) < 0) return 0;
+   this->map_size = st.st_size;
+   if(this->map_size < BM_SHM_DATASTREAM_HEADER) {
+      errno = EPROTO;
+      return 0;
+   }
+   void* base = mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if(base == MAP_FAILED) return 0;
+   this->shm = (struct bm_shm_header_s*)base;
+   /* A segment made by the peer must hold what its header says */
+   uint64_t size = this->shm->size;
+   if(memcmp(this->shm->magic, BM_SHM_DATASTREAM_MAGIC, 8) != 0 ||
+      size < BM_SHM_DATASTREAM_RING_MIN ||
+      (size & (size - 1)) != 0 ||
+      this->map_size != BM_SHM_DATASTREAM_HEADER + 2 * size) {
+      errno = EPROTO;
+      return 0;
+   }
+   this->ring_size = size;
+   this->rx = &this->shm->rings[1 - side];
+   this->tx = &this->shm->rings[side];
+   this->rx_data = (uint8_t*)base + BM_SHM_DATASTREAM_HEADER + (1 - side) * size;
+   this->tx_data = (uint8_t*)base + BM_SHM_DATASTREAM_HEADER + side * size;
+   this->blocked = 0;
+   this->kicked = 0;
+   /* Wake up for the records and for the end of the link alike; the
+    * socket of a peer is polled already, for the handshake */
+   struct epoll_event ev = { .events = EPOLLIN };
+   if(this->poll < 0) {
+      this->poll = epoll_create1(EPOLL_CLOEXEC);
+      if(this->poll < 0 ||
+         epoll_ctl(this->poll, EPOLL_CTL_ADD, this->sock, &ev) < 0)
+         return 0;
+   }
+   return epoll_ctl(this->poll, EPOLL_CTL_ADD, this->wake, &ev) == 0;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Binds the path of a listening stream and listens on it.
+ * A socket left over at the path by an earlier run is replaced.
+ * @param this The datastream.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_shm_datastream_bind(bm_shm_datastream_t this) {
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, this->path);
+   struct stat st;
+   if(lstat(this->path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(this->path);
+   this->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+   if(this->sock < 0 ||
+      bind(this->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(this->sock, SOMAXCONN) < 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't listen: %s",
+                               strerror(errno));
+      if(this->sock >= 0) close(this->sock);
+      this->sock = -1;
+      return 0;
+   }
+   bm_datastream_set_status(this, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_shm_datastream_connect(void* ds) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Disconnect if the stream is already connected */
+   if(this->sock != -1)
+      bm_shm_datastream_disconnect(this);
+   /* Listening streams wait for the peers to connect */
+   if(this->listening)
+      return bm_shm_datastream_bind(this);
+   /* Peers only link if the segment is there already */
+   return bm_shm_datastream_reconnect(this) > 0;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_shm_datastream_reconnect(void* ds) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Disconnect if the stream is still connected */
+   if(this->sock != -1)
+      bm_shm_datastream_disconnect(this);
+   /* Connect, and poll the socket for the segment and the eventfds */
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, this->path);
+   struct epoll_event ev = { .events = EPOLLIN };
+   this->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if(this->sock < 0 ||
+      connect(this->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      (this->poll = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      epoll_ctl(this->poll, EPOLL_CTL_ADD, this->sock, &ev) < 0) {
+      int errnum = errno;
+      bm_shm_datastream_disconnect(this);
+      bm_datastream_set_status(ds, BM_DATASTREAM_ERROR, strerror(errnum));
+      errno = errnum;
+      return -1;
+   }
+   bm_datastream_set_status(ds, BM_DATASTREAM_CONNECTING, "connecting");
+   /* The listening side might have answered already */
+   return bm_shm_datastream_handshake(this);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_shm_datastream_handshake(void* ds) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Get the segment and the eventfds */
+   char magic[8];
+   struct iovec iov = { .iov_base = magic, .iov_len = sizeof(magic) };
+   union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(3 * sizeof(int))];
+   } cmsg;
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cmsg.buf;
+   msg.msg_controllen = sizeof(cmsg.buf);
+   int fds[3] = { -1, -1, -1 };
+   ssize_t ret = recvmsg(this->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+   if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+   if(ret <= 0) {
+      int errnum = ret < 0 ? errno : ECONNRESET;
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Can't link to %s: %s",
+                               this->path,
+                               strerror(errnum));
+      errno = errnum;
+      return -1;
+   }
+   struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+   if(c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+      c->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+      memcpy(fds, CMSG_DATA(c), sizeof(fds));
+   this->wake = fds[2];
+   this->kick = fds[1];
+   int ok = fds[0] >= 0 &&
+      ret == sizeof(magic) &&
+      memcmp(magic, BM_SHM_DATASTREAM_MAGIC, sizeof(magic)) == 0 &&
+      bm_shm_datastream_map(this, fds[0], 1);
+   int errnum = fds[0] >= 0 && ret == sizeof(magic) ? errno : EPROTO;
+   if(fds[0] >= 0) close(fds[0]);
+   if(ok &&
+      bm_framing_frame_max(&this->parent.framing) +
+      BM_SHM_DATASTREAM_RECORD > this->ring_size / 2) {
+      ok = 0;
+      errnum = EMSGSIZE;
+   }
+   if(!ok) {
+      /* The stream is disconnected along with its segment once closed */
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Can't link to %s: %s",
+                               this->path,
+                               strerror(errnum));
+      errno = errnum;
+      return -1;
+   }
+   bm_datastream_set_status(ds, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_shm_datastream_disconnect(void* ds) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Closing the socket tells the peer */
+   if(this->sock != -1) {
+      close(this->sock);
+      this->sock = -1;
+      if(this->listening) unlink(this->path);
+   }
+   if(this->poll != -1) close(this->poll);
+   if(this->wake != -1) close(this->wake);
+   if(this->kick != -1) close(this->kick);
+   this->poll = -1;
+   this->wake = -1;
+   this->kick = -1;
+   if(this->shm) munmap(this->shm, this->map_size);
+   this->shm = NULL;
+   bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Wakes the other side up.
+ */
+static void bm_shm_datastream_kick(int fd) {
+   uint64_t v = 1;
+   if(write(fd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+      /* The peer finds out about the end of the link on its own */
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Copies a message into the ring written by this side, without
+ * publishing it.
+ * @param head The position to write at, advanced.
+ * @param tail The position of the reader, updated if there is no room.
+ * @return 1 if the message was written, 0 if there is no room.
+ */
+static int bm_shm_datastream_put(bm_shm_datastream_t this,
+                                 const uint8_t* data,
+                                 size_t len,
+                                 uint64_t* head,
+                                 uint64_t* tail) {
+   uint64_t size = this->ring_size;
+   uint64_t need = bm_shm_datastream_record_len(len);
+   uint64_t pos = *head & (size - 1);
+   uint64_t skip = pos + need > size ? size - pos : 0;
+   if(*head + skip + need - *tail > size) {
+      *tail = atomic_load_explicit(&this->tx->tail, memory_order_acquire);
+      if(*head + skip + need - *tail > size) return 0;
+   }
+   if(skip > 0) {
+      /* Records don't straddle the end of the ring */
+      *(uint32_t*)(this->tx_data + pos) = BM_SHM_DATASTREAM_WRAP;
+      *head += skip;
+      pos = 0;
+   }
+   uint32_t hdr[2] = { len, 0 };
+   memcpy(this->tx_data + pos, hdr, sizeof(hdr));
+   memcpy(this->tx_data + pos + BM_SHM_DATASTREAM_RECORD, data, len);
+   *head += need;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Publishes the records written so far, waking the reader up if it
+ * sleeps.
+ */
+static void bm_shm_datastream_publish(bm_shm_datastream_t this,
+                                      uint64_t head) {
+   atomic_store_explicit(&this->tx->head, head, memory_order_release);
+   atomic_thread_fence(memory_order_seq_cst);
+   if(atomic_load_explicit(&this->tx->reader_waiting, memory_order_relaxed) &&
+      atomic_exchange(&this->tx->reader_waiting, 0))
+      bm_shm_datastream_kick(this->kick);
+   if(this->blocked) {
+      this->blocked = 0;
+      atomic_store_explicit(&this->tx->writer_waiting, 0, memory_order_relaxed);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Takes note that the ring written by this side is full, and looks
+ * at it once more.
+ * @return 1 if there is room after all, 0 otherwise.
+ */
+static int bm_shm_datastream_block(bm_shm_datastream_t this,
+                                   uint64_t head,
+                                   size_t len) {
+   this->blocked = 1;
+   atomic_store(&this->tx->writer_waiting, 1);
+   uint64_t tail = atomic_load(&this->tx->tail);
+   return head + 2 * bm_shm_datastream_record_len(len) - tail <= this->ring_size;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_shm_datastream_send(void* ds,
+                               const uint8_t* data,
+                               size_t sz) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   uint64_t head = atomic_load_explicit(&this->tx->head, memory_order_relaxed);
+   uint64_t tail = atomic_load_explicit(&this->tx->tail, memory_order_acquire);
+   while(!bm_shm_datastream_put(this, data, sz, &head, &tail)) {
+      if(!bm_shm_datastream_block(this, head, sz)) {
+         errno = EAGAIN;
+         return -1;
+      }
+   }
+   bm_shm_datastream_publish(this, head);
+   return sz;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_shm_datastream_recv(void* ds,
+                               uint8_t* data,
+                               size_t sz) {
+   /* Messages are only received through recvv() */
+   errno = EAGAIN;
+   return -1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_shm_datastream_fd(void* ds) {
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   return this->listening ? this->sock : this->poll;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_shm_datastream_sendv(void* ds,
+                                bm_msg_t* msgs,
+                                size_t n,
+                                size_t off) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Copy as many messages as fit; records are never written
+    * partially, so off is always 0 */
+   uint64_t head = atomic_load_explicit(&this->tx->head, memory_order_relaxed);
+   uint64_t tail = atomic_load_explicit(&this->tx->tail, memory_order_acquire);
+   ssize_t tot = 0;
+   size_t i = 0;
+   while(i < n) {
+      if(bm_shm_datastream_put(this, msgs[i]->data, msgs[i]->len, &head, &tail)) {
+         tot += msgs[i]->len;
+         ++i;
+      }
+      else if(i > 0 || !bm_shm_datastream_block(this, head, msgs[i]->len)) {
+         break;
+      }
+   }
+   bm_debug(ds, "sendv: wrote %zu of %zu messages", i, n);
+   if(i == 0) {
+      /* The reader writes the eventfd of this side once it makes room */
+      errno = EAGAIN;
+      return -1;
+   }
+   bm_shm_datastream_publish(this, head);
+   return tot;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Looks at the socket of a linked stream.
+ * @return 1 if the peer is still there, 0 otherwise.
+ */
+static int bm_shm_datastream_alive(bm_shm_datastream_t this) {
+   uint8_t buf[64];
+   ssize_t ret;
+   /* The peer is not supposed to send anything, discard it */
+   while((ret = recv(this->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+   return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_shm_datastream_recvv(void* ds,
+                                bm_msg_t* msgs,
+                                size_t n) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   uint64_t size = this->ring_size;
+   size_t max = bm_framing_frame_max(&this->parent.framing);
+   uint64_t tail = atomic_load_explicit(&this->rx->tail, memory_order_relaxed);
+   uint64_t head = atomic_load_explicit(&this->rx->head, memory_order_acquire);
+   ssize_t num = 0;
+   while(1) {
+      /* Copy the records out */
+      while((size_t)num < n && tail != head) {
+         uint64_t pos = tail & (size - 1);
+         uint32_t len;
+         memcpy(&len, this->rx_data + pos, sizeof(len));
+         if(len == BM_SHM_DATASTREAM_WRAP) {
+            tail += size - pos;
+            continue;
+         }
+         if(len > max ||
+            pos + bm_shm_datastream_record_len(len) > size) {
+            /* The peer does not follow the format */
+            bm_shm_datastream_disconnect(this);
+            bm_datastream_set_status(this,
+                                     BM_DATASTREAM_ERROR,
+                                     "Invalid record received");
+            errno = EPROTO;
+            return num > 0 ? num : -1;
+         }
+         msgs[num] = bm_datastream_msg_new(ds, len);
+         memcpy(msgs[num]->data, this->rx_data + pos + BM_SHM_DATASTREAM_RECORD, len);
+         tail += bm_shm_datastream_record_len(len);
+         ++num;
+      }
+      if(num > 0) {
+         /* Free the records, and tell a writer that waits for room */
+         atomic_store_explicit(&this->rx->tail, tail, memory_order_release);
+         atomic_thread_fence(memory_order_seq_cst);
+         if(atomic_load_explicit(&this->rx->writer_waiting, memory_order_relaxed))
+            bm_shm_datastream_kick(this->kick);
+         return num;
+      }
+      /* The ring is empty, get ready to sleep */
+      uint64_t v;
+      if(read(this->wake, &v, sizeof(v)) < 0) {
+         /* EAGAIN: nothing to clear */
+      }
+      this->kicked = 0;
+      /* The peer might be gone */
+      if(!bm_shm_datastream_alive(this)) return 0;
+      atomic_store(&this->rx->reader_waiting, 1);
+      head = atomic_load(&this->rx->head);
+      if(head != tail) {
+         atomic_store(&this->rx->reader_waiting, 0);
+         continue;
+      }
+      /* The last wakeup of a writer waiting for room, sent once the
+       * reader emptied the ring, might have just been cleared */
+      if(this->blocked &&
+         atomic_load(&this->tx->head) == atomic_load(&this->tx->tail)) {
+         bm_shm_datastream_kick(this->wake);
+         this->kicked = 1;
+      }
+      errno = EAGAIN;
+      return -1;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Sets up the segment and the eventfds of a peer that just connected,
+ * and passes them to the peer.
+ * @param peer The stream of the peer, whose socket is linked.
+ * @param ring_size The size of the rings.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_shm_datastream_offer(bm_shm_datastream_t peer,
+                                   uint64_t ring_size) {
+   size_t map_size = BM_SHM_DATASTREAM_HEADER + 2 * ring_size;
+   int fd = memfd_create("blabbermouth", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   int peer_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   peer->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   peer->kick = peer_wake;
+   if(fd < 0 || peer->wake < 0 || peer_wake < 0 ||
+      ftruncate(fd, map_size) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+      if(fd >= 0) close(fd);
+      return 0;
+   }
+   /* A fresh memfd is all zeroes, counters included */
+   struct bm_shm_header_s hdr;
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, BM_SHM_DATASTREAM_MAGIC, sizeof(hdr.magic));
+   hdr.size = ring_size;
+   if(pwrite(fd, &hdr, offsetof(struct bm_shm_header_s, rings), 0) < 0 ||
+      !bm_shm_datastream_map(peer, fd, 0)) {
+      close(fd);
+      return 0;
+   }
+   /* Both readers start asleep */
+   atomic_store(&peer->shm->rings[0].reader_waiting, 1);
+   atomic_store(&peer->shm->rings[1].reader_waiting, 1);
+   /* Hand everything over in one packet */
+   char magic[8];
+   memcpy(magic, BM_SHM_DATASTREAM_MAGIC, sizeof(magic));
+   struct iovec iov = { .iov_base = magic, .iov_len = sizeof(magic) };
+   union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(3 * sizeof(int))];
+   } cmsg;
+   memset(&cmsg, 0, sizeof(cmsg));
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cmsg.buf;
+   msg.msg_controllen = sizeof(cmsg.buf);
+   struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+   c->cmsg_level = SOL_SOCKET;
+   c->cmsg_type = SCM_RIGHTS;
+   c->cmsg_len = CMSG_LEN(3 * sizeof(int));
+   int fds[3] = { fd, peer->wake, peer_wake };
+   memcpy(CMSG_DATA(c), fds, sizeof(fds));
+   ssize_t sent = sendmsg(peer->sock, &msg, MSG_NOSIGNAL);
+   close(fd);
+   return sent == sizeof(magic);
+}
+
+/****************************************/
+/****************************************/
+
+bm_datastream_t bm_shm_datastream_accept(void* ds) {
+   /* Cast datastream to this type */
+   bm_shm_datastream_t this = (bm_shm_datastream_t)ds;
+   /* Get the next peer */
+   int fd = accept4(this->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if(fd < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+         int errnum = errno;
+         bm_log(BM_LOG_ERROR, "%s: Can't accept peer: %s",
+                this->parent.descriptor,
+                strerror(errnum));
+         errno = errnum;
+      }
+      return NULL;
+   }
+   /* The peer gets a descriptor like an outbound stream, with an id
+    * made unique by a counter */
+   char* desc;
+   asprintf(&desc, "%s#%zu:shm:%d:%s%s%s",
+            this->parent.id,
+            ++this->accepted_num,
+            this->parent.verbose,
+            this->path,
+            this->options ? ":" : "",
+            this->options ? this->options : "");
+   bm_shm_datastream_t peer = bm_shm_datastream_new(desc);
+   free(desc);
+   if(!peer) {
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+   }
+   peer->sock = fd;
+   /* Round the rings up to a power of two that holds two of the
+    * longest messages */
+   uint64_t size = BM_SHM_DATASTREAM_RING_MIN;
+   while(size < this->ring_size ||
+         size / 2 < bm_framing_frame_max(&this->parent.framing) + BM_SHM_DATASTREAM_RECORD)
+      size <<= 1;
+   if(!bm_shm_datastream_offer(peer, size)) {
+      bm_log(BM_LOG_ERROR, "%s: Can't set up shared memory for peer: %s",
+             this->parent.descriptor,
+             strerror(errno));
+      bm_shm_datastream_destroy(peer);
+      errno = EINVAL;
+      return NULL;
+   }
+   peer->parent.verbose = this->parent.verbose;
+   peer->parent.accepted = 1;
+   /* Only the peer can connect again */
+   peer->parent.reconnect = NULL;
+   peer->parent.handshake = NULL;
+   bm_datastream_set_status(peer, BM_DATASTREAM_READY, "ready");
+   return &peer->parent;
+}
+
+/****************************************/
+/****************************************/
+
+bm_shm_datastream_t bm_shm_datastream_new(const char* desc) {
+   /* Allocate memory */
+   bm_shm_datastream_t this = malloc(sizeof(struct bm_shm_datastream_s));
+   this->path = NULL;
+   this->options = NULL;
+   this->listening = 0;
+   this->accepted_num = 0;
+   this->sock = -1;
+   this->poll = -1;
+   this->wake = -1;
+   this->kick = -1;
+   this->shm = NULL;
+   this->map_size = 0;
+   this->ring_size = BM_SHM_DATASTREAM_RING;
+   this->rx = NULL;
+   this->rx_data = NULL;
+   this->tx = NULL;
+   this->tx_data = NULL;
+   this->blocked = 0;
+   this->kicked = 0;
+   /* Initialize parent */
+   bm_datastream_init(&this->parent,
+                      desc,
+                      bm_shm_datastream_destroy,
+                      bm_shm_datastream_connect,
+                      bm_shm_datastream_disconnect,
+                      bm_shm_datastream_send,
+                      bm_shm_datastream_recv,
+                      bm_shm_datastream_fd);
+   if(this->parent.status == BM_DATASTREAM_ERROR) {
+      bm_shm_datastream_destroy(this);
+      return NULL;
+   }
+   /* Copy whole messages in and out of the rings */
+   this->parent.sendv = bm_shm_datastream_sendv;
+   this->parent.recvv = bm_shm_datastream_recvv;
+   this->parent.room_on_read = 1;
+   this->parent.reconnect = bm_shm_datastream_reconnect;
+   this->parent.handshake = bm_shm_datastream_handshake;
+   /* Set local attributes */
+   if(!bm_shm_datastream_parse(this, desc)) {
+      fprintf(stderr, "%s\n", this->parent.status_desc);
+      bm_shm_datastream_destroy(this);
+      return NULL;
+   }
+   /* All done */
+   return this;
+}
+
+/****************************************/
+/****************************************/
+
+bm_shm_datastream_t bm_shm_datastream_listen_new(const char* desc) {
+   bm_shm_datastream_t this = bm_shm_datastream_new(desc);
+   if(!this) return NULL;
+   this->listening = 1;
+   this->parent.accept = bm_shm_datastream_accept;
+   this->parent.room_on_read = 0;
+   this->parent.reconnect = NULL;
+   this->parent.handshake = NULL;
+   return this;
+}
+
+/****************************************/
+/****************************************/
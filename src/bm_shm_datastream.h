@@ -0,0 +1,155 @@
+#ifndef BM_SHM_DATASTREAM_H
+#define BM_SHM_DATASTREAM_H
+
+#include "bm_datastream.h"
+
+/*
+ * The string for shm connect is:
+ * shm:path[:options]
+ * The string for shm listen is:
+ * shmlisten:path[:options]
+ *
+ * A shared memory stream links two processes of the same host through
+ * a pair of rings in a memory segment they both map, one ring per
+ * direction, so messages go across without system calls as long as
+ * the reader keeps up.
+ *
+ * A listening stream waits for the peers on the Unix domain socket at
+ * path (SOCK_SEQPACKET). For each peer that connects, it makes a new
+ * segment (a memfd) and two eventfds, and passes them to the peer in a
+ * single packet holding the magic string and the three descriptors
+ * (SCM_RIGHTS), in this order: segment, eventfd that wakes the
+ * listening side up, eventfd that wakes the peer up. The peer becomes a
+ * new stream ID#N. The socket stays open: either side closing it ends
+ * the link. A connecting stream waits for the packet in its event loop,
+ * and links again after a backoff once the link ends or can't be made,
+ * like a unix stream. Besides the stream options, listening streams accept
+ * ring=SIZE, the size of each ring (default: 1M, rounded up to a power
+ * of two).
+ *
+ * The segment starts with a struct bm_shm_header_s, padded to
+ * BM_SHM_DATASTREAM_HEADER bytes, followed by the data of ring 0, from
+ * the listening side to the peer, and that of ring 1, the other way.
+ * Each message is a record: its length as a 32-bit integer, 4 bytes
+ * set to 0, then the payload, padded to a multiple of 8 bytes. A length
+ * of BM_SHM_DATASTREAM_WRAP means the rest of the ring is unused and
+ * the next record is at its start. Records never straddle the end of
+ * the ring.
+ *
+ * The writer of a ring copies records in, then publishes them by
+ * advancing head (release); the reader copies them out and frees them
+ * by advancing tail. The reader sleeps in epoll on its eventfd: before
+ * that, it sets reader_waiting and looks at head once more; after
+ * publishing, the writer wakes a waiting reader up by clearing
+ * reader_waiting and writing its eventfd. A writer that finds no room
+ * sets writer_waiting and looks at tail once more; as long as it is
+ * set, the reader writes the eventfd of the writer after freeing
+ * records. Both sides use sequentially consistent fences between
+ * setting their flag and looking at the other side's counter.
+ */
+
+/*
+ * The magic string at the start of a segment
+ */
+#define BM_SHM_DATASTREAM_MAGIC "BMSHM001"
+
+/*
+ * Size of the header of a segment
+ */
+#define BM_SHM_DATASTREAM_HEADER 4096
+
+/*
+ * Default size of a ring
+ */
+#define BM_SHM_DATASTREAM_RING (1024 * 1024)
+
+/*
+ * Record length marking the end of the data before the ring wraps
+ */
+#define BM_SHM_DATASTREAM_WRAP 0xFFFFFFFFu
+
+/*
+ * The counters of a ring, shared by the two processes.
+ */
+struct bm_shm_ring_s {
+   /* Bytes written so far, advanced by the writer */
+   _Alignas(64) atomic_uint_least64_t head;
+   /* Set by the reader before it sleeps, cleared by the writer when it
+    * wakes the reader up */
+   atomic_uint reader_waiting;
+   /* Bytes read so far, advanced by the reader */
+   _Alignas(64) atomic_uint_least64_t tail;
+   /* Set by the writer while it waits for room, cleared by the writer */
+   atomic_uint writer_waiting;
+};
+
+/*
+ * The header of a segment.
+ */
+struct bm_shm_header_s {
+   /* BM_SHM_DATASTREAM_MAGIC */
+   char magic[8];
+   /* The size of the data of each ring, a power of two */
+   uint64_t size;
+   /* Ring 0 from the listening side, ring 1 to it */
+   struct bm_shm_ring_s rings[2];
+};
+
+struct bm_shm_datastream_s {
+   /* Generic datastream definition */
+   struct bm_datastream_s parent;
+   /* Path of the Unix domain socket */
+   char* path;
+   /* Stream options, passed on to accepted peers */
+   char* options;
+   /* Whether the stream listens for peers rather than connecting */
+   int listening;
+   /* Number of peers accepted so far */
+   size_t accepted_num;
+   /* The listening socket, or the socket that links to the peer */
+   int sock;
+   /* The epoll instance polled for the stream: the eventfd that wakes
+    * this side up and the socket */
+   int poll;
+   /* The eventfd that wakes this side up */
+   int wake;
+   /* The eventfd that wakes the peer up */
+   int kick;
+   /* The segment, NULL if not mapped */
+   struct bm_shm_header_s* shm;
+   /* The size of the mapping */
+   size_t map_size;
+   /* The size of the rings */
+   uint64_t ring_size;
+   /* The ring read by this side and its data */
+   struct bm_shm_ring_s* rx;
+   uint8_t* rx_data;
+   /* The ring written by this side and its data */
+   struct bm_shm_ring_s* tx;
+   uint8_t* tx_data;
+   /* Whether this side waits for room to write */
+   int blocked;
+   /* Whether the eventfd of this side was written by this side since
+    * it was last read, to be polled again */
+   int kicked;
+};
+typedef struct bm_shm_datastream_s* bm_shm_datastream_t;
+
+/*
+ * Creates a new shared memory datastream.
+ * @param desc The stream descriptor.
+ * @return The new shared memory datastream.
+ */
+extern bm_shm_datastream_t bm_shm_datastream_new(const char* desc);
+
+/*
+ * Creates a new listening shared memory datastream.
+ * Connecting the stream binds the path and listens on it; every peer
+ * that connects gets a segment of its own and becomes a new shared
+ * memory datastream with the same verbosity and options.
+ * @param desc The stream descriptor.
+ * @return The new shared memory datastream.
+ */
+extern bm_shm_datastream_t bm_shm_datastream_listen_new(const char* desc);
+
+#endif
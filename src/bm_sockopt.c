@@ -0,0 +1,229 @@
+#include "bm_sockopt.h"
+#include "bm_datastream.h"
+#include "bm_log.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+ * Where each option applies
+ */
+#define BM_SOCKOPT_ANY 0 /* Any socket */
+#define BM_SOCKOPT_IP  1 /* IPv4 sockets */
+#define BM_SOCKOPT_TCP 2 /* TCP sockets */
+
+/*
+ * The options, in the order of enum bm_sockopt_e
+ */
+static const struct {
+   const char* name;
+   int level;
+   int optname;
+   int applies;
+} bm_sockopt_table[BM_SOCKOPT_NUM] = {
+   { "nodelay",     IPPROTO_TCP, TCP_NODELAY,      BM_SOCKOPT_TCP },
+   { "quickack",    IPPROTO_TCP, TCP_QUICKACK,     BM_SOCKOPT_TCP },
+   { "sndbuf",      SOL_SOCKET,  SO_SNDBUF,        BM_SOCKOPT_ANY },
+   { "rcvbuf",      SOL_SOCKET,  SO_RCVBUF,        BM_SOCKOPT_ANY },
+   { "busypoll",    SOL_SOCKET,  SO_BUSY_POLL,     BM_SOCKOPT_IP  },
+   { "priority",    SOL_SOCKET,  SO_PRIORITY,      BM_SOCKOPT_ANY },
+   { "dscp",        IPPROTO_IP,  IP_TOS,           BM_SOCKOPT_IP  },
+   { "usertimeout", IPPROTO_TCP, TCP_USER_TIMEOUT, BM_SOCKOPT_TCP },
+   { "keepalive",   SOL_SOCKET,  SO_KEEPALIVE,     BM_SOCKOPT_TCP },
+   { "keepidle",    IPPROTO_TCP, TCP_KEEPIDLE,     BM_SOCKOPT_TCP },
+   { "keepintvl",   IPPROTO_TCP, TCP_KEEPINTVL,    BM_SOCKOPT_TCP },
+   { "keepcnt",     IPPROTO_TCP, TCP_KEEPCNT,      BM_SOCKOPT_TCP }
+};
+
+/****************************************/
+/****************************************/
+
+void bm_sockopt_init(bm_sockopt_t o) {
+   for(size_t i = 0; i < BM_SOCKOPT_NUM; ++i)
+      o->v[i] = -1;
+}
+
+/****************************************/
+/****************************************/
+
+const char* bm_sockopt_name(int opt) {
+   return bm_sockopt_table[opt].name;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses a flag: no value or 1 to set it, 0 to clear it.
+ */
+static int bm_sockopt_parse_flag(const char* str,
+                                 int* v) {
+   if(!str || strcmp(str, "1") == 0) *v = 1;
+   else if(strcmp(str, "0") == 0) *v = 0;
+   else return 0;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses a non-negative integer up to max.
+ */
+static int bm_sockopt_parse_int(const char* str,
+                                long max,
+                                int* v) {
+   if(!str) return 0;
+   char* endptr;
+   long n = strtol(str, &endptr, 10);
+   if(endptr == str || *endptr != '\0' || n < 0 || n > max) return 0;
+   *v = n;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses a duration, in the given unit (ns) by default, and stores it
+ * in that unit, rounded up.
+ */
+static int bm_sockopt_parse_time(const char* str,
+                                 double unit,
+                                 int* v) {
+   uint64_t t;
+   if(!str || !bm_datastream_parse_duration(str, unit, &t)) return 0;
+   t = (t + unit - 1) / unit;
+   if(t > INT_MAX) return 0;
+   *v = t;
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Parses the keepalive settings: 0, or IDLE[/INTVL[/CNT]].
+ */
+static int bm_sockopt_parse_keepalive(bm_sockopt_t o,
+                                      const char* str) {
+   if(!str || strcmp(str, "0") == 0)
+      return bm_sockopt_parse_flag(str, &o->v[BM_SOCKOPT_KEEPALIVE]);
+   char* w = strdup(str);
+   char* intvl = strchr(w, '/');
+   char* cnt = NULL;
+   if(intvl) {
+      *intvl++ = '\0';
+      cnt = strchr(intvl, '/');
+      if(cnt) *cnt++ = '\0';
+   }
+   int ok =
+      bm_sockopt_parse_time(w, 1e9, &o->v[BM_SOCKOPT_KEEPIDLE]) &&
+      (!intvl || bm_sockopt_parse_time(intvl, 1e9, &o->v[BM_SOCKOPT_KEEPINTVL])) &&
+      (!cnt || bm_sockopt_parse_int(cnt, INT_MAX, &o->v[BM_SOCKOPT_KEEPCNT])) &&
+      o->v[BM_SOCKOPT_KEEPIDLE] > 0 &&
+      o->v[BM_SOCKOPT_KEEPINTVL] != 0 &&
+      o->v[BM_SOCKOPT_KEEPCNT] != 0;
+   free(w);
+   o->v[BM_SOCKOPT_KEEPALIVE] = 1;
+   return ok;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_sockopt_parse(bm_sockopt_t o,
+                     const char* name,
+                     const char* val) {
+   if(strcmp(name, "nodelay") == 0)
+      return bm_sockopt_parse_flag(val, &o->v[BM_SOCKOPT_NODELAY]);
+   if(strcmp(name, "quickack") == 0)
+      return bm_sockopt_parse_flag(val, &o->v[BM_SOCKOPT_QUICKACK]);
+   if(strcmp(name, "sndbuf") == 0 || strcmp(name, "rcvbuf") == 0) {
+      /* The kernel doubles the value */
+      size_t n;
+      if(!val || !bm_datastream_parse_size(val, &n) || n == 0 || n > INT_MAX / 2)
+         return 0;
+      o->v[name[0] == 's' ? BM_SOCKOPT_SNDBUF : BM_SOCKOPT_RCVBUF] = n;
+      return 1;
+   }
+   if(strcmp(name, "busypoll") == 0)
+      return bm_sockopt_parse_time(val, 1e3, &o->v[BM_SOCKOPT_BUSYPOLL]);
+   if(strcmp(name, "priority") == 0)
+      return bm_sockopt_parse_int(val, INT_MAX, &o->v[BM_SOCKOPT_PRIORITY]);
+   if(strcmp(name, "dscp") == 0)
+      return bm_sockopt_parse_int(val, 63, &o->v[BM_SOCKOPT_DSCP]);
+   if(strcmp(name, "usertimeout") == 0)
+      return bm_sockopt_parse_time(val, 1e6, &o->v[BM_SOCKOPT_USERTIMEOUT]);
+   if(strcmp(name, "keepalive") == 0)
+      return bm_sockopt_parse_keepalive(o, val);
+   return -1;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_sockopt_apply(bm_sockopt_t o,
+                     int fd,
+                     const char* desc,
+                     bm_sockopt_t eff) {
+   /* Find out which options apply */
+   int domain = AF_UNSPEC, protocol = 0;
+   socklen_t len = sizeof(int);
+   getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+   len = sizeof(int);
+   getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len);
+   int ip = domain == AF_INET;
+   int tcp = ip && protocol == IPPROTO_TCP;
+   int failed = 0;
+   for(size_t i = 0; i < BM_SOCKOPT_NUM; ++i) {
+      int applies =
+         bm_sockopt_table[i].applies == BM_SOCKOPT_ANY ||
+         (bm_sockopt_table[i].applies == BM_SOCKOPT_IP && ip) ||
+         (bm_sockopt_table[i].applies == BM_SOCKOPT_TCP && tcp);
+      if(eff) eff->v[i] = -1;
+      if(!applies) continue;
+      /* Set the option; the DSCP is the upper 6 bits of the TOS */
+      int v = o->v[i];
+      if(v >= 0) {
+         if(i == BM_SOCKOPT_DSCP) v <<= 2;
+         if(setsockopt(fd,
+                       bm_sockopt_table[i].level,
+                       bm_sockopt_table[i].optname,
+                       &v,
+                       sizeof(v)) < 0) {
+            bm_log(BM_LOG_WARNING, "%s: Can't set %s to %d: %s",
+                   desc,
+                   bm_sockopt_table[i].name,
+                   o->v[i],
+                   strerror(errno));
+            ++failed;
+         }
+      }
+      /* Read the value in effect */
+      if(eff) {
+         len = sizeof(v);
+         if(getsockopt(fd,
+                       bm_sockopt_table[i].level,
+                       bm_sockopt_table[i].optname,
+                       &v,
+                       &len) == 0)
+            eff->v[i] = i == BM_SOCKOPT_DSCP ? v >> 2 : v;
+      }
+   }
+   return failed;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_sockopt_rearm(bm_sockopt_t o,
+                      int fd) {
+   if(o->v[BM_SOCKOPT_QUICKACK] > 0) {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+   }
+}
@@ -0,0 +1,109 @@
+#ifndef BM_SOCKOPT_H
+#define BM_SOCKOPT_H
+
+/*
+ * Tuning of the sockets of a stream.
+ * Each option holds a value, or -1 to leave the kernel default. The
+ * options are applied to the sockets as soon as they are created, so
+ * that the buffer sizes count when the connection is set up. The
+ * options that don't apply to a socket, such as the TCP ones on a UDP
+ * or Unix domain socket, are skipped.
+ */
+
+/*
+ * The options.
+ */
+enum bm_sockopt_e {
+   /* TCP_NODELAY: send small segments without waiting for the
+    * acknowledgement of the previous ones (0/1) */
+   BM_SOCKOPT_NODELAY = 0,
+   /* TCP_QUICKACK: acknowledge the segments received right away
+    * (0/1); the kernel clears it, so it is set again after each read */
+   BM_SOCKOPT_QUICKACK,
+   /* SO_SNDBUF: the size of the send buffer (bytes) */
+   BM_SOCKOPT_SNDBUF,
+   /* SO_RCVBUF: the size of the receive buffer (bytes) */
+   BM_SOCKOPT_RCVBUF,
+   /* SO_BUSY_POLL: how long a read polls the device for data before
+    * it sleeps (us) */
+   BM_SOCKOPT_BUSYPOLL,
+   /* SO_PRIORITY: the priority of the packets sent, for queueing
+    * disciplines */
+   BM_SOCKOPT_PRIORITY,
+   /* The DSCP of the packets sent, through IP_TOS (0-63) */
+   BM_SOCKOPT_DSCP,
+   /* TCP_USER_TIMEOUT: how long sent data can stay unacknowledged
+    * before the connection is closed (ms) */
+   BM_SOCKOPT_USERTIMEOUT,
+   /* SO_KEEPALIVE: probe idle connections (0/1) */
+   BM_SOCKOPT_KEEPALIVE,
+   /* TCP_KEEPIDLE: idle time before the first probe (s) */
+   BM_SOCKOPT_KEEPIDLE,
+   /* TCP_KEEPINTVL: time between probes (s) */
+   BM_SOCKOPT_KEEPINTVL,
+   /* TCP_KEEPCNT: unanswered probes before the connection is closed */
+   BM_SOCKOPT_KEEPCNT,
+   /* The number of options */
+   BM_SOCKOPT_NUM
+};
+
+/*
+ * The values of the options.
+ */
+struct bm_sockopt_s {
+   int v[BM_SOCKOPT_NUM];
+};
+typedef struct bm_sockopt_s* bm_sockopt_t;
+
+/*
+ * Initializes a set of options to the kernel defaults.
+ * @param o The options.
+ */
+extern void bm_sockopt_init(bm_sockopt_t o);
+
+/*
+ * Returns the name of an option, as reported in the metrics.
+ * @param opt The option.
+ * @return The name.
+ */
+extern const char* bm_sockopt_name(int opt);
+
+/*
+ * Parses a stream option, if it is a socket option:
+ * nodelay[=0|1], quickack[=0|1], sndbuf=N, rcvbuf=N, busypoll=T,
+ * priority=N, dscp=N, usertimeout=T, keepalive[=IDLE[/INTVL[/CNT]]]
+ * or keepalive=0.
+ * @param o The options.
+ * @param name The name of the option.
+ * @param val The value of the option, or NULL.
+ * @return 1 for success, 0 if the value can't be parsed, -1 if the
+ * option is not a socket option.
+ */
+extern int bm_sockopt_parse(bm_sockopt_t o,
+                            const char* name,
+                            const char* val);
+
+/*
+ * Applies a set of options to a socket, and reads back the values in
+ * effect. An option that can't be set is logged and skipped.
+ * @param o The options.
+ * @param fd The socket.
+ * @param desc The descriptor of the stream, for the log.
+ * @param eff Where the values in effect are stored, -1 for those that
+ * don't apply to the socket; NULL not to read them.
+ * @return The number of options that could not be set.
+ */
+extern int bm_sockopt_apply(bm_sockopt_t o,
+                            int fd,
+                            const char* desc,
+                            bm_sockopt_t eff);
+
+/*
+ * Sets TCP_QUICKACK again on a socket after a read, if requested.
+ * @param o The options.
+ * @param fd The socket.
+ */
+extern void bm_sockopt_rearm(bm_sockopt_t o,
+                             int fd);
+
+#endif
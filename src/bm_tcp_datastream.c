@@ -8,18 +8,44 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include "bm_tcp_datastream.h"
+#include "bm_resolver.h"
 #include "bm_debug.h"
+#include "bm_log.h"
+
+/*
+ * Size of the receive buffer
+ */
+#define BM_TCP_DATASTREAM_RECV_BUFFER (64 * 1024)
+
+/*
+ * Maximum number of buffers in a vectored write
+ */
+#define BM_TCP_DATASTREAM_IOV_MAX 1024
+
+/*
+ * Maximum number of packets sent or received per system call on
+ * sequenced packet sockets
+ */
+#define BM_TCP_DATASTREAM_PACKET_BATCH 64
 
 /****************************************/
 /****************************************/
 
 void bm_tcp_datastream_destroy(void* ds);
 int bm_tcp_datastream_connect(void* ds);
+int bm_tcp_datastream_reconnect(void* ds);
 void bm_tcp_datastream_disconnect(void* ds);
 ssize_t bm_tcp_datastream_send(void* ds, const uint8_t* data, size_t sz);
 ssize_t bm_tcp_datastream_recv(void* ds, uint8_t* data, size_t sz);
+int bm_tcp_datastream_fd(void* ds);
+ssize_t bm_tcp_datastream_sendv(void* ds, bm_msg_t* msgs, size_t n, size_t off);
+ssize_t bm_tcp_datastream_recvv(void* ds, bm_msg_t* msgs, size_t n);
+bm_datastream_t bm_tcp_datastream_accept(void* ds);
 
 /****************************************/
 /****************************************/
@@ -32,8 +58,10 @@ int bm_tcp_datastream_parse(bm_tcp_datastream_t ds,
    char* saveptr = NULL;
    /* Get id (and discard it) */
    char* tok = strtok_r(wdesc, ":", &saveptr);
-   /* Get protocol (and discard it) */
+   /* Get protocol, hub streams use the hub framing */
    tok = strtok_r(NULL, ":", &saveptr);
+   int hub = tok && strncmp(tok, "hub", 3) == 0;
+   if(tok && strncmp(tok, "unix", 4) == 0) ds->family = AF_UNIX;
    /* Get verbosity (and discard it) */
    tok = strtok_r(NULL, ":", &saveptr);
    /* Get server */
@@ -41,14 +69,34 @@ int bm_tcp_datastream_parse(bm_tcp_datastream_t ds,
    if(!tok) {
       bm_datastream_set_status(ds,
                                BM_DATASTREAM_ERROR,
-                               "Can't parse server in '%s'",
+                               "Can't parse %s in '%s'",
+                               ds->family == AF_UNIX ? "path" : "server",
                                desc);
       free(wdesc);
       return 0;
    }
    ds->server = strdup(tok);
+   if(ds->family == AF_UNIX) {
+      /* The address is known right away */
+      struct sockaddr_un* sun = (struct sockaddr_un*)&ds->addr;
+      if(strlen(tok) >= sizeof(sun->sun_path)) {
+         bm_datastream_set_status(ds,
+                                  BM_DATASTREAM_ERROR,
+                                  "Path too long in '%s'",
+                                  desc);
+         free(wdesc);
+         return 0;
+      }
+      memset(sun, 0, sizeof(*sun));
+      sun->sun_family = AF_UNIX;
+      strcpy(sun->sun_path, tok);
+      ds->addrlen = sizeof(*sun);
+   }
    /* Get port */
-   tok = strtok_r(NULL, ":", &saveptr);
+   if(ds->family == AF_UNIX)
+      tok = "";
+   else
+      tok = strtok_r(NULL, ":", &saveptr);
    if(!tok) {
       bm_datastream_set_status(ds,
                                BM_DATASTREAM_ERROR,
@@ -57,7 +105,31 @@ int bm_tcp_datastream_parse(bm_tcp_datastream_t ds,
       free(wdesc);
       return 0;
    }
-   ds->port = strdup(tok);
+   if(ds->family != AF_UNIX) ds->port = strdup(tok);
+   /* Get options */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(tok) {
+      if(!bm_datastream_parse_options(&ds->parent, tok)) {
+         free(wdesc);
+         return 0;
+      }
+      ds->options = strdup(tok);
+   }
+   if(hub) ds->parent.framing.type = BM_FRAMING_HUB;
+   /* Unix domain sockets keep the boundaries of packets */
+   if(ds->family == AF_UNIX &&
+      ds->parent.framing.type == BM_FRAMING_DATAGRAM)
+      ds->type = SOCK_SEQPACKET;
+   /* Streams carry no datagram boundaries */
+   if(ds->type == SOCK_STREAM &&
+      ds->parent.framing.type == BM_FRAMING_DATAGRAM) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Datagram framing is not supported in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
    /* Cleanup */
    free(wdesc);
    /* All is OK */
@@ -70,18 +142,139 @@ int bm_tcp_datastream_parse(bm_tcp_datastream_t ds,
 void bm_tcp_datastream_destroy(void* ds) {
    bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
    bm_datastream_destroy(&this->parent);
+   free(this->server);
+   free(this->port);
+   free(this->options);
+   free(this->rbuf);
    free(this);
 }
 
 /****************************************/
 /****************************************/
 
+/*
+ * Binds the path of a listening Unix domain stream and listens on it.
+ * A socket left over at the path by an earlier run is replaced.
+ * @param this The datastream.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_tcp_datastream_bind_unix(bm_tcp_datastream_t this) {
+   struct stat st;
+   if(lstat(this->server, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(this->server);
+   this->stream = socket(AF_UNIX, this->type | SOCK_CLOEXEC, 0);
+   if(this->stream >= 0) bm_datastream_tune(this, this->stream);
+   if(this->stream < 0 ||
+      bind(this->stream, (struct sockaddr*)&this->addr, this->addrlen) < 0 ||
+      listen(this->stream, SOMAXCONN) < 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't listen: %s",
+                               strerror(errno));
+      if(this->stream >= 0) close(this->stream);
+      this->stream = -1;
+      return 0;
+   }
+   bm_datastream_set_status(this, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Binds the address of a listening stream and listens on it.
+ * @param this The datastream.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_tcp_datastream_bind(bm_tcp_datastream_t this) {
+   if(this->family == AF_UNIX)
+      return bm_tcp_datastream_bind_unix(this);
+   /* Get the address to bind */
+   struct addrinfo hints, *ifaceinfo;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;       /* Only IPv4 is accepted */
+   hints.ai_socktype = SOCK_STREAM; /* TCP socket */
+   hints.ai_flags = AI_PASSIVE;
+   int retval = getaddrinfo(this->server,
+                            this->port,
+                            &hints,
+                            &ifaceinfo);
+   if(retval != 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "%s: Error getting address information: %s",
+                               this->parent.descriptor,
+                               gai_strerror(retval));
+      return 0;
+   }
+   /* Listen */
+   this->stream = socket(ifaceinfo->ai_family,
+                         ifaceinfo->ai_socktype | SOCK_CLOEXEC,
+                         ifaceinfo->ai_protocol);
+   /* The accepted sockets inherit the buffer sizes */
+   if(this->stream >= 0) bm_datastream_tune(this, this->stream);
+   int on = 1;
+   if(this->stream < 0 ||
+      setsockopt(this->stream, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      bind(this->stream, ifaceinfo->ai_addr, ifaceinfo->ai_addrlen) < 0 ||
+      listen(this->stream, SOMAXCONN) < 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't listen: %s",
+                               strerror(errno));
+      if(this->stream >= 0) close(this->stream);
+      this->stream = -1;
+      freeaddrinfo(ifaceinfo);
+      return 0;
+   }
+   freeaddrinfo(ifaceinfo);
+   bm_datastream_set_status(this, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Connects to the address of the stream, blocking.
+ * @param this The datastream.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_tcp_datastream_connect_to(bm_tcp_datastream_t this) {
+   this->stream = socket(this->family, this->type | SOCK_CLOEXEC, 0);
+   if(this->stream >= 0) bm_datastream_tune(this, this->stream);
+   if(this->stream < 0 ||
+      connect(this->stream,
+              (struct sockaddr*)&this->addr,
+              this->addrlen) == -1) {
+      int errnum = errno;
+      if(this->stream >= 0) close(this->stream);
+      this->stream = -1;
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               strerror(errnum));
+      return 0;
+   }
+   bm_datastream_set_status(this, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
 int bm_tcp_datastream_connect(void* ds) {
    /* Cast datastream to this type */
    bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
    /* Disconnect if the stream is already connected */
    if(this->stream != -1)
       bm_tcp_datastream_disconnect(this);
+   /* Listening streams wait for the peers to connect */
+   if(this->listening)
+      return bm_tcp_datastream_bind(this);
+   /* Unix domain sockets have their address already */
+   if(this->family == AF_UNIX)
+      return bm_tcp_datastream_connect_to(this);
    /* Used to store the return value of the network function calls */
    int retval;
    /* Get information on the available interfaces */
@@ -101,30 +294,72 @@ int bm_tcp_datastream_connect(void* ds) {
                                gai_strerror(retval));
       return 0;
    }
-   /* Bind on the first interface available */
-   this->stream = -1;
-   struct addrinfo* iface = NULL;
-   for(iface = ifaceinfo;
-       (iface != NULL) && (this->stream == -1);
-       iface = iface->ai_next) {
-      this->stream = socket(iface->ai_family,
-                            iface->ai_socktype,
-                            iface->ai_protocol);
-      if(this->stream > 0) {
-         if(connect(this->stream,
-                    iface->ai_addr,
-                    iface->ai_addrlen) == -1) {
-            this->stream = -1;
-            bm_datastream_set_status(this,
-                                     BM_DATASTREAM_ERROR,
-                                     strerror(errno));
-            return 0;
-         }
+   /* Connect to the first address, kept to reconnect later */
+   memcpy(&this->addr, ifaceinfo->ai_addr, ifaceinfo->ai_addrlen);
+   this->addrlen = ifaceinfo->ai_addrlen;
+   freeaddrinfo(ifaceinfo);
+   return bm_tcp_datastream_connect_to(this);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_tcp_datastream_reconnect(void* ds) {
+   /* Cast datastream to this type */
+   bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
+   /* Disconnect if the stream is still connected */
+   if(this->stream != -1)
+      bm_tcp_datastream_disconnect(this);
+   /* Find the server address without waiting */
+   if(this->family == AF_INET && this->parent.resolver) {
+      int err;
+      int found = bm_resolver_lookup(this->parent.resolver,
+                                     this->server,
+                                     this->port,
+                                     &this->addr,
+                                     &this->addrlen,
+                                     &err);
+      if(found == 0) {
+         errno = EAGAIN;
+         return -1;
+      }
+      if(found < 0) {
+         bm_datastream_set_status(ds,
+                                  BM_DATASTREAM_ERROR,
+                                  "Error getting address information: %s",
+                                  gai_strerror(err));
+         errno = EHOSTUNREACH;
+         return -1;
       }
    }
-   freeaddrinfo(ifaceinfo);
-   bm_datastream_set_status(ds, BM_DATASTREAM_READY, "ready");
-   return 1;
+   else if(this->addrlen == 0) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Server address unknown");
+      errno = EHOSTUNREACH;
+      return -1;
+   }
+   /* Connect */
+   this->stream = socket(this->family, this->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if(this->stream >= 0) {
+      bm_datastream_tune(this, this->stream);
+      if(connect(this->stream,
+                 (struct sockaddr*)&this->addr,
+                 this->addrlen) == 0) {
+         bm_datastream_set_status(ds, BM_DATASTREAM_READY, "ready");
+         return 1;
+      }
+      if(errno == EINPROGRESS) {
+         bm_datastream_set_status(ds, BM_DATASTREAM_CONNECTING, "connecting");
+         return 0;
+      }
+   }
+   int errnum = errno;
+   if(this->stream >= 0) close(this->stream);
+   this->stream = -1;
+   bm_datastream_set_status(ds, BM_DATASTREAM_ERROR, strerror(errnum));
+   errno = errnum;
+   return -1;
 }
 
 /****************************************/
@@ -137,6 +372,11 @@ void bm_tcp_datastream_disconnect(void* ds) {
       /* Close stream */
       close(this->stream);
       this->stream = -1;
+      /* Remove the path of a listening Unix domain socket */
+      if(this->listening && this->family == AF_UNIX)
+         unlink(this->server);
+      this->rpos = 0;
+      this->rend = 0;
       bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
    }
 }
@@ -151,25 +391,140 @@ ssize_t bm_tcp_datastream_send(void* ds,
    bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
    /* Make sure stream is ready */
    if(this->parent.status != BM_DATASTREAM_READY) return -1;
-   /* To keep track of how many bytes have been sent */
-   ssize_t tot = sz, sent;
-   /* Keep sending until done or error */
-   while(tot > 0) {
-      bm_debug(ds, "send: sending %zd bytes", tot);
-      sent = send(this->stream, data, tot, 0);
-      bm_debug(ds, "send: sent %zd bytes", sent);
-      if(sent < 0) {
-         bm_tcp_datastream_disconnect(this);
+   /* Send as much as the socket buffer takes */
+   bm_debug(ds, "send: sending %zu bytes", sz);
+   ssize_t sent = send(this->stream, data, sz, MSG_NOSIGNAL);
+   bm_debug(ds, "send: sent %zd bytes", sent);
+   if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* The owner reactor takes care of closing the socket */
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error sending data: %s",
+                               strerror(errno));
+   }
+   return sent;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Sends a batch of messages on a sequenced packet socket, one packet
+ * per message.
+ * @return The number of bytes of the messages sent, or -1 for error.
+ */
+static ssize_t bm_tcp_datastream_sendv_packets(bm_tcp_datastream_t this,
+                                               bm_msg_t* msgs,
+                                               size_t n) {
+   /* Packets are never sent partially, so there is no offset */
+   if(n > BM_TCP_DATASTREAM_PACKET_BATCH) n = BM_TCP_DATASTREAM_PACKET_BATCH;
+   struct mmsghdr hdrs[BM_TCP_DATASTREAM_PACKET_BATCH];
+   struct iovec iovs[BM_TCP_DATASTREAM_PACKET_BATCH];
+   memset(hdrs, 0, n * sizeof(struct mmsghdr));
+   for(size_t i = 0; i < n; ++i) {
+      iovs[i].iov_base = msgs[i]->data;
+      iovs[i].iov_len = msgs[i]->len;
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+   bm_debug(this, "sendv: sending %zu packets", n);
+   int sent = sendmmsg(this->stream, hdrs, n, MSG_NOSIGNAL);
+   bm_debug(this, "sendv: sent %d packets", sent);
+   if(sent < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+         /* The owner reactor takes care of closing the socket */
          bm_datastream_set_status(this,
                                   BM_DATASTREAM_ERROR,
                                   "Error sending data: %s",
                                   strerror(errno));
-         return sent;
       }
-      tot -= sent;
-      data += sent;
+      return -1;
    }
-   return sz;
+   ssize_t tot = 0;
+   for(int i = 0; i < sent; ++i)
+      tot += msgs[i]->len;
+   return tot;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_tcp_datastream_sendv(void* ds,
+                                bm_msg_t* msgs,
+                                size_t n,
+                                size_t off) {
+   /* Cast datastream to this type */
+   bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   if(this->type == SOCK_SEQPACKET)
+      return bm_tcp_datastream_sendv_packets(this, msgs, n);
+   /* Coalesce the frames into a single write */
+   struct iovec iovs[BM_TCP_DATASTREAM_IOV_MAX];
+   uint8_t hdrs[BM_TCP_DATASTREAM_IOV_MAX][BM_FRAMING_HEADER_MAX];
+   struct msghdr hdr;
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.msg_iov = iovs;
+   hdr.msg_iovlen = bm_datastream_iov(&this->parent, msgs, n, off,
+                                      iovs, BM_TCP_DATASTREAM_IOV_MAX, hdrs);
+   bm_debug(ds, "sendv: sending %zu messages", n);
+   ssize_t sent = sendmsg(this->stream, &hdr, MSG_NOSIGNAL);
+   bm_debug(ds, "sendv: sent %zd bytes", sent);
+   if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* The owner reactor takes care of closing the socket */
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error sending data: %s",
+                               strerror(errno));
+   }
+   return sent;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Reads as much data as the kernel has into the receive buffer.
+ * The data not yet sliced into messages is moved to the beginning of
+ * the buffer first.
+ * @param this The datastream.
+ * @param sz The message size.
+ * @return The number of bytes read, 0 if the stream was closed, or
+ * <0 for error (-1 with errno set to EAGAIN if no data is available).
+ */
+static ssize_t bm_tcp_datastream_fill(bm_tcp_datastream_t this,
+                                      size_t sz) {
+   /* Make room for at least one message */
+   if(!this->rbuf) {
+      this->rsize = sz > BM_TCP_DATASTREAM_RECV_BUFFER ?
+         sz : BM_TCP_DATASTREAM_RECV_BUFFER;
+      this->rbuf = (uint8_t*)malloc(this->rsize);
+   }
+   /* Carry the partial message over */
+   if(this->rpos > 0) {
+      memmove(this->rbuf, this->rbuf + this->rpos, this->rend - this->rpos);
+      this->rend -= this->rpos;
+      this->rpos = 0;
+   }
+   /* Read */
+   bm_debug(this, "recv: waiting for up to %zu bytes", this->rsize - this->rend);
+   ssize_t received = recv(this->stream,
+                           this->rbuf + this->rend,
+                           this->rsize - this->rend,
+                           0);
+   bm_debug(this, "recv: received %zd bytes", received);
+   if(received > 0) bm_sockopt_rearm(&this->parent.sockopt, this->stream);
+   if(received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      int errnum = errno;
+      bm_tcp_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error receiving data: %s",
+                               strerror(errnum));
+      errno = errnum;
+   }
+   if(received > 0) this->rend += received;
+   return received;
 }
 
 /****************************************/
@@ -182,25 +537,211 @@ ssize_t bm_tcp_datastream_recv(void* ds,
    bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
    /* Make sure stream is ready */
    if(this->parent.status != BM_DATASTREAM_READY) return -1;
-   /* To keep track of how many bytes have been received */
-   ssize_t tot = sz, received;
-   while(tot > 0) {
-      bm_debug(ds, "recv: waiting for %zd bytes", tot);
-      received = recv(this->stream, data, tot, 0);
-      bm_debug(ds, "recv: received %zd bytes", received);
-      if(received < 0){
+   /* Keep reading until a whole message is there or no data is left */
+   ssize_t received;
+   while(this->rend - this->rpos < sz) {
+      received = bm_tcp_datastream_fill(this, sz);
+      if(received <= 0) return received;
+   }
+   /* Message complete */
+   memcpy(data, this->rbuf + this->rpos, sz);
+   this->rpos += sz;
+   return sz;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Receives the messages of a sequenced packet socket, one per packet.
+ * @return The number of messages received, 0 if the stream was closed,
+ * or <0 for error (-1 with errno set to EAGAIN if no message is
+ * available).
+ */
+static ssize_t bm_tcp_datastream_recvv_packets(bm_tcp_datastream_t this,
+                                               bm_msg_t* msgs,
+                                               size_t n) {
+   /* Prepare one buffer per packet */
+   size_t sz = bm_framing_frame_max(&this->parent.framing);
+   if(n > BM_TCP_DATASTREAM_PACKET_BATCH) n = BM_TCP_DATASTREAM_PACKET_BATCH;
+   uint8_t* buf = bm_datastream_scratch(&this->parent, n, sz);
+   if(!buf) {
+      bm_tcp_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't allocate receive buffers");
+      errno = ENOMEM;
+      return -1;
+   }
+   struct mmsghdr hdrs[BM_TCP_DATASTREAM_PACKET_BATCH];
+   struct iovec iovs[BM_TCP_DATASTREAM_PACKET_BATCH];
+   memset(hdrs, 0, n * sizeof(struct mmsghdr));
+   for(size_t i = 0; i < n; ++i) {
+      iovs[i].iov_base = buf + i * sz;
+      iovs[i].iov_len = sz;
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+   bm_debug(this, "recvv: waiting for %zu packets", n);
+   int received = recvmmsg(this->stream, hdrs, n, MSG_DONTWAIT, NULL);
+   bm_debug(this, "recvv: received %d packets", received);
+   int errnum = errno;
+   /* Copy the packets into messages of their size; an empty packet
+    * marks the end of the stream */
+   ssize_t num = 0;
+   int closed = 0;
+   for(int i = 0; i < received && !closed; ++i) {
+      if(hdrs[i].msg_len == 0) {
+         closed = 1;
+      }
+      else if(hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+         bm_debug(this, "recvv: discarded packet longer than %zu bytes", sz);
+      }
+      else {
+         msgs[num] = bm_datastream_msg_new(&this->parent, hdrs[i].msg_len);
+         memcpy(msgs[num]->data, iovs[i].iov_base, hdrs[i].msg_len);
+         ++num;
+      }
+   }
+   if(num > 0) return num;
+   if(closed || received == 0) return 0;
+   if(received < 0) {
+      if(errnum != EAGAIN && errnum != EWOULDBLOCK) {
          bm_tcp_datastream_disconnect(this);
          bm_datastream_set_status(this,
                                   BM_DATASTREAM_ERROR,
                                   "Error receiving data: %s",
-                                  strerror(errno));
-         return received;
+                                  strerror(errnum));
       }
-      if(received == 0) return 0;
-      tot -= received;
-      data += received;
+      errno = errnum;
+      return -1;
    }
-   return sz;
+   /* Packets too long only; nothing to report yet */
+   errno = EAGAIN;
+   return -1;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_tcp_datastream_recvv(void* ds,
+                                bm_msg_t* msgs,
+                                size_t n) {
+   /* Cast datastream to this type */
+   bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   if(this->type == SOCK_SEQPACKET)
+      return bm_tcp_datastream_recvv_packets(this, msgs, n);
+   bm_framing_t f = &this->parent.framing;
+   ssize_t num = 0, received, flen;
+   size_t off, len;
+   while(1) {
+      /* Slice the complete frames out of the buffer */
+      flen = 0;
+      while((size_t)num < n &&
+            this->rend > this->rpos &&
+            (flen = bm_framing_decode(f,
+                                      this->rbuf + this->rpos,
+                                      this->rend - this->rpos,
+                                      &off,
+                                      &len)) > 0) {
+         msgs[num] = bm_datastream_msg_new(ds, len);
+         memcpy(msgs[num]->data, this->rbuf + this->rpos + off, len);
+         bm_framing_header_read(f, this->rbuf + this->rpos, msgs[num]);
+         this->rpos += flen;
+         ++num;
+      }
+      if((size_t)num == n) return num;
+      if(flen < 0) {
+         /* The peer does not follow the framing, there's no way to
+          * find the next frame */
+         bm_tcp_datastream_disconnect(this);
+         bm_datastream_set_status(this,
+                                  BM_DATASTREAM_ERROR,
+                                  "Invalid frame received");
+         errno = EPROTO;
+         return num > 0 ? num : -1;
+      }
+      /* Get more data; closing and errors are reported once the
+       * messages received so far have been handed over */
+      received = bm_tcp_datastream_fill(this, bm_framing_frame_max(f));
+      if(received <= 0) return num > 0 ? num : received;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+int bm_tcp_datastream_fd(void* ds) {
+   return ((bm_tcp_datastream_t)ds)->stream;
+}
+
+/****************************************/
+/****************************************/
+
+bm_datastream_t bm_tcp_datastream_accept(void* ds) {
+   /* Cast datastream to this type */
+   bm_tcp_datastream_t this = (bm_tcp_datastream_t)ds;
+   /* Get the next peer */
+   struct sockaddr_storage addr;
+   socklen_t addrlen = sizeof(addr);
+   int fd = accept4(this->stream,
+                    (struct sockaddr*)&addr,
+                    &addrlen,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if(fd < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+         int errnum = errno;
+         bm_log(BM_LOG_ERROR, "%s: Can't accept peer: %s",
+                this->parent.descriptor,
+                strerror(errnum));
+         errno = errnum;
+      }
+      return NULL;
+   }
+   /* The peer gets a descriptor like an outbound stream, with an id
+    * made unique by a counter */
+   char* desc;
+   if(this->family == AF_UNIX) {
+      /* The peers of Unix domain sockets are known by the path */
+      asprintf(&desc, "%s#%zu:unix:%d:%s%s%s",
+               this->parent.id,
+               ++this->accepted_num,
+               this->parent.verbose,
+               this->server,
+               this->options ? ":" : "",
+               this->options ? this->options : "");
+   }
+   else {
+      struct sockaddr_in* sin = (struct sockaddr_in*)&addr;
+      char ip[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+      asprintf(&desc, "%s#%zu:%s:%d:%s:%u%s%s",
+               this->parent.id,
+               ++this->accepted_num,
+               this->parent.framing.type == BM_FRAMING_HUB ? "hub" : "tcp",
+               this->parent.verbose,
+               ip,
+               ntohs(sin->sin_port),
+               this->options ? ":" : "",
+               this->options ? this->options : "");
+   }
+   bm_tcp_datastream_t peer = bm_tcp_datastream_new(desc);
+   free(desc);
+   if(!peer) {
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+   }
+   peer->stream = fd;
+   bm_datastream_tune(peer, fd);
+   peer->parent.verbose = this->parent.verbose;
+   peer->parent.accepted = 1;
+   /* Only the peer can connect again */
+   peer->parent.reconnect = NULL;
+   bm_datastream_set_status(peer, BM_DATASTREAM_READY, "ready");
+   return &peer->parent;
 }
 
 /****************************************/
@@ -209,6 +750,16 @@ ssize_t bm_tcp_datastream_recv(void* ds,
 bm_tcp_datastream_t bm_tcp_datastream_new(const char* desc) {
    /* Allocate memory */
    bm_tcp_datastream_t this = malloc(sizeof(struct bm_tcp_datastream_s));
+   this->stream = -1;
+   this->family = AF_INET;
+   this->type = SOCK_STREAM;
+   this->server = NULL;
+   this->port = NULL;
+   this->addrlen = 0;
+   this->options = NULL;
+   this->listening = 0;
+   this->accepted_num = 0;
+   this->rbuf = NULL;
    /* Initialize parent */
    bm_datastream_init(&this->parent,
                       desc,
@@ -216,20 +767,45 @@ bm_tcp_datastream_t bm_tcp_datastream_new(const char* desc) {
                       bm_tcp_datastream_connect,
                       bm_tcp_datastream_disconnect,
                       bm_tcp_datastream_send,
-                      bm_tcp_datastream_recv);
+                      bm_tcp_datastream_recv,
+                      bm_tcp_datastream_fd);
    if(this->parent.status == BM_DATASTREAM_ERROR) {
       bm_tcp_datastream_destroy(this);
       return NULL;
    }
+   /* Coalesce queued messages into vectored writes, slice many
+    * messages out of each read */
+   this->parent.sendv = bm_tcp_datastream_sendv;
+   this->parent.recvv = bm_tcp_datastream_recvv;
+   this->parent.bytestream = 1;
+   this->parent.reconnect = bm_tcp_datastream_reconnect;
    /* Set local attributes */
-   this->stream = -1;
+   this->rsize = 0;
+   this->rpos = 0;
+   this->rend = 0;
    if(!bm_tcp_datastream_parse(this, desc)) {
+      fprintf(stderr, "%s\n", this->parent.status_desc);
       bm_tcp_datastream_destroy(this);
       return NULL;
    }
+   /* Packets are sent one by one */
+   if(this->type == SOCK_SEQPACKET)
+      this->parent.bytestream = 0;
    /* All done */
    return this;
 }
 
 /****************************************/
 /****************************************/
+
+bm_tcp_datastream_t bm_tcp_datastream_listen_new(const char* desc) {
+   bm_tcp_datastream_t this = bm_tcp_datastream_new(desc);
+   if(!this) return NULL;
+   this->listening = 1;
+   this->parent.accept = bm_tcp_datastream_accept;
+   this->parent.reconnect = NULL;
+   return this;
+}
+
+/****************************************/
+/****************************************/
@@ -1,11 +1,21 @@
 #ifndef BM_TCP_DATASTREAM_H
 #define BM_TCP_DATASTREAM_H
 
+#include <sys/socket.h>
 #include "bm_datastream.h"
 
 /*
  * The string for tcp connect is:
  * tcp:server:port
+ * The string for tcp listen is:
+ * tcplisten:address:port
+ * Links to other hubs use hub and hublisten instead of tcp and
+ * tcplisten, with the hub framing.
+ * The strings for Unix domain sockets are:
+ * unix:path
+ * unixlisten:path
+ * They are stream sockets, or sequenced packet sockets with one message
+ * per packet with the datagram framing.
  */
 
 struct bm_tcp_datastream_s {
@@ -13,10 +23,32 @@ struct bm_tcp_datastream_s {
    struct bm_datastream_s parent;
    /* Socket stream */
    int stream;
-   /* Server */
+   /* Address family, AF_INET or AF_UNIX */
+   int family;
+   /* Socket type, SOCK_STREAM or SOCK_SEQPACKET */
+   int type;
+   /* Server, or path of a Unix domain socket */
    char* server;
-   /* Port */
+   /* Port, NULL for Unix domain sockets */
    char* port;
+   /* Address of the server, resolved at the first connection */
+   struct sockaddr_storage addr;
+   /* Length of the address, 0 if not resolved */
+   socklen_t addrlen;
+   /* Stream options, passed on to accepted peers */
+   char* options;
+   /* Whether the stream listens for peers rather than connecting */
+   int listening;
+   /* Number of peers accepted so far */
+   size_t accepted_num;
+   /* Receive buffer, filled with as much as the kernel has */
+   uint8_t* rbuf;
+   /* Size of the receive buffer */
+   size_t rsize;
+   /* Start of the data not yet sliced into messages */
+   size_t rpos;
+   /* End of the data in the receive buffer */
+   size_t rend;
 };
 typedef struct bm_tcp_datastream_s* bm_tcp_datastream_t;
 
@@ -27,4 +59,14 @@ typedef struct bm_tcp_datastream_s* bm_tcp_datastream_t;
  */
 extern bm_tcp_datastream_t bm_tcp_datastream_new(const char* desc);
 
+/*
+ * Creates a new listening TCP datastream.
+ * Connecting the stream binds the address and listens on it; every
+ * accepted peer becomes a new TCP datastream with the same verbosity
+ * and options.
+ * @param desc The stream descriptor.
+ * @return The new TCP datastream.
+ */
+extern bm_tcp_datastream_t bm_tcp_datastream_listen_new(const char* desc);
+
 #endif
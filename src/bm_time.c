@@ -0,0 +1,14 @@
+#include "bm_time.h"
+#include <time.h>
+
+/****************************************/
+/****************************************/
+
+uint64_t bm_time_now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/****************************************/
+/****************************************/
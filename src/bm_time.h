@@ -0,0 +1,12 @@
+#ifndef BM_TIME_H
+#define BM_TIME_H
+
+#include <inttypes.h>
+
+/*
+ * Returns the current time of the monotonic clock.
+ * @return The current time, in nanoseconds.
+ */
+extern uint64_t bm_time_now();
+
+#endif
@@ -5,12 +5,35 @@
 #include <unistd.h>
 #include <errno.h>
 #include <netdb.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "bm_udp_datastream.h"
+#include "bm_time.h"
+#include "bm_log.h"
 #include "bm_debug.h"
 
+/*
+ * Maximum number of datagrams sent or received per system call
+ */
+#define BM_UDP_DATASTREAM_BATCH 64
+
+/*
+ * Number of slots of the peer index of a listening stream
+ */
+#define BM_UDP_DATASTREAM_PEER_SLOTS (2 * BM_UDP_DATASTREAM_PEERS_MAX)
+
+/*
+ * Longest time between two looks for silent peers (ns)
+ */
+#define BM_UDP_DATASTREAM_SWEEP 1000000000ULL
+
+/*
+ * The last peer id given out, shared by all the listening streams
+ */
+static atomic_uint bm_udp_datastream_peer_ids = 0;
+
 /****************************************/
 /****************************************/
 
@@ -19,6 +42,9 @@ int bm_udp_datastream_connect(void* ds);
 void bm_udp_datastream_disconnect(void* ds);
 ssize_t bm_udp_datastream_send(void* ds, const uint8_t* data, size_t sz);
 ssize_t bm_udp_datastream_recv(void* ds, uint8_t* data, size_t sz);
+int bm_udp_datastream_fd(void* ds);
+ssize_t bm_udp_datastream_sendv(void* ds, bm_msg_t* msgs, size_t n, size_t off);
+ssize_t bm_udp_datastream_recvv(void* ds, bm_msg_t* msgs, size_t n);
 
 /****************************************/
 /****************************************/
@@ -57,6 +83,22 @@ int bm_udp_datastream_parse(bm_udp_datastream_t ds,
       return 0;
    }
    ds->port = strdup(tok);
+   /* Get options */
+   tok = strtok_r(NULL, ":", &saveptr);
+   if(tok && !bm_datastream_parse_options(&ds->parent, tok)) {
+      free(wdesc);
+      return 0;
+   }
+   /* Datagrams delimit the messages by themselves */
+   if(ds->parent.framing.type != BM_FRAMING_FIXED &&
+      ds->parent.framing.type != BM_FRAMING_DATAGRAM) {
+      bm_datastream_set_status(ds,
+                               BM_DATASTREAM_ERROR,
+                               "Only fixed and datagram framing are supported in '%s'",
+                               desc);
+      free(wdesc);
+      return 0;
+   }
    /* Cleanup */
    free(wdesc);
    /* All is OK */
@@ -66,9 +108,243 @@ int bm_udp_datastream_parse(bm_udp_datastream_t ds,
 /****************************************/
 /****************************************/
 
+/*
+ * Returns the slot of the peer index where the search for an address
+ * starts.
+ */
+static size_t bm_udp_datastream_peer_slot(const struct sockaddr_in* addr) {
+   uint64_t k = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+   k *= 0x9E3779B97F4A7C15ULL;
+   return (k >> 32) & (BM_UDP_DATASTREAM_PEER_SLOTS - 1);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Adds a peer to the index.
+ */
+static void bm_udp_datastream_peer_index(bm_udp_datastream_t this,
+                                         size_t pos) {
+   size_t slot = bm_udp_datastream_peer_slot(&this->peers[pos].addr);
+   while(this->peer_index[slot] != 0)
+      slot = (slot + 1) & (BM_UDP_DATASTREAM_PEER_SLOTS - 1);
+   this->peer_index[slot] = pos + 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Finds the peer with the given address, or adds it, and takes note
+ * that it just sent a datagram.
+ * @return The peer, or NULL if there are too many.
+ */
+static struct bm_udp_peer_s* bm_udp_datastream_peer(bm_udp_datastream_t this,
+                                                    const struct sockaddr_in* addr,
+                                                    uint64_t now) {
+   size_t slot = bm_udp_datastream_peer_slot(addr);
+   uint32_t pos;
+   while((pos = this->peer_index[slot]) != 0) {
+      struct bm_udp_peer_s* p = &this->peers[pos - 1];
+      if(p->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+         p->addr.sin_port == addr->sin_port) {
+         p->last_seen = now;
+         return p;
+      }
+      slot = (slot + 1) & (BM_UDP_DATASTREAM_PEER_SLOTS - 1);
+   }
+   if(this->peer_num == BM_UDP_DATASTREAM_PEERS_MAX) return NULL;
+   struct bm_udp_peer_s* p = &this->peers[this->peer_num];
+   memcpy(&p->addr, addr, sizeof(p->addr));
+   do {
+      p->id = atomic_fetch_add(&bm_udp_datastream_peer_ids, 1) + 1;
+   } while(p->id == 0);
+   p->last_seen = now;
+   this->peer_index[slot] = ++this->peer_num;
+   char host[INET_ADDRSTRLEN];
+   bm_log(BM_LOG_INFO, "%s: new peer %s:%u",
+          this->parent.descriptor,
+          inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host)),
+          ntohs(addr->sin_port));
+   return p;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Forgets the peers that have been silent for too long.
+ * A message being sent to all the peers when some are forgotten might
+ * reach some of the others twice, or not at all.
+ */
+static void bm_udp_datastream_peer_sweep(bm_udp_datastream_t this,
+                                         uint64_t now) {
+   uint64_t every = this->parent.peer_idle < BM_UDP_DATASTREAM_SWEEP ?
+      this->parent.peer_idle : BM_UDP_DATASTREAM_SWEEP;
+   if(now - this->peer_sweep < every) return;
+   this->peer_sweep = now;
+   size_t num = this->peer_num;
+   for(size_t i = 0; i < this->peer_num;) {
+      struct bm_udp_peer_s* p = &this->peers[i];
+      if(now - p->last_seen > this->parent.peer_idle) {
+         char host[INET_ADDRSTRLEN];
+         bm_log(BM_LOG_INFO, "%s: peer %s:%u gone silent",
+                this->parent.descriptor,
+                inet_ntop(AF_INET, &p->addr.sin_addr, host, sizeof(host)),
+                ntohs(p->addr.sin_port));
+         *p = this->peers[--this->peer_num];
+      }
+      else {
+         ++i;
+      }
+   }
+   if(this->peer_num == num) return;
+   /* Index the peers left */
+   memset(this->peer_index, 0, BM_UDP_DATASTREAM_PEER_SLOTS * sizeof(uint32_t));
+   for(size_t i = 0; i < this->peer_num; ++i)
+      bm_udp_datastream_peer_index(this, i);
+   if(this->fanout_next > this->peer_num)
+      this->fanout_next = this->peer_num;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Binds the address of a listening stream.
+ * @return 1 for success, 0 for failure.
+ */
+static int bm_udp_datastream_bind(bm_udp_datastream_t this) {
+   struct addrinfo hints, *ifaceinfo;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;      /* Only IPv4 is accepted */
+   hints.ai_socktype = SOCK_DGRAM; /* UDP socket */
+   hints.ai_flags = AI_PASSIVE;
+   int retval = getaddrinfo(this->server,
+                            this->port,
+                            &hints,
+                            &ifaceinfo);
+   if(retval != 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "%s: Error getting address information: %s",
+                               this->parent.descriptor,
+                               gai_strerror(retval));
+      return 0;
+   }
+   int on = 1;
+   this->stream = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+   if(this->stream >= 0) bm_datastream_tune(this, this->stream);
+   if(this->stream < 0 ||
+      setsockopt(this->stream, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      bind(this->stream, ifaceinfo->ai_addr, ifaceinfo->ai_addrlen) < 0) {
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't bind: %s",
+                               strerror(errno));
+      if(this->stream >= 0) close(this->stream);
+      this->stream = -1;
+      freeaddrinfo(ifaceinfo);
+      return 0;
+   }
+   freeaddrinfo(ifaceinfo);
+   /* Start with no peers */
+   this->peer_num = 0;
+   this->fanout_next = 0;
+   this->peer_sweep = bm_time_now();
+   memset(this->peer_index, 0, BM_UDP_DATASTREAM_PEER_SLOTS * sizeof(uint32_t));
+   bm_datastream_set_status(this, BM_DATASTREAM_READY, "ready");
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Sends a batch of messages to all the peers of a listening stream,
+ * but the one each message comes from, picking up where the previous
+ * call left the first message.
+ * @return The number of bytes of the messages sent to all the peers,
+ * or -1 with errno set to EAGAIN if none.
+ */
+static ssize_t bm_udp_datastream_fanout(bm_udp_datastream_t this,
+                                        bm_msg_t* msgs,
+                                        size_t n) {
+   struct mmsghdr hdrs[BM_UDP_DATASTREAM_BATCH];
+   struct iovec iovs[BM_UDP_DATASTREAM_BATCH];
+   /* Where the sending resumes after each datagram */
+   size_t next_msg[BM_UDP_DATASTREAM_BATCH];
+   size_t next_peer[BM_UDP_DATASTREAM_BATCH];
+   /* The message and the peer to send to next */
+   size_t i = 0, j = this->fanout_next;
+   while(i < n) {
+      /* One datagram per message and peer */
+      size_t k = 0, bi = i, bj = j;
+      memset(hdrs, 0, sizeof(hdrs));
+      while(k < BM_UDP_DATASTREAM_BATCH && bi < n) {
+         if(bj >= this->peer_num) {
+            ++bi;
+            bj = 0;
+            continue;
+         }
+         struct bm_udp_peer_s* p = &this->peers[bj++];
+         if(p->id == msgs[bi]->sender) continue;
+         iovs[k].iov_base = msgs[bi]->data;
+         iovs[k].iov_len = msgs[bi]->len;
+         hdrs[k].msg_hdr.msg_name = &p->addr;
+         hdrs[k].msg_hdr.msg_namelen = sizeof(p->addr);
+         hdrs[k].msg_hdr.msg_iov = &iovs[k];
+         hdrs[k].msg_hdr.msg_iovlen = 1;
+         next_msg[k] = bi;
+         next_peer[k] = bj;
+         ++k;
+      }
+      if(k == 0) {
+         /* Nobody else to send the rest to */
+         i = bi;
+         j = bj;
+         break;
+      }
+      bm_debug(this, "sendv: sending %zu datagrams", k);
+      int sent = sendmmsg(this->stream, hdrs, k, 0);
+      bm_debug(this, "sendv: sent %d datagrams", sent);
+      if(sent < 0) {
+         if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+         /* Skip the peer that can't be sent to, keep the others */
+         bm_debug(this, "sendv: error sending to a peer: %s", strerror(errno));
+         atomic_fetch_add_explicit(&this->parent.send_errors, 1, memory_order_relaxed);
+         sent = 1;
+      }
+      i = next_msg[sent - 1];
+      j = next_peer[sent - 1];
+   }
+   /* A message is done once it has been sent to the last peer */
+   while(i < n && j >= this->peer_num) {
+      ++i;
+      j = 0;
+   }
+   this->fanout_next = j;
+   if(i == 0) {
+      errno = EAGAIN;
+      return -1;
+   }
+   ssize_t tot = 0;
+   for(size_t m = 0; m < i; ++m)
+      tot += msgs[m]->len;
+   return tot;
+}
+
+/****************************************/
+/****************************************/
+
 void bm_udp_datastream_destroy(void* ds) {
    bm_udp_datastream_t this = (bm_udp_datastream_t)ds;
    bm_datastream_destroy(&this->parent);
+   free(this->server);
+   free(this->port);
+   free(this->peers);
+   free(this->peer_index);
    free(this);
 }
 
@@ -81,6 +357,9 @@ int bm_udp_datastream_connect(void* ds) {
    /* Disconnect if the stream is already connected */
    if(this->stream != -1)
       bm_udp_datastream_disconnect(this);
+   /* Listening streams wait for the peers to show up */
+   if(this->listening)
+      return bm_udp_datastream_bind(this);
    /* Used to store the return value of the network function calls */
    int retval;
    /* Get information on the available interfaces */
@@ -114,6 +393,7 @@ int bm_udp_datastream_connect(void* ds) {
          /* We have a socket, let's save it */
          memcpy(&this->sock, iface->ai_addr, sizeof(this->sock));
          freeaddrinfo(ifaceinfo);
+         bm_datastream_tune(this, this->stream);
          bm_datastream_set_status(ds, BM_DATASTREAM_READY, "ready");
          /* Send a HELLO message to start up the connection */
          uint8_t hello = 0;
@@ -139,6 +419,9 @@ void bm_udp_datastream_disconnect(void* ds) {
       close(this->stream);
       this->stream = -1;
    }
+   /* Forget the peers */
+   this->peer_num = 0;
+   this->fanout_next = 0;
    bm_datastream_set_status(ds, BM_DATASTREAM_UNKNOWN, "unknown");
 }
 
@@ -152,57 +435,206 @@ ssize_t bm_udp_datastream_send(void* ds,
    bm_udp_datastream_t this = (bm_udp_datastream_t)ds;
    /* Make sure stream is ready */
    if(this->parent.status != BM_DATASTREAM_READY) return -1;
-   /* To keep track of how many bytes have been sent */
-   ssize_t tot = sz, sent;
-   /* Keep sending until done or error */
-   while(tot > 0) {
-      bm_debug(ds, "send: sending %zd bytes", tot);
-      sent = sendto(this->stream, data, tot, 0, (struct sockaddr*)(&this->sock), sizeof(this->sock));
-      bm_debug(ds, "send: sent %zd bytes", sent);
-      if(sent < 0) {
+   /* Send the datagram */
+   bm_debug(ds, "send: sending %zu bytes", sz);
+   ssize_t sent = sendto(this->stream, data, sz, 0, (struct sockaddr*)(&this->sock), sizeof(this->sock));
+   bm_debug(ds, "send: sent %zd bytes", sent);
+   if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* The owner reactor takes care of closing the socket */
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Error sending data: %s",
+                               strerror(errno));
+   }
+   return sent;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_udp_datastream_recv(void* ds,
+                               uint8_t* data,
+                               size_t sz) {
+   /* Cast datastream to this type */
+   bm_udp_datastream_t this = (bm_udp_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Get one datagram; with MSG_TRUNC, the length is that of the
+    * datagram even if it doesn't fit */
+   struct sockaddr_in addr;
+   socklen_t addrlen = sizeof(addr);
+   bm_debug(ds, "recv: waiting for %zu bytes", sz);
+   ssize_t received = recvfrom(this->stream, data, sz, MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr*)&addr, &addrlen);
+   bm_debug(ds, "recv: received %zd bytes", received);
+   if(received < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+         int errnum = errno;
          bm_udp_datastream_disconnect(this);
+         bm_datastream_set_status(this,
+                                  BM_DATASTREAM_ERROR,
+                                  "Error receiving data: %s",
+                                  strerror(errnum));
+         errno = errnum;
+      }
+      return -1;
+   }
+   /* A datagram is a whole message: discard those of the wrong size */
+   if((size_t)received > sz ||
+      (this->parent.framing.type != BM_FRAMING_DATAGRAM && (size_t)received != sz)) {
+      bm_debug(ds, "recv: discarded datagram of %zd bytes", received);
+      errno = EAGAIN;
+      return -1;
+   }
+   /* Listening streams learn their peers from any datagram */
+   if(this->listening) {
+      uint64_t now = bm_time_now();
+      bm_udp_datastream_peer(this, &addr, now);
+      bm_udp_datastream_peer_sweep(this, now);
+   }
+   else {
+      /* Replies go to the latest sender */
+      memcpy(&this->sock, &addr, sizeof(this->sock));
+   }
+   return received;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_udp_datastream_fd(void* ds) {
+   return ((bm_udp_datastream_t)ds)->stream;
+}
+
+/****************************************/
+/****************************************/
+
+ssize_t bm_udp_datastream_sendv(void* ds,
+                                bm_msg_t* msgs,
+                                size_t n,
+                                size_t off) {
+   /* Cast datastream to this type */
+   bm_udp_datastream_t this = (bm_udp_datastream_t)ds;
+   /* Make sure stream is ready */
+   if(this->parent.status != BM_DATASTREAM_READY) return -1;
+   /* Listening streams send to all their peers */
+   if(this->listening) {
+      bm_udp_datastream_peer_sweep(this, bm_time_now());
+      return bm_udp_datastream_fanout(this, msgs, n);
+   }
+   /* Prepare one header per datagram */
+   if(n > BM_UDP_DATASTREAM_BATCH) n = BM_UDP_DATASTREAM_BATCH;
+   struct mmsghdr hdrs[BM_UDP_DATASTREAM_BATCH];
+   struct iovec iovs[BM_UDP_DATASTREAM_BATCH];
+   memset(hdrs, 0, n * sizeof(struct mmsghdr));
+   for(size_t i = 0; i < n; ++i) {
+      /* Datagrams are never sent partially, so off is always 0 */
+      iovs[i].iov_base = msgs[i]->data;
+      iovs[i].iov_len = msgs[i]->len;
+      hdrs[i].msg_hdr.msg_name = &this->sock;
+      hdrs[i].msg_hdr.msg_namelen = sizeof(this->sock);
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+   /* Send them all at once */
+   bm_debug(ds, "sendv: sending %zu datagrams", n);
+   int sent = sendmmsg(this->stream, hdrs, n, 0);
+   bm_debug(ds, "sendv: sent %d datagrams", sent);
+   if(sent < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+         /* The owner reactor takes care of closing the socket */
          bm_datastream_set_status(this,
                                   BM_DATASTREAM_ERROR,
                                   "Error sending data: %s",
                                   strerror(errno));
-         return sent;
       }
-      tot -= sent;
-      data += sent;
+      return -1;
    }
-   return sz;
+   ssize_t tot = 0;
+   for(int i = 0; i < sent; ++i)
+      tot += msgs[i]->len;
+   return tot;
 }
 
 /****************************************/
 /****************************************/
 
-ssize_t bm_udp_datastream_recv(void* ds,
-                               uint8_t* data,
-                               size_t sz) {
+ssize_t bm_udp_datastream_recvv(void* ds,
+                                bm_msg_t* msgs,
+                                size_t n) {
    /* Cast datastream to this type */
    bm_udp_datastream_t this = (bm_udp_datastream_t)ds;
    /* Make sure stream is ready */
    if(this->parent.status != BM_DATASTREAM_READY) return -1;
-   /* To keep track of how many bytes have been received */
-   ssize_t tot = sz, received;
-   socklen_t addrlen;
-   while(tot > 0) {
-      bm_debug(ds, "recv: waiting for %zd bytes", tot);
-      received = recvfrom(this->stream, data, tot, 0, (struct sockaddr*)(&this->sock), &addrlen);
-      bm_debug(ds, "recv: received %zd bytes", received);
-      if(received < 0){
+   /* Prepare one header and one buffer per datagram */
+   bm_framing_t f = &this->parent.framing;
+   size_t sz = bm_framing_frame_max(f);
+   if(n > BM_UDP_DATASTREAM_BATCH) n = BM_UDP_DATASTREAM_BATCH;
+   uint8_t* buf = bm_datastream_scratch(ds, n, sz);
+   if(!buf) {
+      bm_udp_datastream_disconnect(this);
+      bm_datastream_set_status(this,
+                               BM_DATASTREAM_ERROR,
+                               "Can't allocate receive buffers");
+      errno = ENOMEM;
+      return -1;
+   }
+   struct mmsghdr hdrs[BM_UDP_DATASTREAM_BATCH];
+   struct iovec iovs[BM_UDP_DATASTREAM_BATCH];
+   struct sockaddr_in addrs[BM_UDP_DATASTREAM_BATCH];
+   memset(hdrs, 0, n * sizeof(struct mmsghdr));
+   for(size_t i = 0; i < n; ++i) {
+      iovs[i].iov_base = buf + i * sz;
+      iovs[i].iov_len = sz;
+      hdrs[i].msg_hdr.msg_name = &addrs[i];
+      hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+   }
+   /* Get as many datagrams as are available */
+   bm_debug(ds, "recvv: waiting for %zu datagrams", n);
+   int received = recvmmsg(this->stream, hdrs, n, MSG_DONTWAIT, NULL);
+   bm_debug(ds, "recvv: received %d datagrams", received);
+   if(received < 0) {
+      int errnum = errno;
+      if(errnum != EAGAIN && errnum != EWOULDBLOCK) {
          bm_udp_datastream_disconnect(this);
          bm_datastream_set_status(this,
                                   BM_DATASTREAM_ERROR,
                                   "Error receiving data: %s",
-                                  strerror(errno));
-         return received;
+                                  strerror(errnum));
+      }
+      errno = errnum;
+      return -1;
+   }
+   /* Listening streams learn their peers from any datagram */
+   uint64_t now = 0;
+   if(this->listening) now = bm_time_now();
+   /* Copy the datagrams of the right size into messages of their size */
+   ssize_t num = 0;
+   for(int i = 0; i < received; ++i) {
+      uint32_t sender = 0;
+      if(this->listening) {
+         struct bm_udp_peer_s* p = bm_udp_datastream_peer(this, &addrs[i], now);
+         if(p) sender = p->id;
+      }
+      if((f->type != BM_FRAMING_DATAGRAM && hdrs[i].msg_len != sz) ||
+         (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+         bm_debug(ds, "recvv: discarded datagram of %u bytes",
+                  hdrs[i].msg_len);
+         continue;
       }
-      if(received == 0) return 0;
-      tot -= received;
-      data += received;
+      if(!this->listening)
+         /* Replies go to the latest sender */
+         memcpy(&this->sock, &addrs[i], sizeof(this->sock));
+      msgs[num] = bm_datastream_msg_new(ds, hdrs[i].msg_len);
+      memcpy(msgs[num]->data, iovs[i].iov_base, hdrs[i].msg_len);
+      msgs[num]->sender = sender;
+      ++num;
    }
-   return sz;
+   if(this->listening) bm_udp_datastream_peer_sweep(this, now);
+   /* Datagrams of the wrong size only; nothing to report yet */
+   if(num == 0) errno = EAGAIN;
+   return num > 0 ? num : -1;
 }
 
 /****************************************/
@@ -211,6 +643,15 @@ ssize_t bm_udp_datastream_recv(void* ds,
 bm_udp_datastream_t bm_udp_datastream_new(const char* desc) {
    /* Allocate memory */
    bm_udp_datastream_t this = malloc(sizeof(struct bm_udp_datastream_s));
+   this->stream = -1;
+   this->server = NULL;
+   this->port = NULL;
+   this->listening = 0;
+   this->peers = NULL;
+   this->peer_num = 0;
+   this->peer_index = NULL;
+   this->peer_sweep = 0;
+   this->fanout_next = 0;
    /* Initialize parent */
    bm_datastream_init(&this->parent,
                       desc,
@@ -218,14 +659,18 @@ bm_udp_datastream_t bm_udp_datastream_new(const char* desc) {
                       bm_udp_datastream_connect,
                       bm_udp_datastream_disconnect,
                       bm_udp_datastream_send,
-                      bm_udp_datastream_recv);
+                      bm_udp_datastream_recv,
+                      bm_udp_datastream_fd);
    if(this->parent.status == BM_DATASTREAM_ERROR) {
       bm_udp_datastream_destroy(this);
       return NULL;
    }
+   /* Use batched datagram I/O */
+   this->parent.sendv = bm_udp_datastream_sendv;
+   this->parent.recvv = bm_udp_datastream_recvv;
    /* Set local attributes */
-   this->stream = -1;
    if(!bm_udp_datastream_parse(this, desc)) {
+      fprintf(stderr, "%s\n", this->parent.status_desc);
       bm_udp_datastream_destroy(this);
       return NULL;
    }
@@ -236,3 +681,17 @@ bm_udp_datastream_t bm_udp_datastream_new(const char* desc) {
 
 /****************************************/
 /****************************************/
+
+bm_udp_datastream_t bm_udp_datastream_listen_new(const char* desc) {
+   bm_udp_datastream_t this = bm_udp_datastream_new(desc);
+   if(!this) return NULL;
+   this->listening = 1;
+   this->peers = (struct bm_udp_peer_s*)malloc(BM_UDP_DATASTREAM_PEERS_MAX * sizeof(struct bm_udp_peer_s));
+   this->peer_index = (uint32_t*)calloc(BM_UDP_DATASTREAM_PEER_SLOTS, sizeof(uint32_t));
+   /* The peers get each other's messages */
+   this->parent.shared = 1;
+   return this;
+}
+
+/****************************************/
+/****************************************/
@@ -7,8 +7,27 @@
 /*
  * The string for udp connect is:
  * udp:server:port
+ * The string for udp listen is:
+ * udplisten:address:port
  */
 
+/*
+ * Maximum number of peers of a listening UDP stream
+ */
+#define BM_UDP_DATASTREAM_PEERS_MAX 4096
+
+/*
+ * A peer of a listening UDP stream, known from the datagrams it sends.
+ */
+struct bm_udp_peer_s {
+   /* The address of the peer */
+   struct sockaddr_in addr;
+   /* The id of the peer, unique among all the streams */
+   uint32_t id;
+   /* When the peer last sent a datagram (ns) */
+   uint64_t last_seen;
+};
+
 struct bm_udp_datastream_s {
    /* Generic datastream definition */
    struct bm_datastream_s parent;
@@ -20,6 +39,20 @@ struct bm_udp_datastream_s {
    char* port;
    /* Socket */
    struct sockaddr_in sock;
+   /* Whether the stream serves the peers that send to it, rather than
+    * a single server */
+   int listening;
+   /* The peers of a listening stream, in no particular order */
+   struct bm_udp_peer_s* peers;
+   /* The number of peers */
+   size_t peer_num;
+   /* The index of the peers, by hash of their address: each slot holds
+    * the position of a peer + 1, or 0 if free */
+   uint32_t* peer_index;
+   /* When the silent peers were last looked for (ns) */
+   uint64_t peer_sweep;
+   /* The peer the first queued message goes to next */
+   size_t fanout_next;
 };
 typedef struct bm_udp_datastream_s* bm_udp_datastream_t;
 
@@ -30,4 +63,15 @@ typedef struct bm_udp_datastream_s* bm_udp_datastream_t;
  */
 extern bm_udp_datastream_t bm_udp_datastream_new(const char* desc);
 
+/*
+ * Creates a new listening UDP datastream.
+ * Connecting the stream binds the address. Every address a datagram
+ * comes from becomes a peer, until it stays silent for the peer_idle
+ * time of the stream; the peers get the messages of the other streams
+ * and those of each other.
+ * @param desc The stream descriptor.
+ * @return The new UDP datastream.
+ */
+extern bm_udp_datastream_t bm_udp_datastream_listen_new(const char* desc);
+
 #endif
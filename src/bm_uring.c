@@ -0,0 +1,127 @@
+#include "bm_uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/****************************************/
+/****************************************/
+
+bm_uring_t bm_uring_new() {
+   bm_uring_t u = (bm_uring_t)malloc(sizeof(struct bm_uring_s));
+   int err = io_uring_queue_init(BM_URING_BATCH, &u->ring, 0);
+   if(err < 0) {
+      free(u);
+      errno = -err;
+      return NULL;
+   }
+   u->num = 0;
+   /* Register the sockets if the kernel supports sparse file tables */
+   u->free_num = 0;
+   if(io_uring_register_files_sparse(&u->ring, BM_URING_FILES) == 0) {
+      for(int i = BM_URING_FILES; i > 0; --i)
+         u->free_files[u->free_num++] = i - 1;
+   }
+   return u;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_uring_destroy(bm_uring_t u) {
+   io_uring_queue_exit(&u->ring);
+   free(u);
+}
+
+/****************************************/
+/****************************************/
+
+int bm_uring_file_add(bm_uring_t u,
+                      int fd) {
+   if(u->free_num == 0) return -1;
+   int slot = u->free_files[--u->free_num];
+   if(io_uring_register_files_update(&u->ring, slot, &fd, 1) != 1) {
+      u->free_files[u->free_num++] = slot;
+      return -1;
+   }
+   return slot;
+}
+
+/****************************************/
+/****************************************/
+
+void bm_uring_file_remove(bm_uring_t u,
+                          int slot) {
+   int fd = -1;
+   io_uring_register_files_update(&u->ring, slot, &fd, 1);
+   u->free_files[u->free_num++] = slot;
+}
+
+/****************************************/
+/****************************************/
+
+int bm_uring_send(bm_uring_t u,
+                  bm_datastream_t s) {
+   if(u->num == BM_URING_BATCH) return 0;
+   struct io_uring_sqe* sqe = io_uring_get_sqe(&u->ring);
+   if(!sqe) return 0;
+   struct bm_uring_send_s* snd = &u->sends[u->num++];
+   snd->stream = s;
+   snd->res = -EIO;
+   memset(&snd->msg, 0, sizeof(snd->msg));
+   snd->msg.msg_iov = snd->iov;
+   snd->msg.msg_iovlen = bm_datastream_iov(s,
+                                           s->out_batch,
+                                           s->out_num,
+                                           s->out_off,
+                                           snd->iov,
+                                           BM_URING_IOV_MAX,
+                                           snd->hdrs);
+   /* With MSG_DONTWAIT, a full socket fails the send right away rather
+    * than having the kernel wait for room */
+   if(s->uring_file >= 0) {
+      io_uring_prep_sendmsg(sqe, s->uring_file, &snd->msg,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+      io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+   }
+   else {
+      io_uring_prep_sendmsg(sqe, s->fd(s), &snd->msg,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+   }
+   io_uring_sqe_set_data(sqe, snd);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+size_t bm_uring_submit(bm_uring_t u) {
+   size_t n = u->num;
+   if(n == 0) return 0;
+   u->num = 0;
+   /* Submit the whole batch */
+   size_t submitted = 0;
+   int ret = 0;
+   while(submitted < n) {
+      ret = io_uring_submit(&u->ring);
+      if(ret > 0) submitted += ret;
+      else if(ret != -EINTR && ret != -EAGAIN) break;
+   }
+   for(size_t i = submitted; i < n; ++i)
+      u->sends[i].res = ret < 0 ? ret : -EIO;
+   /* Collect the results, in any order */
+   struct io_uring_cqe* cqe;
+   struct bm_uring_send_s* snd;
+   for(size_t i = 0; i < submitted;) {
+      ret = io_uring_wait_cqe(&u->ring, &cqe);
+      if(ret == -EINTR) continue;
+      if(ret < 0) break;
+      snd = (struct bm_uring_send_s*)io_uring_cqe_get_data(cqe);
+      snd->res = cqe->res;
+      io_uring_cqe_seen(&u->ring, cqe);
+      ++i;
+   }
+   return n;
+}
+
+/****************************************/
+/****************************************/
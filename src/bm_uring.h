@@ -0,0 +1,111 @@
+#ifndef BM_URING_H
+#define BM_URING_H
+
+#include <liburing.h>
+#include "bm_datastream.h"
+
+/*
+ * Maximum number of sends submitted at once
+ */
+#define BM_URING_BATCH 64
+
+/*
+ * Maximum number of buffers per send
+ */
+#define BM_URING_IOV_MAX 256
+
+/*
+ * Number of slots for registered sockets
+ */
+#define BM_URING_FILES 1024
+
+/*
+ * A send in a batch.
+ * The message header, the buffers and the frame headers must stay put
+ * until the send completes.
+ */
+struct bm_uring_send_s {
+   /* The stream */
+   bm_datastream_t stream;
+   /* The result: the number of bytes sent, or -errno */
+   ssize_t res;
+   /* The message header */
+   struct msghdr msg;
+   /* The buffers */
+   struct iovec iov[BM_URING_IOV_MAX];
+   /* The frame headers */
+   uint8_t hdrs[BM_URING_IOV_MAX][BM_FRAMING_HEADER_MAX];
+};
+
+/*
+ * An io_uring instance that sends the batches of many streams with a
+ * single system call.
+ * Every send completes as soon as it is submitted, with -EAGAIN if the
+ * socket is full. When the kernel allows it, the sockets are
+ * registered, so the sends skip the file table lookups.
+ */
+struct bm_uring_s {
+   /* The ring */
+   struct io_uring ring;
+   /* The sends of the current batch */
+   struct bm_uring_send_s sends[BM_URING_BATCH];
+   /* The number of sends in the current batch */
+   size_t num;
+   /* The free slots for registered sockets */
+   int free_files[BM_URING_FILES];
+   /* The number of free slots, 0 if sockets can't be registered */
+   size_t free_num;
+};
+typedef struct bm_uring_s* bm_uring_t;
+
+/*
+ * Creates a new io_uring instance.
+ * @return The instance, or NULL with errno set if io_uring is not
+ * available.
+ */
+extern bm_uring_t bm_uring_new();
+
+/*
+ * Destroys an io_uring instance.
+ * @param u The instance.
+ */
+extern void bm_uring_destroy(bm_uring_t u);
+
+/*
+ * Registers a socket.
+ * Like all the functions below, must be called by the thread that
+ * owns the instance.
+ * @param u The instance.
+ * @param fd The socket.
+ * @return The slot of the socket, or -1 if it can't be registered.
+ */
+extern int bm_uring_file_add(bm_uring_t u,
+                             int fd);
+
+/*
+ * Unregisters a socket.
+ * @param u The instance.
+ * @param slot The slot of the socket.
+ */
+extern void bm_uring_file_remove(bm_uring_t u,
+                                 int slot);
+
+/*
+ * Adds the send of the out_batch of a stream to the current batch.
+ * @param u The instance.
+ * @param s The stream, with bytestream set.
+ * @return 1 for success, 0 if the batch is full.
+ */
+extern int bm_uring_send(bm_uring_t u,
+                         bm_datastream_t s);
+
+/*
+ * Submits the current batch and waits for its completion.
+ * The results are then found in the first sends, and a new batch
+ * starts.
+ * @param u The instance.
+ * @return The number of sends completed.
+ */
+extern size_t bm_uring_submit(bm_uring_t u);
+
+#endif
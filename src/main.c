@@ -4,6 +4,8 @@
 #include <ctype.h>
 #include <config.h>
 #include "bm_dispatcher.h"
+#include "bm_log.h"
+#include "bm_capture.h"
 #include "bm_bt_datastream.h"
 
 /****************************************/
@@ -11,7 +13,7 @@
 
 void usage(FILE* stream, const char* prg) {
    fprintf(stream, "Usage:\n");
-   fprintf(stream, "   %s <-s SIZE> [-f FILE]... [STREAM]...\n", prg);
+   fprintf(stream, "   %s [-s SIZE] [-t THREADS] [-m ADDRESS] [-l LEVEL] [-f FILE]... [STREAM]...\n", prg);
    fprintf(stream, "   %s scan\n", prg);
    fprintf(stream, "Data repeater on various types of connections.\n");
    fprintf(stream, "\nBlabbermouth has two operational modes: streaming and scanning.\n");
@@ -19,8 +21,10 @@ void usage(FILE* stream, const char* prg) {
    fprintf(stream, "In streaming mode, BlabberMouth connects to each STREAM passed as command line\n");
    fprintf(stream, "parameter and/or in FILE. Every time a message is sent by one of the peers over\n");
    fprintf(stream, "a stream, BlabberMouth collects the data and sends it over the other streams.\n\n");
-   fprintf(stream, "Each message managed by BlabberMouth must be exactly SIZE bytes long, so the\n");
-   fprintf(stream, "-s option is required.\n\n");
+   fprintf(stream, "Each stream delimits its messages with its own framing (see the frame option).\n");
+   fprintf(stream, "By default, every message is exactly SIZE bytes long, as set by the size option\n");
+   fprintf(stream, "or by -s SIZE. A message that doesn't fit the framing of a stream is dropped\n");
+   fprintf(stream, "for that stream.\n\n");
    fprintf(stream, "The syntax for stream descriptors is: ID:TYPE:VERBOSE:DATA, where ID is a unique\n");
    fprintf(stream, "identifier for the stream; TYPE is a case-sensitive string such as 'tcp', 'udp',\n");
    fprintf(stream, "'bt', or 'xbee'; VERBOSE is a flag (0/1) to establish whether BlabberMouth should\n");
@@ -29,13 +33,114 @@ void usage(FILE* stream, const char* prg) {
    fprintf(stream, "Supported stream descriptors:\n\n");
    fprintf(stream, "  ID:tcp:VERBOSE:SERVER:PORT   A TCP connection to SERVER on PORT\n");
    fprintf(stream, "  ID:udp:VERBOSE:SERVER:PORT   A UDP connection to SERVER on PORT\n");
+   fprintf(stream, "  ID:tcplisten:VERBOSE:ADDRESS:PORT\n");
+   fprintf(stream, "                               Accept TCP connections on ADDRESS and PORT;\n");
+   fprintf(stream, "                               each peer becomes a new stream ID#N\n");
+   fprintf(stream, "  ID:udplisten:VERBOSE:ADDRESS:PORT\n");
+   fprintf(stream, "                               Receive UDP datagrams on ADDRESS and PORT and\n");
+   fprintf(stream, "                               send to every address they come from\n");
+   fprintf(stream, "  ID:mcast:VERBOSE:GROUP:PORT  Join the IPv4 multicast GROUP on PORT, and send\n");
+   fprintf(stream, "                               each message once for all its members; with the\n");
+   fprintf(stream, "                               options ttl=N (default: 1), iface=ADDRESS|NAME\n");
+   fprintf(stream, "                               and loop=0|1 (default: 0)\n");
+   fprintf(stream, "  ID:unix:VERBOSE:PATH         A Unix domain socket connection to PATH\n");
+   fprintf(stream, "  ID:unixlisten:VERBOSE:PATH   Accept Unix domain socket connections on PATH;\n");
+   fprintf(stream, "                               with frame=datagram, both use SOCK_SEQPACKET\n");
+   fprintf(stream, "  ID:shm:VERBOSE:PATH          A shared memory link to the shmlisten stream\n");
+   fprintf(stream, "                               of another process, reached through PATH\n");
+   fprintf(stream, "  ID:shmlisten:VERBOSE:PATH    Accept shared memory links on PATH; with the\n");
+   fprintf(stream, "                               option ring=SIZE (default: 1M)\n");
+   fprintf(stream, "  ID:hub:VERBOSE:SERVER:PORT   A link to another BlabberMouth on SERVER and PORT\n");
+   fprintf(stream, "  ID:hublisten:VERBOSE:ADDRESS:PORT\n");
+   fprintf(stream, "                               Accept links from other BlabberMouth instances\n");
+   fprintf(stream, "                               on ADDRESS and PORT\n");
+   fprintf(stream, "  ID:replay:VERBOSE:PREFIX[:SPEED]\n");
+   fprintf(stream, "                               Replay the capture PREFIX (see --capture) on\n");
+   fprintf(stream, "                               the original channels, SPEED times faster than\n");
+   fprintf(stream, "                               recorded (default: 1; 0 for no delays)\n");
 #ifdef BLABBERMOUTH_WITH_BT
    fprintf(stream, "  ID:bt:VERBOSE:rfcomm:CHANNEL An RFComm Bluetooth connection on CHANNEL\n");
 #endif
+   fprintf(stream, "\nTCP and UDP descriptors accept an extra field with a comma-separated list of\n");
+   fprintf(stream, "options, e.g. ID:tcp:VERBOSE:SERVER:PORT:q=1024,drop-oldest.\n");
+   fprintf(stream, "\nStream options:\n\n");
+   fprintf(stream, "  q=N          Queue at most N messages for the stream (default: 1024)\n");
+   fprintf(stream, "  qbytes=N     Queue at most N bytes for the stream (k/M suffixes allowed)\n");
+   fprintf(stream, "  drop-newest  When the queue is full, discard the new message (default)\n");
+   fprintf(stream, "  drop-oldest  When the queue is full, discard the oldest queued message\n");
+   fprintf(stream, "  block[=MS]   When the queue is full, stop receiving from all the streams\n");
+   fprintf(stream, "               until it has room again; if it gets none for MS ms\n");
+   fprintf(stream, "               (default: 100), discard the messages waiting for it\n");
+   fprintf(stream, "  disconnect   When the queue is full, close the stream (it then reconnects\n");
+   fprintf(stream, "               like after any loss of connection)\n");
+   fprintf(stream, "  conflate=A-B Queue only the latest message for each key, the key being\n");
+   fprintf(stream, "               bytes A to B of the message (conflate=A for byte A alone)\n");
+   fprintf(stream, "  batch=N      Send at most N queued messages per system call (default: 64,\n");
+   fprintf(stream, "               maximum: 1024)\n");
+   fprintf(stream, "  flush=T      Wait up to T (e.g. 200us, 1ms) for a batch to fill up\n");
+   fprintf(stream, "               before sending it (default: send right away)\n");
+   fprintf(stream, "  backoff=MIN-MAX\n");
+   fprintf(stream, "               For tcp and hub streams, wait MIN to MAX (e.g. 100ms-10s, the\n");
+   fprintf(stream, "               default) before reconnecting a lost connection; the delay\n");
+   fprintf(stream, "               doubles after each failed attempt. backoff=0 never reconnects\n");
+   fprintf(stream, "  idle=T       For udplisten streams, forget a peer after T (e.g. 30s, 500ms;\n");
+   fprintf(stream, "               default: 60s) without a datagram from it\n");
+   fprintf(stream, "  nodelay      For TCP sockets, disable Nagle's algorithm\n");
+   fprintf(stream, "  quickack     For TCP sockets, acknowledge received segments right away\n");
+   fprintf(stream, "  sndbuf=N     The size of the socket send buffer (k/M suffixes allowed)\n");
+   fprintf(stream, "  rcvbuf=N     The size of the socket receive buffer (k/M suffixes allowed)\n");
+   fprintf(stream, "  busypoll=T   For IP sockets, poll the device for up to T (e.g. 50us) before\n");
+   fprintf(stream, "               sleeping in a read\n");
+   fprintf(stream, "  priority=N   The priority of the packets sent (SO_PRIORITY)\n");
+   fprintf(stream, "  dscp=N       For IP sockets, the DSCP of the packets sent (0-63)\n");
+   fprintf(stream, "  usertimeout=T\n");
+   fprintf(stream, "               For TCP sockets, close the connection when sent data stays\n");
+   fprintf(stream, "               unacknowledged for T (e.g. 2s; ms by default)\n");
+   fprintf(stream, "  keepalive[=IDLE[/INTVL[/CNT]]]\n");
+   fprintf(stream, "               For TCP sockets, probe idle connections (e.g. 10s/2s/3);\n");
+   fprintf(stream, "               keepalive=0 turns it off\n");
+   fprintf(stream, "  frame=TYPE   How messages are delimited: fixed (default), u16 or u32 (big\n");
+   fprintf(stream, "               endian length prefix), varint (LEB128 length prefix), delim\n");
+   fprintf(stream, "               (delimiter byte after the message), datagram (UDP,\n");
+   fprintf(stream, "               unix and shm only)\n");
+   fprintf(stream, "  size=N       With fixed framing, the message size (default: -s SIZE)\n");
+   fprintf(stream, "  max=N        The longest message accepted from the peer (default: 64k)\n");
+   fprintf(stream, "  delim=C      With delim framing, the delimiter: a character, \\n, \\r, \\t,\n");
+   fprintf(stream, "               \\0, or 0xNN (default: \\n)\n");
+   fprintf(stream, "  pub=N        Publish the messages received from the stream on channel N\n");
+   fprintf(stream, "               (0-255, default: 0)\n");
+   fprintf(stream, "  pub=@OFF     Publish each message received from the stream on the channel\n");
+   fprintf(stream, "               held by its byte at offset OFF (channel 0 if shorter)\n");
+   fprintf(stream, "  sub=LIST     Only send the stream the messages of the channels in LIST,\n");
+   fprintf(stream, "               e.g. 1+4-7+12 (default: all channels)\n");
    /* fprintf(stream, "  ID:xbee:ADDRESS:PORT    An XBee connection to ADDRESS on PORT\n"); */
    fprintf(stream, "\nOptions:\n\n");
-   fprintf(stream, "  -s SIZE | --size SIZE   The size (in bytes) of a message\n");
+   fprintf(stream, "  -s SIZE | --size SIZE   The size (in bytes) of a message, for the streams with\n");
+   fprintf(stream, "                          fixed framing and no size option\n");
    fprintf(stream, "  -f FILE | --file FILE   A file containing one stream descriptor per line\n");
+   fprintf(stream, "  -t THREADS | --threads THREADS\n");
+   fprintf(stream, "                          The number of event loop threads (default: 1)\n");
+   fprintf(stream, "  --cpus LIST             Pin the event loop threads to the CPUs in LIST, in\n");
+   fprintf(stream, "                          turn, e.g. 0,2,4-7 (default: no pinning)\n");
+   fprintf(stream, "  --io-uring              Send the messages of the streams flushed together\n");
+   fprintf(stream, "                          with a single io_uring submission, where available\n");
+   fprintf(stream, "  --capture PREFIX        Record every message received in the files\n");
+   fprintf(stream, "                          PREFIX.THREAD.SEQUENCE, for the replay stream\n");
+   fprintf(stream, "  --capture-size SIZE     The size of a capture file (default: 64M; k/M/G\n");
+   fprintf(stream, "                          suffixes allowed)\n");
+   fprintf(stream, "  --capture-keep N        Keep only the last N capture files per thread\n");
+   fprintf(stream, "                          (default: 0, keep all)\n");
+   fprintf(stream, "  -m ADDRESS | --metrics ADDRESS\n");
+   fprintf(stream, "                          Serve metrics in Prometheus format over HTTP on\n");
+   fprintf(stream, "                          ADDRESS: PORT (loopback only), HOST:PORT, or the\n");
+   fprintf(stream, "                          path of a Unix socket\n");
+   fprintf(stream, "  -l LEVEL | --log-level LEVEL\n");
+   fprintf(stream, "                          Log error, warning, info (default), or debug\n");
+   fprintf(stream, "                          messages; debug logs the traffic of all streams\n");
+   fprintf(stream, "  --log-rate N            Log at most N lines per second per thread\n");
+   fprintf(stream, "                          (default: 10000, 0 for no limit)\n");
+   fprintf(stream, "  --hub-id ID             The id (1 to 2^32-1) of this instance on hub links\n");
+   fprintf(stream, "                          (default: random)\n");
    fprintf(stream, "\n== SCANNING ==\n\n");
    fprintf(stream, "In scanning mode, Blabbermouth looks for Bluetooth devices to connect to and\n");
    fprintf(stream, "prints a list of available devices. BlueZ must be installed for Bluetooth to be\n");
@@ -111,6 +216,10 @@ int main(int argc, char* argv[]) {
       /* Streaming mode */
       /* Create the stream dispatcher */
       bm_dispatcher_t d = bm_dispatcher_new();
+      if(!d) {
+         fprintf(stderr, "%s: can't create dispatcher\n", argv[0]);
+         return EXIT_FAILURE;
+      }
       /* Parse the arguments */
       for(int i = 1; i < argc; ++i) {
          /* Check options */
@@ -146,6 +255,140 @@ int main(int argc, char* argv[]) {
                   return EXIT_FAILURE;
                }
             }
+            else if(strcmp(argv[i], "-t") == 0 ||
+                    strcmp(argv[i], "--threads") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected thread number after -t and --threads\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               char* endptr;
+               long n = strtol(argv[i], &endptr, 10);
+               if(endptr == argv[i] || *endptr != '\0' || n < 1) {
+                  fprintf(stderr, "%s: can't parse '%s' as a number of threads\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               d->reactor_num = n;
+            }
+            else if(strcmp(argv[i], "--cpus") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected CPU list after --cpus\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               if(!bm_dispatcher_set_cpus(d, argv[i])) {
+                  fprintf(stderr, "%s: can't parse '%s' as a CPU list\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+            }
+            else if(strcmp(argv[i], "--io-uring") == 0) {
+#ifdef BLABBERMOUTH_WITH_URING
+               d->uring = 1;
+#else
+               fprintf(stderr, "%s: built without io_uring support, using epoll only\n", argv[0]);
+#endif
+            }
+            else if(strcmp(argv[i], "--capture") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected prefix after --capture\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               d->capture_path = argv[i];
+            }
+            else if(strcmp(argv[i], "--capture-size") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected size after --capture-size\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               if(!bm_datastream_parse_size(argv[i], &d->capture_size) ||
+                  d->capture_size < BM_CAPTURE_SEGMENT_MIN) {
+                  fprintf(stderr, "%s: can't parse '%s' as a capture size (at least 64k)\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+            }
+            else if(strcmp(argv[i], "--capture-keep") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected number after --capture-keep\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               char* endptr;
+               long n = strtol(argv[i], &endptr, 10);
+               if(endptr == argv[i] || *endptr != '\0' || n < 0) {
+                  fprintf(stderr, "%s: can't parse '%s' as a number of capture files\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               d->capture_keep = n;
+            }
+            else if(strcmp(argv[i], "-m") == 0 ||
+                    strcmp(argv[i], "--metrics") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected address after -m and --metrics\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               d->metrics_addr = argv[i];
+            }
+            else if(strcmp(argv[i], "-l") == 0 ||
+                    strcmp(argv[i], "--log-level") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected level after -l and --log-level\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               int level = bm_log_parse_level(argv[i]);
+               if(level < 0) {
+                  fprintf(stderr, "%s: unknown log level '%s'\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               bm_log_set_level(level);
+            }
+            else if(strcmp(argv[i], "--hub-id") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected id after --hub-id\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               char* endptr;
+               unsigned long long n = strtoull(argv[i], &endptr, 0);
+               if(endptr == argv[i] || *endptr != '\0' || n == 0 || n > UINT32_MAX) {
+                  fprintf(stderr, "%s: can't parse '%s' as a hub id\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               d->hub_id = n;
+            }
+            else if(strcmp(argv[i], "--log-rate") == 0) {
+               ++i;
+               if(i >= argc) {
+                  fprintf(stderr, "%s: expected rate after --log-rate\n", argv[0]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               char* endptr;
+               long n = strtol(argv[i], &endptr, 10);
+               if(endptr == argv[i] || *endptr != '\0' || n < 0) {
+                  fprintf(stderr, "%s: can't parse '%s' as a log rate\n", argv[0], argv[i]);
+                  bm_dispatcher_destroy(d);
+                  return EXIT_FAILURE;
+               }
+               bm_log_set_rate(n);
+            }
             else {
                fprintf(stderr, "%s: %s: unknown option\n", argv[0], argv[i]);
                bm_dispatcher_destroy(d);
@@ -157,11 +400,6 @@ int main(int argc, char* argv[]) {
             bm_dispatcher_stream_add(d, argv[i]);
          }
       }
-      /* Make sure required information has been passed */
-      if(d->msg_len == 0) {
-         fprintf(stderr, "%s: option -s SIZE is required, with a value for SIZE > 0\n", argv[0]);
-         return EXIT_FAILURE;
-      }
       /* Parsing done, start the execution */
       bm_dispatcher_execute(d);
       /* All done */